@@ -0,0 +1,160 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include "host_protocol_codec.h"
+
+void host_protocol_fill_create_request_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argPayload, uint8_t argSourceAddress, bool argRequiresReply)
+{
+    snprintf((char*)buffer, bufferSize, "^%s|%u|%u@", argRequiresReply ? "Q" : "C", argSourceAddress, argPayload);
+}
+
+void host_protocol_fill_create_reply_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argPayload, uint8_t argDestinationAddress)
+{
+    snprintf((char*)buffer, bufferSize, "^R|%u|%u@", argDestinationAddress, argPayload);
+}
+
+void host_protocol_fill_create_gather_reply_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argRequestedMask, uint16_t argRespondedMask, const uint16_t* argPayloads)
+{
+    int len=snprintf((char*)buffer, bufferSize, "^G|");
+
+    bool first=true;
+
+    for(uint8_t address=1; address<16; address++)
+    {
+        if(!(argRespondedMask & (1 << address))) continue;
+
+        len+=snprintf((char*)buffer+len, bufferSize-len, "%s%u=%u", first ? "" : ",", address, argPayloads[address]);
+        first=false;
+    }
+
+    len+=snprintf((char*)buffer+len, bufferSize-len, "|");
+
+    first=true;
+
+    for(uint8_t address=1; address<16; address++)
+    {
+        if(!(argRequestedMask & (1 << address)) || (argRespondedMask & (1 << address))) continue;
+
+        len+=snprintf((char*)buffer+len, bufferSize-len, "%s%u", first ? "" : ",", address);
+        first=false;
+    }
+
+    snprintf((char*)buffer+len, bufferSize-len, "@");
+}
+
+void host_protocol_fill_create_not_sent_buffer(uint8_t* buffer, uint16_t bufferSize, char argRequestType, const char* argAddresses, uint16_t argPayload, uint8_t argReason, uint32_t argRetryAfterMs)
+{
+    snprintf((char*)buffer, bufferSize, "^E|%c|%s|%u|%u|%lu@", argRequestType, argAddresses, argPayload, argReason, (unsigned long)argRetryAfterMs);
+}
+
+void host_protocol_fill_create_credits_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argAddress, uint8_t argCredits, uint8_t argWindow)
+{
+    snprintf((char*)buffer, bufferSize, "^W|%u|%u|%u@", argAddress, argCredits, argWindow);
+}
+
+void host_protocol_fill_create_stored_report_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argAddress, uint16_t argRequestPayload, uint16_t argReplyPayload, uint8_t argEvent, uint32_t argMs)
+{
+    snprintf((char*)buffer, bufferSize, "^V|%u|%u|%u|%u|%lu@", argAddress, argRequestPayload, argReplyPayload, argEvent, (unsigned long)argMs);
+}
+
+static int fill_with_address_list(char* dest, size_t destSize, uint16_t addressMask)
+{
+    int len=0;
+
+    dest[0]='\0';
+
+    for(uint8_t address=1; address<16 && (size_t)len<destSize; address++)
+    {
+        if(!(addressMask & (1 << address))) continue;
+
+        len+=snprintf(dest+len, destSize-len, "%s%u", len > 0 ? "," : "", address);
+    }
+
+    return len;
+}
+
+void host_protocol_fill_create_bulk_report_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argRequestedMask, uint16_t argCompletedMask)
+{
+    char completed[48];
+    char missing[48];
+
+    fill_with_address_list(completed, sizeof(completed), argRequestedMask & argCompletedMask);
+    fill_with_address_list(missing, sizeof(missing), argRequestedMask & ~argCompletedMask);
+
+    snprintf((char*)buffer, bufferSize, "^Y|%s|%s@", completed, missing);
+}
+
+void host_protocol_fill_create_bulk_received_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argSourceAddress, uint8_t argSession, const uint8_t* argBlob, uint16_t argSize)
+{
+    int len=snprintf((char*)buffer, bufferSize, "^Z|%u|%u|", argSourceAddress, argSession);
+
+    for(uint16_t i=0; i<argSize && len+3<bufferSize; i++) len+=snprintf((char*)buffer+len, bufferSize-len, "%02X", argBlob[i]);
+
+    snprintf((char*)buffer+len, bufferSize-len, "@");
+}
+
+void host_protocol_fill_create_batch_reply_buffer(uint8_t* buffer, uint16_t bufferSize, const HostBatchItem_t* argItems, uint8_t argCount)
+{
+    int len=snprintf((char*)buffer, bufferSize, "^M");
+
+    for(uint8_t i=0; i<argCount && len<bufferSize; i++)
+    {
+        len+=snprintf((char*)buffer+len, bufferSize-len, "|%c,%u,%u,%u", argItems[i].type, argItems[i].address, argItems[i].status, argItems[i].replyPayload);
+    }
+
+    if(len<bufferSize) snprintf((char*)buffer+len, bufferSize-len, "@");
+}
+
+bool host_protocol_parse_batch_item(const char* argItem, HostBatchItem_t* outItem)
+{
+    std::vector<std::string> fields;
+
+    split(argItem, fields, ',');
+
+    outItem->type = fields.size() > 0 && fields[0].size() == 1 ? fields[0][0] : '?';
+    outItem->address = fields.size() > 1 ? atoi(fields[1].c_str()) : 0;
+    outItem->payload = fields.size() > 2 ? atoi(fields[2].c_str()) : 0;
+    outItem->replyPayload = 0xFFFF;
+
+    bool valid = fields.size() == 3 && (outItem->type == 'Q' || outItem->type == 'C') && !fields[1].empty() && !fields[2].empty();
+
+    // 1 is HOST_NOT_SENT_BUSY: what an item stays as if nothing takes it
+    outItem->status = valid ? 1 : HOST_BATCH_ITEM_INVALID;
+
+    return valid;
+}
+
+uint16_t host_protocol_parse_address_mask(const char* argAddresses)
+{
+    std::vector<std::string> addresses;
+
+    split(argAddresses, addresses, ',');
+
+    uint16_t addressMask=0;
+
+    for(size_t i=0; i<addresses.size(); i++)
+    {
+        int address=atoi(addresses[i].c_str());
+
+        if(address > 0 && address < 16) addressMask |= (1 << address);
+    }
+
+    return addressMask;
+}
+
+void split(const char *str, std::vector<std::string>& v, char c)
+{
+    v.clear();
+
+    do
+    {
+        const char *begin = str;
+
+        while(*str != c && *str)
+            str++;
+
+        v.push_back(std::string(begin, str));
+
+    } while (0 != *str++);
+}
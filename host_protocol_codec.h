@@ -0,0 +1,60 @@
+#ifndef __HOST_PROTOCOL_CODEC_H__
+#define __HOST_PROTOCOL_CODEC_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Stateless host frame encoding/parsing, kept free of mbed dependencies so it builds natively too (see tools/)
+
+#define HOST_BATCH_MAX_ITEMS 8
+
+// Status of a batch item besides 0 (done) and 1..4 (not sent, the reasons of "^E|..@")
+#define HOST_BATCH_ITEM_DONE 0
+#define HOST_BATCH_ITEM_FAILED 5                // sent, but no reply (query) or no delivery (command) came back
+#define HOST_BATCH_ITEM_INVALID 6               // malformed item, not handled
+
+// Command or query of a batch ("!M|<type>,<address>,<payload>|..#") and, once handled, its status and reply payload
+typedef struct
+{
+    char type;                                  // 'Q' or 'C'
+    uint8_t address;
+    uint16_t payload;
+    uint8_t status;
+    uint16_t replyPayload;                      // of a query, 65535 if none
+
+} HostBatchItem_t;
+
+void host_protocol_fill_create_request_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argCounter, uint8_t argSourceAddress, bool argRequiresReply);
+void host_protocol_fill_create_reply_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argPayload, uint8_t argDestinationAddress);
+void host_protocol_fill_create_gather_reply_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argRequestedMask, uint16_t argRespondedMask, const uint16_t* argPayloads);
+
+// "^E|<request type>|<addresses as received>|<payload>|<reason>|<retry after ms>@": the request was not sent over LoRa
+void host_protocol_fill_create_not_sent_buffer(uint8_t* buffer, uint16_t bufferSize, char argRequestType, const char* argAddresses, uint16_t argPayload, uint8_t argReason, uint32_t argRetryAfterMs);
+
+// "^W|<address>|<credits>|<window>@": how many requests for that address the node can take right now, out of how many
+void host_protocol_fill_create_credits_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argAddress, uint8_t argCredits, uint8_t argWindow);
+
+// "^V|<address>|<request payload>|<reply payload>|<event>|<ms>@": a request kept by the gateway store-and-forward was stored (0),
+// delivered (1, with the reply of a query), expired (2) or dropped (3)
+void host_protocol_fill_create_stored_report_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argAddress, uint16_t argRequestPayload, uint16_t argReplyPayload, uint8_t argEvent, uint32_t argMs);
+
+// "^Y|<addresses which rebuilt the blob>|<addresses which didn't>@": outcome of a bulk transfer ("!Y|..#")
+void host_protocol_fill_create_bulk_report_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argRequestedMask, uint16_t argCompletedMask);
+
+// "^Z|<source address>|<session>|<blob as hex digits>@": blob received with a bulk transfer from another node
+void host_protocol_fill_create_bulk_received_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argSourceAddress, uint8_t argSession, const uint8_t* argBlob, uint16_t argSize);
+
+// "^M|<type>,<address>,<status>,<reply payload>|..@": outcome of each item of a batch, in the order they came
+void host_protocol_fill_create_batch_reply_buffer(uint8_t* buffer, uint16_t bufferSize, const HostBatchItem_t* argItems, uint8_t argCount);
+
+// "Q,2,202" -> item, false (and status HOST_BATCH_ITEM_INVALID) if malformed; a valid item is HOST_NOT_SENT_BUSY until handled
+bool host_protocol_parse_batch_item(const char* argItem, HostBatchItem_t* outItem);
+
+// "2,3,12" -> bit per address (1..15, others are ignored)
+uint16_t host_protocol_parse_address_mask(const char* argAddresses);
+
+void split(const char *str, std::vector<std::string>& v, char c);
+
+#endif // __HOST_PROTOCOL_CODEC_H__
@@ -1,19 +1,43 @@
 #include "mbed.h"
 
-#include "BufferedSerial.h"
-
 #include "host_protocol_impl.h"
 
+#include "lora_config.h"
+
+#include "lora_trace.h"
+
 static Timer s_timer_1;
 
 #define PROTOCOL_BUFFER_SIZE 32
 #define PROTOCOL_PROC_COMMUNICATION_CYCLE_INTERVAL 20
-#define PROTOCOL_UART_BAUD_RATE 115200
 
-BufferedSerial pc_buffered_serial(PB_10, PB_11);
+// USART3 flow control pins on NUCLEO-L476RG (morpho connector)
+#define HOST_UART_RTS_PIN PB_14
+#define HOST_UART_CTS_PIN PB_13
+
+// Buffered in both directions (drivers.uart-serial-rxbuf-size/txbuf-size in mbed_app.json): writes wait for room instead of overwriting
+static UARTSerial s_host_serial(PB_10, PB_11, HOST_UART_BAUD_RATE);
+
+static const uint32_t s_supported_baud_rates[] = { 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600 };
+
+static uint32_t s_baud_rate = HOST_UART_BAUD_RATE;
+static uint32_t s_previous_baud_rate = HOST_UART_BAUD_RATE;
+static bool s_baud_rate_confirmed = true;
+static int s_baud_rate_confirm_event_id;
+static uint32_t s_garbage_since_valid_frame;
+
+static volatile bool s_worker_scheduled;
+
+static HostLinkStats_t s_link_stats;
 
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+// Single-thread runtime: the UART is polled from the command handler event queue
+static EventQueue* s_p_eq_serial_worker;
+#else
 static Thread s_thread_serial_worker;
 static EventQueue s_eq_serial_worker;
+static EventQueue* s_p_eq_serial_worker = &s_eq_serial_worker;
+#endif
 
 static EventQueue* s_p_eq_command_handler_worker;
 
@@ -27,6 +51,9 @@ static std::string s_latest_received_command, s_latest_sent_command;
 
 static std::vector<std::string> s_latest_received_vector, s_latest_sent_vector;
 
+// When the uart worker parsed the latest received command (trace time base), before it waited on the command handler queue
+static uint32_t s_latest_received_command_rx_us;
+
 void event_proc_protocol_timeout_handler()
 {
     current_protocol_content.clear();
@@ -36,12 +63,163 @@ void event_proc_protocol_timeout_handler()
 }
 
 host_protocol_notify_command_received_callback_t host_protocol_notify_command_received_callback_instance;
+host_protocol_notify_local_command_received_callback_t host_protocol_notify_local_command_received_callback_instance;
+
+// Local commands are answered by the node itself, outside of the request/reply transactions
+static bool is_local_command(const std::vector<std::string>& items)
+{
+    return items[0]=="S" || items[0]=="P" || items[0]=="K" || items[0]=="F" || items[0]=="J" || items[0]=="B" || items[0]=="W" || items[0]=="T" || items[0]=="D" || items[0]=="Y" || items[0]=="M" || items[0]=="U";
+}
+
+static void apply_baud_rate(uint32_t baud)
+{
+    // Whatever is still in the tx buffer belongs to the old rate (the reply to "!B" included)
+    s_host_serial.sync();
+    wait_ms(2);
+
+    s_host_serial.set_baud(baud);
+
+    s_baud_rate = baud;
+    s_garbage_since_valid_frame = 0;
+}
+
+static void fall_back_to_baud_rate(uint32_t baud)
+{
+    s_link_stats.baudFallbacks++;
+
+    s_baud_rate_confirmed = true;
+    if (s_baud_rate_confirm_event_id != 0) s_p_eq_serial_worker->cancel(s_baud_rate_confirm_event_id);
+    s_baud_rate_confirm_event_id = 0;
+
+    apply_baud_rate(baud);
+
+    printf("[HOST PROTOCOL] baud rate fallback to %lu\n", (unsigned long)baud);
+}
+
+static void event_proc_baud_rate_confirm_timeout()
+{
+    s_baud_rate_confirm_event_id = 0;
+
+    // Nothing valid heard at the new rate: the host didn't follow (or can't)
+    if(!s_baud_rate_confirmed) fall_back_to_baud_rate(s_previous_baud_rate);
+}
+
+static void event_proc_switch_baud_rate(uint32_t baud)
+{
+    s_previous_baud_rate = s_baud_rate;
+    s_baud_rate_confirmed = false;
+
+    apply_baud_rate(baud);
+
+    if (s_baud_rate_confirm_event_id != 0) s_p_eq_serial_worker->cancel(s_baud_rate_confirm_event_id);
+    s_baud_rate_confirm_event_id = s_p_eq_serial_worker->call_in(HOST_UART_BAUD_CONFIRM_TIMEOUT, event_proc_baud_rate_confirm_timeout);
+}
+
+bool host_protocol_is_baud_rate_supported(uint32_t baud)
+{
+    for(size_t i=0; i<sizeof(s_supported_baud_rates)/sizeof(s_supported_baud_rates[0]); i++)
+    {
+        if(s_supported_baud_rates[i] == baud) return baud <= HOST_UART_MAX_BAUD_RATE;
+    }
+
+    return false;
+}
+
+uint32_t host_protocol_get_baud_rate()
+{
+    return s_baud_rate;
+}
+
+void host_protocol_switch_baud_rate(uint32_t baud)
+{
+    // Switched from the serial worker, which owns the receive side
+    s_p_eq_serial_worker->call(event_proc_switch_baud_rate, baud);
+}
+
+static void on_valid_frame_received()
+{
+    s_garbage_since_valid_frame = 0;
+
+    if(!s_baud_rate_confirmed)
+    {
+        s_baud_rate_confirmed = true;
+
+        printf("[HOST PROTOCOL] baud rate %lu confirmed\n", (unsigned long)s_baud_rate);
+    }
+}
+
+// The serial API doesn't report framing errors: at a mismatched rate they show up as bytes the text protocol never uses
+static void on_garbage_byte_received()
+{
+    s_link_stats.garbageBytes++;
+
+    if(++s_garbage_since_valid_frame >= HOST_UART_MAX_GARBAGE_BYTES && s_baud_rate != HOST_UART_BAUD_RATE)
+    {
+        fall_back_to_baud_rate(HOST_UART_BAUD_RATE);
+    }
+}
+
+static void write_to_host(const uint8_t* buffer, uint16_t size)
+{
+    Timer timer;
+    bool stalled=false;
+
+    timer.start();
+
+    while(size > 0)
+    {
+        ssize_t written = s_host_serial.write(buffer, size);
 
-void event_proc_command_handler(std::string *pcontent)
+        if(written > 0)
+        {
+            buffer += written;
+            size -= written;
+
+            continue;
+        }
+
+        // Tx buffer full: the link (or the host, through CTS) is slower than we write
+        if(!stalled) s_link_stats.txStalls++;
+        stalled=true;
+
+        if(timer.read_ms() > HOST_UART_WRITE_TIMEOUT)
+        {
+            s_link_stats.txDroppedBytes += size;
+
+            return;
+        }
+
+        wait_ms(1);
+    }
+}
+
+void host_protocol_fill_with_link_stats_dump(char* destBuffer, size_t destBufferSize)
+{
+    snprintf(destBuffer, destBufferSize, "baud=%lu,fc=%d,rxfull=%lu,garbage=%lu,txstall=%lu,txdrop=%lu,fallback=%lu",
+        (unsigned long)s_baud_rate, HOST_UART_FLOW_CONTROL_ENABLED ? 1 : 0,
+        (unsigned long)s_link_stats.rxBufferFull, (unsigned long)s_link_stats.garbageBytes,
+        (unsigned long)s_link_stats.txStalls, (unsigned long)s_link_stats.txDroppedBytes, (unsigned long)s_link_stats.baudFallbacks);
+}
+
+void event_proc_command_handler(std::string *pcontent, uint32_t rxUs)
 {
     //if (pcontent->size() != 0) printf("[HOST COMMAND_HANDLER - %d] Ricevuto Comando: '%s'\n", s_timer_1.read_ms(), pcontent->c_str());
 
+    std::vector<std::string> items;
+
+    split(pcontent->c_str(), items, '|');
+
+    if(is_local_command(items))
+    {
+        if(host_protocol_notify_local_command_received_callback_instance) host_protocol_notify_local_command_received_callback_instance(items);
+
+        delete pcontent;
+
+        return;
+    }
+
     s_latest_received_command = *pcontent;
+    s_latest_received_command_rx_us = rxUs;
 
     split(s_latest_received_command.c_str(), s_latest_received_vector, '|');
 
@@ -52,13 +230,24 @@ void event_proc_command_handler(std::string *pcontent)
 
 void event_proc_protocol_worker()
 {
-    while (pc_buffered_serial.readable())
+    s_worker_scheduled = false;
+
+    char c;
+    uint32_t drained=0;
+
+    while (s_host_serial.read(&c, 1) > 0)
     {
-        char c = pc_buffered_serial.getc();
+        drained++;
 
         if (c == '\r' || c == '\n')
             continue;
 
+        if (c < ' ' || c > '~')
+        {
+            on_garbage_byte_received();
+            continue;
+        }
+
         //printf("[PROTOCOL_HANDLER - %d] Ricevuto '%c'\n", s_timer_1.read_ms(), c);
 
         switch (current_protocol_state)
@@ -70,8 +259,8 @@ void event_proc_protocol_worker()
                     case '!':
                         current_protocol_content.clear();
                         current_protocol_state = WAITING_END;
-                        if (current_protocol_timeout_event_id != 0) s_eq_serial_worker.cancel(current_protocol_timeout_event_id);
-                        current_protocol_timeout_event_id = s_eq_serial_worker.call_in(PROTOCOL_TIMEOUT_MS, event_proc_protocol_timeout_handler);
+                        if (current_protocol_timeout_event_id != 0) s_p_eq_serial_worker->cancel(current_protocol_timeout_event_id);
+                        current_protocol_timeout_event_id = s_p_eq_serial_worker->call_in(PROTOCOL_TIMEOUT_MS, event_proc_protocol_timeout_handler);
 
                         //printf("[PROTOCOL_HANDLER - %d] Stato Settato a 'WAITING_END'\n", s_timer_1.read_ms());
                         
@@ -87,19 +276,21 @@ void event_proc_protocol_worker()
                     case '!':
                         current_protocol_content.clear();
                         current_protocol_state = WAITING_END;
-                        if (current_protocol_timeout_event_id != 0) s_eq_serial_worker.cancel(current_protocol_timeout_event_id);
-                        current_protocol_timeout_event_id = s_eq_serial_worker.call_in(PROTOCOL_TIMEOUT_MS, event_proc_protocol_timeout_handler);
+                        if (current_protocol_timeout_event_id != 0) s_p_eq_serial_worker->cancel(current_protocol_timeout_event_id);
+                        current_protocol_timeout_event_id = s_p_eq_serial_worker->call_in(PROTOCOL_TIMEOUT_MS, event_proc_protocol_timeout_handler);
 
                         //printf("[PROTOCOL_HANDLER - %d] Stato Settato a 'WAITING_END'\n", s_timer_1.read_ms());
 
                         break;
 
                     case '#':
-                        s_p_eq_command_handler_worker->call(event_proc_command_handler, new std::string(current_protocol_content));
+                        on_valid_frame_received();
+
+                        s_p_eq_command_handler_worker->call(event_proc_command_handler, new std::string(current_protocol_content), lora_trace_get_time_us());
 
                         current_protocol_content.clear();
                         current_protocol_state = WAITING_START;
-                        if (current_protocol_timeout_event_id != 0) s_eq_serial_worker.cancel(current_protocol_timeout_event_id);
+                        if (current_protocol_timeout_event_id != 0) s_p_eq_serial_worker->cancel(current_protocol_timeout_event_id);
                         current_protocol_timeout_event_id = 0;
 
                         //printf("[PROTOCOL_HANDLER - %d] Stato Settato a 'WAITING_START'\n", s_timer_1.read_ms());
@@ -114,14 +305,41 @@ void event_proc_protocol_worker()
                 break;
         }
     }
+
+    // A full rx buffer stops reception (and, with flow control, the host): the worker didn't keep up
+    if (drained >= MBED_CONF_DRIVERS_UART_SERIAL_RXBUF_SIZE) s_link_stats.rxBufferFull++;
+}
+
+static void on_host_serial_sigio()
+{
+    // Interrupt context: one pass of the worker is enough to drain whatever arrived meanwhile
+    if (s_worker_scheduled) return;
+
+    s_worker_scheduled = true;
+
+    s_p_eq_serial_worker->call(event_proc_protocol_worker);
 }
 
 void host_protocol_initialize(EventQueue* eventQueue)
 {
-    pc_buffered_serial.baud(PROTOCOL_UART_BAUD_RATE);
+    s_host_serial.set_blocking(false);
+
+#if DEVICE_SERIAL_FC
+    if (HOST_UART_FLOW_CONTROL_ENABLED) s_host_serial.set_flow_control(SerialBase::RTSCTS, HOST_UART_RTS_PIN, HOST_UART_CTS_PIN);
+#endif
+
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+    s_p_eq_serial_worker = eventQueue;
+#endif
+
+    // Woken up by the UART as data arrives, with a periodic pass as a safety net
+    s_host_serial.sigio(callback(on_host_serial_sigio));
 
-    s_eq_serial_worker.call_every(PROTOCOL_PROC_COMMUNICATION_CYCLE_INTERVAL, event_proc_protocol_worker);
+    s_p_eq_serial_worker->call_every(PROTOCOL_PROC_COMMUNICATION_CYCLE_INTERVAL, event_proc_protocol_worker);
+
+#if !MBED_CONF_APP_SINGLE_THREAD_RUNTIME
     s_thread_serial_worker.start(callback(&s_eq_serial_worker, &EventQueue::dispatch_forever));
+#endif
 
     s_p_eq_command_handler_worker = eventQueue; 
 
@@ -132,13 +350,13 @@ void host_protocol_reset()
 {
     current_protocol_content.clear();
     current_protocol_state = WAITING_START;
-    if (current_protocol_timeout_event_id != 0) s_eq_serial_worker.cancel(current_protocol_timeout_event_id);
+    if (current_protocol_timeout_event_id != 0) s_p_eq_serial_worker->cancel(current_protocol_timeout_event_id);
     current_protocol_timeout_event_id = 0;
 }
 
 void host_protocol_fill_with_rx_buffer_dump(char* destBuffer, size_t destBufferSize)
 {
-    sprintf(destBuffer, s_latest_received_command.c_str());
+    snprintf(destBuffer, destBufferSize, "%s", s_latest_received_command.c_str());
 }
 
 void host_protocol_fill_with_tx_buffer_dump(char* destBuffer, uint8_t* txBuffer, size_t destBufferSize)
@@ -147,7 +365,7 @@ void host_protocol_fill_with_tx_buffer_dump(char* destBuffer, uint8_t* txBuffer,
     memcpy(srcBuffer,txBuffer,PROTOCOL_BUFFER_SIZE);
     srcBuffer[PROTOCOL_BUFFER_SIZE-1]='\0';
 
-    strcpy(destBuffer,srcBuffer);
+    snprintf(destBuffer, destBufferSize, "%s", srcBuffer);
 }
 
 uint16_t host_protocol_get_latest_received_reply_payload()
@@ -177,7 +395,33 @@ uint16_t host_protocol_get_latest_sent_request_payload()
 
 bool host_protocol_should_i_reply_to_latest_received_request()
 {
-    return s_latest_received_vector[0].compare("Q")==0;
+    return s_latest_received_vector[0].compare("Q")==0 || s_latest_received_vector[0].compare("G")==0;
+}
+
+bool host_protocol_is_latest_received_request_a_gather()
+{
+    return s_latest_received_vector[0].compare("G")==0;
+}
+
+uint16_t host_protocol_get_latest_received_request_address_mask()
+{
+    return host_protocol_parse_address_mask(s_latest_received_vector[1].c_str());
+}
+
+char host_protocol_get_latest_received_command_type()
+{
+    return s_latest_received_vector[0].empty() ? '?' : s_latest_received_vector[0][0];
+}
+
+uint32_t host_protocol_get_latest_received_command_rx_us()
+{
+    return s_latest_received_command_rx_us;
+}
+
+void host_protocol_fill_with_latest_received_request_addresses(char* destBuffer, size_t destBufferSize)
+{
+    // As received: a single address, or the comma separated group of a gather
+    snprintf(destBuffer, destBufferSize, "%s", s_latest_received_vector.size() > 1 ? s_latest_received_vector[1].c_str() : "");
 }
 
 bool host_protocol_should_i_wait_for_reply_for_latest_sent_request()
@@ -187,7 +431,7 @@ bool host_protocol_should_i_wait_for_reply_for_latest_sent_request()
 
 void host_protocol_send_request_command(uint8_t* buffer, uint16_t bufferSize)
 {
-    pc_buffered_serial.write(buffer, strlen((const char*)buffer));
+    write_to_host(buffer, strlen((const char*)buffer));
 
     s_latest_sent_command=(const char*)buffer;
 
@@ -198,7 +442,7 @@ void host_protocol_send_request_command(uint8_t* buffer, uint16_t bufferSize)
 
 void host_protocol_send_reply_command(uint8_t* buffer, uint16_t bufferSize)
 {
-    pc_buffered_serial.write(buffer, strlen((const char*)buffer));
+    write_to_host(buffer, strlen((const char*)buffer));
 
     s_latest_sent_command=(const char*)buffer;
 
@@ -207,19 +451,21 @@ void host_protocol_send_reply_command(uint8_t* buffer, uint16_t bufferSize)
     split(s_latest_sent_command.c_str(), s_latest_sent_vector, '|');
 }
 
-void host_protocol_fill_create_request_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argPayload, uint8_t argSourceAddress, bool argRequiresReply)
+void host_protocol_send_out_of_band_reply(uint8_t* buffer, uint16_t bufferSize)
 {
-    sprintf((char*)buffer,"^%s|%u|%u@", argRequiresReply ? "Q" : "C", argSourceAddress, argPayload);
+    // Local command replies and deferred replies don't touch the latest sent command, which belongs to the ongoing transaction
+    write_to_host(buffer, strlen((const char*)buffer));
 }
 
-void host_protocol_fill_create_reply_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argPayload, uint8_t argDestinationAddress)
+void host_protocol_send_binary(const uint8_t* buffer, uint16_t bufferSize)
 {
-    sprintf((char*)buffer,"^R|%u|%u@", argDestinationAddress, argPayload);
+    // Binary records (frame capture) are interleaved with the text replies: the host tells them apart by their sync bytes
+    write_to_host(buffer, bufferSize);
 }
 
 bool host_protocol_is_latest_received_command_a_request()
 {
-    return s_latest_received_vector[0]=="Q" || s_latest_received_vector[0]=="C";
+    return s_latest_received_vector[0]=="Q" || s_latest_received_vector[0]=="C" || s_latest_received_vector[0]=="G";
 }
 
 bool host_protocol_is_latest_received_command_a_reply()
@@ -231,19 +477,3 @@ bool host_protocol_is_latest_received_reply_right()
 {
     return atoi(s_latest_received_vector[2].c_str()) >= 0;
 }
-
-void split(const char *str, std::vector<std::string>& v, char c = ' ')
-{
-    v.clear();
-
-    do
-    {
-        const char *begin = str;
-
-        while(*str != c && *str)
-            str++;
-
-        v.push_back(std::string(begin, str));
-
-    } while (0 != *str++);
-}
\ No newline at end of file
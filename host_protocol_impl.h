@@ -1,15 +1,30 @@
 #include <string>
 #include <vector>
 
+#include "host_protocol_codec.h"
+
 typedef enum _protocol_states_enum {
     WAITING_START,
     WAITING_END,
 
 } ProtocolStates;
 
+typedef struct
+{
+    uint32_t rxBufferFull;
+    uint32_t garbageBytes;
+    uint32_t txStalls;
+    uint32_t txDroppedBytes;
+    uint32_t baudFallbacks;
+
+} HostLinkStats_t;
+
 typedef void (*host_protocol_notify_command_received_callback_t) ();
 
+typedef void (*host_protocol_notify_local_command_received_callback_t) (const std::vector<std::string>&);
+
 extern host_protocol_notify_command_received_callback_t host_protocol_notify_command_received_callback_instance;
+extern host_protocol_notify_local_command_received_callback_t host_protocol_notify_local_command_received_callback_instance;
 
 void host_protocol_initialize(EventQueue* eventQueue);
 void host_protocol_reset();
@@ -21,20 +36,27 @@ uint16_t host_protocol_get_latest_received_request_payload();
 uint8_t host_protocol_get_latest_received_request_source_address();
 
 bool host_protocol_should_i_reply_to_latest_received_request();
+bool host_protocol_is_latest_received_request_a_gather();
+uint16_t host_protocol_get_latest_received_request_address_mask();
+char host_protocol_get_latest_received_command_type();
+uint32_t host_protocol_get_latest_received_command_rx_us();
+void host_protocol_fill_with_latest_received_request_addresses(char* destBuffer, size_t destBufferSize);
 bool host_protocol_should_i_wait_for_reply_for_latest_sent_request();
 
 void host_protocol_send_reply_command(uint8_t* buffer, uint16_t bufferSize);
 void host_protocol_send_request_command(uint8_t* buffer, uint16_t bufferSize);
+void host_protocol_send_out_of_band_reply(uint8_t* buffer, uint16_t bufferSize);
+void host_protocol_send_binary(const uint8_t* buffer, uint16_t bufferSize);
 
 bool host_protocol_is_latest_received_reply_right();
 
-void host_protocol_fill_create_request_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argCounter, uint8_t argSourceAddress, bool argRequiresReply);
-void host_protocol_fill_create_reply_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argPayload, uint8_t argDestinationAddress);
-
 bool host_protocol_is_latest_received_command_a_request();
 bool host_protocol_is_latest_received_command_a_reply();
 
+bool host_protocol_is_baud_rate_supported(uint32_t baud);
+uint32_t host_protocol_get_baud_rate();
+void host_protocol_switch_baud_rate(uint32_t baud);
+
+void host_protocol_fill_with_link_stats_dump(char* destBuffer, size_t destBufferSize);
 void host_protocol_fill_with_rx_buffer_dump(char* destBuffer, size_t destBufferSize);
 void host_protocol_fill_with_tx_buffer_dump(char* destBuffer, uint8_t* txBuffer, size_t destBufferSize);
-
-void split(const char *str, std::vector<std::string>& v, char c);
\ No newline at end of file
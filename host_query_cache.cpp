@@ -0,0 +1,184 @@
+#include <cstdint>
+#include <cstdio>
+
+#include "lora_config.h"
+#include "lora_airtime.h"
+
+#include "host_query_cache.h"
+
+typedef struct
+{
+    uint16_t payload;
+    uint32_t ttlMs;
+
+} QueryCacheClass_t;
+
+typedef struct
+{
+    bool valid;
+    uint8_t destinationAddress;
+    uint16_t payload;
+    uint16_t replyPayload;
+    uint32_t storedAtMs;
+    uint32_t lastUsedAtMs;
+
+} QueryCacheEntry_t;
+
+static QueryCacheClass_t s_classes[HOST_QUERY_CACHE_MAX_CLASSES];
+static QueryCacheEntry_t s_entries[HOST_QUERY_CACHE_SIZE];
+
+static uint32_t s_hits, s_misses, s_invalidations, s_airtime_saved_ms;
+
+static QueryCacheClass_t* find_class(uint16_t payload)
+{
+    for(int i=0; i<HOST_QUERY_CACHE_MAX_CLASSES; i++)
+    {
+        if(s_classes[i].ttlMs != 0 && s_classes[i].payload == payload) return &s_classes[i];
+    }
+
+    return NULL;
+}
+
+// An entry whose class is gone never matches a lookup again (its entries are dropped with it)
+static bool is_entry_expired(const QueryCacheEntry_t* entry, uint32_t nowMs)
+{
+    QueryCacheClass_t* cacheClass = find_class(entry->payload);
+
+    return !cacheClass || nowMs - entry->storedAtMs > cacheClass->ttlMs;
+}
+
+bool host_query_cache_set_cacheable_class(uint16_t payload, uint32_t ttlMs)
+{
+    QueryCacheClass_t* cacheClass = find_class(payload);
+
+    if(!cacheClass)
+    {
+        if(ttlMs == 0) return true;
+
+        for(int i=0; i<HOST_QUERY_CACHE_MAX_CLASSES && !cacheClass; i++)
+        {
+            if(s_classes[i].ttlMs == 0) cacheClass = &s_classes[i];
+        }
+
+        if(!cacheClass) return false;
+    }
+
+    cacheClass->payload = payload;
+    cacheClass->ttlMs = ttlMs;
+
+    if(ttlMs == 0)
+    {
+        for(int i=0; i<HOST_QUERY_CACHE_SIZE; i++)
+        {
+            if(s_entries[i].payload == payload) s_entries[i].valid = false;
+        }
+    }
+
+    return true;
+}
+
+bool host_query_cache_is_cacheable(uint16_t payload)
+{
+    return find_class(payload) != NULL;
+}
+
+bool host_query_cache_lookup(uint8_t destinationAddress, uint16_t payload, uint32_t nowMs, uint16_t* outReplyPayload)
+{
+    if(!find_class(payload)) return false;
+
+    for(int i=0; i<HOST_QUERY_CACHE_SIZE; i++)
+    {
+        QueryCacheEntry_t* entry = &s_entries[i];
+
+        if(!entry->valid || entry->destinationAddress != destinationAddress || entry->payload != payload) continue;
+
+        if(is_entry_expired(entry, nowMs))
+        {
+            entry->valid = false;
+
+            break;
+        }
+
+        entry->lastUsedAtMs = nowMs;
+
+        *outReplyPayload = entry->replyPayload;
+
+        // Neither the request nor the reply frame went on air
+        s_hits++;
+        s_airtime_saved_ms += 2 * lora_airtime_get_time_on_air_ms(RADIO_MESSAGES_BUFFER_SIZE);
+
+        return true;
+    }
+
+    s_misses++;
+
+    return false;
+}
+
+void host_query_cache_store(uint8_t destinationAddress, uint16_t payload, uint16_t replyPayload, uint32_t nowMs)
+{
+    if(!find_class(payload)) return;
+
+    QueryCacheEntry_t* victim = NULL;
+
+    for(int i=0; i<HOST_QUERY_CACHE_SIZE && !victim; i++)
+    {
+        QueryCacheEntry_t* entry = &s_entries[i];
+
+        if(entry->valid && entry->destinationAddress == destinationAddress && entry->payload == payload) victim = entry;
+    }
+
+    for(int i=0; i<HOST_QUERY_CACHE_SIZE && !victim; i++)
+    {
+        QueryCacheEntry_t* entry = &s_entries[i];
+
+        if(!entry->valid || is_entry_expired(entry, nowMs)) victim = entry;
+    }
+
+    if(!victim)
+    {
+        // Cache full of live entries: evict the least recently used one
+        victim = &s_entries[0];
+
+        for(int i=1; i<HOST_QUERY_CACHE_SIZE; i++)
+        {
+            if(nowMs - s_entries[i].lastUsedAtMs > nowMs - victim->lastUsedAtMs) victim = &s_entries[i];
+        }
+    }
+
+    victim->valid = true;
+    victim->destinationAddress = destinationAddress;
+    victim->payload = payload;
+    victim->replyPayload = replyPayload;
+    victim->storedAtMs = nowMs;
+    victim->lastUsedAtMs = nowMs;
+}
+
+void host_query_cache_invalidate(uint8_t destinationAddress)
+{
+    for(int i=0; i<HOST_QUERY_CACHE_SIZE; i++)
+    {
+        QueryCacheEntry_t* entry = &s_entries[i];
+
+        if(entry->valid && (destinationAddress == 0 || entry->destinationAddress == destinationAddress))
+        {
+            entry->valid = false;
+
+            s_invalidations++;
+        }
+    }
+}
+
+void host_query_cache_fill_with_stats_dump(char* destBuffer, size_t destBufferSize)
+{
+    int classes=0, used=0;
+
+    for(int i=0; i<HOST_QUERY_CACHE_MAX_CLASSES; i++) if(s_classes[i].ttlMs != 0) classes++;
+    for(int i=0; i<HOST_QUERY_CACHE_SIZE; i++) if(s_entries[i].valid) used++;
+
+    uint32_t lookups = s_hits + s_misses;
+
+    snprintf(destBuffer, destBufferSize, "hit=%lu,miss=%lu,rate=%lu%%,inv=%lu,saved=%lu,classes=%d,used=%d/%d",
+        (unsigned long)s_hits, (unsigned long)s_misses, (unsigned long)(lookups ? (100 * s_hits) / lookups : 0),
+        (unsigned long)s_invalidations, (unsigned long)s_airtime_saved_ms, classes, used, HOST_QUERY_CACHE_SIZE);
+}
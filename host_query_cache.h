@@ -0,0 +1,31 @@
+#ifndef __HOST_QUERY_CACHE_H__
+#define __HOST_QUERY_CACHE_H__
+
+#include <cstdint>
+#include <cstddef>
+
+#define HOST_QUERY_CACHE_SIZE           16      // (destination, payload) entries, least recently used is evicted
+#define HOST_QUERY_CACHE_MAX_CLASSES    8       // cacheable query payloads
+
+/*!
+ * @brief Marks queries with the given payload as cacheable for ttlMs (0 makes them not cacheable anymore)
+ */
+bool host_query_cache_set_cacheable_class(uint16_t payload, uint32_t ttlMs);
+
+bool host_query_cache_is_cacheable(uint16_t payload);
+
+/*!
+ * @brief Looks up a still valid reply for the (destination, payload) query
+ */
+bool host_query_cache_lookup(uint8_t destinationAddress, uint16_t payload, uint32_t nowMs, uint16_t* outReplyPayload);
+
+void host_query_cache_store(uint8_t destinationAddress, uint16_t payload, uint16_t replyPayload, uint32_t nowMs);
+
+/*!
+ * @brief Drops every cached reply of the given node (of every node for broadcast address 0)
+ */
+void host_query_cache_invalidate(uint8_t destinationAddress);
+
+void host_query_cache_fill_with_stats_dump(char* destBuffer, size_t destBufferSize);
+
+#endif // __HOST_QUERY_CACHE_H__
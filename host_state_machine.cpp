@@ -3,10 +3,17 @@
 #include "host_protocol_impl.h"
 #include "host_state_machine.h"
 
-#define WAIT_FOR_REPLY_TIMEOUT                          (2000)      // in ms
-#define STATE_MACHINE_STALE_STATE_TIMEOUT               (WAIT_FOR_REPLY_TIMEOUT+500)      // in ms
+#include "request_reply_engine.h"
+
+#include "lora_timing.h"
+
+#include "lora_config.h"
 
 #define HOST_MESSAGES_BUFFER_SIZE 32
+#define HOST_GATHER_REPLY_BUFFER_SIZE 160
+#define HOST_STATUS_REPLY_BUFFER_SIZE 160
+#define HOST_BULK_BUFFER_SIZE (2 * LORA_BULK_MAX_SIZE + 16)
+#define HOST_BATCH_REPLY_BUFFER_SIZE (HOST_BATCH_MAX_ITEMS * 16 + 8)
 
 /*
  *  Global variables declarations
@@ -22,38 +29,77 @@ typedef enum
     RX_DONE_RECEIVED_REPLY,
 
     TX_DONE_SENT_REQUEST,
-    TX_DONE_SENT_REPLY
+    TX_DONE_SENT_REPLY,
 
-} HostAppStates_t;
- 
-static HostAppStates_t State = INITIAL;
+    HOST_APP_STATES_COUNT
 
-static Timer s_state_timer;
+} HostAppStates_t;
 
 static Timer s_wait_for_reply_timer;
+
+// Derived from the host link settings at initialization (see lora_timing.h)
+static uint32_t s_wait_for_reply_timeout_ms;
+static uint32_t s_stale_state_timeout_ms;
+
+static EventQueue* s_event_queue;
+
+static HostFlowStats_t s_flow_stats;
+
+// Set by a request callback which couldn't send the request over LoRa, see host_state_machine_reject_latest_request()
+static uint8_t s_reject_reason;
+static uint32_t s_reject_retry_after_ms;
+
+// Addresses (bit n for address n < 32) turned down with "^E|..@", to be advertised with "^W|..@" once they can take requests again
+static uint32_t s_credits_owed_mask;
  
 /*
  *  Global variables declarations
  */
 
-Mutex host_reply_cond_var_mutex;
-ConditionVariable host_reply_cond_var(host_reply_cond_var_mutex);
-HostReplyOutcomes_t host_reply_outcome;
-uint16_t host_reply_payload;
-
 host_notify_request_callback_t host_state_machine_notify_request_callback;
 host_notify_request_and_get_reply_callback_t host_state_machine_notify_request_and_get_reply_callback;
+host_notify_gather_and_get_replies_callback_t host_state_machine_notify_gather_and_get_replies_callback;
+host_notify_gather_and_defer_replies_callback_t host_state_machine_notify_gather_and_defer_replies_callback;
+host_fill_status_callback_t host_state_machine_fill_status_callback;
+host_notify_request_and_defer_reply_callback_t host_state_machine_notify_request_and_defer_reply_callback;
+host_notify_local_command_callback_t host_state_machine_notify_local_command_callback;
+host_notify_injected_frame_callback_t host_state_machine_notify_injected_frame_callback;
+host_get_credits_callback_t host_state_machine_get_credits_callback;
+host_notify_bulk_callback_t host_state_machine_notify_bulk_callback;
+host_notify_batch_callback_t host_state_machine_notify_batch_callback;
+
+struct HostTransport
+{
+    typedef HostReplyOutcomes_t Outcome;
+
+    static constexpr Outcome pending_outcome() { return HOST_OUTCOME_PENDING; }
+    static constexpr Outcome timeout_stuck_outcome() { return HOST_OUTCOME_TIMEOUT_STUCK; }
+    static constexpr Outcome reply_right_outcome() { return HOST_OUTCOME_REPLY_RIGHT; }
+    static constexpr Outcome invalid_state_outcome() { return HOST_OUTCOME_INVALID_STATE; }
+
+    static Outcome send_request(uint16_t payload, uint8_t address, bool requiresReply) { return host_state_machine_send_request(payload, address, requiresReply); }
+};
+
+struct HostPolicy
+{
+    typedef HostAppStates_t State;
+    typedef void (*StateHandler)();
 
-static inline HostAppStates_t getState() { return State;}
-static HostAppStates_t setState(HostAppStates_t newState) { HostAppStates_t previousState=State; State=newState; s_state_timer.reset(); return previousState;}
+    static constexpr State initial_state() { return INITIAL; }
+
+    static StateHandler get_state_handler(State state);
+    static int get_stale_state_timeout_ms(State) { return s_stale_state_timeout_ms; }
+    static void on_stale_state(State) { /*printf("...(host state-machine timeout, resetting to initial state)...\n" );*/ }
+};
+
+static RequestReplyEngine<HostTransport, HostPolicy> s_engine;
+
+static inline HostAppStates_t getState() { return s_engine.get_state(); }
+static inline HostAppStates_t setState(HostAppStates_t newState) { return s_engine.set_state(newState); }
 
 static inline void updateAndNotifyConditionOutcome(HostReplyOutcomes_t outcome, uint16_t payload)
 {
-    host_reply_cond_var_mutex.lock();
-    host_reply_outcome=outcome;
-    host_reply_payload=payload;
-    host_reply_cond_var.notify_all();
-    host_reply_cond_var_mutex.unlock();
+    s_engine.update_and_notify_outcome(outcome, payload);
 }
 
 static void notify_request(uint8_t requestSourceAddress, uint16_t requestPayload)
@@ -68,147 +114,313 @@ static uint16_t notify_request_and_get_reply(uint8_t requestSourceAddress, uint1
     return 0;
 }
 
-void host_event_proc_communication_cycle()
+static bool notify_request_and_defer_reply(uint8_t requestSourceAddress, uint16_t requestPayload)
+{
+    if(host_state_machine_notify_request_and_defer_reply_callback) return host_state_machine_notify_request_and_defer_reply_callback(requestSourceAddress, requestPayload);
+
+    return false;
+}
+
+static bool notify_gather_and_defer_replies(uint16_t addressMask, uint16_t requestPayload)
+{
+    if(host_state_machine_notify_gather_and_defer_replies_callback) return host_state_machine_notify_gather_and_defer_replies_callback(addressMask, requestPayload);
+
+    return false;
+}
+
+static void notify_gather_and_get_replies(uint16_t addressMask, uint16_t requestPayload, uint16_t* outRespondedMask, uint16_t* outReplyPayloads)
+{
+    *outRespondedMask=0;
+
+    if(host_state_machine_notify_gather_and_get_replies_callback) host_state_machine_notify_gather_and_get_replies_callback(addressMask, requestPayload, outRespondedMask, outReplyPayloads);
+}
+
+static uint8_t get_credits(uint8_t address, uint8_t* outWindow, uint32_t* outRetryAfterMs)
+{
+    *outWindow=1;
+    *outRetryAfterMs=0;
+
+    uint8_t credits = host_state_machine_get_credits_callback ? host_state_machine_get_credits_callback(address, outWindow, outRetryAfterMs) : 1;
+
+    // Requests are only taken while waiting for one, whatever the radio side could do
+    if(getState() != RX_WAITING_FOR_REQUEST)
+    {
+        if(*outRetryAfterMs < HOST_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL) *outRetryAfterMs = HOST_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL;
+
+        return 0;
+    }
+
+    return credits;
+}
+
+static void send_not_sent(uint8_t reason, uint32_t retryAfterMs)
+{
+    char addresses[HOST_MESSAGES_BUFFER_SIZE];
+    uint8_t buffer[HOST_MESSAGES_BUFFER_SIZE * 2];
+
+    host_protocol_fill_with_latest_received_request_addresses(addresses, HOST_MESSAGES_BUFFER_SIZE);
+    host_protocol_fill_create_not_sent_buffer(buffer, sizeof(buffer), host_protocol_get_latest_received_command_type(), addresses,
+        host_protocol_get_latest_received_request_payload(), reason, retryAfterMs);
+
+    printf("*** HOST SEND NOT SENT : '%s' ***\n", (const char*)buffer);
+
+    host_protocol_send_out_of_band_reply(buffer, sizeof(buffer));
+
+    if(reason == HOST_NOT_SENT_QUEUE_FULL) s_flow_stats.notSentQueueFull++;
+    else if(reason == HOST_NOT_SENT_NO_SLOT) s_flow_stats.notSentNoSlot++;
+    else if(reason == HOST_NOT_SENT_UNKNOWN_PEER) s_flow_stats.notSentUnknownPeer++;
+    else if(reason == HOST_NOT_SENT_BAD_REQUEST) s_flow_stats.notSentBadRequest++;
+    else s_flow_stats.notSentBusy++;
+
+    // Sending the same request again wouldn't help, no credits to advertise later
+    if(reason == HOST_NOT_SENT_BAD_REQUEST) return;
+
+    if(host_protocol_is_latest_received_request_a_gather())
+    {
+        s_credits_owed_mask |= host_protocol_get_latest_received_request_address_mask();
+    }
+    else
+    {
+        uint8_t address = host_protocol_get_latest_received_request_source_address();
+
+        if(address < 32) s_credits_owed_mask |= (1UL << address);
+    }
+}
+
+// A request callback may have turned the request down (see host_state_machine_reject_latest_request())
+static bool send_not_sent_if_rejected()
+{
+    if(s_reject_reason == 0) return false;
+
+    send_not_sent(s_reject_reason, s_reject_retry_after_ms);
+
+    s_reject_reason=0;
+
+    return true;
+}
+
+static void handle_initial()
+{
+    //printf("--- HOST INITIAL STATE ---\n");
+
+    host_protocol_reset();
+    
+    setState(RX_WAITING_FOR_REQUEST);
+}
+
+static void handle_rx_waiting_for_request()
 {
-    int elapsed_ms=s_state_timer.read_ms();
+    if(s_credits_owed_mask == 0) return;
 
-    if(elapsed_ms > STATE_MACHINE_STALE_STATE_TIMEOUT)
+    // Hosts turned down with "^E|..@" are told as soon as they can send again
+    for(uint8_t address=0; address<32; address++)
     {
-        //printf("...(host state-machine timeout, resetting to initial state)...\n" );
+        if(!(s_credits_owed_mask & (1UL << address))) continue;
+
+        uint8_t window;
+        uint32_t retryAfterMs;
+
+        uint8_t credits = get_credits(address, &window, &retryAfterMs);
+
+        if(credits == 0) continue;
+
+        uint8_t buffer[HOST_MESSAGES_BUFFER_SIZE];
+
+        host_protocol_fill_create_credits_buffer(buffer, HOST_MESSAGES_BUFFER_SIZE, address, credits, window);
+        host_protocol_send_out_of_band_reply(buffer, HOST_MESSAGES_BUFFER_SIZE);
+
+        s_credits_owed_mask &= ~(1UL << address);
+
+        s_flow_stats.creditAdvertisements++;
+    }
+}
+
+static void handle_rx_waiting_for_reply()
+{
+    //printf("...(waiting for host reply)...\n" );
+
+    if((uint32_t)s_wait_for_reply_timer.read_ms() > s_wait_for_reply_timeout_ms)
+    {
+        printf("...(timeout waiting for host reply)...\n" );
+
+        updateAndNotifyConditionOutcome(HOST_OUTCOME_WAITING_FOR_REPLY_TIMEOUT, 0);
 
         setState(INITIAL);
     }
+}
 
+static void handle_rx_done_received_request()
+{
     uint16_t requestPayload;
     uint16_t replyPayload;
     uint8_t requestSourceAddress;
-    uint8_t replyDestinationAddress;
 
     char dumpBuffer[HOST_MESSAGES_BUFFER_SIZE];
 
     uint16_t bufferSize=HOST_MESSAGES_BUFFER_SIZE;
     uint8_t buffer[HOST_MESSAGES_BUFFER_SIZE];
 
-    switch( getState() )
-    {
-        case INITIAL:
+    host_protocol_fill_with_rx_buffer_dump(dumpBuffer, HOST_MESSAGES_BUFFER_SIZE);
 
-            //printf("--- HOST INITIAL STATE ---\n");
+    printf("*** HOST REQUEST RECEIVED : '%s' ***\n", dumpBuffer);
+    
+    requestSourceAddress = host_protocol_get_latest_received_request_source_address();
+    requestPayload = host_protocol_get_latest_received_request_payload();
 
-            host_protocol_reset();
-            
-            setState(RX_WAITING_FOR_REQUEST);
+    s_reject_reason=0;
 
-            break;
+    if(!host_protocol_should_i_reply_to_latest_received_request())
+    {
+        printf("...but I should not reply to host\n");
 
-        case RX_WAITING_FOR_REQUEST:
-            //printf("...(waiting for host request)...\n" );
-            break;
+        notify_request(requestSourceAddress, requestPayload);
 
-        case RX_WAITING_FOR_REPLY:
-            //printf("...(waiting for host reply)...\n" );
+        send_not_sent_if_rejected();
 
-            if(s_wait_for_reply_timer.read_ms() > WAIT_FOR_REPLY_TIMEOUT)
-            {
-                printf("...(timeout waiting for host reply)...\n" );
+        setState(INITIAL);
+        
+        return;
+    }
 
-                updateAndNotifyConditionOutcome(HOST_OUTCOME_WAITING_FOR_REPLY_TIMEOUT, 0);
+    if(host_protocol_is_latest_received_request_a_gather())
+    {
+        uint16_t addressMask = host_protocol_get_latest_received_request_address_mask();
+        uint16_t respondedMask;
+        uint16_t replyPayloads[HOST_GATHER_MAX_ADDRESS+1];
+        uint8_t gatherBuffer[HOST_GATHER_REPLY_BUFFER_SIZE];
 
-                setState(INITIAL);
-            }
+        printf("...GATHER REQUEST, I SHOULD REPLY TO HOST...\n");
 
-            break;
+        if(notify_gather_and_defer_replies(addressMask, requestPayload))
+        {
+            if(!send_not_sent_if_rejected()) printf("...AND GATHER REPLY TO HOST HAS BEEN DEFERRED\n");
 
-        case RX_DONE_RECEIVED_REQUEST:
+            setState(INITIAL);
 
-            host_protocol_fill_with_rx_buffer_dump(dumpBuffer, HOST_MESSAGES_BUFFER_SIZE);
+            return;
+        }
 
-            printf("*** HOST REQUEST RECEIVED : '%s' ***\n", dumpBuffer);
-            
-            requestSourceAddress = host_protocol_get_latest_received_request_source_address();
-            requestPayload = host_protocol_get_latest_received_request_payload();
+        notify_gather_and_get_replies(addressMask, requestPayload, &respondedMask, replyPayloads);
 
-            if(!host_protocol_should_i_reply_to_latest_received_request())
-            {
-                printf("...but I should not reply to host\n");
+        if(send_not_sent_if_rejected())
+        {
+            setState(INITIAL);
+
+            return;
+        }
 
-                notify_request(requestSourceAddress, requestPayload);
+        // Send the aggregated REPLY frame
+        host_protocol_fill_create_gather_reply_buffer(gatherBuffer, HOST_GATHER_REPLY_BUFFER_SIZE, addressMask, respondedMask, replyPayloads);
+        host_protocol_send_reply_command(gatherBuffer, HOST_GATHER_REPLY_BUFFER_SIZE);
 
-                setState(INITIAL);
-                
-                break;
-            }
+        setState(TX_DONE_SENT_REPLY);
 
-            printf("...AND I SHOULD REPLY TO HOST...\n");
+        return;
+    }
 
-            replyPayload = notify_request_and_get_reply(requestSourceAddress, requestPayload);
-            
-            // Send the REPLY frame
-            host_protocol_fill_create_reply_buffer(buffer, bufferSize, replyPayload, requestSourceAddress);
-            host_protocol_send_reply_command(buffer, bufferSize);
+    if(notify_request_and_defer_reply(requestSourceAddress, requestPayload))
+    {
+        if(!send_not_sent_if_rejected()) printf("...AND REPLY TO HOST HAS BEEN DEFERRED\n");
 
-            setState(TX_DONE_SENT_REPLY);
+        setState(INITIAL);
 
-            break;
+        return;
+    }
 
-        case RX_DONE_RECEIVED_REPLY:
+    printf("...AND I SHOULD REPLY TO HOST...\n");
 
-            host_protocol_fill_with_rx_buffer_dump(dumpBuffer, HOST_MESSAGES_BUFFER_SIZE);
+    replyPayload = notify_request_and_get_reply(requestSourceAddress, requestPayload);
 
-            printf("*** HOST REPLY RECEIVED ('%s') ***\n", dumpBuffer);
-            
-            if(host_protocol_is_latest_received_reply_right())
-            {
-                printf("...AND HOST REPLY IS RIGHT\n");
+    // Not sent over LoRa: no reply to give, the host retries later
+    if(send_not_sent_if_rejected())
+    {
+        setState(INITIAL);
 
-                replyPayload = host_protocol_get_latest_received_reply_payload();
+        return;
+    }
+    
+    // Send the REPLY frame
+    host_protocol_fill_create_reply_buffer(buffer, bufferSize, replyPayload, requestSourceAddress);
+    host_protocol_send_reply_command(buffer, bufferSize);
 
-                updateAndNotifyConditionOutcome(HOST_OUTCOME_REPLY_RIGHT, replyPayload);
+    setState(TX_DONE_SENT_REPLY);
+}
 
-                setState(INITIAL);
-            }
-            else
-            {
-                printf("...BUT HOST REPLY IS WRONG\n");
+static void handle_rx_done_received_reply()
+{
+    char dumpBuffer[HOST_MESSAGES_BUFFER_SIZE];
 
-                updateAndNotifyConditionOutcome(HOST_OUTCOME_REPLY_WRONG, 0);
+    host_protocol_fill_with_rx_buffer_dump(dumpBuffer, HOST_MESSAGES_BUFFER_SIZE);
 
-                setState(INITIAL);
-            }
+    printf("*** HOST REPLY RECEIVED ('%s') ***\n", dumpBuffer);
+    
+    if(host_protocol_is_latest_received_reply_right())
+    {
+        printf("...AND HOST REPLY IS RIGHT\n");
 
-            break;
+        updateAndNotifyConditionOutcome(HOST_OUTCOME_REPLY_RIGHT, host_protocol_get_latest_received_reply_payload());
+    }
+    else
+    {
+        printf("...BUT HOST REPLY IS WRONG\n");
 
-        case TX_DONE_SENT_REQUEST:
+        updateAndNotifyConditionOutcome(HOST_OUTCOME_REPLY_WRONG, 0);
+    }
 
-            printf("...host request sent...\n" );
+    setState(INITIAL);
+}
 
-            if(!host_protocol_should_i_wait_for_reply_for_latest_sent_request())
-            {
-                printf("...but I should not wait for host reply\n" );
+static void handle_tx_done_sent_request()
+{
+    printf("...host request sent...\n" );
 
-                updateAndNotifyConditionOutcome(HOST_OUTCOME_REPLY_NOT_NEEDED, 0);
+    if(!host_protocol_should_i_wait_for_reply_for_latest_sent_request())
+    {
+        printf("...but I should not wait for host reply\n" );
 
-                setState(INITIAL);
+        updateAndNotifyConditionOutcome(HOST_OUTCOME_REPLY_NOT_NEEDED, 0);
 
-                break;
-            }
+        setState(INITIAL);
 
-            printf("...waiting for host reply...\n" );
-            
-            setState(RX_WAITING_FOR_REPLY);
+        return;
+    }
 
-            s_wait_for_reply_timer.reset();
+    printf("...waiting for host reply (%lu ms)...\n", (unsigned long)s_wait_for_reply_timeout_ms );
+    
+    setState(RX_WAITING_FOR_REPLY);
 
-            break;
+    s_wait_for_reply_timer.reset();
+}
 
-        case TX_DONE_SENT_REPLY:
+static void handle_tx_done_sent_reply()
+{
+    printf("...REPLY SENT TO HOST\n" ); 
+   
+    setState(INITIAL);
+}
 
-            printf("...REPLY SENT TO HOST\n" ); 
-           
-            setState(INITIAL);
-            
-            break;
-    }
+// Indexed by HostAppStates_t; NULL where the state only waits for a host command (or reply)
+static constexpr HostPolicy::StateHandler s_state_handlers[] =
+{
+    handle_initial,                     // INITIAL
+    handle_rx_waiting_for_request,      // RX_WAITING_FOR_REQUEST
+    handle_rx_waiting_for_reply,        // RX_WAITING_FOR_REPLY
+    handle_rx_done_received_request,    // RX_DONE_RECEIVED_REQUEST
+    handle_rx_done_received_reply,      // RX_DONE_RECEIVED_REPLY
+    handle_tx_done_sent_request,        // TX_DONE_SENT_REQUEST
+    handle_tx_done_sent_reply           // TX_DONE_SENT_REPLY
+};
+
+static_assert(sizeof(s_state_handlers)/sizeof(s_state_handlers[0]) == HOST_APP_STATES_COUNT, "one handler per host state expected");
+
+HostPolicy::StateHandler HostPolicy::get_state_handler(HostAppStates_t state)
+{
+    return s_state_handlers[state];
+}
+
+void host_event_proc_communication_cycle()
+{
+    s_engine.dispatch();
 }
 
 HostReplyOutcomes_t host_state_machine_send_request(uint16_t argCounter, uint8_t argLoraDestinationAddress, bool argRequiresReply)
@@ -234,6 +446,16 @@ HostReplyOutcomes_t host_state_machine_send_request(uint16_t argCounter, uint8_t
     return HOST_OUTCOME_PENDING;
 }
 
+HostReplyOutcomes_t host_state_machine_send_request_and_wait(uint16_t argCounter, uint8_t argLoraDestinationAddress, bool argRequiresReply, uint32_t argTimeoutMs, uint16_t* outReplyPayload)
+{
+    return s_engine.send_request_and_wait(argCounter, argLoraDestinationAddress, argRequiresReply, argTimeoutMs, outReplyPayload);
+}
+
+HostReplyOutcomes_t host_state_machine_send_request_async(uint16_t argCounter, uint8_t argLoraDestinationAddress, bool argRequiresReply, uint32_t argTimeoutMs, host_completion_callback_t argCompletion)
+{
+    return s_engine.send_request_async(argCounter, argLoraDestinationAddress, argRequiresReply, argTimeoutMs, argCompletion);
+}
+
 void notify_command_received_callback()
 {
     if(getState() == RX_WAITING_FOR_REQUEST && host_protocol_is_latest_received_command_a_request())
@@ -248,6 +470,16 @@ void notify_command_received_callback()
 
         setState(RX_DONE_RECEIVED_REPLY);
     }
+    else if(host_protocol_is_latest_received_command_a_request())
+    {
+        // Busy with another transaction: the host is told so (and when to retry) instead of the request being dropped
+        uint8_t window;
+        uint32_t retryAfterMs;
+
+        get_credits(host_protocol_get_latest_received_request_source_address(), &window, &retryAfterMs);
+
+        send_not_sent(HOST_NOT_SENT_BUSY, retryAfterMs);
+    }
     else // ricezione valida, ma arrivata in uno stato non previsto
     {   
         char dumpBuffer[HOST_MESSAGES_BUFFER_SIZE];
@@ -258,13 +490,267 @@ void notify_command_received_callback()
     }
 }
 
+static void event_proc_send_deferred_reply(uint8_t loraSourceAddress, uint16_t payload)
+{
+    uint8_t buffer[HOST_MESSAGES_BUFFER_SIZE];
+
+    host_protocol_fill_create_reply_buffer(buffer, HOST_MESSAGES_BUFFER_SIZE, payload, loraSourceAddress);
+
+    printf("*** HOST SEND DEFERRED REPLY : '%s' ***\n", (const char*)buffer);
+
+    host_protocol_send_out_of_band_reply(buffer, HOST_MESSAGES_BUFFER_SIZE);
+}
+
+void host_state_machine_send_deferred_reply(uint8_t argLoraSourceAddress, uint16_t argPayload)
+{
+    // Host link is only written from its own event queue
+    s_event_queue->call(event_proc_send_deferred_reply, argLoraSourceAddress, argPayload);
+}
+
+static void event_proc_send_deferred_gather_reply(std::string* pbuffer)
+{
+    printf("*** HOST SEND DEFERRED GATHER REPLY : '%s' ***\n", pbuffer->c_str());
+
+    host_protocol_send_out_of_band_reply((uint8_t*)pbuffer->c_str(), pbuffer->size() + 1);
+
+    delete pbuffer;
+}
+
+void host_state_machine_send_deferred_gather_reply(uint16_t argAddressMask, uint16_t argRespondedMask, const uint16_t* argReplyPayloads)
+{
+    uint8_t buffer[HOST_GATHER_REPLY_BUFFER_SIZE];
+
+    host_protocol_fill_create_gather_reply_buffer(buffer, HOST_GATHER_REPLY_BUFFER_SIZE, argAddressMask, argRespondedMask, argReplyPayloads);
+
+    // Payloads don't fit the event arguments: the reply is formatted here and only written from the host event queue
+    s_event_queue->call(event_proc_send_deferred_gather_reply, new std::string((const char*)buffer));
+}
+
+static void event_proc_send_bulk_message(std::string* pbuffer)
+{
+    printf("*** HOST SEND BULK : '%s' ***\n", pbuffer->c_str());
+
+    host_protocol_send_out_of_band_reply((uint8_t*)pbuffer->c_str(), pbuffer->size() + 1);
+
+    delete pbuffer;
+}
+
+void host_state_machine_send_bulk_report(uint16_t argAddressMask, uint16_t argCompletedMask)
+{
+    uint8_t buffer[HOST_GATHER_REPLY_BUFFER_SIZE];
+
+    host_protocol_fill_create_bulk_report_buffer(buffer, HOST_GATHER_REPLY_BUFFER_SIZE, argAddressMask, argCompletedMask);
+
+    s_event_queue->call(event_proc_send_bulk_message, new std::string((const char*)buffer));
+}
+
+void host_state_machine_send_bulk_received(uint8_t argLoraSourceAddress, uint8_t argSession, const uint8_t* argBlob, uint16_t argSize)
+{
+    uint8_t buffer[HOST_BULK_BUFFER_SIZE];
+
+    host_protocol_fill_create_bulk_received_buffer(buffer, HOST_BULK_BUFFER_SIZE, argLoraSourceAddress, argSession, argBlob, argSize);
+
+    s_event_queue->call(event_proc_send_bulk_message, new std::string((const char*)buffer));
+}
+
+static void event_proc_send_batch_reply(std::string* pbuffer)
+{
+    printf("*** HOST SEND BATCH REPLY : '%s' ***\n", pbuffer->c_str());
+
+    host_protocol_send_out_of_band_reply((uint8_t*)pbuffer->c_str(), pbuffer->size() + 1);
+
+    delete pbuffer;
+}
+
+void host_state_machine_send_batch_reply(const HostBatchItem_t* argItems, uint8_t argCount)
+{
+    uint8_t buffer[HOST_BATCH_REPLY_BUFFER_SIZE];
+
+    host_protocol_fill_create_batch_reply_buffer(buffer, HOST_BATCH_REPLY_BUFFER_SIZE, argItems, argCount);
+
+    s_event_queue->call(event_proc_send_batch_reply, new std::string((const char*)buffer));
+}
+
+static void event_proc_send_stored_report(std::string* pbuffer)
+{
+    printf("*** HOST SEND STORED REPORT : '%s' ***\n", pbuffer->c_str());
+
+    host_protocol_send_out_of_band_reply((uint8_t*)pbuffer->c_str(), pbuffer->size() + 1);
+
+    delete pbuffer;
+}
+
+void host_state_machine_send_stored_report(uint8_t argLoraAddress, uint16_t argRequestPayload, uint16_t argReplyPayload, uint8_t argEvent, uint32_t argMs)
+{
+    uint8_t buffer[HOST_MESSAGES_BUFFER_SIZE * 2];
+
+    host_protocol_fill_create_stored_report_buffer(buffer, sizeof(buffer), argLoraAddress, argRequestPayload, argReplyPayload, argEvent, argMs);
+
+    s_event_queue->call(event_proc_send_stored_report, new std::string((const char*)buffer));
+}
+
+void host_state_machine_reject_latest_request(HostNotSentReasons_t argReason, uint32_t argRetryAfterMs)
+{
+    s_reject_reason = argReason;
+    s_reject_retry_after_ms = argRetryAfterMs;
+}
+
+void host_state_machine_fill_with_flow_stats_dump(char* destBuffer, size_t destBufferSize)
+{
+    snprintf(destBuffer, destBufferSize, "busy=%lu,full=%lu,noslot=%lu,unk=%lu,bad=%lu,adv=%lu,owed=0x%lX,batch=%lu/%lu",
+        (unsigned long)s_flow_stats.notSentBusy, (unsigned long)s_flow_stats.notSentQueueFull, (unsigned long)s_flow_stats.notSentNoSlot,
+        (unsigned long)s_flow_stats.notSentUnknownPeer, (unsigned long)s_flow_stats.notSentBadRequest,
+        (unsigned long)s_flow_stats.creditAdvertisements, (unsigned long)s_credits_owed_mask,
+        (unsigned long)s_flow_stats.batches, (unsigned long)s_flow_stats.batchItems);
+}
+
+void notify_local_command_received_callback(const std::vector<std::string>& items)
+{
+    if(items[0]=="S")
+    {
+        char section = items.size() > 1 && !items[1].empty() ? items[1][0] : '?';
+
+        char content[HOST_STATUS_REPLY_BUFFER_SIZE];
+        uint8_t buffer[HOST_STATUS_REPLY_BUFFER_SIZE];
+
+        content[0]='\0';
+
+        if(host_state_machine_fill_status_callback) host_state_machine_fill_status_callback(section, content, HOST_STATUS_REPLY_BUFFER_SIZE - 8);
+
+        snprintf((char*)buffer, HOST_STATUS_REPLY_BUFFER_SIZE, "^S|%c|%s@", section, content);
+
+        host_protocol_send_out_of_band_reply(buffer, HOST_STATUS_REPLY_BUFFER_SIZE);
+    }
+    else if(items[0]=="B")
+    {
+        // !B|baud# switches the host link rate (0 only asks for the current and maximum one)
+        uint32_t baud = items.size() > 1 ? strtoul(items[1].c_str(), NULL, 10) : 0;
+        bool switching = false;
+
+        uint8_t buffer[HOST_MESSAGES_BUFFER_SIZE];
+
+        if(baud == 0)
+        {
+            snprintf((char*)buffer, HOST_MESSAGES_BUFFER_SIZE, "^B|%lu|%lu@", (unsigned long)host_protocol_get_baud_rate(), (unsigned long)HOST_UART_MAX_BAUD_RATE);
+        }
+        else
+        {
+            bool supported = host_protocol_is_baud_rate_supported(baud);
+
+            snprintf((char*)buffer, HOST_MESSAGES_BUFFER_SIZE, "^B|%lu|%d@", (unsigned long)baud, supported ? 1 : 0);
+
+            switching = supported && baud != host_protocol_get_baud_rate();
+        }
+
+        // The reply still goes out at the current rate
+        host_protocol_send_out_of_band_reply(buffer, HOST_MESSAGES_BUFFER_SIZE);
+
+        if(switching) host_protocol_switch_baud_rate(baud);
+    }
+    else if(items[0]=="W")
+    {
+        // !W|address# asks how many requests for that address the node can take right now
+        uint8_t address = items.size() > 1 ? atoi(items[1].c_str()) : 0;
+        uint8_t window;
+        uint32_t retryAfterMs;
+
+        uint8_t credits = get_credits(address, &window, &retryAfterMs);
+
+        uint8_t buffer[HOST_MESSAGES_BUFFER_SIZE];
+
+        host_protocol_fill_create_credits_buffer(buffer, HOST_MESSAGES_BUFFER_SIZE, address, credits, window);
+        host_protocol_send_out_of_band_reply(buffer, HOST_MESSAGES_BUFFER_SIZE);
+    }
+    else if(items[0]=="J")
+    {
+        // !J|rssi|snr|frame as hex digits#
+        int16_t rssi = items.size() > 1 ? atoi(items[1].c_str()) : 0;
+        int8_t snr = items.size() > 2 ? atoi(items[2].c_str()) : 0;
+        const std::string hex = items.size() > 3 ? items[3] : "";
+
+        uint8_t frame[HOST_MESSAGES_BUFFER_SIZE];
+        uint16_t frameSize=0;
+
+        for(size_t i=0; i+1 < hex.size() && frameSize < HOST_MESSAGES_BUFFER_SIZE; i+=2)
+        {
+            frame[frameSize++] = strtoul(hex.substr(i, 2).c_str(), NULL, 16);
+        }
+
+        int result = host_state_machine_notify_injected_frame_callback && frameSize > 0 ? host_state_machine_notify_injected_frame_callback(frame, frameSize, rssi, snr) : -1;
+
+        uint8_t buffer[HOST_MESSAGES_BUFFER_SIZE];
+
+        snprintf((char*)buffer, HOST_MESSAGES_BUFFER_SIZE, "^J|%u|%d@", frameSize, result);
+
+        host_protocol_send_out_of_band_reply(buffer, HOST_MESSAGES_BUFFER_SIZE);
+    }
+    else if(items[0]=="Y")
+    {
+        // !Y|addresses|blob as hex digits#: "^Y|..@" comes once the bulk transfer is over, right away if it couldn't start
+        uint16_t addressMask = items.size() > 1 ? host_protocol_parse_address_mask(items[1].c_str()) : 0;
+        const std::string hex = items.size() > 2 ? items[2] : "";
+
+        uint8_t blob[LORA_BULK_MAX_SIZE];
+        uint16_t blobSize=0;
+
+        for(size_t i=0; i+1 < hex.size() && blobSize < LORA_BULK_MAX_SIZE; i+=2)
+        {
+            blob[blobSize++] = strtoul(hex.substr(i, 2).c_str(), NULL, 16);
+        }
+
+        bool started = host_state_machine_notify_bulk_callback && blobSize > 0 && hex.size() <= 2 * LORA_BULK_MAX_SIZE &&
+            host_state_machine_notify_bulk_callback(addressMask, blob, blobSize);
+
+        if(!started) host_state_machine_send_bulk_report(addressMask, 0);
+    }
+    else if(items[0]=="M")
+    {
+        // !M|<type>,<address>,<payload>|..#: the items go to the radio side together, "^M|..@" comes once all of them are over
+        HostBatchItem_t batch[HOST_BATCH_MAX_ITEMS];
+        uint8_t count=0;
+        uint8_t validCount=0;
+
+        for(size_t i=1; i<items.size() && count<HOST_BATCH_MAX_ITEMS; i++)
+        {
+            if(host_protocol_parse_batch_item(items[i].c_str(), &batch[count++])) validCount++;
+        }
+
+        s_flow_stats.batches++;
+        s_flow_stats.batchItems += count;
+
+        bool deferred = validCount > 0 && host_state_machine_notify_batch_callback && host_state_machine_notify_batch_callback(batch, count);
+
+        if(!deferred) host_state_machine_send_batch_reply(batch, count);
+    }
+    else
+    {
+        char command = items[0][0];
+        int arg1 = items.size() > 1 ? atoi(items[1].c_str()) : 0;
+        int arg2 = items.size() > 2 ? atoi(items[2].c_str()) : 0;
+
+        int result = host_state_machine_notify_local_command_callback ? host_state_machine_notify_local_command_callback(command, arg1, arg2) : -1;
+
+        uint8_t buffer[HOST_MESSAGES_BUFFER_SIZE];
+
+        snprintf((char*)buffer, HOST_MESSAGES_BUFFER_SIZE, "^%c|%d|%d@", command, arg1, result);
+
+        host_protocol_send_out_of_band_reply(buffer, HOST_MESSAGES_BUFFER_SIZE);
+    }
+}
+
 int host_state_machine_initialize(EventQueue* eventQueue)
 {
     host_protocol_initialize(eventQueue);
 
+    s_event_queue = eventQueue;
+
     host_protocol_notify_command_received_callback_instance = notify_command_received_callback;
+    host_protocol_notify_local_command_received_callback_instance = notify_local_command_received_callback;
+
+    s_wait_for_reply_timeout_ms = lora_timing_get_host_reply_timeout_ms();
+    s_stale_state_timeout_ms = lora_timing_get_stale_state_timeout_ms(s_wait_for_reply_timeout_ms);
 
-    s_state_timer.start();
+    s_engine.start();
     s_wait_for_reply_timer.start();
 
     return 0;
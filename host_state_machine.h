@@ -1,3 +1,5 @@
+#include "host_protocol_codec.h"
+
 typedef enum
 {
     HOST_OUTCOME_PENDING=-1,
@@ -12,17 +14,94 @@ typedef enum
 
 } HostReplyOutcomes_t;
 
+// Why a request from the host was not sent over LoRa (reported with "^E|..@" instead of a reply)
+typedef enum
+{
+    HOST_NOT_SENT_BUSY=1,                   // node busy with another transaction (host link or radio)
+    HOST_NOT_SENT_QUEUE_FULL=2,             // gateway mode: queue of the destination node full
+    HOST_NOT_SENT_NO_SLOT=3,                // TDMA mode: not synchronized, no slot to send in
+    HOST_NOT_SENT_UNKNOWN_PEER=4,           // neighbor discovery: destination node not heard lately
+    HOST_NOT_SENT_BAD_REQUEST=6,            // request the node can't send as it is (e.g. gather to an empty group), same value as HOST_BATCH_ITEM_INVALID
+
+} HostNotSentReasons_t;
+
+typedef struct
+{
+    uint32_t notSentBusy;
+    uint32_t notSentQueueFull;
+    uint32_t notSentNoSlot;
+    uint32_t notSentUnknownPeer;
+    uint32_t notSentBadRequest;
+    uint32_t creditAdvertisements;
+    uint32_t batches;
+    uint32_t batchItems;
+
+} HostFlowStats_t;
+
 typedef void (*host_notify_request_callback_t)(uint8_t, uint16_t);
 typedef uint16_t (*host_notify_request_and_get_reply_callback_t)(uint8_t, uint16_t);
 
-extern Mutex host_reply_cond_var_mutex;
-extern ConditionVariable host_reply_cond_var;
-extern HostReplyOutcomes_t host_reply_outcome;
-extern uint16_t host_reply_payload;
+#define HOST_GATHER_MAX_ADDRESS 15
+
+// (address mask, payload, out responded mask, out reply payloads indexed by address)
+typedef void (*host_notify_gather_and_get_replies_callback_t)(uint16_t, uint16_t, uint16_t*, uint16_t*);
+
+// (address mask, payload) -> true if the aggregated reply will be sent later through host_state_machine_send_deferred_gather_reply()
+typedef bool (*host_notify_gather_and_defer_replies_callback_t)(uint16_t, uint16_t);
+
+// (outcome, reply payload) of a request started without blocking
+typedef void (*host_completion_callback_t)(HostReplyOutcomes_t, uint16_t);
+
+// (lora destination address, payload) -> true if the reply will be sent later through host_state_machine_send_deferred_reply()
+typedef bool (*host_notify_request_and_defer_reply_callback_t)(uint8_t, uint16_t);
+
+// (section, destination buffer, destination buffer size)
+typedef void (*host_fill_status_callback_t)(char, char*, uint16_t);
+
+// (local command, first argument, second argument) -> value echoed back in the reply
+typedef int (*host_notify_local_command_callback_t)(char, int, int);
+
+// (frame, frame size, rssi, snr) -> value echoed back in the reply
+typedef int (*host_notify_injected_frame_callback_t)(const uint8_t*, uint16_t, int16_t, int8_t);
+
+// (lora destination address, out window, out retry after ms) -> requests for that address the node can take right now
+typedef uint8_t (*host_get_credits_callback_t)(uint8_t, uint8_t*, uint32_t*);
+
+// (address mask, blob, blob size) -> true if the bulk transfer started, its outcome comes later through host_state_machine_send_bulk_report()
+typedef bool (*host_notify_bulk_callback_t)(uint16_t, const uint8_t*, uint16_t);
+
+// (items, item count) -> true if their statuses will be sent later through host_state_machine_send_batch_reply(), otherwise
+// they are filled in place (items not taken stay HOST_NOT_SENT_BUSY)
+typedef bool (*host_notify_batch_callback_t)(HostBatchItem_t*, uint8_t);
 
 extern host_notify_request_callback_t host_state_machine_notify_request_callback;
 extern host_notify_request_and_get_reply_callback_t host_state_machine_notify_request_and_get_reply_callback;
+extern host_notify_gather_and_get_replies_callback_t host_state_machine_notify_gather_and_get_replies_callback;
+extern host_notify_gather_and_defer_replies_callback_t host_state_machine_notify_gather_and_defer_replies_callback;
+extern host_fill_status_callback_t host_state_machine_fill_status_callback;
+extern host_notify_request_and_defer_reply_callback_t host_state_machine_notify_request_and_defer_reply_callback;
+extern host_notify_local_command_callback_t host_state_machine_notify_local_command_callback;
+extern host_notify_injected_frame_callback_t host_state_machine_notify_injected_frame_callback;
+extern host_get_credits_callback_t host_state_machine_get_credits_callback;
+extern host_notify_bulk_callback_t host_state_machine_notify_bulk_callback;
+extern host_notify_batch_callback_t host_state_machine_notify_batch_callback;
 
 int host_state_machine_initialize(EventQueue* eventQueue);
 HostReplyOutcomes_t host_state_machine_send_request(uint16_t argCounter, uint8_t argLoraDestinationAddress, bool argRequiresReply);
+HostReplyOutcomes_t host_state_machine_send_request_and_wait(uint16_t argCounter, uint8_t argLoraDestinationAddress, bool argRequiresReply, uint32_t argTimeoutMs, uint16_t* outReplyPayload);
+HostReplyOutcomes_t host_state_machine_send_request_async(uint16_t argCounter, uint8_t argLoraDestinationAddress, bool argRequiresReply, uint32_t argTimeoutMs, host_completion_callback_t argCompletion);
 void host_event_proc_communication_cycle();
+void host_state_machine_send_deferred_reply(uint8_t argLoraSourceAddress, uint16_t argPayload);
+void host_state_machine_send_deferred_gather_reply(uint16_t argAddressMask, uint16_t argRespondedMask, const uint16_t* argReplyPayloads);
+void host_state_machine_send_bulk_report(uint16_t argAddressMask, uint16_t argCompletedMask);
+void host_state_machine_send_bulk_received(uint8_t argLoraSourceAddress, uint8_t argSession, const uint8_t* argBlob, uint16_t argSize);
+void host_state_machine_send_batch_reply(const HostBatchItem_t* argItems, uint8_t argCount);
+void host_state_machine_send_stored_report(uint8_t argLoraAddress, uint16_t argRequestPayload, uint16_t argReplyPayload, uint8_t argEvent, uint32_t argMs);
+
+/*!
+ * @brief Called by the request callbacks (on the host event queue) when they couldn't send the request over LoRa:
+ *        the host gets "^E|..@" instead of the reply, then "^W|..@" as soon as the node can take requests again
+ */
+void host_state_machine_reject_latest_request(HostNotSentReasons_t argReason, uint32_t argRetryAfterMs);
+
+void host_state_machine_fill_with_flow_stats_dump(char* destBuffer, size_t destBufferSize);
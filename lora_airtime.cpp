@@ -0,0 +1,39 @@
+#include <cstdint>
+
+#include "lora_config.h"
+
+#include "lora_airtime.h"
+
+uint32_t lora_airtime_get_symbol_time_us()
+{
+    const uint32_t bandwidthHz = 125000UL << LORA_BANDWIDTH;
+
+    return ((1UL << LORA_SPREADING_FACTOR) * 1000000UL) / bandwidthHz;
+}
+
+uint32_t lora_airtime_get_time_on_air_us(uint16_t payloadSize)
+{
+    const uint32_t symbolTimeUs = lora_airtime_get_symbol_time_us();
+
+    // Low data rate optimization is mandated when a symbol lasts more than 16 ms
+    const int32_t lowDataRateOptimize = symbolTimeUs > 16000 ? 1 : 0;
+    const int32_t implicitHeader = LORA_FIX_LENGTH_PAYLOAD_ON ? 1 : 0;
+    const int32_t crcOn = LORA_CRC_ENABLED ? 1 : 0;
+
+    int32_t numerator = 8 * (int32_t)payloadSize - 4 * LORA_SPREADING_FACTOR + 28 + 16 * crcOn - 20 * implicitHeader;
+    int32_t denominator = 4 * (LORA_SPREADING_FACTOR - 2 * lowDataRateOptimize);
+
+    int32_t payloadSymbols = 8;
+
+    if(numerator > 0) payloadSymbols += ((numerator + denominator - 1) / denominator) * (LORA_CODINGRATE + 4);
+
+    // Preamble lasts (LORA_PREAMBLE_LENGTH + 4.25) symbols
+    uint32_t preambleTimeUs = LORA_PREAMBLE_LENGTH * symbolTimeUs + (symbolTimeUs * 17) / 4;
+
+    return preambleTimeUs + payloadSymbols * symbolTimeUs;
+}
+
+uint32_t lora_airtime_get_time_on_air_ms(uint16_t payloadSize)
+{
+    return (lora_airtime_get_time_on_air_us(payloadSize) + 999) / 1000;
+}
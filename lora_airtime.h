@@ -0,0 +1,22 @@
+#ifndef __LORA_AIRTIME_H__
+#define __LORA_AIRTIME_H__
+
+#include <cstdint>
+
+/*!
+ * @brief Time on air (in us) of a LoRa frame with the given payload size, computed
+ *        from the modem settings in lora_config.h (SX127x datasheet formula)
+ */
+uint32_t lora_airtime_get_time_on_air_us(uint16_t payloadSize);
+
+/*!
+ * @brief Same as lora_airtime_get_time_on_air_us(), rounded up to ms
+ */
+uint32_t lora_airtime_get_time_on_air_ms(uint16_t payloadSize);
+
+/*!
+ * @brief Duration (in us) of a LoRa symbol with the modem settings in lora_config.h
+ */
+uint32_t lora_airtime_get_symbol_time_us();
+
+#endif // __LORA_AIRTIME_H__
@@ -0,0 +1,186 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "lora_protocol_impl.h"
+#include "host_protocol_codec.h"
+
+#include "lora_benchmark.h"
+
+#define BENCHMARK_BUFFER_SIZE 64
+
+lora_benchmark_read_time_ns_callback_t lora_benchmark_read_time_ns_callback;
+lora_benchmark_read_cycles_callback_t lora_benchmark_read_cycles_callback;
+lora_benchmark_read_allocation_count_callback_t lora_benchmark_read_allocation_count_callback;
+lora_benchmark_dispatch_callback_t lora_benchmark_dispatch_callback;
+lora_benchmark_dispatch_callback_t lora_benchmark_switch_dispatch_callback;
+
+static uint8_t s_buffer[BENCHMARK_BUFFER_SIZE];
+
+static const char RequestFrame[] = "QUERY-1234|2|1|17";
+static const char ReplyFrame[] = "RESPONSE-4321|1|2|17";
+static const char HostRequestCommand[] = "Q|2|1234";
+
+static const uint16_t s_gather_payloads[16] = { 0, 11, 22, 33, 44, 55, 66, 77, 88, 99, 110, 121, 132, 143, 154, 165 };
+
+static void case_lora_encode_request()
+{
+    lora_protocol_fill_create_request_buffer(s_buffer, BENCHMARK_BUFFER_SIZE, 1234, 2, true);
+}
+
+static void case_lora_encode_gather_request()
+{
+    lora_protocol_fill_create_gather_request_buffer(s_buffer, BENCHMARK_BUFFER_SIZE, 1234, 0x001E);
+}
+
+static void case_lora_encode_reply()
+{
+    lora_protocol_fill_create_reply_buffer(s_buffer, BENCHMARK_BUFFER_SIZE, 4321);
+}
+
+static void case_lora_decode_request()
+{
+    lora_protocol_process_received_data((uint8_t*)RequestFrame, sizeof(RequestFrame) - 1);
+
+    if(lora_protocol_is_received_data_a_request()) lora_protocol_process_received_data_as_request();
+}
+
+static void case_lora_decode_reply()
+{
+    lora_protocol_process_received_data((uint8_t*)ReplyFrame, sizeof(ReplyFrame) - 1);
+
+    if(lora_protocol_is_received_data_a_reply()) lora_protocol_process_received_data_as_reply();
+}
+
+static void case_host_encode_request()
+{
+    host_protocol_fill_create_request_buffer(s_buffer, BENCHMARK_BUFFER_SIZE, 1234, 2, true);
+}
+
+static void case_host_encode_gather_reply()
+{
+    host_protocol_fill_create_gather_reply_buffer(s_buffer, BENCHMARK_BUFFER_SIZE, 0x001E, 0x000E, s_gather_payloads);
+}
+
+// Fresh vector per command, as in event_proc_command_handler()
+static void case_host_split()
+{
+    std::vector<std::string> items;
+
+    split(HostRequestCommand, items, '|');
+}
+
+static void case_dispatch_cycle()
+{
+    lora_benchmark_dispatch_callback();
+}
+
+static void case_dispatch_cycle_switch()
+{
+    lora_benchmark_switch_dispatch_callback();
+}
+
+typedef struct
+{
+    const char* name;
+    void (*run)();
+
+} BenchmarkCase_t;
+
+static const BenchmarkCase_t s_cases[] =
+{
+    { "lora_encode_request", case_lora_encode_request },
+    { "lora_encode_gather_request", case_lora_encode_gather_request },
+    { "lora_encode_reply", case_lora_encode_reply },
+    { "lora_decode_request", case_lora_decode_request },
+    { "lora_decode_reply", case_lora_decode_reply },
+    { "host_encode_request", case_host_encode_request },
+    { "host_encode_gather_reply", case_host_encode_gather_reply },
+    { "host_split", case_host_split },
+    { "dispatch_cycle", case_dispatch_cycle },
+    { "dispatch_cycle_switch", case_dispatch_cycle_switch },
+};
+
+static_assert(sizeof(s_cases)/sizeof(s_cases[0]) <= LORA_BENCHMARK_MAX_CASES, "LORA_BENCHMARK_MAX_CASES too small");
+
+static uint32_t read_cycles()
+{
+    return lora_benchmark_read_cycles_callback ? lora_benchmark_read_cycles_callback() : 0;
+}
+
+static uint32_t read_allocation_count()
+{
+    return lora_benchmark_read_allocation_count_callback ? lora_benchmark_read_allocation_count_callback() : 0;
+}
+
+int lora_benchmark_run_all(uint32_t iterations, LoraBenchmarkResult_t* results, int maxResults)
+{
+    int count=0;
+
+    if(!lora_benchmark_read_time_ns_callback || iterations == 0) return 0;
+
+    for(size_t i=0; i<sizeof(s_cases)/sizeof(s_cases[0]) && count<maxResults; i++)
+    {
+        const BenchmarkCase_t* benchmarkCase=&s_cases[i];
+
+        if(benchmarkCase->run == case_dispatch_cycle && !lora_benchmark_dispatch_callback) continue;
+        if(benchmarkCase->run == case_dispatch_cycle_switch && !lora_benchmark_switch_dispatch_callback) continue;
+
+        // Warm-up: first-time allocations (vector capacity) and state transitions stay out of the figures
+        benchmarkCase->run();
+
+        uint32_t allocationsStart=read_allocation_count();
+        uint32_t cyclesStart=read_cycles();
+        uint64_t timeStart=lora_benchmark_read_time_ns_callback();
+
+        for(uint32_t iteration=0; iteration<iterations; iteration++) benchmarkCase->run();
+
+        uint64_t timeEnd=lora_benchmark_read_time_ns_callback();
+        uint32_t cyclesEnd=read_cycles();
+        uint32_t allocationsEnd=read_allocation_count();
+
+        LoraBenchmarkResult_t* result=&results[count++];
+
+        result->name=benchmarkCase->name;
+        result->iterations=iterations;
+        result->elapsedNs=timeEnd - timeStart;
+        result->cycles=cyclesEnd - cyclesStart;
+        result->allocations=allocationsEnd - allocationsStart;
+    }
+
+    lora_protocol_reset();
+
+    return count;
+}
+
+// value/iterations with two decimals, without floating point printf (not available with every toolchain setup)
+static int fill_with_ratio(char* destBuffer, size_t destBufferSize, uint64_t value, uint32_t iterations)
+{
+    uint64_t hundredths=(value * 100 + iterations / 2) / iterations;
+
+    return snprintf(destBuffer, destBufferSize, "%lu.%02u", (unsigned long)(hundredths / 100), (unsigned)(hundredths % 100));
+}
+
+void lora_benchmark_fill_with_result_json(char* destBuffer, size_t destBufferSize, const char* platform, const LoraBenchmarkResult_t* result)
+{
+    size_t len=snprintf(destBuffer, destBufferSize, "{\"platform\":\"%s\",\"name\":\"%s\",\"iterations\":%lu,\"ns_per_op\":",
+        platform, result->name, (unsigned long)result->iterations);
+
+    if(len < destBufferSize) len+=fill_with_ratio(destBuffer + len, destBufferSize - len, result->elapsedNs, result->iterations);
+
+    if(len < destBufferSize) len+=snprintf(destBuffer + len, destBufferSize - len, ",\"cycles_per_op\":");
+
+    if(len < destBufferSize)
+    {
+        if(lora_benchmark_read_cycles_callback) len+=fill_with_ratio(destBuffer + len, destBufferSize - len, result->cycles, result->iterations);
+        else len+=snprintf(destBuffer + len, destBufferSize - len, "null");
+    }
+
+    if(len < destBufferSize) len+=snprintf(destBuffer + len, destBufferSize - len, ",\"allocs_per_op\":");
+
+    if(len < destBufferSize) len+=fill_with_ratio(destBuffer + len, destBufferSize - len, result->allocations, result->iterations);
+
+    if(len < destBufferSize) snprintf(destBuffer + len, destBufferSize - len, "}");
+}
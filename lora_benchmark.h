@@ -0,0 +1,54 @@
+#ifndef __LORA_BENCHMARK_H__
+#define __LORA_BENCHMARK_H__
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Microbenchmarks of the protocol encode/decode functions and of one communication cycle pass.
+ * Portable: the platform provides time, cycle and allocation counters through the callbacks below
+ * (main.cpp on target, tools/lora_benchmark_tool.cpp on Linux).
+ */
+
+typedef struct
+{
+    const char* name;
+    uint32_t iterations;
+    uint64_t elapsedNs;
+    uint32_t cycles;        // 0 if the platform has no cycle counter
+    uint32_t allocations;
+
+} LoraBenchmarkResult_t;
+
+#define LORA_BENCHMARK_MAX_CASES 16
+
+// Monotonic time in ns
+typedef uint64_t (*lora_benchmark_read_time_ns_callback_t)();
+
+// Free running 32 bit cycle counter (wraps, like DWT->CYCCNT): a single case must take less than 2^32 cycles
+typedef uint32_t (*lora_benchmark_read_cycles_callback_t)();
+
+// Number of heap allocations done so far
+typedef uint32_t (*lora_benchmark_read_allocation_count_callback_t)();
+
+// One communication cycle pass
+typedef void (*lora_benchmark_dispatch_callback_t)();
+
+extern lora_benchmark_read_time_ns_callback_t lora_benchmark_read_time_ns_callback;
+extern lora_benchmark_read_cycles_callback_t lora_benchmark_read_cycles_callback;
+extern lora_benchmark_read_allocation_count_callback_t lora_benchmark_read_allocation_count_callback;
+extern lora_benchmark_dispatch_callback_t lora_benchmark_dispatch_callback;
+extern lora_benchmark_dispatch_callback_t lora_benchmark_switch_dispatch_callback;      // same pass with a switch on the state (baseline), optional
+
+/*!
+ * @brief Runs every case for the given iterations (after one warm-up call each); the protocol
+ *        decoder state is left reset. Returns the number of results written
+ */
+int lora_benchmark_run_all(uint32_t iterations, LoraBenchmarkResult_t* results, int maxResults);
+
+/*!
+ * @brief One JSON object (single line, no newline) per result: name, iterations, ns/op, cycles/op and allocations/op
+ */
+void lora_benchmark_fill_with_result_json(char* destBuffer, size_t destBufferSize, const char* platform, const LoraBenchmarkResult_t* result);
+
+#endif // __LORA_BENCHMARK_H__
@@ -0,0 +1,393 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "lora_config.h"
+
+#include "lora_bulk.h"
+
+static_assert(LORA_BULK_MAX_SIZE >= 1 && LORA_BULK_MAX_SIZE <= LORA_BULK_MAX_DATA_FRAGMENTS * LORA_BULK_FRAGMENT_SIZE, "bulk blob larger than its data fragments");
+static_assert(LORA_BULK_MAX_FRAGMENTS < 64, "fragment indices out of the missing mask");
+
+#define ALL_FRAGMENTS_MASK              ((1ULL << LORA_BULK_MAX_FRAGMENTS) - 1)
+
+// GF(2^8) with the 0x11D polynomial, 2 is a generator: products and inverses go through logarithms
+static uint8_t s_gf_exp[512];
+static uint8_t s_gf_log[256];
+
+// Sender side
+static uint8_t s_tx_blob[LORA_BULK_MAX_DATA_FRAGMENTS * LORA_BULK_FRAGMENT_SIZE];
+static uint16_t s_tx_size;
+static uint8_t s_tx_data_count;
+static uint8_t s_tx_session;
+static uint8_t s_tx_round;
+static uint16_t s_tx_targets_mask;
+static uint16_t s_tx_completed_mask;
+static uint64_t s_tx_sent_mask;
+static uint64_t s_tx_round_mask;
+static uint64_t s_tx_received_masks[LORA_BULK_MAX_ADDRESS + 1];     // as last reported by each target
+
+// Receiver side
+static uint8_t s_rx_source_address;
+static uint8_t s_rx_session;
+static uint16_t s_rx_size;                                          // 0: no transfer heard yet
+static uint8_t s_rx_data_count;
+static uint8_t s_rx_count;
+static uint64_t s_rx_received_mask;
+static bool s_rx_complete;
+static uint8_t s_rx_indices[LORA_BULK_MAX_DATA_FRAGMENTS];
+static uint8_t s_rx_fragments[LORA_BULK_MAX_DATA_FRAGMENTS][LORA_BULK_FRAGMENT_SIZE];
+static uint8_t s_rx_matrix[LORA_BULK_MAX_DATA_FRAGMENTS][LORA_BULK_MAX_DATA_FRAGMENTS];
+static uint8_t s_rx_blob[LORA_BULK_MAX_DATA_FRAGMENTS * LORA_BULK_FRAGMENT_SIZE];
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    if(a == 0 || b == 0) return 0;
+
+    return s_gf_exp[s_gf_log[a] + s_gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a)
+{
+    return s_gf_exp[255 - s_gf_log[a]];
+}
+
+static uint8_t count_bits(uint64_t mask)
+{
+    uint8_t count=0;
+
+    for(; mask; mask &= mask - 1) count++;
+
+    return count;
+}
+
+// Row of the generator matrix for the fragment index: identity for the data fragments, Cauchy for parity (x and y
+// never meet, the indices of either kind being apart)
+static uint8_t get_coefficient(uint8_t dataCount, uint8_t index, uint8_t dataIndex)
+{
+    if(index < dataCount) return index == dataIndex ? 1 : 0;
+
+    return gf_inv(index ^ dataIndex);
+}
+
+void lora_bulk_initialize()
+{
+    uint16_t x=1;
+
+    for(uint16_t i=0; i<255; i++)
+    {
+        s_gf_exp[i]=(uint8_t)x;
+        s_gf_log[x]=(uint8_t)i;
+
+        x <<= 1;
+
+        if(x & 0x100) x ^= 0x11D;
+    }
+
+    for(uint16_t i=255; i<sizeof(s_gf_exp); i++) s_gf_exp[i]=s_gf_exp[i - 255];
+
+    s_tx_size=0;
+    s_tx_targets_mask=0;
+    s_tx_completed_mask=0;
+
+    s_rx_size=0;
+}
+
+uint8_t lora_bulk_get_data_fragment_count(uint16_t size)
+{
+    return (uint8_t)((size + LORA_BULK_FRAGMENT_SIZE - 1) / LORA_BULK_FRAGMENT_SIZE);
+}
+
+uint8_t lora_bulk_get_first_round_count(uint16_t size)
+{
+    uint16_t dataCount = lora_bulk_get_data_fragment_count(size);
+    uint16_t count = dataCount + (dataCount * LORA_BULK_PARITY_PERCENT + 99) / 100;
+
+    return (uint8_t)(count > LORA_BULK_MAX_FRAGMENTS ? LORA_BULK_MAX_FRAGMENTS : count);
+}
+
+bool lora_bulk_sender_start(uint8_t session, const uint8_t* blob, uint16_t size, uint16_t targetsMask)
+{
+    if(size == 0 || size > LORA_BULK_MAX_SIZE || targetsMask == 0 || (targetsMask >> (LORA_BULK_MAX_ADDRESS + 1)) != 0) return false;
+
+    memset(s_tx_blob, 0, sizeof(s_tx_blob));
+    memcpy(s_tx_blob, blob, size);
+    memset(s_tx_received_masks, 0, sizeof(s_tx_received_masks));
+
+    s_tx_size=size;
+    s_tx_data_count=lora_bulk_get_data_fragment_count(size);
+    s_tx_session=session;
+    s_tx_round=0;
+    s_tx_targets_mask=targetsMask;
+    s_tx_completed_mask=0;
+    s_tx_sent_mask=0;
+    s_tx_round_mask=0;
+
+    return true;
+}
+
+uint8_t lora_bulk_sender_get_session()
+{
+    return s_tx_session;
+}
+
+uint16_t lora_bulk_sender_get_size()
+{
+    return s_tx_size;
+}
+
+uint8_t lora_bulk_sender_get_round()
+{
+    return s_tx_round;
+}
+
+uint16_t lora_bulk_sender_get_targets_mask()
+{
+    return s_tx_targets_mask;
+}
+
+uint16_t lora_bulk_sender_get_completed_mask()
+{
+    return s_tx_completed_mask;
+}
+
+uint16_t lora_bulk_sender_get_pending_mask()
+{
+    return s_tx_targets_mask & ~s_tx_completed_mask;
+}
+
+// Pending targets which don't have the (already sent) fragment, as far as the sender knows
+static uint8_t count_missing_targets(uint8_t index)
+{
+    uint8_t count=0;
+
+    for(uint8_t address=1; address<=LORA_BULK_MAX_ADDRESS; address++)
+    {
+        if((lora_bulk_sender_get_pending_mask() & (1 << address)) && !(s_tx_received_masks[address] & (1ULL << index))) count++;
+    }
+
+    return count;
+}
+
+uint8_t lora_bulk_sender_plan_round()
+{
+    if(s_tx_size == 0) return 0;
+
+    s_tx_round_mask=0;
+
+    if(s_tx_round++ == 0)
+    {
+        uint8_t count = lora_bulk_get_first_round_count(s_tx_size);
+
+        s_tx_round_mask = (1ULL << count) - 1;
+        s_tx_sent_mask = s_tx_round_mask;
+
+        return count;
+    }
+
+    uint8_t needed=0;
+
+    for(uint8_t address=1; address<=LORA_BULK_MAX_ADDRESS; address++)
+    {
+        if(!(lora_bulk_sender_get_pending_mask() & (1 << address))) continue;
+
+        uint8_t received = count_bits(s_tx_received_masks[address] & s_tx_sent_mask);
+        uint8_t lacking = received >= s_tx_data_count ? 0 : s_tx_data_count - received;
+
+        if(lacking > needed) needed = lacking;
+    }
+
+    uint8_t count=0;
+
+    // Fresh parity is new to everybody...
+    for(uint8_t index=s_tx_data_count; index<LORA_BULK_MAX_FRAGMENTS && count<needed; index++)
+    {
+        if(s_tx_sent_mask & (1ULL << index)) continue;
+
+        s_tx_round_mask |= 1ULL << index;
+        count++;
+    }
+
+    // ...then fragments already sent go out again, those most targets miss first
+    while(count < needed)
+    {
+        uint8_t best = LORA_BULK_MAX_FRAGMENTS;
+        uint8_t bestMissing = 0;
+
+        for(uint8_t index=0; index<LORA_BULK_MAX_FRAGMENTS; index++)
+        {
+            if(!(s_tx_sent_mask & (1ULL << index)) || (s_tx_round_mask & (1ULL << index))) continue;
+
+            uint8_t missing = count_missing_targets(index);
+
+            if(missing > bestMissing)
+            {
+                best = index;
+                bestMissing = missing;
+            }
+        }
+
+        if(best == LORA_BULK_MAX_FRAGMENTS) break;
+
+        s_tx_round_mask |= 1ULL << best;
+        count++;
+    }
+
+    s_tx_sent_mask |= s_tx_round_mask;
+
+    return count;
+}
+
+bool lora_bulk_sender_next_fragment(uint8_t* outIndex, uint8_t* outFragment)
+{
+    if(s_tx_round_mask == 0) return false;
+
+    uint8_t index=0;
+
+    while(!(s_tx_round_mask & (1ULL << index))) index++;
+
+    s_tx_round_mask &= ~(1ULL << index);
+
+    *outIndex = index;
+
+    if(index < s_tx_data_count)
+    {
+        memcpy(outFragment, s_tx_blob + index * LORA_BULK_FRAGMENT_SIZE, LORA_BULK_FRAGMENT_SIZE);
+
+        return true;
+    }
+
+    for(uint8_t byte=0; byte<LORA_BULK_FRAGMENT_SIZE; byte++)
+    {
+        uint8_t sum=0;
+
+        for(uint8_t dataIndex=0; dataIndex<s_tx_data_count; dataIndex++)
+        {
+            sum ^= gf_mul(get_coefficient(s_tx_data_count, index, dataIndex), s_tx_blob[dataIndex * LORA_BULK_FRAGMENT_SIZE + byte]);
+        }
+
+        outFragment[byte]=sum;
+    }
+
+    return true;
+}
+
+void lora_bulk_sender_add_report(uint8_t address, uint64_t missingMask)
+{
+    if(address > LORA_BULK_MAX_ADDRESS || !(s_tx_targets_mask & (1 << address))) return;
+
+    s_tx_received_masks[address] = ALL_FRAGMENTS_MASK & ~missingMask;
+
+    if(missingMask == 0) s_tx_completed_mask |= 1 << address;
+}
+
+static void swap_rows(uint8_t a, uint8_t b)
+{
+    uint8_t row[LORA_BULK_MAX_DATA_FRAGMENTS];
+    uint8_t fragment[LORA_BULK_FRAGMENT_SIZE];
+
+    memcpy(row, s_rx_matrix[a], s_rx_data_count);
+    memcpy(s_rx_matrix[a], s_rx_matrix[b], s_rx_data_count);
+    memcpy(s_rx_matrix[b], row, s_rx_data_count);
+
+    memcpy(fragment, s_rx_fragments[a], LORA_BULK_FRAGMENT_SIZE);
+    memcpy(s_rx_fragments[a], s_rx_fragments[b], LORA_BULK_FRAGMENT_SIZE);
+    memcpy(s_rx_fragments[b], fragment, LORA_BULK_FRAGMENT_SIZE);
+}
+
+// Gauss-Jordan on the generator rows of the fragments received: each row ends up as the data fragment of its position
+static bool decode()
+{
+    uint8_t count = s_rx_data_count;
+
+    for(uint8_t row=0; row<count; row++)
+    {
+        for(uint8_t column=0; column<count; column++) s_rx_matrix[row][column] = get_coefficient(count, s_rx_indices[row], column);
+    }
+
+    for(uint8_t column=0; column<count; column++)
+    {
+        uint8_t pivot=column;
+
+        while(pivot < count && s_rx_matrix[pivot][column] == 0) pivot++;
+
+        if(pivot == count) return false;
+
+        if(pivot != column) swap_rows(pivot, column);
+
+        uint8_t scale = gf_inv(s_rx_matrix[column][column]);
+
+        for(uint8_t other=0; other<count; other++) s_rx_matrix[column][other] = gf_mul(s_rx_matrix[column][other], scale);
+        for(uint8_t byte=0; byte<LORA_BULK_FRAGMENT_SIZE; byte++) s_rx_fragments[column][byte] = gf_mul(s_rx_fragments[column][byte], scale);
+
+        for(uint8_t row=0; row<count; row++)
+        {
+            uint8_t factor = s_rx_matrix[row][column];
+
+            if(row == column || factor == 0) continue;
+
+            for(uint8_t other=0; other<count; other++) s_rx_matrix[row][other] ^= gf_mul(s_rx_matrix[column][other], factor);
+            for(uint8_t byte=0; byte<LORA_BULK_FRAGMENT_SIZE; byte++) s_rx_fragments[row][byte] ^= gf_mul(s_rx_fragments[column][byte], factor);
+        }
+    }
+
+    for(uint8_t row=0; row<count; row++) memcpy(s_rx_blob + row * LORA_BULK_FRAGMENT_SIZE, s_rx_fragments[row], LORA_BULK_FRAGMENT_SIZE);
+
+    return true;
+}
+
+bool lora_bulk_receiver_add_fragment(uint8_t sourceAddress, uint8_t session, uint16_t size, uint8_t index, const uint8_t* fragment)
+{
+    if(size == 0 || size > LORA_BULK_MAX_SIZE || index >= LORA_BULK_MAX_FRAGMENTS) return false;
+
+    if(s_rx_size == 0 || sourceAddress != s_rx_source_address || session != s_rx_session)
+    {
+        s_rx_source_address=sourceAddress;
+        s_rx_session=session;
+        s_rx_size=size;
+        s_rx_data_count=lora_bulk_get_data_fragment_count(size);
+        s_rx_count=0;
+        s_rx_received_mask=0;
+        s_rx_complete=false;
+    }
+
+    if(s_rx_complete || size != s_rx_size || (s_rx_received_mask & (1ULL << index))) return false;
+
+    s_rx_received_mask |= 1ULL << index;
+    s_rx_indices[s_rx_count]=index;
+    memcpy(s_rx_fragments[s_rx_count], fragment, LORA_BULK_FRAGMENT_SIZE);
+
+    if(++s_rx_count < s_rx_data_count) return false;
+
+    // Any data count of distinct fragments does: a failure means a corrupted fragment, the transfer starts over
+    s_rx_complete = decode();
+
+    if(!s_rx_complete)
+    {
+        s_rx_count=0;
+        s_rx_received_mask=0;
+    }
+
+    return s_rx_complete;
+}
+
+uint64_t lora_bulk_receiver_get_missing_mask(uint8_t sourceAddress, uint8_t session)
+{
+    if(s_rx_size == 0 || sourceAddress != s_rx_source_address || session != s_rx_session) return ALL_FRAGMENTS_MASK;
+
+    return s_rx_complete ? 0 : ALL_FRAGMENTS_MASK & ~s_rx_received_mask;
+}
+
+const uint8_t* lora_bulk_receiver_get_blob(uint16_t* outSize)
+{
+    *outSize = s_rx_complete ? s_rx_size : 0;
+
+    return s_rx_blob;
+}
+
+void lora_bulk_fill_with_dump(char* destBuffer, size_t destBufferSize)
+{
+    snprintf(destBuffer, destBufferSize, "tx=%u/%u/%X/%X,rx=%u/%u/%u/%u",
+        s_tx_session, s_tx_round, s_tx_targets_mask, s_tx_completed_mask,
+        s_rx_source_address, s_rx_session, s_rx_count, s_rx_data_count);
+}
@@ -0,0 +1,75 @@
+#ifndef __LORA_BULK_H__
+#define __LORA_BULK_H__
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Erasure coding of the bulk transfers. A blob is cut into k data fragments of LORA_BULK_FRAGMENT_SIZE bytes (the last
+ * one zero padded) and extended with parity fragments of a systematic Reed-Solomon code over GF(2^8): fragment x >= k
+ * is the sum over the data fragments y of d(y) / (x xor y) (Cauchy matrix), so that any k distinct fragments rebuild
+ * the blob, whichever got lost.
+ *
+ * The sender side keeps what went out and what every target reported missing, and plans the rounds; the receiver side
+ * collects the fragments of one transfer at a time (the latest heard).
+ */
+
+#define LORA_BULK_FRAGMENT_SIZE         5       // in bytes, hex encoded in the fragment frame
+#define LORA_BULK_MAX_DATA_FRAGMENTS    32
+#define LORA_BULK_MAX_FRAGMENTS         48      // data and parity, bits of the missing fragments mask
+#define LORA_BULK_MAX_ADDRESS           15      // targets are a gather-like address mask
+
+void lora_bulk_initialize();
+
+uint8_t lora_bulk_get_data_fragment_count(uint16_t size);
+
+/*!
+ * @brief Fragments of the first round of a transfer: the data ones and LORA_BULK_PARITY_PERCENT of parity
+ */
+uint8_t lora_bulk_get_first_round_count(uint16_t size);
+
+bool lora_bulk_sender_start(uint8_t session, const uint8_t* blob, uint16_t size, uint16_t targetsMask);
+
+uint8_t lora_bulk_sender_get_session();
+uint16_t lora_bulk_sender_get_size();
+uint8_t lora_bulk_sender_get_round();
+
+uint16_t lora_bulk_sender_get_targets_mask();
+uint16_t lora_bulk_sender_get_completed_mask();
+uint16_t lora_bulk_sender_get_pending_mask();
+
+/*!
+ * @brief Plans the next round and returns its fragment count (0: nothing worth sending). The first round is
+ *        lora_bulk_get_first_round_count(), a repair round sends as many fragments as the neediest pending target
+ *        lacks: parity never sent first, then the fragments missing at most targets (a target which never reported
+ *        lacks them all)
+ */
+uint8_t lora_bulk_sender_plan_round();
+
+/*!
+ * @brief Next fragment of the round (index and LORA_BULK_FRAGMENT_SIZE bytes), false once the round is over
+ */
+bool lora_bulk_sender_next_fragment(uint8_t* outIndex, uint8_t* outFragment);
+
+void lora_bulk_sender_add_report(uint8_t address, uint64_t missingMask);
+
+/*!
+ * @brief Returns true if the fragment just completed the blob (see lora_bulk_receiver_get_blob()); a fragment of
+ *        another transfer than the one being collected starts over with it
+ */
+bool lora_bulk_receiver_add_fragment(uint8_t sourceAddress, uint8_t session, uint16_t size, uint8_t index, const uint8_t* fragment);
+
+/*!
+ * @brief Fragments the receiver still needs to tell apart, 0 once the blob is rebuilt (all of them for a transfer it
+ *        never heard of)
+ */
+uint64_t lora_bulk_receiver_get_missing_mask(uint8_t sourceAddress, uint8_t session);
+
+const uint8_t* lora_bulk_receiver_get_blob(uint16_t* outSize);
+
+/*!
+ * @brief "tx=<session>/<round>/<targets>/<completed>,rx=<source>/<session>/<fragments>/<data fragments>" (masks in hex)
+ */
+void lora_bulk_fill_with_dump(char* destBuffer, size_t destBufferSize);
+
+#endif // __LORA_BULK_H__
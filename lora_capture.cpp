@@ -0,0 +1,137 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "lora_config.h"
+
+#include "lora_capture.h"
+
+static LoraCaptureRecord_t s_ring[LORA_CAPTURE_RING_SIZE];
+
+// Written by one side only each: the producer moves s_head, the consumer moves s_tail
+static volatile uint32_t s_head, s_tail;
+
+static volatile bool s_enabled;
+
+static uint32_t s_recorded, s_dropped, s_streamed;
+
+void lora_capture_set_enabled(bool enabled)
+{
+    s_enabled = enabled;
+}
+
+bool lora_capture_is_enabled()
+{
+    return s_enabled;
+}
+
+void lora_capture_record(uint8_t kind, uint32_t nowMs, const uint8_t* frame, uint16_t size, int16_t rssi, int8_t snr)
+{
+    if(!s_enabled) return;
+
+    if(s_head - s_tail >= LORA_CAPTURE_RING_SIZE)
+    {
+        s_dropped++;
+
+        return;
+    }
+
+    LoraCaptureRecord_t* record = &s_ring[s_head % LORA_CAPTURE_RING_SIZE];
+
+    if(size > LORA_CAPTURE_MAX_FRAME_SIZE) size = LORA_CAPTURE_MAX_FRAME_SIZE;
+
+    record->timestampMs = nowMs;
+    record->rssi = rssi;
+    record->snr = snr;
+    record->kind = kind;
+    record->size = frame ? size : 0;
+
+    if(frame) memcpy(record->frame, frame, size);
+
+    s_recorded++;
+
+    s_head = s_head + 1;
+}
+
+bool lora_capture_pop(LoraCaptureRecord_t* outRecord)
+{
+    if(s_head == s_tail) return false;
+
+    *outRecord = s_ring[s_tail % LORA_CAPTURE_RING_SIZE];
+
+    s_streamed++;
+
+    s_tail = s_tail + 1;
+
+    return true;
+}
+
+static uint8_t get_checksum(const uint8_t* buffer, uint16_t size)
+{
+    uint8_t checksum=0;
+
+    for(uint16_t i=0; i<size; i++) checksum ^= buffer[i];
+
+    return checksum;
+}
+
+uint16_t lora_capture_encode_record(const LoraCaptureRecord_t* record, uint8_t* buffer, uint16_t bufferSize)
+{
+    uint16_t encodedSize = LORA_CAPTURE_RECORD_HEADER_SIZE + record->size + 1;
+
+    if(bufferSize < encodedSize || record->size > LORA_CAPTURE_MAX_FRAME_SIZE) return 0;
+
+    buffer[0] = LORA_CAPTURE_SYNC_0;
+    buffer[1] = LORA_CAPTURE_SYNC_1;
+    buffer[2] = record->kind;
+    buffer[3] = record->size;
+    buffer[4] = record->timestampMs & 0xFF;
+    buffer[5] = (record->timestampMs >> 8) & 0xFF;
+    buffer[6] = (record->timestampMs >> 16) & 0xFF;
+    buffer[7] = (record->timestampMs >> 24) & 0xFF;
+    buffer[8] = (uint16_t)record->rssi & 0xFF;
+    buffer[9] = ((uint16_t)record->rssi >> 8) & 0xFF;
+    buffer[10] = (uint8_t)record->snr;
+
+    memcpy(buffer + LORA_CAPTURE_RECORD_HEADER_SIZE, record->frame, record->size);
+
+    // Sync bytes excluded, so that a checksum error always means a corrupted record
+    buffer[encodedSize - 1] = get_checksum(buffer + 2, encodedSize - 3);
+
+    return encodedSize;
+}
+
+int lora_capture_decode_record(const uint8_t* buffer, uint16_t size, LoraCaptureRecord_t* outRecord)
+{
+    if(size < 1) return 0;
+    if(buffer[0] != LORA_CAPTURE_SYNC_0) return -1;
+
+    if(size < 2) return 0;
+    if(buffer[1] != LORA_CAPTURE_SYNC_1) return -1;
+
+    if(size < 4) return 0;
+    if(buffer[3] > LORA_CAPTURE_MAX_FRAME_SIZE) return -1;
+
+    uint16_t encodedSize = LORA_CAPTURE_RECORD_HEADER_SIZE + buffer[3] + 1;
+
+    if(size < encodedSize) return 0;
+
+    if(get_checksum(buffer + 2, encodedSize - 3) != buffer[encodedSize - 1]) return -1;
+
+    outRecord->kind = buffer[2];
+    outRecord->size = buffer[3];
+    outRecord->timestampMs = (uint32_t)buffer[4] | ((uint32_t)buffer[5] << 8) | ((uint32_t)buffer[6] << 16) | ((uint32_t)buffer[7] << 24);
+    outRecord->rssi = (int16_t)((uint16_t)buffer[8] | ((uint16_t)buffer[9] << 8));
+    outRecord->snr = (int8_t)buffer[10];
+
+    memcpy(outRecord->frame, buffer + LORA_CAPTURE_RECORD_HEADER_SIZE, outRecord->size);
+
+    return encodedSize;
+}
+
+void lora_capture_fill_with_stats_dump(char* destBuffer, size_t destBufferSize)
+{
+    snprintf(destBuffer, destBufferSize, "on=%d,rec=%lu,drop=%lu,out=%lu,used=%lu/%d",
+        s_enabled ? 1 : 0, (unsigned long)s_recorded, (unsigned long)s_dropped, (unsigned long)s_streamed,
+        (unsigned long)(s_head - s_tail), LORA_CAPTURE_RING_SIZE);
+}
@@ -0,0 +1,62 @@
+#ifndef __LORA_CAPTURE_H__
+#define __LORA_CAPTURE_H__
+
+#include <cstdint>
+#include <cstddef>
+
+#define LORA_CAPTURE_MAX_FRAME_SIZE         32
+#define LORA_CAPTURE_SYNC_0                 0xA5
+#define LORA_CAPTURE_SYNC_1                 0x5A
+
+// Encoded record: sync (2), kind (1), size (1), timestamp ms (4, LE), rssi (2, LE), snr (1), frame (size), xor checksum (1)
+#define LORA_CAPTURE_RECORD_HEADER_SIZE     11
+#define LORA_CAPTURE_RECORD_MAX_SIZE        (LORA_CAPTURE_RECORD_HEADER_SIZE + LORA_CAPTURE_MAX_FRAME_SIZE + 1)
+
+typedef enum
+{
+    LORA_CAPTURE_RX_DONE='R',
+    LORA_CAPTURE_RX_ERROR='E',
+    LORA_CAPTURE_RX_REPLY_TIMEOUT='O',
+    LORA_CAPTURE_TX='T',
+    LORA_CAPTURE_TX_DONE='D',
+    LORA_CAPTURE_TX_TIMEOUT='X',
+
+} LoraCaptureKinds_t;
+
+typedef struct
+{
+    uint32_t timestampMs;
+    int16_t rssi;
+    int8_t snr;
+    uint8_t kind;
+    uint8_t size;
+    uint8_t frame[LORA_CAPTURE_MAX_FRAME_SIZE];
+
+} LoraCaptureRecord_t;
+
+void lora_capture_set_enabled(bool enabled);
+bool lora_capture_is_enabled();
+
+/*!
+ * @brief Appends a record to the ring (single producer: the radio event queue), dropped if the ring is full
+ */
+void lora_capture_record(uint8_t kind, uint32_t nowMs, const uint8_t* frame, uint16_t size, int16_t rssi, int8_t snr);
+
+/*!
+ * @brief Takes the oldest record out of the ring (single consumer: the host event queue)
+ */
+bool lora_capture_pop(LoraCaptureRecord_t* outRecord);
+
+/*!
+ * @brief Encodes a record in the binary streaming format, returns the encoded size (0 if it doesn't fit)
+ */
+uint16_t lora_capture_encode_record(const LoraCaptureRecord_t* record, uint8_t* buffer, uint16_t bufferSize);
+
+/*!
+ * @brief Decodes a record from a byte stream: returns the bytes consumed, 0 if more data is needed, -1 if the stream must be resynchronized (skip one byte)
+ */
+int lora_capture_decode_record(const uint8_t* buffer, uint16_t size, LoraCaptureRecord_t* outRecord);
+
+void lora_capture_fill_with_stats_dump(char* destBuffer, size_t destBufferSize);
+
+#endif // __LORA_CAPTURE_H__
@@ -0,0 +1,223 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "lora_config.h"
+
+#include "lora_channels.h"
+
+static constexpr uint32_t s_plan_frequencies[] = LORA_CHANNEL_PLAN;
+static constexpr uint32_t s_sub_band_edges[] = LORA_CHANNEL_SUB_BANDS;
+
+#define PLAN_COUNT (sizeof(s_plan_frequencies)/sizeof(s_plan_frequencies[0]))
+#define SUB_BAND_COUNT (sizeof(s_sub_band_edges)/sizeof(s_sub_band_edges[0])/2)
+
+#define CHANNEL_BANDWIDTH_HZ (125000UL << LORA_BANDWIDTH)
+
+static_assert(PLAN_COUNT <= LORA_CHANNEL_MAX_COUNT, "channel plan larger than the active channels mask");
+static_assert(LORA_CHANNEL_COUNT >= 1 && LORA_CHANNEL_COUNT <= PLAN_COUNT, "channel count out of the plan");
+
+// Channel i is at least a bandwidth away from channels j.. of the plan
+static constexpr bool is_channel_apart_from(size_t i, size_t j)
+{
+    return j >= PLAN_COUNT ||
+        ((s_plan_frequencies[i] > s_plan_frequencies[j] ? s_plan_frequencies[i] - s_plan_frequencies[j] : s_plan_frequencies[j] - s_plan_frequencies[i]) >= CHANNEL_BANDWIDTH_HZ &&
+        is_channel_apart_from(i, j + 1));
+}
+
+static constexpr bool are_channels_apart(size_t i)
+{
+    return i >= PLAN_COUNT || (is_channel_apart_from(i, i + 1) && are_channels_apart(i + 1));
+}
+
+// The whole bandwidth of the channel lies within one of the sub-bands band..
+static constexpr bool is_channel_in_sub_band(uint32_t frequency, size_t band)
+{
+    return band < SUB_BAND_COUNT &&
+        ((frequency - CHANNEL_BANDWIDTH_HZ / 2 >= s_sub_band_edges[2 * band] && frequency + CHANNEL_BANDWIDTH_HZ / 2 <= s_sub_band_edges[2 * band + 1]) ||
+        is_channel_in_sub_band(frequency, band + 1));
+}
+
+static constexpr bool are_channels_in_sub_bands(size_t i)
+{
+    return i >= PLAN_COUNT || (is_channel_in_sub_band(s_plan_frequencies[i], 0) && are_channels_in_sub_bands(i + 1));
+}
+
+static_assert(are_channels_apart(0), "channels of LORA_CHANNEL_PLAN closer than LORA_BANDWIDTH overlap");
+static_assert(are_channels_in_sub_bands(0), "a channel of LORA_CHANNEL_PLAN runs past the edges of LORA_CHANNEL_SUB_BANDS");
+
+static LoraChannel_t s_channels[LORA_CHANNEL_MAX_COUNT];
+
+static uint8_t s_count = LORA_CHANNEL_COUNT;
+static uint16_t s_active_mask;
+static uint32_t s_window_start_ms;
+
+void lora_channels_set_count(uint8_t count)
+{
+    uint8_t planCount = PLAN_COUNT;
+
+    s_count = count < 1 ? 1 : (count > planCount ? planCount : count);
+}
+
+uint8_t lora_channels_get_count()
+{
+    return s_count;
+}
+
+void lora_channels_initialize(uint32_t nowMs)
+{
+    memset(s_channels, 0, sizeof(s_channels));
+
+    for(uint8_t channel=0; channel<LORA_CHANNEL_MAX_COUNT; channel++) s_channels[channel].failurePercent = -1;
+
+    s_active_mask = (1 << s_count) - 1;
+    s_window_start_ms = nowMs;
+}
+
+uint32_t lora_channels_get_frequency(uint8_t channel)
+{
+    // A single channel stays where the firmware always was
+    if(s_count == 1) return RF_FREQUENCY;
+
+    return s_plan_frequencies[channel < s_count ? channel : 0];
+}
+
+uint16_t lora_channels_get_active_mask()
+{
+    return s_active_mask;
+}
+
+bool lora_channels_set_active_mask(uint16_t mask)
+{
+    if((mask & 1) == 0 || (mask >> s_count) != 0 || mask == s_active_mask) return false;
+
+    s_active_mask = mask;
+
+    return true;
+}
+
+uint8_t lora_channels_get_active_count()
+{
+    uint8_t count=0;
+
+    for(uint8_t channel=0; channel<s_count; channel++)
+    {
+        if(s_active_mask & (1 << channel)) count++;
+    }
+
+    return count;
+}
+
+uint8_t lora_channels_get_active(uint8_t index)
+{
+    index %= lora_channels_get_active_count();
+
+    for(uint8_t channel=0; channel<s_count; channel++)
+    {
+        if((s_active_mask & (1 << channel)) == 0) continue;
+
+        if(index-- == 0) return channel;
+    }
+
+    return 0;
+}
+
+int lora_channels_get_active_index(uint8_t channel)
+{
+    if(channel >= s_count || (s_active_mask & (1 << channel)) == 0) return -1;
+
+    int index=0;
+
+    for(uint8_t other=0; other<channel; other++)
+    {
+        if(s_active_mask & (1 << other)) index++;
+    }
+
+    return index;
+}
+
+// Consecutive addresses land on consecutive channels, starting from the gateway one
+uint8_t lora_channels_get_home(uint8_t address)
+{
+    return lora_channels_get_active((uint8_t)(address - LORA_GATEWAY_ADDRESS));
+}
+
+void lora_channels_account_airtime(uint8_t channel, uint32_t airtimeMs)
+{
+    if(channel < s_count) s_channels[channel].airtimeMs += airtimeMs;
+}
+
+void lora_channels_account_transaction(uint8_t channel, bool failed)
+{
+    if(channel >= s_count) return;
+
+    s_channels[channel].transactions++;
+
+    if(failed) s_channels[channel].failures++;
+}
+
+bool lora_channels_is_congested(uint8_t channel)
+{
+    return channel < s_count && s_channels[channel].failurePercent >= LORA_CHANNEL_BUSY_FAILURE_PERCENT;
+}
+
+bool lora_channels_update(uint32_t nowMs, bool manage)
+{
+    uint32_t elapsedMs = nowMs - s_window_start_ms;
+
+    if(elapsedMs < LORA_CHANNEL_UTILISATION_WINDOW) return false;
+
+    s_window_start_ms = nowMs;
+
+    bool changed = false;
+
+    for(uint8_t channel=0; channel<s_count; channel++)
+    {
+        LoraChannel_t* state = &s_channels[channel];
+
+        state->utilisationPermille = (uint16_t)((uint64_t)state->airtimeMs * 1000 / elapsedMs);
+        state->failurePercent = state->transactions >= LORA_CHANNEL_MIN_TRANSACTIONS ? (int8_t)(100 * state->failures / state->transactions) : -1;
+
+        state->airtimeMs = 0;
+        state->transactions = 0;
+        state->failures = 0;
+
+        // The gateway channel stays, whatever its load: the nodes would have nowhere to reach the gateway
+        if(!manage || channel == 0) continue;
+
+        if(state->blocked)
+        {
+            if(nowMs - state->blockedAtMs < LORA_CHANNEL_BLOCK_TIME) continue;
+
+            state->blocked = false;
+            s_active_mask |= 1 << channel;
+            changed = true;
+        }
+        else if(state->utilisationPermille >= LORA_CHANNEL_BUSY_PERMILLE || state->failurePercent >= LORA_CHANNEL_BUSY_FAILURE_PERCENT)
+        {
+            state->blocked = true;
+            state->blockedAtMs = nowMs;
+            s_active_mask &= ~(1 << channel);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+void lora_channels_fill_with_dump(char* destBuffer, size_t destBufferSize, uint32_t nowMs)
+{
+    size_t len=0;
+
+    destBuffer[0]='\0';
+
+    for(uint8_t channel=0; channel<s_count && len<destBufferSize; channel++)
+    {
+        const LoraChannel_t* state = &s_channels[channel];
+
+        long blockedS = state->blocked ? (long)((nowMs - state->blockedAtMs) / 1000) : -1;
+
+        len += snprintf(destBuffer + len, destBufferSize - len, "%s%u:%lu/%u/%d/%ld", len > 0 ? "," : "", channel,
+            (unsigned long)(lora_channels_get_frequency(channel) / 1000), state->utilisationPermille, state->failurePercent, blockedS);
+    }
+}
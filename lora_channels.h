@@ -0,0 +1,79 @@
+#ifndef __LORA_CHANNELS_H__
+#define __LORA_CHANNELS_H__
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Channel plan (LORA_CHANNEL_PLAN, first LORA_CHANNEL_COUNT entries) and per-channel statistics. Every node listens on
+ * its home channel, drawn from its address among the active channels, and a frame goes out on the home channel of its
+ * destination: nodes agree on the homes as long as they agree on the active channels, which only the gateway changes
+ * (lora_channels_update()) and advertises. The gateway home is the first channel of the plan, never left out.
+ */
+
+#define LORA_CHANNEL_MAX_COUNT          8       // bits of the active channels mask
+
+typedef struct
+{
+    uint32_t airtimeMs;                 // sent and heard within the current window
+    uint32_t transactions;              // queries sent to nodes homed on the channel, within the current window
+    uint32_t failures;                  // of which unanswered
+    uint16_t utilisationPermille;       // of the latest window
+    int8_t failurePercent;              // of the latest window, -1 with too few queries to judge
+    bool blocked;
+    uint32_t blockedAtMs;
+
+} LoraChannel_t;
+
+/*!
+ * @brief Channels of the plan in use (LORA_CHANNEL_COUNT unless changed), before lora_channels_initialize()
+ */
+void lora_channels_set_count(uint8_t count);
+uint8_t lora_channels_get_count();
+
+void lora_channels_initialize(uint32_t nowMs);
+
+uint32_t lora_channels_get_frequency(uint8_t channel);
+
+/*!
+ * @brief Bit per channel of the plan; a mask without the gateway channel, or with channels beyond the count, is refused
+ *        (returns false, as when it's the mask already in use)
+ */
+uint16_t lora_channels_get_active_mask();
+bool lora_channels_set_active_mask(uint16_t mask);
+
+uint8_t lora_channels_get_active_count();
+
+/*!
+ * @brief index-th active channel, in plan order (wraps around)
+ */
+uint8_t lora_channels_get_active(uint8_t index);
+
+/*!
+ * @brief Position of the channel among the active ones, -1 if it isn't active
+ */
+int lora_channels_get_active_index(uint8_t channel);
+
+uint8_t lora_channels_get_home(uint8_t address);
+
+void lora_channels_account_airtime(uint8_t channel, uint32_t airtimeMs);
+void lora_channels_account_transaction(uint8_t channel, bool failed);
+
+/*!
+ * @brief True if most queries sent on the channel went unanswered in the latest window (LORA_CHANNEL_BUSY_FAILURE_PERCENT),
+ *        whether or not the channel can be left out (the gateway one never is)
+ */
+bool lora_channels_is_congested(uint8_t channel);
+
+/*!
+ * @brief Closes the statistics window once it's over; when managing (gateway) busy channels are left out for
+ *        LORA_CHANNEL_BLOCK_TIME ms, returns true if the active channels changed
+ */
+bool lora_channels_update(uint32_t nowMs, bool manage);
+
+/*!
+ * @brief "<channel>:<frequency kHz>/<utilisation per mille>/<failure %>/<blocked s>,..." (blocked s is -1 for active channels)
+ */
+void lora_channels_fill_with_dump(char* destBuffer, size_t destBufferSize, uint32_t nowMs);
+
+#endif // __LORA_CHANNELS_H__
@@ -19,5 +19,113 @@
 #define LORA_CRC_ENABLED                            true
 
 // Communication parameters 
-#define RX_TIMEOUT_VALUE                                2000      // in ms
-#define TX_TIMEOUT_VALUE                                1000      // in ms
\ No newline at end of file
+#define RX_TIMEOUT_VALUE                                2000      // in ms, idle listening is restarted at this pace without continuous rx (reply timeouts come from lora_timing.h)
+#define REQUEST_REPLY_DELAY                             150       // in ms
+
+// Continuous receive (mains-powered nodes): idle listening is never re-armed, the radio goes back to rx right from tx done
+#define LORA_CONTINUOUS_RX_ENABLED                      false
+#define LORA_MISSED_SEQUENCE_MAX_GAP                    16        // wider sequence jumps (e.g. a sender reboot) are not counted as missed frames
+
+#define LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL    100       // in ms
+#define HOST_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL    100       // in ms
+#define HOST_UART_BAUD_RATE                             115200    // at boot and after a fallback, higher rates are negotiated with "!B|<baud>#"
+#define HOST_UART_MAX_BAUD_RATE                         921600
+#define HOST_UART_FLOW_CONTROL_ENABLED                  false     // RTS/CTS, the host must wire and enable them too
+#define HOST_UART_BAUD_CONFIRM_TIMEOUT                  2000      // in ms, a new rate is kept only if a valid command arrives at it within this time
+#define HOST_UART_MAX_GARBAGE_BYTES                     16        // non-text bytes (framing errors) tolerated at a negotiated rate before falling back
+#define HOST_UART_WRITE_TIMEOUT                         100       // in ms, waiting for room in the tx buffer (e.g. host holding CTS) before dropping
+
+// Timeout budgets (see lora_timing.h)
+#define HOST_REPLY_ALLOWANCE                            1000      // in ms, time left to the host application to answer a query (RealTerm scripts answer within 1 s)
+#define TIMEOUT_SAFETY_MARGIN_PERCENT                   20        // of the expected time
+#define TIMEOUT_SAFETY_MARGIN_MS                        50        // in ms, on top of the percentage (scheduling jitter)
+
+#define RADIO_MESSAGES_BUFFER_SIZE                      32        // in bytes, every frame is sent with this size
+
+// Gather (multicast query) parameters: the first reply slot opens once the host reply timeout is over (lora_timing.h)
+#define GATHER_REPLY_SLOT_GUARD_TIME                    20        // in ms
+
+
+// Gateway (concentrator) role parameters
+#define LORA_GATEWAY_MODE_ENABLED                       false
+#define LORA_GATEWAY_ADDRESS                            1         // node wired to the server
+
+// TDMA (slotted schedule) parameters
+#define LORA_TDMA_ENABLED                               false
+#define TDMA_GATEWAY_ADDRESS                            LORA_GATEWAY_ADDRESS // node that broadcasts the beacon
+#define TDMA_SLOT_MAP                                   "1234"    // one hex digit (node address) per slot, a node may own more slots
+#define TDMA_SLOT_HOST_ALLOWANCE                        200       // in ms, time left to the replying host within a slot
+#define TDMA_SLOT_GUARD_TIME                            20        // in ms
+#define TDMA_MAX_MISSED_BEACONS                         3
+
+// Sleepy end devices (battery nodes, LoRaWAN class A style): the radio sleeps and only listens in two short windows opened
+// at fixed delays after each uplink, the gateway (or any node) sends them downlinks in those windows only
+#define LORA_SLEEPY_END_DEVICE_ENABLED                  false     // applies to every node but LORA_GATEWAY_ADDRESS
+#define LORA_SLEEPY_POLL_INTERVAL                       60000     // in ms, an empty uplink (POLL frame) is sent when nothing else was sent for this long
+#define LORA_SLEEPY_RX1_DELAY                           1000      // in ms, from the end of the uplink to the start of a downlink in the first window
+#define LORA_SLEEPY_RX2_DELAY                           2000      // in ms, same for the second window (opened only if nothing came in the first)
+#define LORA_SLEEPY_TIMING_ERROR                        20        // in ms, worst wake-up error of either side (timers, event queue latency, radio startup)
+#define LORA_SLEEPY_RX_MIN_SYMBOLS                      6         // preamble symbols the receiver needs to lock on a frame
+
+// Neighbor discovery: every node broadcasts a HELLO frame now and then, the frames heard feed a table of the nodes in range
+// and a request for a node which isn't in it fails right away (LORA_OUTCOME_UNKNOWN_PEER) instead of waiting for its timeout
+#define LORA_DISCOVERY_ENABLED                          false
+#define LORA_DISCOVERY_BEACON_INTERVAL                  60000     // in ms, between HELLO frames of a node
+#define LORA_DISCOVERY_BEACON_JITTER                    10000     // in ms, each interval is drawn within +- this, a node just heard for the first time is greeted within this
+#define LORA_DISCOVERY_STARTUP_TIME                     25000     // in ms, requests go out unchecked until the first HELLO round is over
+#define LORA_NEIGHBOR_MAX_AGE                           200000    // in ms, a node not heard for this long leaves the table (three HELLO frames missed)
+
+// Multi-channel operation: every node listens on a home channel of its own (drawn from its address among the active
+// channels of the plan) and transmits on the home channel of the destination, broadcasts go out once per plan channel;
+// the gateway blocks the channels its transactions keep failing on (or it sees too busy) and advertises the channels
+// in use with its HELLO frames (LORA_DISCOVERY_ENABLED)
+#define LORA_CHANNEL_COUNT                              1         // channels of LORA_CHANNEL_PLAN in use, 1 is the single RF_FREQUENCY channel
+#define LORA_CHANNEL_PLAN                               { 868125000, 868375000, 867875000, 867625000, 867375000, 867125000, 866875000, 866625000 } // Hz, centres at least LORA_BANDWIDTH apart (first is the gateway one)
+#define LORA_CHANNEL_SUB_BANDS                          { 865000000, 868000000, 868000000, 868600000 } // Hz, low/high edges of the sub-bands every channel must fit in (EU868 g and g1)
+#define LORA_CHANNEL_UTILISATION_WINDOW                 60000     // in ms, channel statistics are computed over this
+#define LORA_CHANNEL_BUSY_PERMILLE                      100       // airtime heard or sent on a channel, in per mille of the window, above which it is busy
+#define LORA_CHANNEL_BUSY_FAILURE_PERCENT               50        // unanswered queries on a channel, above which it is busy
+#define LORA_CHANNEL_MIN_TRANSACTIONS                   8         // queries within a window needed before judging their failures
+#define LORA_CHANNEL_BLOCK_TIME                         600000    // in ms, a busy channel is left out for this long
+#define LORA_FHSS_MIN_FRAME_AIRTIME                     400       // in ms, longer frames hop among the active channels (dwell time), with LORA_CHANNEL_COUNT > 1
+
+// Bulk transfers: a blob goes out once as broadcast fragments extended with erasure-coding parity (any data-count
+// fragments rebuild it), the targets then report the fragments they miss and repair rounds send more parity
+#define LORA_BULK_MAX_SIZE                              160       // in bytes, of the blob
+#define LORA_BULK_PARITY_PERCENT                        25        // parity fragments of the first round, in percent of the data ones
+#define LORA_BULK_MAX_ROUNDS                            3         // repair rounds after the first one
+#define LORA_BULK_PREEMPT_HOLD_TIME                     1000      // in ms, a transfer set aside for an urgent request goes on by itself if the request doesn't come within this
+
+// Retransmission and responder reply cache parameters
+#define LORA_QUERY_MAX_RETRIES                          0         // re-sends of an unanswered query, with the same sequence number
+#define LORA_REPLY_CACHE_SIZE                           8         // entries, least recently used is evicted
+#define LORA_REPLY_CACHE_TTL                            10000     // in ms
+
+// A query for the node being answered rides on the reply, and the reply to it may carry the next one; every node of the
+// network needs firmware that knows the combined frame (older nodes take it for a plain reply)
+#define LORA_PIGGYBACK_ENABLED                          false
+
+// Frame capture parameters
+#define LORA_CAPTURE_RING_SIZE                          16        // in records, newest records are dropped when full
+#define LORA_CAPTURE_STREAM_INTERVAL                    50        // in ms, records are streamed to the host uart at this pace
+
+// Transaction tracing parameters
+#define LORA_TRACE_RING_SIZE                            16        // in finished records, newest records are dropped when full
+#define LORA_TRACE_HOST_NOTES_SIZE                      8         // host requests waiting for the radio, oldest is dropped when full
+#define LORA_TRACE_STREAM_INTERVAL                      100       // in ms, records are streamed to the host uart at this pace
+
+// Radio supply currents for the energy accounting, in nA (datasheet typical values, tx at TX_OUTPUT_POWER)
+#define SX1272_SLEEP_CURRENT_NA                         100
+#define SX1272_STANDBY_CURRENT_NA                       1400000
+#define SX1272_RX_CURRENT_NA                            11200000
+#define SX1272_TX_CURRENT_NA                            28000000
+#define SX1272_CAD_CURRENT_NA                           11200000
+
+#define SX1276_SLEEP_CURRENT_NA                         200
+#define SX1276_STANDBY_CURRENT_NA                       1600000
+#define SX1276_RX_CURRENT_NA                            11500000
+#define SX1276_TX_CURRENT_NA                            29000000
+#define SX1276_CAD_CURRENT_NA                           11500000
+
+// Boot-time microbenchmarks (mbed_app.json "benchmark_on_boot")
+#define LORA_BENCHMARK_ITERATIONS                       1000
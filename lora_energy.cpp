@@ -0,0 +1,105 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "lora_energy.h"
+
+static uint64_t s_time_us[LORA_RADIO_MODES_COUNT][LORA_ENERGY_CLASSES_COUNT];
+
+static uint32_t s_mode_currents_na[LORA_RADIO_MODES_COUNT];
+
+static uint8_t s_mode;
+static uint8_t s_class;
+static uint64_t s_interval_start_us;
+
+static void close_interval(uint64_t nowUs)
+{
+    if(nowUs > s_interval_start_us) s_time_us[s_mode][s_class] += nowUs - s_interval_start_us;
+
+    s_interval_start_us = nowUs;
+}
+
+// nA * ms fits 64 bits for years of radio time, 1 uAh = 3.6e9 nA*ms
+static uint32_t get_charge_uah(uint64_t timeUs, uint8_t mode)
+{
+    return (uint32_t)((timeUs / 1000) * s_mode_currents_na[mode] / 3600000000ULL);
+}
+
+void lora_energy_initialize(const uint32_t* modeCurrentsNa, uint64_t nowUs)
+{
+    memcpy(s_mode_currents_na, modeCurrentsNa, sizeof(s_mode_currents_na));
+    memset(s_time_us, 0, sizeof(s_time_us));
+
+    s_mode = LORA_RADIO_MODE_SLEEP;
+    s_class = LORA_ENERGY_CLASS_IDLE;
+    s_interval_start_us = nowUs;
+}
+
+void lora_energy_set_mode(uint8_t mode, uint64_t nowUs)
+{
+    if(mode >= LORA_RADIO_MODES_COUNT) return;
+
+    close_interval(nowUs);
+
+    s_mode = mode;
+}
+
+void lora_energy_set_class(uint8_t energyClass, uint64_t nowUs)
+{
+    if(energyClass >= LORA_ENERGY_CLASSES_COUNT) return;
+
+    close_interval(nowUs);
+
+    s_class = energyClass;
+}
+
+void lora_energy_get_totals(LoraEnergyTotals_t* outTotals, uint64_t nowUs)
+{
+    memcpy(outTotals->timeUs, s_time_us, sizeof(s_time_us));
+
+    if(nowUs > s_interval_start_us) outTotals->timeUs[s_mode][s_class] += nowUs - s_interval_start_us;
+}
+
+uint32_t lora_energy_get_mode_charge_uah(const LoraEnergyTotals_t* totals, uint8_t mode)
+{
+    uint64_t timeUs=0;
+
+    for(uint8_t energyClass=0; energyClass<LORA_ENERGY_CLASSES_COUNT; energyClass++) timeUs += totals->timeUs[mode][energyClass];
+
+    return get_charge_uah(timeUs, mode);
+}
+
+uint32_t lora_energy_get_class_charge_uah(const LoraEnergyTotals_t* totals, uint8_t energyClass)
+{
+    uint32_t charge=0;
+
+    for(uint8_t mode=0; mode<LORA_RADIO_MODES_COUNT; mode++) charge += get_charge_uah(totals->timeUs[mode][energyClass], mode);
+
+    return charge;
+}
+
+static unsigned long get_mode_time_ms(const LoraEnergyTotals_t* totals, uint8_t mode)
+{
+    uint64_t timeUs=0;
+
+    for(uint8_t energyClass=0; energyClass<LORA_ENERGY_CLASSES_COUNT; energyClass++) timeUs += totals->timeUs[mode][energyClass];
+
+    return (unsigned long)(timeUs / 1000);
+}
+
+void lora_energy_fill_with_totals_dump(const LoraEnergyTotals_t* totals, char* destBuffer, size_t destBufferSize)
+{
+    uint32_t totalCharge=0;
+
+    for(uint8_t mode=0; mode<LORA_RADIO_MODES_COUNT; mode++) totalCharge += lora_energy_get_mode_charge_uah(totals, mode);
+
+    // Times in ms per mode, then charge in uAh: total and per class
+    snprintf(destBuffer, destBufferSize, "tx=%lu,rx=%lu,stby=%lu,sleep=%lu,cad=%lu,uah=%lu,idle=%lu,qry=%lu,cmd=%lu,gth=%lu,rep=%lu,bcn=%lu,pol=%lu",
+        get_mode_time_ms(totals, LORA_RADIO_MODE_TX), get_mode_time_ms(totals, LORA_RADIO_MODE_RX), get_mode_time_ms(totals, LORA_RADIO_MODE_STANDBY),
+        get_mode_time_ms(totals, LORA_RADIO_MODE_SLEEP), get_mode_time_ms(totals, LORA_RADIO_MODE_CAD),
+        (unsigned long)totalCharge,
+        (unsigned long)lora_energy_get_class_charge_uah(totals, LORA_ENERGY_CLASS_IDLE), (unsigned long)lora_energy_get_class_charge_uah(totals, LORA_ENERGY_CLASS_QUERY),
+        (unsigned long)lora_energy_get_class_charge_uah(totals, LORA_ENERGY_CLASS_COMMAND), (unsigned long)lora_energy_get_class_charge_uah(totals, LORA_ENERGY_CLASS_GATHER),
+        (unsigned long)lora_energy_get_class_charge_uah(totals, LORA_ENERGY_CLASS_REPLY), (unsigned long)lora_energy_get_class_charge_uah(totals, LORA_ENERGY_CLASS_BEACON),
+        (unsigned long)lora_energy_get_class_charge_uah(totals, LORA_ENERGY_CLASS_POLL));
+}
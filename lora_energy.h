@@ -0,0 +1,65 @@
+#ifndef __LORA_ENERGY_H__
+#define __LORA_ENERGY_H__
+
+#include <cstdint>
+#include <cstddef>
+
+typedef enum
+{
+    LORA_RADIO_MODE_SLEEP,
+    LORA_RADIO_MODE_STANDBY,
+    LORA_RADIO_MODE_RX,
+    LORA_RADIO_MODE_TX,
+    LORA_RADIO_MODE_CAD,
+
+    LORA_RADIO_MODES_COUNT
+
+} LoraRadioModes_t;
+
+// What the radio time is spent for: a wait for reply is charged to the request that opened it
+typedef enum
+{
+    LORA_ENERGY_CLASS_IDLE,
+    LORA_ENERGY_CLASS_QUERY,
+    LORA_ENERGY_CLASS_COMMAND,
+    LORA_ENERGY_CLASS_GATHER,
+    LORA_ENERGY_CLASS_REPLY,
+    LORA_ENERGY_CLASS_BEACON,
+    LORA_ENERGY_CLASS_POLL,             // sleepy end device: poll frames and the downlink windows after any uplink
+
+    LORA_ENERGY_CLASSES_COUNT
+
+} LoraEnergyClasses_t;
+
+typedef struct
+{
+    uint64_t timeUs[LORA_RADIO_MODES_COUNT][LORA_ENERGY_CLASSES_COUNT];
+
+} LoraEnergyTotals_t;
+
+/*!
+ * @brief Starts the accounting in sleep mode, idle class; currents in nA, one per LoraRadioModes_t
+ */
+void lora_energy_initialize(const uint32_t* modeCurrentsNa, uint64_t nowUs);
+
+/*!
+ * @brief Radio mode transition: the time since the previous one goes to the previous mode and class
+ */
+void lora_energy_set_mode(uint8_t mode, uint64_t nowUs);
+
+void lora_energy_set_class(uint8_t energyClass, uint64_t nowUs);
+
+/*!
+ * @brief Copies the accumulated times, the running interval included up to nowUs
+ */
+void lora_energy_get_totals(LoraEnergyTotals_t* outTotals, uint64_t nowUs);
+
+/*!
+ * @brief Estimated charge in uAh drawn in the given mode (all classes) or by the given class (all modes), from the configured currents
+ */
+uint32_t lora_energy_get_mode_charge_uah(const LoraEnergyTotals_t* totals, uint8_t mode);
+uint32_t lora_energy_get_class_charge_uah(const LoraEnergyTotals_t* totals, uint8_t energyClass);
+
+void lora_energy_fill_with_totals_dump(const LoraEnergyTotals_t* totals, char* destBuffer, size_t destBufferSize);
+
+#endif // __LORA_ENERGY_H__
@@ -0,0 +1,330 @@
+#include <cstdint>
+#include <cstring>
+
+#include "lora_flash_log.h"
+
+// Record: magic (1), type (1), id (2, LE), item data (LORA_FLASH_LOG_ITEM_SIZE), reserved (1), checksum (1)
+#define RECORD_MAGIC            0x4C
+#define RECORD_TYPE_HEADER      'H'     // first record of a sector, id unused, data starts with the generation (4, LE)
+#define RECORD_TYPE_PUT         'P'
+#define RECORD_TYPE_REMOVE      'X'
+#define RECORD_DATA_OFFSET      4
+#define RECORD_CHECKSUM_OFFSET  (LORA_FLASH_LOG_RECORD_SIZE - 1)
+
+static_assert(RECORD_DATA_OFFSET + LORA_FLASH_LOG_ITEM_SIZE + 2 == LORA_FLASH_LOG_RECORD_SIZE, "item doesn't fit the record");
+
+static uint32_t get_slots(const LoraFlashLog_t* log)
+{
+    return log->ops->sectorSize / LORA_FLASH_LOG_RECORD_SIZE;
+}
+
+static uint32_t get_offset(const LoraFlashLog_t* log, uint8_t sector, uint32_t slot)
+{
+    return sector * log->ops->sectorSize + slot * LORA_FLASH_LOG_RECORD_SIZE;
+}
+
+// Seeded, so that a record of zeros (a partially programmed one, on some flash) isn't valid
+static uint8_t get_checksum(const uint8_t* record)
+{
+    uint8_t checksum=0x5A;
+
+    for(int i=0; i<RECORD_CHECKSUM_OFFSET; i++) checksum ^= record[i];
+
+    return checksum;
+}
+
+static bool is_blank(const uint8_t* record)
+{
+    for(int i=0; i<LORA_FLASH_LOG_RECORD_SIZE; i++)
+    {
+        if(record[i] != 0xFF) return false;
+    }
+
+    return true;
+}
+
+static bool is_valid(const uint8_t* record)
+{
+    return record[0] == RECORD_MAGIC && record[RECORD_CHECKSUM_OFFSET] == get_checksum(record);
+}
+
+static uint16_t get_id(const uint8_t* record)
+{
+    return (uint16_t)record[2] | ((uint16_t)record[3] << 8);
+}
+
+static bool read_record(const LoraFlashLog_t* log, uint8_t sector, uint32_t slot, uint8_t* record)
+{
+    return log->ops->read(get_offset(log, sector, slot), record, LORA_FLASH_LOG_RECORD_SIZE);
+}
+
+static bool program_record(LoraFlashLog_t* log, uint8_t sector, uint32_t slot, uint8_t type, uint16_t id, const uint8_t* data)
+{
+    uint8_t record[LORA_FLASH_LOG_RECORD_SIZE];
+
+    memset(record, 0, sizeof(record));
+
+    record[0] = RECORD_MAGIC;
+    record[1] = type;
+    record[2] = id & 0xFF;
+    record[3] = (id >> 8) & 0xFF;
+
+    if(data) memcpy(record + RECORD_DATA_OFFSET, data, LORA_FLASH_LOG_ITEM_SIZE);
+
+    record[RECORD_CHECKSUM_OFFSET] = get_checksum(record);
+
+    if(log->ops->program(get_offset(log, sector, slot), record, LORA_FLASH_LOG_RECORD_SIZE)) return true;
+
+    log->programErrors++;
+
+    return false;
+}
+
+static bool read_header(const LoraFlashLog_t* log, uint8_t sector, uint32_t* outGeneration)
+{
+    uint8_t record[LORA_FLASH_LOG_RECORD_SIZE];
+
+    if(!read_record(log, sector, 0, record) || !is_valid(record) || record[1] != RECORD_TYPE_HEADER) return false;
+
+    const uint8_t* data = record + RECORD_DATA_OFFSET;
+
+    *outGeneration = (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+
+    return true;
+}
+
+static bool program_header(LoraFlashLog_t* log, uint8_t sector, uint32_t generation)
+{
+    uint8_t data[LORA_FLASH_LOG_ITEM_SIZE];
+
+    memset(data, 0, sizeof(data));
+
+    data[0] = generation & 0xFF;
+    data[1] = (generation >> 8) & 0xFF;
+    data[2] = (generation >> 16) & 0xFF;
+    data[3] = (generation >> 24) & 0xFF;
+
+    return program_record(log, sector, 0, RECORD_TYPE_HEADER, 0, data);
+}
+
+static bool is_sector_blank(const LoraFlashLog_t* log, uint8_t sector)
+{
+    uint8_t record[LORA_FLASH_LOG_RECORD_SIZE];
+
+    for(uint32_t slot=0; slot<get_slots(log); slot++)
+    {
+        if(!read_record(log, sector, slot, record) || !is_blank(record)) return false;
+    }
+
+    return true;
+}
+
+static bool erase_sector(LoraFlashLog_t* log, uint8_t sector)
+{
+    log->erases++;
+
+    return log->ops->erase(get_offset(log, sector, 0), log->ops->sectorSize);
+}
+
+// A put is live unless a remove for its id follows it in the same sector
+static bool is_removed_after(const LoraFlashLog_t* log, uint32_t putSlot, uint16_t id)
+{
+    uint8_t record[LORA_FLASH_LOG_RECORD_SIZE];
+
+    for(uint32_t slot=putSlot+1; slot<log->writeSlot; slot++)
+    {
+        if(!read_record(log, log->activeSector, slot, record) || !is_valid(record)) continue;
+
+        if(record[1] == RECORD_TYPE_REMOVE && get_id(record) == id) return true;
+    }
+
+    return false;
+}
+
+static bool is_id_live(const LoraFlashLog_t* log, uint16_t id)
+{
+    uint8_t record[LORA_FLASH_LOG_RECORD_SIZE];
+
+    for(uint32_t slot=1; slot<log->writeSlot; slot++)
+    {
+        if(!read_record(log, log->activeSector, slot, record) || !is_valid(record)) continue;
+
+        if(record[1] == RECORD_TYPE_PUT && get_id(record) == id && !is_removed_after(log, slot, id)) return true;
+    }
+
+    return false;
+}
+
+void lora_flash_log_for_each(LoraFlashLog_t* log, lora_flash_log_visitor_t visitor, void* context)
+{
+    uint8_t record[LORA_FLASH_LOG_RECORD_SIZE];
+
+    for(uint32_t slot=1; slot<log->writeSlot; slot++)
+    {
+        // Records left half programmed by a reset don't pass the checksum
+        if(!read_record(log, log->activeSector, slot, record) || !is_valid(record) || record[1] != RECORD_TYPE_PUT) continue;
+
+        LoraFlashLogItem_t item;
+
+        item.id = get_id(record);
+
+        if(is_removed_after(log, slot, item.id)) continue;
+
+        memcpy(item.data, record + RECORD_DATA_OFFSET, LORA_FLASH_LOG_ITEM_SIZE);
+
+        if(!visitor(&item, context)) return;
+    }
+}
+
+typedef struct
+{
+    LoraFlashLog_t* log;
+    uint8_t targetSector;
+    uint32_t targetSlot;
+    bool ok;
+
+} CompactionContext_t;
+
+static bool copy_item_visitor(const LoraFlashLogItem_t* item, void* context)
+{
+    CompactionContext_t* compaction = (CompactionContext_t*)context;
+
+    compaction->ok = program_record(compaction->log, compaction->targetSector, compaction->targetSlot++, RECORD_TYPE_PUT, item->id, item->data);
+
+    return compaction->ok;
+}
+
+static bool compact(LoraFlashLog_t* log)
+{
+    CompactionContext_t compaction = { log, (uint8_t)(1 - log->activeSector), 1, true };
+
+    if(!is_sector_blank(log, compaction.targetSector) && !erase_sector(log, compaction.targetSector)) return false;
+
+    lora_flash_log_for_each(log, copy_item_visitor, &compaction);
+
+    // The header goes last: until it is there, a reset leaves the old sector in charge
+    if(!compaction.ok || !program_header(log, compaction.targetSector, log->generation + 1)) return false;
+
+    erase_sector(log, log->activeSector);
+
+    log->activeSector = compaction.targetSector;
+    log->generation++;
+    log->writeSlot = compaction.targetSlot;
+    log->compactions++;
+
+    return true;
+}
+
+static bool format(LoraFlashLog_t* log)
+{
+    for(uint8_t sector=0; sector<2; sector++)
+    {
+        if(!is_sector_blank(log, sector) && !erase_sector(log, sector)) return false;
+    }
+
+    log->activeSector = 0;
+    log->generation = 1;
+    log->writeSlot = 1;
+
+    return program_header(log, 0, log->generation);
+}
+
+bool lora_flash_log_mount(LoraFlashLog_t* log, const LoraFlashLogOps_t* ops)
+{
+    memset(log, 0, sizeof(LoraFlashLog_t));
+
+    log->ops = ops;
+
+    if(get_slots(log) < 3) return false;
+
+    uint32_t generations[2];
+    bool valid[2];
+
+    for(uint8_t sector=0; sector<2; sector++) valid[sector] = read_header(log, sector, &generations[sector]);
+
+    if(!valid[0] && !valid[1])
+    {
+        if(!format(log)) return false;
+    }
+    else
+    {
+        log->activeSector = valid[0] && (!valid[1] || (int32_t)(generations[0] - generations[1]) > 0) ? 0 : 1;
+        log->generation = generations[log->activeSector];
+
+        // Old sector of a compaction interrupted before its erase, or target of one interrupted before its header
+        uint8_t otherSector = 1 - log->activeSector;
+
+        if(!is_sector_blank(log, otherSector)) erase_sector(log, otherSector);
+    }
+
+    uint8_t record[LORA_FLASH_LOG_RECORD_SIZE];
+    uint16_t maxId=0;
+
+    for(log->writeSlot=1; log->writeSlot<get_slots(log); log->writeSlot++)
+    {
+        if(!read_record(log, log->activeSector, log->writeSlot, record) || is_blank(record)) break;
+
+        if(is_valid(record) && get_id(record) > maxId) maxId = get_id(record);
+    }
+
+    log->nextId = maxId + 1;
+
+    for(uint32_t slot=1; slot<log->writeSlot; slot++)
+    {
+        if(read_record(log, log->activeSector, slot, record) && is_valid(record) && record[1] == RECORD_TYPE_PUT && !is_removed_after(log, slot, get_id(record))) log->liveCount++;
+    }
+
+    return true;
+}
+
+uint16_t lora_flash_log_get_capacity(const LoraFlashLog_t* log)
+{
+    // Header and room for one tombstone: a full log can still take a remove after compacting
+    return get_slots(log) - 2;
+}
+
+static bool make_room(LoraFlashLog_t* log)
+{
+    if(log->writeSlot < get_slots(log)) return true;
+
+    return compact(log) && log->writeSlot < get_slots(log);
+}
+
+bool lora_flash_log_append(LoraFlashLog_t* log, const uint8_t* data, uint16_t* outId)
+{
+    if(log->liveCount >= lora_flash_log_get_capacity(log) || !make_room(log)) return false;
+
+    uint16_t id;
+
+    do
+    {
+        if(log->nextId == 0 || log->nextId == 0xFFFF)
+        {
+            log->nextId = 1;
+            log->idsWrapped = true;
+        }
+
+        id = log->nextId++;
+
+    } while(log->idsWrapped && is_id_live(log, id));
+
+    // The slot is used up even if programming fails
+    if(!program_record(log, log->activeSector, log->writeSlot++, RECORD_TYPE_PUT, id, data)) return false;
+
+    log->liveCount++;
+
+    if(outId) *outId = id;
+
+    return true;
+}
+
+bool lora_flash_log_remove(LoraFlashLog_t* log, uint16_t id)
+{
+    if(log->liveCount == 0 || !make_room(log)) return false;
+
+    if(!program_record(log, log->activeSector, log->writeSlot++, RECORD_TYPE_REMOVE, id, NULL)) return false;
+
+    log->liveCount--;
+
+    return true;
+}
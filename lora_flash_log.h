@@ -0,0 +1,74 @@
+#ifndef __LORA_FLASH_LOG_H__
+#define __LORA_FLASH_LOG_H__
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Append-only log of small fixed-size items on two flash sectors, used in turn
+ *
+ * Adding or removing an item only programs one more record (a remove is a tombstone), so a sector is erased only once it is
+ * full: the live items are then copied to the other sector, whose header is programmed last, and the full one is erased.
+ * On mount the sector with the newest complete header wins, so a copy interrupted by a reset is simply done again.
+ * Each record is programmed once (16 bytes, a multiple of the flash program unit), never overwritten.
+ */
+
+#define LORA_FLASH_LOG_RECORD_SIZE          16
+#define LORA_FLASH_LOG_ITEM_SIZE            10
+
+typedef struct
+{
+    // Offsets are relative to the start of the log area, two sectors of sectorSize bytes
+    bool (*read)(uint32_t offset, void* buffer, uint32_t size);
+    bool (*program)(uint32_t offset, const void* buffer, uint32_t size);
+    bool (*erase)(uint32_t offset, uint32_t size);
+    uint32_t sectorSize;
+
+} LoraFlashLogOps_t;
+
+typedef struct
+{
+    uint16_t id;
+    uint8_t data[LORA_FLASH_LOG_ITEM_SIZE];
+
+} LoraFlashLogItem_t;
+
+typedef struct
+{
+    const LoraFlashLogOps_t* ops;
+    uint8_t activeSector;
+    uint32_t generation;
+    uint32_t writeSlot;
+    uint16_t nextId;
+    bool idsWrapped;                // ids started over at 1: the ones still live are skipped
+    uint16_t liveCount;
+
+    uint32_t erases;
+    uint32_t compactions;
+    uint32_t programErrors;
+
+} LoraFlashLog_t;
+
+// (item, context) -> false to stop visiting
+typedef bool (*lora_flash_log_visitor_t)(const LoraFlashLogItem_t*, void*);
+
+/*!
+ * @brief Finds the current sector (formatting the area if there is none), returns false if the flash can't be used
+ */
+bool lora_flash_log_mount(LoraFlashLog_t* log, const LoraFlashLogOps_t* ops);
+
+/*!
+ * @brief Adds an item (compacting first if the sector is full), false if there's no room left even after compacting
+ */
+bool lora_flash_log_append(LoraFlashLog_t* log, const uint8_t* data, uint16_t* outId);
+
+bool lora_flash_log_remove(LoraFlashLog_t* log, uint16_t id);
+
+/*!
+ * @brief Visits the live items, oldest first
+ */
+void lora_flash_log_for_each(LoraFlashLog_t* log, lora_flash_log_visitor_t visitor, void* context);
+
+uint16_t lora_flash_log_get_capacity(const LoraFlashLog_t* log);
+
+#endif // __LORA_FLASH_LOG_H__
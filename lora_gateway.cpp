@@ -0,0 +1,1135 @@
+#include "mbed.h"
+
+#include "lora_config.h"
+#include "lora_state_machine.h"
+
+#include "lora_flash_log.h"
+
+#include "lora_gateway.h"
+
+typedef struct
+{
+    uint16_t payload;
+    bool requiresReply;
+    uint32_t enqueuedAtMs;
+    uint16_t tag;
+    GatewayTrafficClasses_t trafficClass;
+
+    // Set once the request went to the store (the host already had its outcome), kept while it goes back and forth
+    bool stored;
+    uint32_t storedAtMs;
+    uint32_t expiresAtMs;
+
+} GatewayQueuedRequest_t;
+
+typedef struct
+{
+    bool used;
+    uint8_t peerAddress;
+    GatewayQueuedRequest_t request;
+
+} GatewayStoreSlot_t;
+
+typedef struct
+{
+    uint8_t peerAddress;
+    GatewayQueuedRequest_t request;
+    uint16_t replyPayload;
+    GatewayStoreEvents_t event;
+    uint32_t ms;
+
+} GatewayStoreReport_t;
+
+typedef struct
+{
+    GatewayQueuedRequest_t queue[GATEWAY_PEER_QUEUE_SIZE];
+    uint8_t head;
+    uint8_t count;
+
+    uint8_t inFlight;
+
+    uint8_t weight;
+    int32_t currentWeight;
+
+    uint8_t consecutiveFailures;
+    uint32_t backoffUntilMs;
+
+    uint32_t sent;
+    uint32_t failed;
+    uint32_t expired;
+    uint32_t rejected;
+
+    uint16_t storeTtlS;
+    uint8_t storedInRam;
+    uint16_t storedInFlash;
+
+    uint32_t heard;
+    uint32_t storeIn;
+    uint32_t storeDelivered;
+    uint32_t storeExpired;
+    uint32_t storeDropped;
+    uint32_t redeliveryTotalMs;
+    uint32_t redeliveryMaxMs;
+
+    // Sleepy end device: reachable only until its latest downlink window is over
+    bool sleepy;
+    uint32_t windowUntilMs;
+
+} GatewayPeer_t;
+
+typedef struct
+{
+    uint8_t peerAddress;
+    GatewayQueuedRequest_t request;
+
+} GatewayUrgentRequest_t;
+
+typedef enum
+{
+    GATEWAY_BULK_IDLE,
+    GATEWAY_BULK_WAITING,
+    GATEWAY_BULK_SENDING,
+
+} GatewayBulkStates_t;
+
+static GatewayPeer_t s_peers[GATEWAY_MAX_PEERS];
+
+// Urgent requests of all peers, in arrival order
+static GatewayUrgentRequest_t s_urgent_queue[GATEWAY_URGENT_QUEUE_SIZE];
+static uint8_t s_urgent_head;
+static uint8_t s_urgent_count;
+static uint32_t s_urgent_sent;
+static uint32_t s_urgent_rejected;
+static uint32_t s_urgent_expired;
+static uint32_t s_urgent_latency_total_ms;
+static uint32_t s_urgent_latency_max_ms;
+
+static GatewayBulkStates_t s_bulk_state;
+static uint8_t s_bulk_blob[LORA_BULK_MAX_SIZE];
+static uint16_t s_bulk_size;
+static uint16_t s_bulk_address_mask;
+static uint32_t s_bulk_sent;
+
+static Mutex s_peers_mutex;
+
+static Timer s_gateway_timer;
+
+static lora_gateway_send_request_function_t s_send_request_function;
+static lora_gateway_send_bulk_function_t s_send_bulk_function;
+
+lora_gateway_notify_completion_callback_t lora_gateway_notify_completion_callback;
+lora_gateway_notify_stored_callback_t lora_gateway_notify_stored_callback;
+lora_gateway_notify_bulk_completion_callback_t lora_gateway_notify_bulk_completion_callback;
+
+static GatewayStoreSlot_t s_store[GATEWAY_STORE_RAM_SIZE];
+
+// Flash items: peer address (1), requires reply (1), payload (2, LE), stored at (4, LE, s of store clock), time to live (2, LE, s).
+// The store clock goes on from the newest item found at startup, so the time the gateway was off doesn't count towards expiry
+static LoraFlashLog_t s_flash_log;
+static bool s_flash_log_mounted;
+static uint32_t s_store_clock_base_s;
+static uint32_t s_flash_expiry_checked_at_ms;
+
+#if GATEWAY_STORE_FLASH_ENABLED
+
+static FlashIAP s_flash;
+static uint32_t s_flash_log_start;
+
+static bool flash_read(uint32_t offset, void* buffer, uint32_t size)
+{
+    return s_flash.read(buffer, s_flash_log_start + offset, size) == 0;
+}
+
+static bool flash_program(uint32_t offset, const void* buffer, uint32_t size)
+{
+    return s_flash.program(buffer, s_flash_log_start + offset, size) == 0;
+}
+
+static bool flash_erase(uint32_t offset, uint32_t size)
+{
+    return s_flash.erase(s_flash_log_start + offset, size) == 0;
+}
+
+static LoraFlashLogOps_t s_flash_log_ops = { flash_read, flash_program, flash_erase, 0 };
+
+#endif
+
+// Request handed to a send function which didn't block (LORA_OUTCOME_PENDING), completed by lora_gateway_complete_pending_request()
+static int s_pending_peer_address = -1;
+static GatewayQueuedRequest_t s_pending_request;
+
+static void notify_completion(uint8_t peerAddress, const GatewayQueuedRequest_t& request, uint16_t replyPayload, int outcome)
+{
+    if(lora_gateway_notify_completion_callback) lora_gateway_notify_completion_callback(peerAddress, request.payload, request.requiresReply, replyPayload, outcome, request.tag);
+}
+
+static bool is_peer_failure_outcome(int outcome)
+{
+    return outcome == LORA_OUTCOME_WAITING_FOR_REPLY_TIMEOUT ||
+        outcome == LORA_OUTCOME_TIMEOUT_WAITING_FOR_REQUEST_SENT ||
+        outcome == LORA_OUTCOME_TIMEOUT_STUCK ||
+        outcome == LORA_OUTCOME_UNKNOWN_PEER;
+}
+
+static bool is_downlink_window_open(GatewayPeer_t* peer, uint32_t now)
+{
+    return !peer->sleepy || (int32_t)(peer->windowUntilMs - now) > 0;
+}
+
+static bool is_peer_eligible(GatewayPeer_t* peer, uint32_t now)
+{
+    return peer->count > 0 && peer->inFlight < GATEWAY_PEER_MAX_IN_FLIGHT && (int32_t)(now - peer->backoffUntilMs) >= 0 && is_downlink_window_open(peer, now);
+}
+
+// Broadcast commands (peer 0) are never answered, so there's nothing to wait for
+static bool is_store_enabled(int peerAddress)
+{
+    return peerAddress != 0 && s_peers[peerAddress].storeTtlS > 0;
+}
+
+static uint32_t get_store_clock_s(uint32_t now)
+{
+    return s_store_clock_base_s + now / 1000;
+}
+
+static void encode_flash_item(uint8_t* data, uint8_t peerAddress, const GatewayQueuedRequest_t& request, uint32_t now)
+{
+    uint32_t storedAtS = get_store_clock_s(now) - (now - request.storedAtMs) / 1000;
+    uint32_t ttlS = (request.expiresAtMs - request.storedAtMs) / 1000;
+
+    if(ttlS > 0xFFFF) ttlS = 0xFFFF;
+
+    data[0] = peerAddress;
+    data[1] = request.requiresReply ? 1 : 0;
+    data[2] = request.payload & 0xFF;
+    data[3] = (request.payload >> 8) & 0xFF;
+    data[4] = storedAtS & 0xFF;
+    data[5] = (storedAtS >> 8) & 0xFF;
+    data[6] = (storedAtS >> 16) & 0xFF;
+    data[7] = (storedAtS >> 24) & 0xFF;
+    data[8] = ttlS & 0xFF;
+    data[9] = (ttlS >> 8) & 0xFF;
+}
+
+static uint32_t get_flash_item_stored_at_s(const uint8_t* data)
+{
+    return (uint32_t)data[4] | ((uint32_t)data[5] << 8) | ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+}
+
+static void decode_flash_item(const uint8_t* data, GatewayQueuedRequest_t* request, uint32_t now)
+{
+    int32_t ageS = (int32_t)(get_store_clock_s(now) - get_flash_item_stored_at_s(data));
+    uint32_t ttlS = (uint32_t)data[8] | ((uint32_t)data[9] << 8);
+
+    request->payload = (uint16_t)data[2] | ((uint16_t)data[3] << 8);
+    request->requiresReply = data[1] != 0;
+    request->enqueuedAtMs = now;
+    request->tag = 0;
+    request->trafficClass = GATEWAY_TRAFFIC_NORMAL;
+    request->stored = true;
+    request->storedAtMs = now - (ageS > 0 ? (uint32_t)ageS : 0) * 1000;
+    request->expiresAtMs = request->storedAtMs + ttlS * 1000;
+}
+
+#if GATEWAY_STORE_FLASH_ENABLED
+
+static bool mount_flash_item_visitor(const LoraFlashLogItem_t* item, void* context)
+{
+    if(item->data[0] < GATEWAY_MAX_PEERS) s_peers[item->data[0]].storedInFlash++;
+
+    uint32_t storedAtS = get_flash_item_stored_at_s(item->data);
+
+    if(storedAtS > s_store_clock_base_s) s_store_clock_base_s = storedAtS;
+
+    return true;
+}
+
+#endif
+
+static void mount_flash_store()
+{
+#if GATEWAY_STORE_FLASH_ENABLED
+    if(s_flash.init() != 0) return;
+
+    // Last two sectors of the internal flash, which must be the same size
+    uint32_t flashEnd = s_flash.get_flash_start() + s_flash.get_flash_size();
+
+    s_flash_log_ops.sectorSize = s_flash.get_sector_size(flashEnd - 1);
+    s_flash_log_start = flashEnd - 2 * s_flash_log_ops.sectorSize;
+
+    if(s_flash.get_sector_size(s_flash_log_start) != s_flash_log_ops.sectorSize) return;
+
+    s_flash_log_mounted = lora_flash_log_mount(&s_flash_log, &s_flash_log_ops);
+
+    if(s_flash_log_mounted) lora_flash_log_for_each(&s_flash_log, mount_flash_item_visitor, NULL);
+#endif
+}
+
+void lora_gateway_initialize(lora_gateway_send_request_function_t sendRequestFunction, lora_gateway_send_bulk_function_t sendBulkFunction)
+{
+    s_send_request_function = sendRequestFunction;
+    s_send_bulk_function = sendBulkFunction;
+
+    memset(s_peers, 0, sizeof(s_peers));
+    memset(s_store, 0, sizeof(s_store));
+
+    for(int address=0; address<GATEWAY_MAX_PEERS; address++)
+    {
+        s_peers[address].weight = 1;
+        s_peers[address].storeTtlS = GATEWAY_STORE_TTL;
+    }
+
+    mount_flash_store();
+
+    s_gateway_timer.start();
+}
+
+static bool enqueue_request_locked(uint16_t payload, uint8_t destinationAddress, bool requiresReply, uint16_t tag)
+{
+    if(destinationAddress >= GATEWAY_MAX_PEERS) return false;
+
+    GatewayPeer_t* peer = &s_peers[destinationAddress];
+
+    if(peer->count == GATEWAY_PEER_QUEUE_SIZE)
+    {
+        peer->rejected++;
+
+        return false;
+    }
+
+    GatewayQueuedRequest_t* request = &peer->queue[(peer->head + peer->count) % GATEWAY_PEER_QUEUE_SIZE];
+
+    request->payload = payload;
+    request->requiresReply = requiresReply;
+    request->enqueuedAtMs = s_gateway_timer.read_ms();
+    request->tag = tag;
+    request->trafficClass = GATEWAY_TRAFFIC_NORMAL;
+    request->stored = false;
+
+    peer->count++;
+
+    return true;
+}
+
+bool lora_gateway_enqueue_request(uint16_t argPayload, uint8_t argDestinationAddress, bool argRequiresReply)
+{
+    s_peers_mutex.lock();
+
+    bool queued = enqueue_request_locked(argPayload, argDestinationAddress, argRequiresReply, 0);
+
+    s_peers_mutex.unlock();
+
+    return queued;
+}
+
+bool lora_gateway_enqueue_urgent_request(uint16_t argPayload, uint8_t argDestinationAddress, bool argRequiresReply)
+{
+    if(argDestinationAddress >= GATEWAY_MAX_PEERS) return false;
+
+    s_peers_mutex.lock();
+
+    if(s_urgent_count == GATEWAY_URGENT_QUEUE_SIZE)
+    {
+        s_urgent_rejected++;
+
+        s_peers_mutex.unlock();
+
+        return false;
+    }
+
+    GatewayUrgentRequest_t* urgent = &s_urgent_queue[(s_urgent_head + s_urgent_count) % GATEWAY_URGENT_QUEUE_SIZE];
+
+    urgent->peerAddress = argDestinationAddress;
+    urgent->request.payload = argPayload;
+    urgent->request.requiresReply = argRequiresReply;
+    urgent->request.enqueuedAtMs = s_gateway_timer.read_ms();
+    urgent->request.tag = 0;
+    urgent->request.trafficClass = GATEWAY_TRAFFIC_URGENT;
+    urgent->request.stored = false;
+
+    s_urgent_count++;
+
+    s_peers_mutex.unlock();
+
+    return true;
+}
+
+bool lora_gateway_enqueue_bulk(const uint8_t* argBlob, uint16_t argSize, uint16_t argAddressMask)
+{
+    if(argSize == 0 || argSize > LORA_BULK_MAX_SIZE) return false;
+
+    s_peers_mutex.lock();
+
+    bool queued = s_bulk_state == GATEWAY_BULK_IDLE;
+
+    if(queued)
+    {
+        memcpy(s_bulk_blob, argBlob, argSize);
+
+        s_bulk_size = argSize;
+        s_bulk_address_mask = argAddressMask;
+        s_bulk_state = GATEWAY_BULK_WAITING;
+    }
+
+    s_peers_mutex.unlock();
+
+    return queued;
+}
+
+uint8_t lora_gateway_enqueue_batch(const GatewayRequest_t* argRequests, uint8_t argCount, bool* outQueued)
+{
+    uint8_t queuedCount=0;
+
+    // All at once: the scheduler never runs in between, so the batch is served as a whole by the round robin
+    s_peers_mutex.lock();
+
+    for(uint8_t i=0; i<argCount; i++)
+    {
+        outQueued[i] = enqueue_request_locked(argRequests[i].payload, argRequests[i].destinationAddress, argRequests[i].requiresReply, argRequests[i].tag);
+
+        if(outQueued[i]) queuedCount++;
+    }
+
+    s_peers_mutex.unlock();
+
+    return queuedCount;
+}
+
+bool lora_gateway_set_peer_weight(uint8_t argPeerAddress, uint8_t argWeight)
+{
+    if(argPeerAddress >= GATEWAY_MAX_PEERS || argWeight == 0) return false;
+
+    s_peers_mutex.lock();
+    s_peers[argPeerAddress].weight = argWeight;
+    s_peers_mutex.unlock();
+
+    return true;
+}
+
+bool lora_gateway_set_peer_store_ttl(uint8_t argPeerAddress, uint16_t argTtlS)
+{
+    if(argPeerAddress == 0 || argPeerAddress >= GATEWAY_MAX_PEERS) return false;
+
+    s_peers_mutex.lock();
+    s_peers[argPeerAddress].storeTtlS = argTtlS;
+    s_peers_mutex.unlock();
+
+    return true;
+}
+
+void lora_gateway_notify_peer_heard(uint8_t argPeerAddress, bool argSleepy, uint32_t argDownlinkWindowMs)
+{
+    if(argPeerAddress >= GATEWAY_MAX_PEERS) return;
+
+    s_peers_mutex.lock();
+
+    GatewayPeer_t* peer = &s_peers[argPeerAddress];
+
+    peer->heard++;
+
+    peer->sleepy = argSleepy;
+    peer->windowUntilMs = s_gateway_timer.read_ms() + argDownlinkWindowMs;
+
+    // Awake again: no more back-off, its stored requests are taken back by the next scheduler cycle
+    if(peer->consecutiveFailures > 0)
+    {
+        peer->consecutiveFailures = 0;
+        peer->backoffUntilMs = s_gateway_timer.read_ms();
+    }
+
+    s_peers_mutex.unlock();
+}
+
+uint16_t lora_gateway_get_peer_pending_count(uint8_t argPeerAddress)
+{
+    if(argPeerAddress >= GATEWAY_MAX_PEERS) return 0;
+
+    s_peers_mutex.lock();
+
+    GatewayPeer_t* peer = &s_peers[argPeerAddress];
+
+    uint16_t count = peer->count + peer->storedInRam + peer->storedInFlash;
+
+    for(uint8_t i=0; i<s_urgent_count; i++) if(s_urgent_queue[(s_urgent_head + i) % GATEWAY_URGENT_QUEUE_SIZE].peerAddress == argPeerAddress) count++;
+
+    s_peers_mutex.unlock();
+
+    return count;
+}
+
+uint8_t lora_gateway_get_peer_credits(uint8_t argPeerAddress, uint32_t argTransactionMs, uint32_t* outRetryAfterMs)
+{
+    *outRetryAfterMs = 0;
+
+    if(argPeerAddress >= GATEWAY_MAX_PEERS) return 0;
+
+    s_peers_mutex.lock();
+
+    GatewayPeer_t* peer = &s_peers[argPeerAddress];
+
+    uint8_t credits = GATEWAY_PEER_QUEUE_SIZE - peer->count;
+
+    if(credits == 0)
+    {
+        int32_t backoffLeft = (int32_t)(peer->backoffUntilMs - (uint32_t)s_gateway_timer.read_ms());
+
+        *outRetryAfterMs = (backoffLeft > 0 ? backoffLeft : 0) + argTransactionMs;
+    }
+
+    s_peers_mutex.unlock();
+
+    return credits;
+}
+
+static void add_store_report(GatewayStoreReport_t* reports, int* reportCount, uint8_t peerAddress, const GatewayQueuedRequest_t& request,
+    uint16_t replyPayload, GatewayStoreEvents_t event, uint32_t ms)
+{
+    GatewayStoreReport_t* report = &reports[(*reportCount)++];
+
+    report->peerAddress = peerAddress;
+    report->request = request;
+    report->replyPayload = replyPayload;
+    report->event = event;
+    report->ms = ms;
+}
+
+static void notify_store_reports(const GatewayStoreReport_t* reports, int reportCount)
+{
+    if(!lora_gateway_notify_stored_callback) return;
+
+    for(int i=0; i<reportCount; i++)
+    {
+        lora_gateway_notify_stored_callback(reports[i].peerAddress, reports[i].request.payload, reports[i].request.requiresReply,
+            reports[i].replyPayload, reports[i].event, reports[i].ms);
+    }
+}
+
+// RAM first, then flash; false if both are full (the request is dropped)
+static bool store_request_locked(uint8_t peerAddress, GatewayQueuedRequest_t request, uint32_t now)
+{
+    GatewayPeer_t* peer = &s_peers[peerAddress];
+
+    if(!request.stored)
+    {
+        request.stored = true;
+        request.storedAtMs = now;
+        request.expiresAtMs = now + peer->storeTtlS * 1000UL;
+
+        peer->storeIn++;
+    }
+
+    for(int i=0; i<GATEWAY_STORE_RAM_SIZE; i++)
+    {
+        if(s_store[i].used) continue;
+
+        s_store[i].used = true;
+        s_store[i].peerAddress = peerAddress;
+        s_store[i].request = request;
+
+        peer->storedInRam++;
+
+        return true;
+    }
+
+    uint8_t data[LORA_FLASH_LOG_ITEM_SIZE];
+
+    encode_flash_item(data, peerAddress, request, now);
+
+    if(s_flash_log_mounted && lora_flash_log_append(&s_flash_log, data, NULL))
+    {
+        peer->storedInFlash++;
+
+        return true;
+    }
+
+    peer->storeDropped++;
+
+    return false;
+}
+
+typedef struct
+{
+    uint8_t peerAddress;
+    bool queriesOnly;
+    bool found;
+    LoraFlashLogItem_t item;
+
+} GatewayFlashSearch_t;
+
+static bool find_flash_item_visitor(const LoraFlashLogItem_t* item, void* context)
+{
+    GatewayFlashSearch_t* search = (GatewayFlashSearch_t*)context;
+
+    if(item->data[0] != search->peerAddress || (search->queriesOnly && item->data[1] == 0)) return true;
+
+    search->item = *item;
+    search->found = true;
+
+    return false;
+}
+
+// Oldest stored request of a peer, RAM before flash (flash items are older than the RAM ones unless RAM was freed meanwhile)
+static bool take_stored_request_locked(uint8_t peerAddress, bool queriesOnly, uint32_t now, GatewayQueuedRequest_t* outRequest)
+{
+    GatewayPeer_t* peer = &s_peers[peerAddress];
+
+    int oldest=-1;
+
+    for(int i=0; i<GATEWAY_STORE_RAM_SIZE; i++)
+    {
+        if(!s_store[i].used || s_store[i].peerAddress != peerAddress || (queriesOnly && !s_store[i].request.requiresReply)) continue;
+
+        if(oldest < 0 || (int32_t)(s_store[i].request.storedAtMs - s_store[oldest].request.storedAtMs) < 0) oldest = i;
+    }
+
+    if(oldest >= 0)
+    {
+        *outRequest = s_store[oldest].request;
+
+        s_store[oldest].used = false;
+        peer->storedInRam--;
+
+        return true;
+    }
+
+    if(peer->storedInFlash == 0) return false;
+
+    GatewayFlashSearch_t search = { peerAddress, queriesOnly, false, {} };
+
+    lora_flash_log_for_each(&s_flash_log, find_flash_item_visitor, &search);
+
+    if(!search.found || !lora_flash_log_remove(&s_flash_log, search.item.id)) return false;
+
+    decode_flash_item(search.item.data, outRequest, now);
+
+    peer->storedInFlash--;
+
+    return true;
+}
+
+typedef struct
+{
+    uint32_t now;
+    int count;
+    LoraFlashLogItem_t items[GATEWAY_STORE_REPORTS_PER_CYCLE];
+
+} GatewayFlashExpiry_t;
+
+static bool find_expired_flash_item_visitor(const LoraFlashLogItem_t* item, void* context)
+{
+    GatewayFlashExpiry_t* expiry = (GatewayFlashExpiry_t*)context;
+
+    GatewayQueuedRequest_t request;
+
+    decode_flash_item(item->data, &request, expiry->now);
+
+    if((int32_t)(expiry->now - request.expiresAtMs) >= 0) expiry->items[expiry->count++] = *item;
+
+    return expiry->count < GATEWAY_STORE_REPORTS_PER_CYCLE;
+}
+
+static void expire_stored_requests_locked(uint32_t now, GatewayStoreReport_t* reports, int* reportCount)
+{
+    for(int i=0; i<GATEWAY_STORE_RAM_SIZE && *reportCount < GATEWAY_STORE_REPORTS_PER_CYCLE; i++)
+    {
+        if(!s_store[i].used || (int32_t)(now - s_store[i].request.expiresAtMs) < 0) continue;
+
+        GatewayPeer_t* peer = &s_peers[s_store[i].peerAddress];
+
+        s_store[i].used = false;
+        peer->storedInRam--;
+        peer->storeExpired++;
+
+        add_store_report(reports, reportCount, s_store[i].peerAddress, s_store[i].request, 0xFFFF, GATEWAY_STORE_EXPIRED, now - s_store[i].request.storedAtMs);
+    }
+
+    if(!s_flash_log_mounted || s_flash_log.liveCount == 0 || now - s_flash_expiry_checked_at_ms < GATEWAY_STORE_FLASH_EXPIRY_INTERVAL) return;
+
+    s_flash_expiry_checked_at_ms = now;
+
+    GatewayFlashExpiry_t expiry;
+
+    expiry.now = now;
+    expiry.count = 0;
+
+    lora_flash_log_for_each(&s_flash_log, find_expired_flash_item_visitor, &expiry);
+
+    for(int i=0; i<expiry.count && *reportCount < GATEWAY_STORE_REPORTS_PER_CYCLE; i++)
+    {
+        uint8_t peerAddress = expiry.items[i].data[0];
+
+        if(peerAddress >= GATEWAY_MAX_PEERS || !lora_flash_log_remove(&s_flash_log, expiry.items[i].id)) continue;
+
+        GatewayQueuedRequest_t request;
+
+        decode_flash_item(expiry.items[i].data, &request, now);
+
+        s_peers[peerAddress].storedInFlash--;
+        s_peers[peerAddress].storeExpired++;
+
+        add_store_report(reports, reportCount, peerAddress, request, 0xFFFF, GATEWAY_STORE_EXPIRED, now - request.storedAtMs);
+    }
+}
+
+static bool push_back_locked(GatewayPeer_t* peer, const GatewayQueuedRequest_t& request)
+{
+    if(peer->count == GATEWAY_PEER_QUEUE_SIZE) return false;
+
+    peer->queue[(peer->head + peer->count) % GATEWAY_PEER_QUEUE_SIZE] = request;
+    peer->count++;
+
+    return true;
+}
+
+// Reachable peers get their stored requests back in their queue (sleepy ones only while a downlink window is open),
+// unreachable ones get their new commands stored and, once their back-off is over, one stored query to find out whether they're awake
+static void forward_stored_requests_locked(uint32_t now, GatewayStoreReport_t* reports, int* reportCount)
+{
+    for(int address=1; address<GATEWAY_MAX_PEERS; address++)
+    {
+        GatewayPeer_t* peer = &s_peers[address];
+
+        GatewayQueuedRequest_t request;
+
+        if(peer->consecutiveFailures == 0)
+        {
+            if(!is_downlink_window_open(peer, now)) continue;
+
+            while(peer->count < GATEWAY_PEER_QUEUE_SIZE && take_stored_request_locked(address, false, now, &request))
+            {
+                request.enqueuedAtMs = now;
+
+                push_back_locked(peer, request);
+            }
+
+            continue;
+        }
+
+        if(!is_store_enabled(address)) continue;
+
+        for(uint8_t i=0, count=peer->count; i<count; i++)
+        {
+            request = peer->queue[peer->head];
+
+            peer->head = (peer->head + 1) % GATEWAY_PEER_QUEUE_SIZE;
+            peer->count--;
+
+            if(request.requiresReply || request.stored || *reportCount >= GATEWAY_STORE_REPORTS_PER_CYCLE)
+            {
+                push_back_locked(peer, request);
+
+                continue;
+            }
+
+            bool stored = store_request_locked(address, request, now);
+
+            add_store_report(reports, reportCount, address, request, 0xFFFF, stored ? GATEWAY_STORE_STORED : GATEWAY_STORE_DROPPED, stored ? peer->storeTtlS * 1000UL : 0);
+        }
+
+        if(peer->count == 0 && peer->inFlight == 0 && (int32_t)(now - peer->backoffUntilMs) >= 0 && take_stored_request_locked(address, true, now, &request))
+        {
+            request.enqueuedAtMs = now;
+
+            push_back_locked(peer, request);
+        }
+    }
+}
+
+// Kept for when the peer is heard again: the host gets the failure now and the reply later on, if it ever comes
+static void store_undelivered_request_locked(uint8_t peerAddress, const GatewayQueuedRequest_t& request, uint32_t now, GatewayStoreReport_t* reports, int* reportCount)
+{
+    GatewayPeer_t* peer = &s_peers[peerAddress];
+
+    if(request.stored && (int32_t)(now - request.expiresAtMs) >= 0)
+    {
+        peer->storeExpired++;
+
+        add_store_report(reports, reportCount, peerAddress, request, 0xFFFF, GATEWAY_STORE_EXPIRED, now - request.storedAtMs);
+    }
+    else if(request.stored || is_store_enabled(peerAddress))
+    {
+        bool stored = store_request_locked(peerAddress, request, now);
+
+        if(!request.stored || !stored)
+        {
+            add_store_report(reports, reportCount, peerAddress, request, 0xFFFF, stored ? GATEWAY_STORE_STORED : GATEWAY_STORE_DROPPED,
+                stored ? peer->storeTtlS * 1000UL : 0);
+        }
+    }
+}
+
+static void complete_request(int peerAddress, const GatewayQueuedRequest_t& request, int outcome, uint16_t replyPayload)
+{
+    s_peers_mutex.lock();
+
+    GatewayPeer_t* peer = &s_peers[peerAddress];
+
+    peer->inFlight--;
+
+    // Windows of a sleepy end device over before the request could go out: it waits for the next uplink
+    bool windowMissed = outcome == LORA_OUTCOME_NO_SLOT && peer->sleepy;
+
+    if(windowMissed) peer->windowUntilMs = s_gateway_timer.read_ms();
+
+    // Radio still busy with the frame on air of a bulk transfer (or with anything else): the urgent request is tried again first
+    if((outcome == LORA_OUTCOME_INVALID_STATE || windowMissed) && request.trafficClass == GATEWAY_TRAFFIC_URGENT && s_urgent_count < GATEWAY_URGENT_QUEUE_SIZE)
+    {
+        s_urgent_head = (s_urgent_head + GATEWAY_URGENT_QUEUE_SIZE - 1) % GATEWAY_URGENT_QUEUE_SIZE;
+        s_urgent_queue[s_urgent_head].peerAddress = peerAddress;
+        s_urgent_queue[s_urgent_head].request = request;
+        s_urgent_count++;
+
+        s_peers_mutex.unlock();
+
+        return;
+    }
+
+    if((outcome == LORA_OUTCOME_INVALID_STATE || windowMissed) && request.trafficClass == GATEWAY_TRAFFIC_NORMAL && peer->count < GATEWAY_PEER_QUEUE_SIZE)
+    {
+        // Radio busy serving an incoming request, or sleepy peer out of reach: put the request back in front of its queue
+        peer->head = (peer->head + GATEWAY_PEER_QUEUE_SIZE - 1) % GATEWAY_PEER_QUEUE_SIZE;
+        peer->queue[peer->head] = request;
+        peer->count++;
+
+        s_peers_mutex.unlock();
+
+        return;
+    }
+
+    uint32_t now = s_gateway_timer.read_ms();
+
+    GatewayStoreReport_t report;
+    int reportCount=0;
+
+    if(request.trafficClass == GATEWAY_TRAFFIC_URGENT)
+    {
+        uint32_t latency = now - request.enqueuedAtMs;
+
+        s_urgent_sent++;
+        s_urgent_latency_total_ms += latency;
+
+        if(latency > s_urgent_latency_max_ms) s_urgent_latency_max_ms = latency;
+    }
+
+    if(is_peer_failure_outcome(outcome))
+    {
+        // Slow or offline peer: back off, so that it doesn't steal airtime from the other peers
+        uint32_t backoff = GATEWAY_PEER_BACKOFF_BASE << (peer->consecutiveFailures < 4 ? peer->consecutiveFailures : 4);
+
+        if(backoff > GATEWAY_PEER_BACKOFF_MAX) backoff = GATEWAY_PEER_BACKOFF_MAX;
+
+        peer->consecutiveFailures++;
+        peer->backoffUntilMs = now + backoff;
+        peer->failed++;
+
+        store_undelivered_request_locked(peerAddress, request, now, &report, &reportCount);
+    }
+    else
+    {
+        peer->consecutiveFailures = 0;
+        peer->sent++;
+
+        if(request.stored)
+        {
+            uint32_t latency = now - request.storedAtMs;
+
+            peer->storeDelivered++;
+            peer->redeliveryTotalMs += latency;
+
+            if(latency > peer->redeliveryMaxMs) peer->redeliveryMaxMs = latency;
+
+            add_store_report(&report, &reportCount, peerAddress, request, request.requiresReply ? replyPayload : 0xFFFF, GATEWAY_STORE_DELIVERED, latency);
+        }
+    }
+
+    s_peers_mutex.unlock();
+
+    if(!request.stored) notify_completion(peerAddress, request, replyPayload, outcome);
+
+    notify_store_reports(&report, reportCount);
+}
+
+// First urgent request whose peer can be reached right now (back-off doesn't hold it), -1 if none
+static int take_urgent_request_locked(uint32_t now, GatewayQueuedRequest_t* outRequest)
+{
+    for(uint8_t i=0; i<s_urgent_count; i++)
+    {
+        uint8_t index = (s_urgent_head + i) % GATEWAY_URGENT_QUEUE_SIZE;
+        uint8_t peerAddress = s_urgent_queue[index].peerAddress;
+
+        GatewayPeer_t* peer = &s_peers[peerAddress];
+
+        if(peer->inFlight >= GATEWAY_PEER_MAX_IN_FLIGHT || !is_downlink_window_open(peer, now)) continue;
+
+        *outRequest = s_urgent_queue[index].request;
+
+        // The ones before it keep their order
+        for(uint8_t j=i; j>0; j--)
+        {
+            s_urgent_queue[(s_urgent_head + j) % GATEWAY_URGENT_QUEUE_SIZE] = s_urgent_queue[(s_urgent_head + j - 1) % GATEWAY_URGENT_QUEUE_SIZE];
+        }
+
+        s_urgent_head = (s_urgent_head + 1) % GATEWAY_URGENT_QUEUE_SIZE;
+        s_urgent_count--;
+
+        peer->inFlight++;
+
+        return peerAddress;
+    }
+
+    return -1;
+}
+
+void lora_gateway_event_proc_scheduler_cycle()
+{
+    GatewayQueuedRequest_t expired[GATEWAY_MAX_PEERS * GATEWAY_PEER_QUEUE_SIZE];
+    uint8_t expiredPeerAddresses[GATEWAY_MAX_PEERS * GATEWAY_PEER_QUEUE_SIZE];
+    int expiredCount=0;
+
+    GatewayStoreReport_t reports[GATEWAY_STORE_REPORTS_PER_CYCLE];
+    int reportCount=0;
+
+    s_peers_mutex.lock();
+
+    uint32_t now = s_gateway_timer.read_ms();
+
+    // Drop requests which waited too long in their peer queue (to the store, if enabled), a few per cycle if they have to be reported
+    for(int address=0; address<GATEWAY_MAX_PEERS; address++)
+    {
+        GatewayPeer_t* peer = &s_peers[address];
+
+        while(peer->count > 0 && now - peer->queue[peer->head].enqueuedAtMs > GATEWAY_PEER_QUEUE_TIMEOUT && reportCount < GATEWAY_STORE_REPORTS_PER_CYCLE)
+        {
+            GatewayQueuedRequest_t* request = &peer->queue[peer->head];
+
+            if(!request->stored)
+            {
+                expired[expiredCount] = *request;
+                expiredPeerAddresses[expiredCount] = address;
+                expiredCount++;
+            }
+
+            store_undelivered_request_locked(address, *request, now, reports, &reportCount);
+
+            peer->head = (peer->head + 1) % GATEWAY_PEER_QUEUE_SIZE;
+            peer->count--;
+            peer->expired++;
+        }
+    }
+
+    while(s_urgent_count > 0 && now - s_urgent_queue[s_urgent_head].request.enqueuedAtMs > GATEWAY_PEER_QUEUE_TIMEOUT && expiredCount < GATEWAY_MAX_PEERS * GATEWAY_PEER_QUEUE_SIZE)
+    {
+        expired[expiredCount] = s_urgent_queue[s_urgent_head].request;
+        expiredPeerAddresses[expiredCount] = s_urgent_queue[s_urgent_head].peerAddress;
+        expiredCount++;
+
+        s_urgent_head = (s_urgent_head + 1) % GATEWAY_URGENT_QUEUE_SIZE;
+        s_urgent_count--;
+        s_urgent_expired++;
+    }
+
+    expire_stored_requests_locked(now, reports, &reportCount);
+
+    forward_stored_requests_locked(now, reports, &reportCount);
+
+    GatewayQueuedRequest_t request;
+
+    int selectedAddress = s_pending_peer_address < 0 ? take_urgent_request_locked(now, &request) : -1;
+    bool urgentSelected = selectedAddress >= 0;
+
+    // Urgent requests waiting for a bulk transfer on air: it steps aside at the end of its current frame
+    bool preemptBulk = (selectedAddress >= 0 || s_urgent_count > 0) && s_bulk_state == GATEWAY_BULK_SENDING;
+
+    // Smooth weighted round robin among the peers which have something to send and aren't backing off; a bulk transfer
+    // being sent isn't preempted by them
+    int32_t totalWeight=0;
+    bool normalSelected=false;
+
+    for(int address=0; address<GATEWAY_MAX_PEERS && s_pending_peer_address < 0 && !urgentSelected && s_bulk_state != GATEWAY_BULK_SENDING; address++)
+    {
+        GatewayPeer_t* peer = &s_peers[address];
+
+        if(!is_peer_eligible(peer, now)) continue;
+
+        peer->currentWeight += peer->weight;
+        totalWeight += peer->weight;
+
+        if(!normalSelected || peer->currentWeight > s_peers[selectedAddress].currentWeight) selectedAddress = address;
+
+        normalSelected = true;
+    }
+
+    if(normalSelected)
+    {
+        GatewayPeer_t* peer = &s_peers[selectedAddress];
+
+        peer->currentWeight -= totalWeight;
+
+        request = peer->queue[peer->head];
+
+        peer->head = (peer->head + 1) % GATEWAY_PEER_QUEUE_SIZE;
+        peer->count--;
+        peer->inFlight++;
+    }
+
+    bool startBulk = selectedAddress < 0 && s_pending_peer_address < 0 && s_bulk_state == GATEWAY_BULK_WAITING;
+
+    if(startBulk) s_bulk_state = GATEWAY_BULK_SENDING;
+
+    s_peers_mutex.unlock();
+
+    for(int i=0; i<expiredCount; i++) notify_completion(expiredPeerAddresses[i], expired[i], 0xFFFF, LORA_OUTCOME_TIMEOUT_STUCK);
+
+    notify_store_reports(reports, reportCount);
+
+    if(preemptBulk) lora_state_machine_preempt_bulk();
+
+    if(startBulk)
+    {
+        // The blob is copied by the state machine as the transfer starts
+        int outcome = s_send_bulk_function(s_bulk_blob, s_bulk_size, s_bulk_address_mask);
+
+        if(outcome == LORA_OUTCOME_PENDING) return;
+
+        // Radio serving an incoming request: the transfer waits for the next cycle
+        if(outcome == LORA_OUTCOME_INVALID_STATE && lora_state_machine_get_busy_remaining_ms() > 0)
+        {
+            s_peers_mutex.lock();
+            s_bulk_state = GATEWAY_BULK_WAITING;
+            s_peers_mutex.unlock();
+
+            return;
+        }
+
+        lora_gateway_complete_bulk(outcome, 0);
+
+        return;
+    }
+
+    if(selectedAddress < 0) return;
+
+    uint16_t replyPayload=0xFFFF;
+
+    int outcome = s_send_request_function(request.payload, selectedAddress, request.requiresReply, &replyPayload);
+
+    if(outcome == LORA_OUTCOME_PENDING)
+    {
+        s_peers_mutex.lock();
+        s_pending_peer_address = selectedAddress;
+        s_pending_request = request;
+        s_peers_mutex.unlock();
+
+        return;
+    }
+
+    complete_request(selectedAddress, request, outcome, replyPayload);
+}
+
+void lora_gateway_complete_pending_request(int argOutcome, uint16_t argReplyPayload)
+{
+    s_peers_mutex.lock();
+
+    int peerAddress = s_pending_peer_address;
+    GatewayQueuedRequest_t request = s_pending_request;
+
+    s_pending_peer_address = -1;
+
+    s_peers_mutex.unlock();
+
+    if(peerAddress >= 0) complete_request(peerAddress, request, argOutcome, argReplyPayload);
+}
+
+void lora_gateway_complete_bulk(int argOutcome, uint16_t argCompletedMask)
+{
+    s_peers_mutex.lock();
+
+    if(s_bulk_state != GATEWAY_BULK_SENDING)
+    {
+        s_peers_mutex.unlock();
+
+        return;
+    }
+
+    uint16_t addressMask = s_bulk_address_mask;
+
+    s_bulk_state = GATEWAY_BULK_IDLE;
+    s_bulk_sent++;
+
+    s_peers_mutex.unlock();
+
+    if(lora_gateway_notify_bulk_completion_callback) lora_gateway_notify_bulk_completion_callback(addressMask, argOutcome, argCompletedMask);
+}
+
+void lora_gateway_fill_with_status_dump(char* destBuffer, size_t destBufferSize)
+{
+    int len=0;
+
+    destBuffer[0]='\0';
+
+    s_peers_mutex.lock();
+
+    uint32_t now = s_gateway_timer.read_ms();
+
+    for(int address=0; address<GATEWAY_MAX_PEERS && len < (int)destBufferSize; address++)
+    {
+        GatewayPeer_t* peer = &s_peers[address];
+
+        if(peer->count == 0 && peer->sent == 0 && peer->failed == 0 && peer->expired == 0 && peer->rejected == 0) continue;
+
+        int32_t backoffLeft = (int32_t)(peer->backoffUntilMs - now);
+
+        len += snprintf(destBuffer + len, destBufferSize - len, "%s%d:q=%u,f=%u,w=%u,ok=%lu,ko=%lu,exp=%lu,rej=%lu,bo=%ld",
+            len ? ";" : "", address, peer->count, peer->inFlight, peer->weight,
+            (unsigned long)peer->sent, (unsigned long)peer->failed, (unsigned long)peer->expired, (unsigned long)peer->rejected,
+            (long)(backoffLeft > 0 ? backoffLeft : 0));
+    }
+
+    // Urgent class (latency from enqueue to outcome, average/max) and bulk transfers (waiting, sending or idle)
+    if((s_urgent_count > 0 || s_urgent_sent > 0 || s_urgent_rejected > 0 || s_urgent_expired > 0) && len < (int)destBufferSize)
+    {
+        len += snprintf(destBuffer + len, destBufferSize - len, "%su:q=%u,ok=%lu,rej=%lu,exp=%lu,lat=%lu/%lu", len ? ";" : "",
+            s_urgent_count, (unsigned long)s_urgent_sent, (unsigned long)s_urgent_rejected, (unsigned long)s_urgent_expired,
+            (unsigned long)(s_urgent_sent ? s_urgent_latency_total_ms / s_urgent_sent : 0), (unsigned long)s_urgent_latency_max_ms);
+    }
+
+    if((s_bulk_state != GATEWAY_BULK_IDLE || s_bulk_sent > 0) && len < (int)destBufferSize)
+    {
+        len += snprintf(destBuffer + len, destBufferSize - len, "%sb:%c,ok=%lu", len ? ";" : "",
+            s_bulk_state == GATEWAY_BULK_SENDING ? 's' : s_bulk_state == GATEWAY_BULK_WAITING ? 'w' : '-', (unsigned long)s_bulk_sent);
+    }
+
+    s_peers_mutex.unlock();
+}
+
+void lora_gateway_fill_with_store_dump(char* destBuffer, size_t destBufferSize)
+{
+    s_peers_mutex.lock();
+
+    int storedInRam=0;
+
+    for(int i=0; i<GATEWAY_STORE_RAM_SIZE; i++) if(s_store[i].used) storedInRam++;
+
+    int len = snprintf(destBuffer, destBufferSize, "ram=%d/%d", storedInRam, GATEWAY_STORE_RAM_SIZE);
+
+    if(s_flash_log_mounted && len < (int)destBufferSize)
+    {
+        len += snprintf(destBuffer + len, destBufferSize - len, ",flash=%u/%u,er=%lu,cmp=%lu,perr=%lu",
+            s_flash_log.liveCount, lora_flash_log_get_capacity(&s_flash_log),
+            (unsigned long)s_flash_log.erases, (unsigned long)s_flash_log.compactions, (unsigned long)s_flash_log.programErrors);
+    }
+
+    for(int address=1; address<GATEWAY_MAX_PEERS && len < (int)destBufferSize; address++)
+    {
+        GatewayPeer_t* peer = &s_peers[address];
+
+        if(peer->storeIn == 0 && peer->heard == 0) continue;
+
+        len += snprintf(destBuffer + len, destBufferSize - len, ";%d:ttl=%u,in=%lu,ok=%lu,exp=%lu,drop=%lu,now=%u+%u,lat=%lu/%lu,heard=%lu",
+            address, peer->storeTtlS, (unsigned long)peer->storeIn, (unsigned long)peer->storeDelivered, (unsigned long)peer->storeExpired,
+            (unsigned long)peer->storeDropped, peer->storedInRam, peer->storedInFlash,
+            (unsigned long)(peer->storeDelivered ? peer->redeliveryTotalMs / peer->storeDelivered : 0), (unsigned long)peer->redeliveryMaxMs,
+            (unsigned long)peer->heard);
+    }
+
+    s_peers_mutex.unlock();
+}
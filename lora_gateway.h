@@ -0,0 +1,118 @@
+#ifndef __LORA_GATEWAY_H__
+#define __LORA_GATEWAY_H__
+
+#define GATEWAY_MAX_PEERS                   16      // peer 0 collects broadcast commands
+#define GATEWAY_PEER_QUEUE_SIZE             4
+#define GATEWAY_PEER_MAX_IN_FLIGHT          1
+#define GATEWAY_PEER_QUEUE_TIMEOUT          15000   // in ms, queued requests older than this are dropped
+#define GATEWAY_PEER_BACKOFF_BASE           1000    // in ms, doubled at each consecutive failure of the same peer
+#define GATEWAY_PEER_BACKOFF_MAX            16000   // in ms
+#define GATEWAY_SCHEDULER_CYCLE_INTERVAL    20      // in ms
+#define GATEWAY_URGENT_QUEUE_SIZE           4       // urgent requests, all peers
+
+// Store-and-forward: a request for a node which doesn't answer is kept until the node is heard again (any frame from it)
+// or answers a query retried after its back-off; commands for such a node are stored without being sent
+#define GATEWAY_STORE_TTL                   600     // in s, default expiry of a stored request (0 disables), per node with lora_gateway_set_peer_store_ttl()
+#define GATEWAY_STORE_RAM_SIZE              16      // stored requests in RAM, all nodes
+#define GATEWAY_STORE_FLASH_ENABLED         0       // when RAM is full, spill to the last two sectors of the internal flash (kept across resets)
+#define GATEWAY_STORE_FLASH_EXPIRY_INTERVAL 1000    // in ms, how often requests stored in flash are checked for expiry
+#define GATEWAY_STORE_REPORTS_PER_CYCLE     8       // store events notified per scheduler cycle, the others wait for the next one
+
+// Traffic classes, in strict priority order: urgent requests go first (a bulk transfer being sent steps aside for them
+// between two of its frames, see lora_state_machine_preempt_bulk()), then the peer queues (weighted round robin), and a
+// bulk transfer starts only when nothing else can go; a transaction already on air is never cut short
+typedef enum
+{
+    GATEWAY_TRAFFIC_URGENT=0,
+    GATEWAY_TRAFFIC_NORMAL=1,
+    GATEWAY_TRAFFIC_BULK=2,
+
+} GatewayTrafficClasses_t;
+
+typedef enum
+{
+    GATEWAY_STORE_STORED=0,                 // ms = time to live
+    GATEWAY_STORE_DELIVERED=1,              // ms = time spent in the store
+    GATEWAY_STORE_EXPIRED=2,                // ms = time spent in the store
+    GATEWAY_STORE_DROPPED=3,                // store full
+
+} GatewayStoreEvents_t;
+
+// (payload, destination address, requires reply, out reply payload) -> LoraReplyOutcomes_t
+// LORA_OUTCOME_PENDING if the request was started without blocking: its outcome then comes through lora_gateway_complete_pending_request()
+typedef int (*lora_gateway_send_request_function_t)(uint16_t, uint8_t, bool, uint16_t*);
+
+// (blob, size, address mask) -> LoraReplyOutcomes_t, LORA_OUTCOME_PENDING if the transfer started: its outcome then comes
+// through lora_gateway_complete_bulk()
+typedef int (*lora_gateway_send_bulk_function_t)(const uint8_t*, uint16_t, uint16_t);
+
+typedef struct
+{
+    uint16_t payload;
+    uint8_t destinationAddress;
+    bool requiresReply;
+    uint16_t tag;                           // handed back with the completion, 0 for a request on its own
+
+} GatewayRequest_t;
+
+// (peer address, request payload, requires reply, reply payload, outcome, tag)
+typedef void (*lora_gateway_notify_completion_callback_t)(uint8_t, uint16_t, bool, uint16_t, int, uint16_t);
+
+// (peer address, request payload, requires reply, reply payload, event, ms)
+typedef void (*lora_gateway_notify_stored_callback_t)(uint8_t, uint16_t, bool, uint16_t, GatewayStoreEvents_t, uint32_t);
+
+// (address mask, outcome, mask of the nodes which rebuilt the blob) of a bulk transfer
+typedef void (*lora_gateway_notify_bulk_completion_callback_t)(uint16_t, int, uint16_t);
+
+extern lora_gateway_notify_completion_callback_t lora_gateway_notify_completion_callback;
+extern lora_gateway_notify_stored_callback_t lora_gateway_notify_stored_callback;
+extern lora_gateway_notify_bulk_completion_callback_t lora_gateway_notify_bulk_completion_callback;
+
+void lora_gateway_initialize(lora_gateway_send_request_function_t sendRequestFunction, lora_gateway_send_bulk_function_t sendBulkFunction);
+bool lora_gateway_enqueue_request(uint16_t argPayload, uint8_t argDestinationAddress, bool argRequiresReply);
+
+/*!
+ * @brief Enqueues a request of the urgent class (e.g. an actuator stop): sent before anything in the peer queues,
+ *        regardless of the back-off of its peer. False if the urgent queue is full
+ */
+bool lora_gateway_enqueue_urgent_request(uint16_t argPayload, uint8_t argDestinationAddress, bool argRequiresReply);
+
+/*!
+ * @brief Enqueues a bulk transfer (the blob is copied), started once no urgent or queued request can go; false if
+ *        another one is still waiting or being sent
+ */
+bool lora_gateway_enqueue_bulk(const uint8_t* argBlob, uint16_t argSize, uint16_t argAddressMask);
+
+/*!
+ * @brief Enqueues the requests of a batch together, so that none waits for the host to write the next one; outQueued
+ *        tells which ones found room in the queue of their peer. Returns how many did
+ */
+uint8_t lora_gateway_enqueue_batch(const GatewayRequest_t* argRequests, uint8_t argCount, bool* outQueued);
+bool lora_gateway_set_peer_weight(uint8_t argPeerAddress, uint8_t argWeight);
+
+/*!
+ * @brief Free slots in the queue of a peer; when there are none, outRetryAfterMs estimates when one frees up
+ *        (back-off left, then one transaction of transactionMs)
+ */
+uint8_t lora_gateway_get_peer_credits(uint8_t argPeerAddress, uint32_t argTransactionMs, uint32_t* outRetryAfterMs);
+
+/*!
+ * @brief A frame from the peer was received: it is awake, its stored requests are sent again right away; a sleepy end
+ *        device only gets them within argDownlinkWindowMs (its downlink windows), one per uplink
+ */
+void lora_gateway_notify_peer_heard(uint8_t argPeerAddress, bool argSleepy, uint32_t argDownlinkWindowMs);
+bool lora_gateway_set_peer_store_ttl(uint8_t argPeerAddress, uint16_t argTtlS);
+
+/*!
+ * @brief Requests queued or stored for a peer, announced to sleepy end devices so that they poll again right away
+ */
+uint16_t lora_gateway_get_peer_pending_count(uint8_t argPeerAddress);
+
+void lora_gateway_event_proc_scheduler_cycle();
+void lora_gateway_complete_pending_request(int argOutcome, uint16_t argReplyPayload);
+void lora_gateway_complete_bulk(int argOutcome, uint16_t argCompletedMask);
+
+void lora_gateway_fill_with_status_dump(char* destBuffer, size_t destBufferSize);
+void lora_gateway_fill_with_store_dump(char* destBuffer, size_t destBufferSize);
+
+#endif // __LORA_GATEWAY_H__
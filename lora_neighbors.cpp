@@ -0,0 +1,142 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "lora_config.h"
+
+#include "lora_neighbors.h"
+
+static_assert(LORA_DISCOVERY_BEACON_JITTER < LORA_DISCOVERY_BEACON_INTERVAL, "hello jitter must be shorter than its interval");
+static_assert(LORA_NEIGHBOR_MAX_AGE > LORA_DISCOVERY_BEACON_INTERVAL + LORA_DISCOVERY_BEACON_JITTER, "neighbors would age out between two hello frames");
+static_assert(LORA_NEIGHBOR_MAX_AGE > LORA_SLEEPY_POLL_INTERVAL, "sleepy end devices would age out between two polls");
+
+static LoraNeighbor_t s_neighbors[LORA_NEIGHBOR_MAX_ADDRESS+1];
+
+static uint8_t s_my_address;
+
+static bool is_valid_address(uint8_t address)
+{
+    return address > 0 && address <= LORA_NEIGHBOR_MAX_ADDRESS && address != s_my_address;
+}
+
+static bool is_entry_live(const LoraNeighbor_t* neighbor, uint32_t nowMs)
+{
+    return neighbor->used && nowMs - neighbor->lastHeardMs <= LORA_NEIGHBOR_MAX_AGE;
+}
+
+void lora_neighbors_initialize(uint8_t myAddress)
+{
+    s_my_address = myAddress;
+
+    memset(s_neighbors, 0, sizeof(s_neighbors));
+}
+
+bool lora_neighbors_update_heard(uint8_t address, int16_t rssi, int8_t snr, uint32_t nowMs)
+{
+    if(!is_valid_address(address)) return false;
+
+    LoraNeighbor_t* neighbor = &s_neighbors[address];
+
+    bool isNew = !is_entry_live(neighbor, nowMs);
+
+    if(isNew)
+    {
+        // Back in range after aging out: what was learned before may not hold anymore
+        memset(neighbor, 0, sizeof(LoraNeighbor_t));
+
+        neighbor->used = true;
+        neighbor->firstHeardMs = nowMs;
+        neighbor->rssi = rssi;
+        neighbor->snr = snr;
+    }
+    else
+    {
+        neighbor->rssi = (3 * neighbor->rssi + rssi) / 4;
+        neighbor->snr = (3 * neighbor->snr + snr) / 4;
+    }
+
+    neighbor->lastHeardMs = nowMs;
+    neighbor->framesHeard++;
+
+    return isNew;
+}
+
+void lora_neighbors_update_beacon(uint8_t address, uint8_t capabilities, uint16_t sequence, uint16_t neighborMask, uint32_t nowMs)
+{
+    if(!is_valid_address(address) || !is_entry_live(&s_neighbors[address], nowMs)) return;
+
+    LoraNeighbor_t* neighbor = &s_neighbors[address];
+
+    if(neighbor->beaconHeard)
+    {
+        uint16_t distance = sequence - neighbor->latestBeaconSequence;
+
+        // A wider jump (or going back) is a reboot of the neighbor rather than lost beacons
+        if(distance > 1 && distance <= LORA_MISSED_SEQUENCE_MAX_GAP) neighbor->beaconsMissed += distance - 1;
+    }
+
+    neighbor->beaconHeard = true;
+    neighbor->capabilities = capabilities | (neighbor->capabilities & LORA_NEIGHBOR_CAPABILITY_SLEEPY);
+    neighbor->neighborMask = neighborMask;
+    neighbor->latestBeaconSequence = sequence;
+    neighbor->beaconsHeard++;
+}
+
+void lora_neighbors_add_capabilities(uint8_t address, uint8_t capabilities)
+{
+    if(!is_valid_address(address) || !s_neighbors[address].used) return;
+
+    s_neighbors[address].capabilities |= capabilities;
+}
+
+bool lora_neighbors_is_known(uint8_t address, uint32_t nowMs)
+{
+    return is_valid_address(address) && is_entry_live(&s_neighbors[address], nowMs);
+}
+
+bool lora_neighbors_get(uint8_t address, uint32_t nowMs, LoraNeighbor_t* outNeighbor)
+{
+    if(!lora_neighbors_is_known(address, nowMs)) return false;
+
+    *outNeighbor = s_neighbors[address];
+
+    return true;
+}
+
+uint16_t lora_neighbors_get_mask(uint32_t nowMs)
+{
+    uint16_t mask=0;
+
+    for(uint8_t address=1; address<=LORA_NEIGHBOR_MAX_ADDRESS; address++)
+    {
+        if(!s_neighbors[address].used) continue;
+
+        if(is_entry_live(&s_neighbors[address], nowMs)) mask |= 1 << address;
+        else s_neighbors[address].used = false;
+    }
+
+    return mask;
+}
+
+void lora_neighbors_fill_with_table_dump(char* destBuffer, size_t destBufferSize, uint32_t nowMs)
+{
+    size_t len=0;
+
+    destBuffer[0]='\0';
+
+    for(uint8_t address=1; address<=LORA_NEIGHBOR_MAX_ADDRESS && len<destBufferSize; address++)
+    {
+        const LoraNeighbor_t* neighbor = &s_neighbors[address];
+
+        if(!is_entry_live(neighbor, nowMs)) continue;
+
+        uint32_t beaconsExpected = neighbor->beaconsHeard + neighbor->beaconsMissed;
+        int deliveryPercent = beaconsExpected > 0 ? (int)(100 * neighbor->beaconsHeard / beaconsExpected) : -1;
+        int symmetric = neighbor->beaconHeard ? ((neighbor->neighborMask & (1 << s_my_address)) != 0 ? 1 : 0) : -1;
+
+        len += snprintf(destBuffer + len, destBufferSize - len, "%s%u:%d/%d/%X/%lu/%d/%d", len > 0 ? "," : "", address,
+            neighbor->rssi, neighbor->snr, neighbor->capabilities, (unsigned long)((nowMs - neighbor->lastHeardMs) / 1000), deliveryPercent, symmetric);
+    }
+
+    if(len == 0) snprintf(destBuffer, destBufferSize, "none");
+}
@@ -0,0 +1,67 @@
+#ifndef __LORA_NEIGHBORS_H__
+#define __LORA_NEIGHBORS_H__
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Table of the nodes in range, fed by every frame heard (address, signal) and by their discovery beacons (HELLO frames:
+ * capabilities, beacon sequence for the delivery ratio, mask of the nodes they hear for the link symmetry).
+ * Entries age out LORA_NEIGHBOR_MAX_AGE ms after the latest frame heard from the node.
+ */
+
+#define LORA_NEIGHBOR_MAX_ADDRESS               15      // same address space as gather masks
+
+// Capabilities advertised in the HELLO frame
+#define LORA_NEIGHBOR_CAPABILITY_GATEWAY        0x01    // node wired to the server (gateway mode)
+#define LORA_NEIGHBOR_CAPABILITY_SLEEPY         0x02    // sleepy end device, reachable only in its downlink windows (learned from its polls)
+#define LORA_NEIGHBOR_CAPABILITY_TDMA           0x04
+#define LORA_NEIGHBOR_CAPABILITY_CONTINUOUS_RX  0x08
+#define LORA_NEIGHBOR_CAPABILITY_PIGGYBACK      0x10
+
+typedef struct
+{
+    bool used;
+    bool beaconHeard;                   // capabilities and neighbor mask are only known from a HELLO frame
+    uint8_t capabilities;
+    uint16_t neighborMask;              // nodes the neighbor hears, as advertised in its latest HELLO frame
+    int16_t rssi;                       // smoothed over the frames heard (1/4 weight to the newest one)
+    int8_t snr;
+    uint32_t firstHeardMs;
+    uint32_t lastHeardMs;
+    uint32_t framesHeard;
+    uint16_t latestBeaconSequence;
+    uint32_t beaconsHeard;
+    uint32_t beaconsMissed;             // sequence gaps between consecutive HELLO frames
+
+} LoraNeighbor_t;
+
+void lora_neighbors_initialize(uint8_t myAddress);
+
+/*!
+ * @brief Any frame from the node: refreshes its entry (adding it if new), returns true if the node was unknown or aged out
+ */
+bool lora_neighbors_update_heard(uint8_t address, int16_t rssi, int8_t snr, uint32_t nowMs);
+
+/*!
+ * @brief HELLO frame from the node, after lora_neighbors_update_heard() for the same frame
+ */
+void lora_neighbors_update_beacon(uint8_t address, uint8_t capabilities, uint16_t sequence, uint16_t neighborMask, uint32_t nowMs);
+
+void lora_neighbors_add_capabilities(uint8_t address, uint8_t capabilities);
+
+bool lora_neighbors_is_known(uint8_t address, uint32_t nowMs);
+bool lora_neighbors_get(uint8_t address, uint32_t nowMs, LoraNeighbor_t* outNeighbor);
+
+/*!
+ * @brief Addresses of the nodes in range, bit per address; aged out entries are dropped on the way
+ */
+uint16_t lora_neighbors_get_mask(uint32_t nowMs);
+
+/*!
+ * @brief "<address>:<rssi>/<snr>/<capabilities>/<age s>/<delivery %>/<symmetric>,..." (delivery -1 without HELLO frames,
+ *        symmetric 1 if the node hears us, 0 if it doesn't, -1 if unknown)
+ */
+void lora_neighbors_fill_with_table_dump(char* destBuffer, size_t destBufferSize, uint32_t nowMs);
+
+#endif // __LORA_NEIGHBORS_H__
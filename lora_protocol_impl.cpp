@@ -5,6 +5,8 @@
 
 #include "lora_protocol_impl.h"
 
+#include "lora_bulk.h"
+
 #define lora_protocol_BUFFER_SIZE 32
 
 static uint16_t RxBufferSize = lora_protocol_BUFFER_SIZE;
@@ -15,14 +17,76 @@ static uint8_t DestinationAddress=0;
 static uint16_t Counter=0, LatestReceivedRequestCounter=0, LatestReceivedReplyCounter=0;
 static uint8_t LatestReceivedRequestDestinationAddress=0, LatestReceivedRequestSourceAddress=0;
 static uint8_t LatestReceivedReplyDestinationAddress=0, LatestReceivedReplySourceAddress=0;
+static uint16_t LatestReceivedRequestGatherMask=0;
+static uint8_t LatestReceivedRequestSequence=0, LatestReceivedReplySequence=0;
+static uint16_t LatestReceivedBeaconSequence=0;
+static uint8_t LatestReceivedBeaconSourceAddress=0;
+static char LatestReceivedBeaconSlotMap[lora_protocol_BUFFER_SIZE];
 
 static uint8_t MyAddress;
 
 static const uint8_t CommandMsg[] = "COMMAND-";
 static const uint8_t RequestMsg[] = "QUERY-";
 static const uint8_t ReplyMsg[] = "RESPONSE-";
+static const uint8_t GatherMsg[] = "GATHER-";
+static const uint8_t BeaconMsg[] = "BEACON-";
+static const uint8_t PollMsg[] = "POLL-";
+static const uint8_t HelloMsg[] = "HELLO-";
+static const uint8_t BulkMsg[] = "BULK-";
+static const uint8_t BulkPollMsg[] = "BULKS-";
+static const uint8_t BulkReportMsg[] = "BULKR-";
+
+// A reply may carry a query for the node it answers: "RESPONSE-reply|src|dst|seq+query:query seq"
+// (older parsers stop at '+' and simply see a plain reply)
+#define PIGGYBACK_SEPARATOR '+'
+#define PIGGYBACK_SEQUENCE_SEPARATOR ':'
+
+static bool LatestReceivedReplyCarriesRequest=false;
+static uint16_t LatestReceivedReplyRequestCounter=0;
+static uint8_t LatestReceivedReplyRequestSequence=0;
+
+// Latest received request came riding on a reply instead of a frame of its own
+static bool s_latest_received_request_piggybacked=false;
+
+// A request for a sleepy end device may end with "|1" (fifth field): more downlinks are waiting for it
+static bool LatestReceivedRequestMoreData=false;
 
 static bool s_latest_sent_request_requires_reply=false;
+static uint16_t s_latest_sent_gather_mask=0;
+
+// Sequence number of the latest new request (0 means "no sequence", sent by older firmwares)
+static uint8_t s_latest_sent_sequence=0;
+
+#define MAX_FRAME_FIELDS 6
+
+// Parses the '|' separated numeric fields following the frame type ("TYPE-f0|f1|f2|f3|f4"), returns how many were found
+static int parse_numeric_fields(uint32_t* fields, int maxFields)
+{
+    const char* ptr=strchr((const char*)RxBuffer,'-');
+
+    int count=0;
+
+    while(ptr && count<maxFields)
+    {
+        fields[count++]=strtoul(ptr+1, NULL, 10);
+
+        ptr=strchr(ptr+1,'|');
+    }
+
+    return count;
+}
+
+static uint8_t next_sequence()
+{
+    if(++s_latest_sent_sequence == 0) s_latest_sent_sequence = 1;
+
+    return s_latest_sent_sequence;
+}
+
+static bool is_received_data_a_gather()
+{
+    return strncmp((const char*)RxBuffer, (const char*)GatherMsg, strlen((const char*)GatherMsg)) == 0;
+}
 
 void lora_protocol_initialize(uint8_t myAddress)
 {
@@ -37,23 +101,63 @@ void lora_protocol_reset()
 
 bool lora_protocol_is_latest_received_request_for_me()
 {
+    if(is_received_data_a_gather()) return (LatestReceivedRequestGatherMask & (1 << MyAddress)) != 0;
+
     return LatestReceivedRequestDestinationAddress==MyAddress || LatestReceivedRequestDestinationAddress==0;
 }
 
 bool lora_protocol_should_i_reply_to_latest_received_request()
 {
-    return strncmp((const char*)RxBuffer, (const char*)RequestMsg, strlen((const char*)RequestMsg)) == 0 && 
-        LatestReceivedRequestDestinationAddress==MyAddress;
+    if(is_received_data_a_gather()) return (LatestReceivedRequestGatherMask & (1 << MyAddress)) != 0;
+
+    bool isQuery = s_latest_received_request_piggybacked || strncmp((const char*)RxBuffer, (const char*)RequestMsg, strlen((const char*)RequestMsg)) == 0;
+
+    return isQuery && LatestReceivedRequestDestinationAddress==MyAddress;
+}
+
+bool lora_protocol_is_latest_received_request_a_gather()
+{
+    return is_received_data_a_gather();
+}
+
+uint8_t lora_protocol_get_latest_received_request_gather_slot()
+{
+    // Slot index is the rank of my address among the addresses of the group
+    uint8_t slot=0;
+
+    for(uint8_t address=1; address<MyAddress; address++)
+    {
+        if(LatestReceivedRequestGatherMask & (1 << address)) slot++;
+    }
+
+    return slot;
 }
 
 bool lora_protocol_is_latest_received_reply_for_me()
 {
+    // A reply echoing another sequence number answers an older attempt
+    if(LatestReceivedReplySequence!=0 && LatestReceivedReplySequence!=s_latest_sent_sequence) return false;
+
     return LatestReceivedReplyDestinationAddress==MyAddress;
 }
 
 void lora_protocol_fill_create_reply_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t replyPayload)
 {
-    sprintf((char*)buffer, "%s%u|%u|%u",(const char*)ReplyMsg, replyPayload, MyAddress, LatestReceivedRequestSourceAddress);
+    snprintf((char*)buffer, bufferSize, "%s%u|%u|%u|%u",(const char*)ReplyMsg, replyPayload, MyAddress, LatestReceivedRequestSourceAddress, LatestReceivedRequestSequence);
+}
+
+bool lora_protocol_fill_create_reply_with_latest_request_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t replyPayload)
+{
+    int len=snprintf((char*)buffer, bufferSize, "%s%u|%u|%u|%u%c%u%c%u",(const char*)ReplyMsg, replyPayload, MyAddress, LatestReceivedRequestSourceAddress,
+        LatestReceivedRequestSequence, PIGGYBACK_SEPARATOR, Counter, PIGGYBACK_SEQUENCE_SEPARATOR, s_latest_sent_sequence);
+
+    // Received frames are clamped to lora_protocol_BUFFER_SIZE-1 characters
+    return len > 0 && len < bufferSize && len < lora_protocol_BUFFER_SIZE;
+}
+
+uint8_t lora_protocol_get_latest_received_request_sequence()
+{
+    return LatestReceivedRequestSequence;
 }
 
 bool lora_protocol_is_latest_received_reply_right()
@@ -87,61 +191,330 @@ void lora_protocol_fill_create_request_buffer(uint8_t* buffer, uint16_t bufferSi
     Counter=argCounter;
     DestinationAddress=argDestinationAddress;
 
-    sprintf((char*)buffer, "%s%u|%u|%u",(const char*)(argRequiresReply ? RequestMsg : CommandMsg), Counter, MyAddress, DestinationAddress);
+    snprintf((char*)buffer, bufferSize, "%s%u|%u|%u|%u",(const char*)(argRequiresReply ? RequestMsg : CommandMsg), Counter, MyAddress, DestinationAddress, next_sequence());
 
     s_latest_sent_request_requires_reply = argRequiresReply;
+    s_latest_sent_gather_mask = 0;
+}
+
+void lora_protocol_fill_create_gather_request_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argCounter, uint16_t argAddressMask)
+{
+    Counter=argCounter;
+    DestinationAddress=0;
+
+    snprintf((char*)buffer, bufferSize, "%s%u|%u|%u|%u",(const char*)GatherMsg, Counter, MyAddress, argAddressMask, next_sequence());
+
+    s_latest_sent_request_requires_reply = true;
+    s_latest_sent_gather_mask = argAddressMask;
 }
 
 bool lora_protocol_should_i_wait_for_reply_for_latest_sent_request()
 {
-    return s_latest_sent_request_requires_reply && DestinationAddress!=0;
+    return s_latest_sent_request_requires_reply && (DestinationAddress!=0 || s_latest_sent_gather_mask!=0);
+}
+
+uint8_t lora_protocol_get_latest_sent_request_destination_address()
+{
+    return DestinationAddress;
+}
+
+uint8_t lora_protocol_get_latest_sent_request_sequence()
+{
+    return s_latest_sent_sequence;
+}
+
+bool lora_protocol_is_latest_sent_request_a_gather()
+{
+    return s_latest_sent_gather_mask!=0;
+}
+
+uint16_t lora_protocol_get_latest_sent_gather_mask()
+{
+    return s_latest_sent_gather_mask;
 }
 
 void lora_protocol_process_received_data(uint8_t *payload, uint16_t size)
 {
+    if(size > lora_protocol_BUFFER_SIZE - 1) size = lora_protocol_BUFFER_SIZE - 1;
+
     RxBufferSize = size;
 
     memcpy( RxBuffer, payload, size );
+
+    RxBuffer[size] = '\0';
 }
 
 bool lora_protocol_is_received_data_a_request()
 {
     return strncmp((const char*)RxBuffer, (const char*)RequestMsg, strlen((const char*)RequestMsg)) == 0 ||
-        strncmp((const char*)RxBuffer, (const char*)CommandMsg, strlen((const char*)CommandMsg)) == 0;
+        strncmp((const char*)RxBuffer, (const char*)CommandMsg, strlen((const char*)CommandMsg)) == 0 ||
+        is_received_data_a_gather();
 }
 
 void lora_protocol_process_received_data_as_request()
 {
-    char* dashPtr=NULL;
-    char* pipePtr1=NULL;
-    char* pipePtr2=NULL;
-
-    dashPtr=strchr((const char*)RxBuffer,'-');
+    uint32_t fields[MAX_FRAME_FIELDS];
 
-    if(dashPtr)
-    {
-        pipePtr1=strchr(dashPtr+1,'|');
-
-        if(pipePtr1)
-        {
-            pipePtr2=strchr(pipePtr1+1,'|');
-        }
-    }
+    int count=parse_numeric_fields(fields, MAX_FRAME_FIELDS);
     
-    if(dashPtr && pipePtr1 && pipePtr2)
+    if(count >= 3)
     {
-        *pipePtr1='\0';
-        *pipePtr2='\0';
-        LatestReceivedRequestCounter=atoi(dashPtr+1);
-        LatestReceivedRequestSourceAddress=atoi(pipePtr1+1);
-        LatestReceivedRequestDestinationAddress=atoi(pipePtr2+1);
-        *pipePtr1='|';
-        *pipePtr2='|';
+        LatestReceivedRequestCounter=fields[0];
+        LatestReceivedRequestSourceAddress=fields[1];
+        LatestReceivedRequestDestinationAddress=fields[2];
+        LatestReceivedRequestGatherMask=is_received_data_a_gather() ? fields[2] : 0;
+        LatestReceivedRequestSequence=count >= 4 ? fields[3] : 0;
+        LatestReceivedRequestMoreData=count >= 5 && fields[4] != 0;
     }
     else
     {
         LatestReceivedRequestCounter=0;
+        LatestReceivedRequestGatherMask=0;
+        LatestReceivedRequestSequence=0;
+        LatestReceivedRequestMoreData=false;
     }
+
+    s_latest_received_request_piggybacked=false;
+}
+
+void lora_protocol_set_more_data_flag(uint8_t* buffer, uint16_t bufferSize)
+{
+    size_t len=strlen((const char*)buffer);
+
+    // Left out if it doesn't fit: the node simply polls again at its own pace
+    if(len + 2 < bufferSize && len + 2 < lora_protocol_BUFFER_SIZE) strcat((char*)buffer, "|1");
+}
+
+bool lora_protocol_does_latest_received_request_announce_more_data()
+{
+    return LatestReceivedRequestMoreData;
+}
+
+void lora_protocol_fill_create_poll_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argDestinationAddress, uint16_t argPollIntervalS)
+{
+    snprintf((char*)buffer, bufferSize, "%s%u|%u|%u",(const char*)PollMsg, argPollIntervalS, MyAddress, argDestinationAddress);
+}
+
+bool lora_protocol_is_received_data_a_poll()
+{
+    return strncmp((const char*)RxBuffer, (const char*)PollMsg, strlen((const char*)PollMsg)) == 0;
+}
+
+// Uplinks after which a sleepy sender opens its downlink windows: no reply window of its own follows them
+bool lora_protocol_does_received_data_open_downlink_windows()
+{
+    if(lora_protocol_is_received_data_a_poll()) return true;
+
+    if(strncmp((const char*)RxBuffer, (const char*)CommandMsg, strlen((const char*)CommandMsg)) == 0) return true;
+
+    return lora_protocol_is_received_data_a_reply() && strchr((const char*)RxBuffer, PIGGYBACK_SEPARATOR) == NULL;
+}
+
+// A channel mask of 0 leaves its field out (single channel, or not the gateway)
+void lora_protocol_fill_create_hello_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argCapabilities, uint16_t argSequence, uint16_t argNeighborMask, uint16_t argChannelMask)
+{
+    int len=snprintf((char*)buffer, bufferSize, "%s%u|%u|0|%u|%u",(const char*)HelloMsg, argCapabilities, MyAddress, argSequence, argNeighborMask);
+
+    if(argChannelMask != 0 && len > 0 && len < bufferSize) snprintf((char*)buffer + len, bufferSize - len, "|%u", argChannelMask);
+}
+
+bool lora_protocol_is_received_data_a_hello()
+{
+    return strncmp((const char*)RxBuffer, (const char*)HelloMsg, strlen((const char*)HelloMsg)) == 0;
+}
+
+// "HELLO-capabilities|src|0|sequence|neighbor mask"
+bool lora_protocol_get_received_hello(uint8_t* outSourceAddress, uint8_t* outCapabilities, uint16_t* outSequence, uint16_t* outNeighborMask)
+{
+    uint32_t fields[MAX_FRAME_FIELDS];
+
+    if(!lora_protocol_is_received_data_a_hello() || parse_numeric_fields(fields, MAX_FRAME_FIELDS) < 5) return false;
+
+    *outCapabilities=fields[0];
+    *outSourceAddress=fields[1];
+    *outSequence=fields[3];
+    *outNeighborMask=fields[4];
+
+    return true;
+}
+
+// "HELLO-capabilities|src|0|sequence|neighbor mask|channel mask": active channels, as advertised by the gateway
+bool lora_protocol_get_received_hello_channel_mask(uint16_t* outChannelMask)
+{
+    uint32_t fields[MAX_FRAME_FIELDS];
+
+    if(!lora_protocol_is_received_data_a_hello() || parse_numeric_fields(fields, MAX_FRAME_FIELDS) < 6) return false;
+
+    *outChannelMask=fields[5];
+
+    return true;
+}
+
+// Bytes as two uppercase hex digits each, the last field of the bulk frames
+static void fill_with_hex(char* dest, const uint8_t* bytes, uint8_t count)
+{
+    for(uint8_t i=0; i<count; i++) sprintf(dest + 2 * i, "%02X", bytes[i]);
+}
+
+static bool parse_hex(const char* text, uint8_t* outBytes, uint8_t count)
+{
+    for(uint8_t i=0; i<2*count; i++)
+    {
+        char c=text[i];
+        uint8_t nibble;
+
+        if(c >= '0' && c <= '9') nibble = c - '0';
+        else if(c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+        else return false;
+
+        outBytes[i / 2] = (i % 2) ? (outBytes[i / 2] | nibble) : (nibble << 4);
+    }
+
+    return true;
+}
+
+// "BULK-session|src|index|blob size|fragment hex" (at most 30 characters)
+void lora_protocol_fill_create_bulk_fragment_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argSession, uint8_t argIndex, uint16_t argBlobSize, const uint8_t* argFragment)
+{
+    char hex[2 * LORA_BULK_FRAGMENT_SIZE + 1];
+
+    fill_with_hex(hex, argFragment, LORA_BULK_FRAGMENT_SIZE);
+
+    snprintf((char*)buffer, bufferSize, "%s%u|%u|%u|%u|%s",(const char*)BulkMsg, argSession, MyAddress, argIndex, argBlobSize, hex);
+}
+
+bool lora_protocol_is_received_data_a_bulk_fragment()
+{
+    return strncmp((const char*)RxBuffer, (const char*)BulkMsg, strlen((const char*)BulkMsg)) == 0;
+}
+
+bool lora_protocol_get_received_bulk_fragment(uint8_t* outSourceAddress, uint8_t* outSession, uint8_t* outIndex, uint16_t* outBlobSize, uint8_t* outFragment)
+{
+    uint32_t fields[MAX_FRAME_FIELDS];
+
+    if(!lora_protocol_is_received_data_a_bulk_fragment() || parse_numeric_fields(fields, MAX_FRAME_FIELDS) < 5) return false;
+
+    const char* hex=strrchr((const char*)RxBuffer,'|') + 1;
+
+    if(strlen(hex) != 2 * LORA_BULK_FRAGMENT_SIZE || !parse_hex(hex, outFragment, LORA_BULK_FRAGMENT_SIZE)) return false;
+
+    *outSession=fields[0];
+    *outSourceAddress=fields[1];
+    *outIndex=fields[2];
+    *outBlobSize=fields[3];
+
+    return true;
+}
+
+// "BULKS-session|src|0|address mask": the targets which haven't rebuilt the blob yet report what they miss
+void lora_protocol_fill_create_bulk_poll_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argSession, uint16_t argAddressMask)
+{
+    snprintf((char*)buffer, bufferSize, "%s%u|%u|0|%u",(const char*)BulkPollMsg, argSession, MyAddress, argAddressMask);
+}
+
+bool lora_protocol_is_received_data_a_bulk_poll()
+{
+    return strncmp((const char*)RxBuffer, (const char*)BulkPollMsg, strlen((const char*)BulkPollMsg)) == 0;
+}
+
+bool lora_protocol_get_received_bulk_poll(uint8_t* outSourceAddress, uint8_t* outSession, uint16_t* outAddressMask)
+{
+    uint32_t fields[MAX_FRAME_FIELDS];
+
+    if(!lora_protocol_is_received_data_a_bulk_poll() || parse_numeric_fields(fields, MAX_FRAME_FIELDS) < 4) return false;
+
+    *outSession=fields[0];
+    *outSourceAddress=fields[1];
+    *outAddressMask=fields[3];
+
+    return true;
+}
+
+// "BULKR-session|src|dst|missing fragments mask hex" (12 digits, most significant first)
+void lora_protocol_fill_create_bulk_report_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argSession, uint8_t argDestinationAddress, uint64_t argMissingMask)
+{
+    uint8_t bytes[LORA_BULK_MAX_FRAGMENTS / 8];
+    char hex[2 * sizeof(bytes) + 1];
+
+    for(uint8_t i=0; i<sizeof(bytes); i++) bytes[i] = (uint8_t)(argMissingMask >> (8 * (sizeof(bytes) - 1 - i)));
+
+    fill_with_hex(hex, bytes, sizeof(bytes));
+
+    snprintf((char*)buffer, bufferSize, "%s%u|%u|%u|%s",(const char*)BulkReportMsg, argSession, MyAddress, argDestinationAddress, hex);
+}
+
+bool lora_protocol_is_received_data_a_bulk_report()
+{
+    return strncmp((const char*)RxBuffer, (const char*)BulkReportMsg, strlen((const char*)BulkReportMsg)) == 0;
+}
+
+bool lora_protocol_get_received_bulk_report(uint8_t* outSourceAddress, uint8_t* outSession, uint8_t* outDestinationAddress, uint64_t* outMissingMask)
+{
+    uint32_t fields[MAX_FRAME_FIELDS];
+    uint8_t bytes[LORA_BULK_MAX_FRAGMENTS / 8];
+
+    if(!lora_protocol_is_received_data_a_bulk_report() || parse_numeric_fields(fields, MAX_FRAME_FIELDS) < 4) return false;
+
+    const char* hex=strrchr((const char*)RxBuffer,'|') + 1;
+
+    if(strlen(hex) != 2 * sizeof(bytes) || !parse_hex(hex, bytes, sizeof(bytes))) return false;
+
+    *outSession=fields[0];
+    *outSourceAddress=fields[1];
+    *outDestinationAddress=fields[2];
+    *outMissingMask=0;
+
+    for(uint8_t i=0; i<sizeof(bytes); i++) *outMissingMask = (*outMissingMask << 8) | bytes[i];
+
+    return true;
+}
+
+void lora_protocol_fill_create_beacon_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argSequence, const char* argSlotMap)
+{
+    snprintf((char*)buffer, bufferSize, "%s%u|%u|0|%s",(const char*)BeaconMsg, argSequence, MyAddress, argSlotMap);
+}
+
+bool lora_protocol_is_received_data_a_beacon()
+{
+    return strncmp((const char*)RxBuffer, (const char*)BeaconMsg, strlen((const char*)BeaconMsg)) == 0;
+}
+
+void lora_protocol_process_received_data_as_beacon()
+{
+    char* dashPtr=NULL;
+    char* pipePtr1=NULL;
+    char* pipePtr3=NULL;
+
+    LatestReceivedBeaconSlotMap[0]='\0';
+
+    dashPtr=strchr((char*)RxBuffer,'-');
+
+    if(dashPtr) pipePtr1=strchr(dashPtr+1,'|');
+    if(pipePtr1) pipePtr3=strrchr(pipePtr1+1,'|');
+
+    if(dashPtr && pipePtr1 && pipePtr3)
+    {
+        LatestReceivedBeaconSequence=atoi(dashPtr+1);
+        LatestReceivedBeaconSourceAddress=atoi(pipePtr1+1);
+
+        strncpy(LatestReceivedBeaconSlotMap, pipePtr3+1, lora_protocol_BUFFER_SIZE-1);
+        LatestReceivedBeaconSlotMap[lora_protocol_BUFFER_SIZE-1]='\0';
+    }
+}
+
+uint16_t lora_protocol_get_latest_received_beacon_sequence()
+{
+    return LatestReceivedBeaconSequence;
+}
+
+uint8_t lora_protocol_get_latest_received_beacon_source_address()
+{
+    return LatestReceivedBeaconSourceAddress;
+}
+
+const char* lora_protocol_get_latest_received_beacon_slot_map()
+{
+    return LatestReceivedBeaconSlotMap;
 }
 
 bool lora_protocol_is_received_data_a_reply()
@@ -151,36 +524,102 @@ bool lora_protocol_is_received_data_a_reply()
 
 void lora_protocol_process_received_data_as_reply()
 {
-    char* dashPtr=NULL;
-    char* pipePtr1=NULL;
-    char* pipePtr2=NULL;
+    uint32_t fields[MAX_FRAME_FIELDS];
+
+    int count=parse_numeric_fields(fields, MAX_FRAME_FIELDS);
+    
+    if(count >= 3)
+    {
+        LatestReceivedReplyCounter=fields[0];
+        LatestReceivedReplySourceAddress=fields[1];
+        LatestReceivedReplyDestinationAddress=fields[2];
+        LatestReceivedReplySequence=count >= 4 ? fields[3] : 0;
+    }
+    else
+    {
+        LatestReceivedReplyCounter=0;
+        LatestReceivedReplySequence=0;
+    }
 
-    dashPtr=strchr((const char*)RxBuffer,'-');
+    const char* piggybackPtr=strchr((const char*)RxBuffer, PIGGYBACK_SEPARATOR);
+    char* sequencePtr=NULL;
 
-    if(dashPtr)
+    LatestReceivedReplyCarriesRequest=false;
+
+    if(count >= 4 && piggybackPtr)
     {
-        pipePtr1=strchr(dashPtr+1,'|');
+        LatestReceivedReplyRequestCounter=strtoul(piggybackPtr+1, &sequencePtr, 10);
 
-        if(pipePtr1)
+        if(sequencePtr && *sequencePtr==PIGGYBACK_SEQUENCE_SEPARATOR)
         {
-            pipePtr2=strchr(pipePtr1+1,'|');
+            LatestReceivedReplyRequestSequence=strtoul(sequencePtr+1, NULL, 10);
+            LatestReceivedReplyCarriesRequest=true;
         }
     }
-    
-    if(dashPtr && pipePtr1 && pipePtr2)
+}
+
+bool lora_protocol_does_latest_received_reply_carry_request()
+{
+    return LatestReceivedReplyCarriesRequest;
+}
+
+void lora_protocol_process_latest_received_reply_as_request()
+{
+    // The query travels from the replying node to us: same addressing as the reply carrying it
+    LatestReceivedRequestCounter=LatestReceivedReplyRequestCounter;
+    LatestReceivedRequestSourceAddress=LatestReceivedReplySourceAddress;
+    LatestReceivedRequestDestinationAddress=LatestReceivedReplyDestinationAddress;
+    LatestReceivedRequestGatherMask=0;
+    LatestReceivedRequestSequence=LatestReceivedReplyRequestSequence;
+    LatestReceivedRequestMoreData=false;
+
+    s_latest_received_request_piggybacked=true;
+
+    LatestReceivedReplyCarriesRequest=false;
+}
+
+// Any frame type: the source address always follows the type
+bool lora_protocol_get_received_data_source_address(uint8_t* outSourceAddress)
+{
+    uint32_t fields[MAX_FRAME_FIELDS];
+
+    if(parse_numeric_fields(fields, MAX_FRAME_FIELDS) < 2) return false;
+
+    *outSourceAddress=fields[1];
+
+    return true;
+}
+
+bool lora_protocol_get_received_data_request_sequence(uint8_t* outSourceAddress, uint8_t* outSequence)
+{
+    uint32_t fields[MAX_FRAME_FIELDS];
+
+    int count=parse_numeric_fields(fields, MAX_FRAME_FIELDS);
+
+    if(count < 4) return false;
+
+    *outSourceAddress=fields[1];
+
+    if(lora_protocol_is_received_data_a_request())
     {
-        *pipePtr1='\0';
-        *pipePtr2='\0';
-        LatestReceivedReplyCounter=atoi(dashPtr+1);
-        LatestReceivedReplySourceAddress=atoi(pipePtr1+1);
-        LatestReceivedReplyDestinationAddress=atoi(pipePtr2+1);
-        *pipePtr1='|';
-        *pipePtr2='|';
+        *outSequence=fields[3];
+    }
+    else if(lora_protocol_is_received_data_a_reply())
+    {
+        // Only a query riding on the reply takes a sequence number from its sender
+        const char* piggybackPtr=strchr((const char*)RxBuffer, PIGGYBACK_SEPARATOR);
+        const char* sequencePtr=piggybackPtr ? strchr(piggybackPtr, PIGGYBACK_SEQUENCE_SEPARATOR) : NULL;
+
+        if(!sequencePtr) return false;
+
+        *outSequence=strtoul(sequencePtr+1, NULL, 10);
     }
     else
     {
-        LatestReceivedReplyCounter=0;
+        return false;
     }
+
+    return *outSequence!=0;
 }
 
 void lora_protocol_fill_with_rx_buffer_dump(char* destBuffer, size_t destBufferSize)
@@ -189,7 +628,7 @@ void lora_protocol_fill_with_rx_buffer_dump(char* destBuffer, size_t destBufferS
     memcpy(srcBuffer,RxBuffer,lora_protocol_BUFFER_SIZE);
     srcBuffer[lora_protocol_BUFFER_SIZE-1]='\0';
 
-    strcpy(destBuffer,srcBuffer);
+    snprintf(destBuffer, destBufferSize, "%s", srcBuffer);
 }
 
 void lora_protocol_fill_with_tx_buffer_dump(char* destBuffer, uint8_t* txBuffer, size_t destBufferSize)
@@ -198,5 +637,5 @@ void lora_protocol_fill_with_tx_buffer_dump(char* destBuffer, uint8_t* txBuffer,
     memcpy(srcBuffer,txBuffer,lora_protocol_BUFFER_SIZE);
     srcBuffer[lora_protocol_BUFFER_SIZE-1]='\0';
 
-    strcpy(destBuffer,srcBuffer);
+    snprintf(destBuffer, destBufferSize, "%s", srcBuffer);
 }
\ No newline at end of file
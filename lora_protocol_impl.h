@@ -6,17 +6,58 @@ bool lora_protocol_should_i_reply_to_latest_received_request();
 bool lora_protocol_should_i_wait_for_reply_for_latest_sent_request();
 bool lora_protocol_is_latest_received_reply_for_me();
 void lora_protocol_fill_create_reply_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t replyPayload);
+bool lora_protocol_fill_create_reply_with_latest_request_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t replyPayload);
 bool lora_protocol_is_latest_received_reply_right();
 uint16_t lora_protocol_get_latest_received_reply_payload();
 uint16_t lora_protocol_get_latest_received_request_payload();
 uint8_t lora_protocol_get_latest_received_request_source_address();
+uint8_t lora_protocol_get_latest_received_request_sequence();
 uint8_t lora_protocol_get_latest_received_reply_source_address();
 void lora_protocol_fill_create_request_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply);
+void lora_protocol_fill_create_gather_request_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argCounter, uint16_t argAddressMask);
+uint8_t lora_protocol_get_latest_sent_request_destination_address();
+uint8_t lora_protocol_get_latest_sent_request_sequence();
+bool lora_protocol_is_latest_sent_request_a_gather();
+uint16_t lora_protocol_get_latest_sent_gather_mask();
+bool lora_protocol_is_latest_received_request_a_gather();
+uint8_t lora_protocol_get_latest_received_request_gather_slot();
 void lora_protocol_process_received_data(uint8_t *payload, uint16_t size);
 bool lora_protocol_is_received_data_a_request();
 void lora_protocol_process_received_data_as_request();
 bool lora_protocol_is_received_data_a_reply();
 void lora_protocol_process_received_data_as_reply();
+bool lora_protocol_does_latest_received_reply_carry_request();
+void lora_protocol_process_latest_received_reply_as_request();
+bool lora_protocol_get_received_data_request_sequence(uint8_t* outSourceAddress, uint8_t* outSequence);
+bool lora_protocol_get_received_data_source_address(uint8_t* outSourceAddress);
+
+void lora_protocol_fill_create_beacon_buffer(uint8_t* buffer, uint16_t bufferSize, uint16_t argSequence, const char* argSlotMap);
+bool lora_protocol_is_received_data_a_beacon();
+void lora_protocol_process_received_data_as_beacon();
+uint16_t lora_protocol_get_latest_received_beacon_sequence();
+uint8_t lora_protocol_get_latest_received_beacon_source_address();
+const char* lora_protocol_get_latest_received_beacon_slot_map();
+
+void lora_protocol_set_more_data_flag(uint8_t* buffer, uint16_t bufferSize);
+bool lora_protocol_does_latest_received_request_announce_more_data();
+void lora_protocol_fill_create_poll_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argDestinationAddress, uint16_t argPollIntervalS);
+bool lora_protocol_is_received_data_a_poll();
+bool lora_protocol_does_received_data_open_downlink_windows();
+
+void lora_protocol_fill_create_hello_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argCapabilities, uint16_t argSequence, uint16_t argNeighborMask, uint16_t argChannelMask);
+bool lora_protocol_is_received_data_a_hello();
+bool lora_protocol_get_received_hello(uint8_t* outSourceAddress, uint8_t* outCapabilities, uint16_t* outSequence, uint16_t* outNeighborMask);
+bool lora_protocol_get_received_hello_channel_mask(uint16_t* outChannelMask);
+
+void lora_protocol_fill_create_bulk_fragment_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argSession, uint8_t argIndex, uint16_t argBlobSize, const uint8_t* argFragment);
+bool lora_protocol_is_received_data_a_bulk_fragment();
+bool lora_protocol_get_received_bulk_fragment(uint8_t* outSourceAddress, uint8_t* outSession, uint8_t* outIndex, uint16_t* outBlobSize, uint8_t* outFragment);
+void lora_protocol_fill_create_bulk_poll_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argSession, uint16_t argAddressMask);
+bool lora_protocol_is_received_data_a_bulk_poll();
+bool lora_protocol_get_received_bulk_poll(uint8_t* outSourceAddress, uint8_t* outSession, uint16_t* outAddressMask);
+void lora_protocol_fill_create_bulk_report_buffer(uint8_t* buffer, uint16_t bufferSize, uint8_t argSession, uint8_t argDestinationAddress, uint64_t argMissingMask);
+bool lora_protocol_is_received_data_a_bulk_report();
+bool lora_protocol_get_received_bulk_report(uint8_t* outSourceAddress, uint8_t* outSession, uint8_t* outDestinationAddress, uint64_t* outMissingMask);
 
 void lora_protocol_fill_with_rx_buffer_dump(char* destBuffer, size_t destBufferSize);
 void lora_protocol_fill_with_tx_buffer_dump(char* destBuffer, uint8_t* txBuffer, size_t destBufferSize);
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include <cstdint>
+#include <cstdio>
+
+#include "lora_config.h"
+
+#include "lora_reply_cache.h"
+
+typedef struct
+{
+    bool valid;
+    uint8_t source;
+    uint8_t sequence;
+    uint16_t replyPayload;
+    uint32_t storedAtMs;
+    uint32_t lastUsedAtMs;
+
+} ReplyCacheEntry_t;
+
+static ReplyCacheEntry_t s_entries[LORA_REPLY_CACHE_SIZE];
+
+static uint32_t s_hits, s_misses, s_evictions;
+
+static bool is_entry_expired(const ReplyCacheEntry_t* entry, uint32_t nowMs)
+{
+    return nowMs - entry->storedAtMs > LORA_REPLY_CACHE_TTL;
+}
+
+bool lora_reply_cache_lookup(uint8_t source, uint8_t sequence, uint32_t nowMs, uint16_t* outReplyPayload)
+{
+    for(int i=0; i<LORA_REPLY_CACHE_SIZE; i++)
+    {
+        ReplyCacheEntry_t* entry = &s_entries[i];
+
+        if(!entry->valid || entry->source != source || entry->sequence != sequence) continue;
+
+        if(is_entry_expired(entry, nowMs))
+        {
+            entry->valid = false;
+
+            break;
+        }
+
+        entry->lastUsedAtMs = nowMs;
+
+        *outReplyPayload = entry->replyPayload;
+
+        s_hits++;
+
+        return true;
+    }
+
+    s_misses++;
+
+    return false;
+}
+
+void lora_reply_cache_store(uint8_t source, uint8_t sequence, uint16_t replyPayload, uint32_t nowMs)
+{
+    ReplyCacheEntry_t* victim = NULL;
+
+    for(int i=0; i<LORA_REPLY_CACHE_SIZE && !victim; i++)
+    {
+        ReplyCacheEntry_t* entry = &s_entries[i];
+
+        if(entry->valid && entry->source == source && entry->sequence == sequence) victim = entry;
+    }
+
+    for(int i=0; i<LORA_REPLY_CACHE_SIZE && !victim; i++)
+    {
+        ReplyCacheEntry_t* entry = &s_entries[i];
+
+        if(!entry->valid || is_entry_expired(entry, nowMs)) victim = entry;
+    }
+
+    if(!victim)
+    {
+        // Cache full of live entries: evict the least recently used one
+        victim = &s_entries[0];
+
+        for(int i=1; i<LORA_REPLY_CACHE_SIZE; i++)
+        {
+            if(nowMs - s_entries[i].lastUsedAtMs > nowMs - victim->lastUsedAtMs) victim = &s_entries[i];
+        }
+
+        s_evictions++;
+    }
+
+    victim->valid = true;
+    victim->source = source;
+    victim->sequence = sequence;
+    victim->replyPayload = replyPayload;
+    victim->storedAtMs = nowMs;
+    victim->lastUsedAtMs = nowMs;
+}
+
+void lora_reply_cache_fill_with_stats_dump(char* destBuffer, size_t destBufferSize)
+{
+    int used=0;
+
+    for(int i=0; i<LORA_REPLY_CACHE_SIZE; i++) if(s_entries[i].valid) used++;
+
+    snprintf(destBuffer, destBufferSize, "hit=%lu,miss=%lu,evict=%lu,used=%d/%d,ttl=%d",
+        (unsigned long)s_hits, (unsigned long)s_misses, (unsigned long)s_evictions, used, LORA_REPLY_CACHE_SIZE, LORA_REPLY_CACHE_TTL);
+}
@@ -0,0 +1,19 @@
+#ifndef __LORA_REPLY_CACHE_H__
+#define __LORA_REPLY_CACHE_H__
+
+#include <cstdint>
+#include <cstddef>
+
+/*!
+ * @brief Looks up the reply already given to the (source, sequence) query, refreshing its LRU position
+ */
+bool lora_reply_cache_lookup(uint8_t source, uint8_t sequence, uint32_t nowMs, uint16_t* outReplyPayload);
+
+/*!
+ * @brief Stores the reply given to the (source, sequence) query, evicting the least recently used entry if full
+ */
+void lora_reply_cache_store(uint8_t source, uint8_t sequence, uint16_t replyPayload, uint32_t nowMs);
+
+void lora_reply_cache_fill_with_stats_dump(char* destBuffer, size_t destBufferSize);
+
+#endif // __LORA_REPLY_CACHE_H__
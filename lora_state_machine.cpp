@@ -1,5 +1,7 @@
 #include "mbed.h"
 
+#include <string>
+
 #define /*USE_SX1276_RADIO_MODULE*/ USE_SX1272_RADIO_MODULE
 
 /* Set this flag to '1' to display debug messages on the console */
@@ -29,296 +31,2167 @@
 
 #include "lora_config.h"
 
-#include "lora_events_callbacks.h"
+#include "lora_events_callbacks.h"
+
+#include "lora_state_machine.h"
+
+#include "lora_airtime.h"
+
+#include "lora_timing.h"
+
+#include "lora_tdma.h"
+
+#include "lora_reply_cache.h"
+
+#include "request_reply_engine.h"
+
+#include "lora_capture.h"
+
+#include "lora_energy.h"
+
+#include "lora_trace.h"
+
+#include "lora_neighbors.h"
+
+#include "lora_channels.h"
+
+#include "lora_bulk.h"
+
+// Slots are laid out on a single channel: a schedule per channel would need a beacon per channel
+static_assert(!LORA_TDMA_ENABLED || LORA_CHANNEL_COUNT == 1, "tdma works on a single channel only");
+
+/*
+ *  Global variables declarations
+ */
+typedef enum
+{
+    INITIAL,
+
+    RX_WAITING_FOR_REQUEST,
+    RX_WAITING_FOR_REPLY,
+
+    RX_DONE_RECEIVED_REQUEST,
+    RX_DONE_RECEIVED_REPLY,
+ 
+    TX_WAITING_FOR_REQUEST_SENT,
+    TX_WAITING_FOR_REPLY_SENT,
+
+    TX_DONE_SENT_REQUEST,
+    TX_DONE_SENT_REPLY,
+
+    RX_DONE_RECEIVED_GATHER_REPLIES,
+
+    TX_WAITING_FOR_BEACON_SENT,
+
+    WAITING_FOR_DEFERRED_REPLY,
+
+    TX_WAITING_FOR_POLL_SENT,
+
+    TX_WAITING_FOR_BULK_SENT,
+    RX_WAITING_FOR_BULK_REPORTS,
+    RX_DONE_RECEIVED_BULK_REPORTS,
+
+    APP_STATES_COUNT
+
+} AppStates_t;
+ 
+/*!
+ * Radio events function pointer
+ */
+static RadioEvents_t RadioEvents;
+ 
+/*
+ *  Global variables declarations
+ */
+static Timer s_request_rx_timer;
+
+static Timer s_gather_window_timer;
+static uint32_t s_gather_window_ms;
+static LoraGatherResults_t s_gather_collected_results;
+
+static Timer s_uptime_timer;
+
+// Derived from the modem settings at initialization (see lora_timing.h)
+static uint32_t s_tx_timeout_ms;
+static uint32_t s_reply_timeout_ms;
+static Timer s_reply_window_timer;
+
+// Idle: the radio is listening for requests with no timeout (continuous rx) or asleep (sleepy end device), nothing to
+// re-arm until it's used for something else
+static bool s_idle_rx_running;
+
+// Latest request sequence heard from each sender, gaps count as missed frames
+static uint8_t s_heard_request_sequences[LORA_GATHER_MAX_ADDRESS+1];
+
+// Reply ready to be sent, waiting for the requester (or its gather slot) to be listening
+static uint8_t s_pending_reply_buffer[RADIO_MESSAGES_BUFFER_SIZE];
+static uint16_t s_pending_reply_payload;
+static bool s_pending_reply_scheduled;
+
+// Query for the node being answered, queued to ride on the reply (see event_proc_send_pending_reply)
+static bool s_piggyback_request_queued;
+static bool s_reply_carries_request;
+
+// Latest request sent, kept for retransmissions
+static uint8_t s_latest_request_buffer[RADIO_MESSAGES_BUFFER_SIZE];
+static uint8_t s_retries_left;
+
+static uint8_t s_my_address;
+static EventQueue* s_event_queue;
+
+static LoraStats_t s_stats;
+
+#if defined USE_SX1272_RADIO_MODULE
+    static const uint32_t s_radio_currents_na[LORA_RADIO_MODES_COUNT] = { SX1272_SLEEP_CURRENT_NA, SX1272_STANDBY_CURRENT_NA, SX1272_RX_CURRENT_NA, SX1272_TX_CURRENT_NA, SX1272_CAD_CURRENT_NA };
+#elif defined USE_SX1276_RADIO_MODULE
+    static const uint32_t s_radio_currents_na[LORA_RADIO_MODES_COUNT] = { SX1276_SLEEP_CURRENT_NA, SX1276_STANDBY_CURRENT_NA, SX1276_RX_CURRENT_NA, SX1276_TX_CURRENT_NA, SX1276_CAD_CURRENT_NA };
+#endif
+
+// Energy accounting is updated from the radio event queue and read from the host one
+static Mutex s_energy_mutex;
+
+// TDMA schedule: slot map (from configuration on the gateway, from beacons on the other nodes)
+static char s_tdma_slot_map[TDMA_MAX_SLOTS+1];
+static bool s_tdma_synchronized;
+static Timer s_tdma_superframe_timer;
+static uint32_t s_tdma_superframe_offset_ms;
+static uint16_t s_tdma_beacon_sequence;
+static bool s_tdma_pending_send;
+static uint8_t s_tdma_pending_buffer[RADIO_MESSAGES_BUFFER_SIZE];
+
+// Sleepy end device (this node): asleep while idle, listening only in the downlink windows opened after each uplink
+static bool s_sleepy;
+static Timer s_uplink_timer;
+static bool s_downlink_windows_open;
+static uint8_t s_downlink_windows_generation;
+static bool s_poll_requested;
+static bool s_rx_window_configured;
+
+// Sleepy end devices heard (other nodes): requests for them only go out in the windows following their latest uplink
+static uint16_t s_sleepy_peers_mask;
+static uint16_t s_downlink_windows_mask;
+static uint32_t s_peer_uplink_at_ms[LORA_GATHER_MAX_ADDRESS+1];
+static bool s_downlink_pending_send;
+static uint8_t s_downlink_pending_buffer[RADIO_MESSAGES_BUFFER_SIZE];
+
+// Neighbor discovery: the table is updated on the radio event queue and looked up by the requesters too
+static Mutex s_neighbors_mutex;
+static uint16_t s_hello_sequence;
+static uint8_t s_hello_generation;
+static bool s_hello_scheduled;
+static uint32_t s_hello_due_at_ms;
+
+// Multi-channel operation: statistics are updated on the radio event queue and dumped from the host one
+static Mutex s_channels_mutex;
+static uint8_t s_tuned_channel;
+static uint32_t s_tuned_frequency;
+static bool s_fhss;
+static bool s_hopped;
+static uint8_t s_broadcast_buffer[RADIO_MESSAGES_BUFFER_SIZE];
+static uint16_t s_broadcast_buffer_size;
+static uint8_t s_broadcast_copy_index;
+static uint8_t s_broadcast_copies_left;
+
+static LoraGatherResults_t s_gather_published_results;
+static lora_gather_completion_callback_t s_gather_completion;
+
+// Bulk transfer being sent: fragments and polls go out back to back, the reports to a poll are collected within the
+// gather window (a node never runs both at once)
+static uint8_t s_bulk_session;
+static bool s_bulk_poll_sent;
+static uint16_t s_bulk_polled_mask;
+static uint16_t s_bulk_reported_mask;
+
+// Bulk transfer set aside between two frames for an urgent request (see lora_state_machine_preempt_bulk()): it goes on
+// from the idle state once that request is sent, or after LORA_BULK_PREEMPT_HOLD_TIME if none comes
+static bool s_bulk_preempt_requested;
+static bool s_bulk_suspended;
+static Timer s_bulk_suspended_timer;
+
+// Report owed to the latest bulk poll heard, a newer poll supersedes it
+static uint8_t s_bulk_report_generation;
+
+lora_notify_request_callback_t lora_state_machine_notify_request_callback;
+lora_notify_request_and_get_reply_callback_t lora_state_machine_notify_request_and_get_reply_callback;
+lora_notify_request_and_defer_reply_callback_t lora_state_machine_notify_request_and_defer_reply_callback;
+lora_notify_heard_callback_t lora_state_machine_notify_heard_callback;
+lora_get_pending_downlinks_callback_t lora_state_machine_get_pending_downlinks_callback;
+lora_notify_bulk_callback_t lora_state_machine_notify_bulk_callback;
+
+struct LoraTransport
+{
+    typedef LoraReplyOutcomes_t Outcome;
+
+    static constexpr Outcome pending_outcome() { return LORA_OUTCOME_PENDING; }
+    static constexpr Outcome timeout_stuck_outcome() { return LORA_OUTCOME_TIMEOUT_STUCK; }
+    static constexpr Outcome reply_right_outcome() { return LORA_OUTCOME_REPLY_RIGHT; }
+    static constexpr Outcome invalid_state_outcome() { return LORA_OUTCOME_INVALID_STATE; }
+
+    static Outcome send_request(uint16_t payload, uint8_t address, bool requiresReply) { return lora_state_machine_send_request(payload, address, requiresReply); }
+};
+
+struct LoraPolicy
+{
+    typedef AppStates_t State;
+    typedef void (*StateHandler)();
+
+    static constexpr State initial_state() { return INITIAL; }
+
+    static StateHandler get_state_handler(State state);
+    static int get_stale_state_timeout_ms(State state);
+    static void on_stale_state(State state);
+};
+
+static RequestReplyEngine<LoraTransport, LoraPolicy> s_engine;
+
+static inline AppStates_t getState() { return s_engine.get_state(); }
+static inline AppStates_t setState(AppStates_t newState) { return s_engine.set_state(newState); }
+
+// Answered or not, a query tells how the home channel of its destination is doing (broadcasts tell nothing)
+static void account_channel_transaction(LoraReplyOutcomes_t outcome)
+{
+    uint8_t destinationAddress = lora_protocol_get_latest_sent_request_destination_address();
+
+    if(destinationAddress == 0) return;
+
+    if(outcome != LORA_OUTCOME_REPLY_RIGHT && outcome != LORA_OUTCOME_REPLY_WRONG && outcome != LORA_OUTCOME_WAITING_FOR_REPLY_TIMEOUT) return;
+
+    s_channels_mutex.lock();
+    lora_channels_account_transaction(lora_channels_get_home(destinationAddress), outcome == LORA_OUTCOME_WAITING_FOR_REPLY_TIMEOUT);
+    s_channels_mutex.unlock();
+}
+
+// Every uplink goes to the gateway channel: once most queries there go unanswered, re-sending them only adds to the load
+// (statistics are kept with more than one channel only)
+static bool is_latest_request_channel_congested()
+{
+    s_channels_mutex.lock();
+    bool congested = lora_channels_is_congested(lora_channels_get_home(lora_protocol_get_latest_sent_request_destination_address()));
+    s_channels_mutex.unlock();
+
+    return congested;
+}
+
+static inline void updateAndNotifyConditionOutcome(LoraReplyOutcomes_t outcome, uint16_t payload)
+{
+    account_channel_transaction(outcome);
+
+    lora_trace_set_outcome(LORA_TRACE_ROLE_REQUESTER, outcome);
+
+    s_engine.update_and_notify_outcome(outcome, payload);
+}
+
+static void publish_gather_results()
+{
+    s_gather_published_results=s_gather_collected_results;
+}
+
+static inline void updateAndNotifyGatherOutcome()
+{
+    LoraReplyOutcomes_t outcome;
+
+    if(s_gather_collected_results.respondedMask == 0) outcome = LORA_OUTCOME_WAITING_FOR_REPLY_TIMEOUT;
+    else if(s_gather_collected_results.respondedMask == s_gather_collected_results.requestedMask) outcome = LORA_OUTCOME_REPLY_RIGHT;
+    else outcome = LORA_OUTCOME_GATHER_PARTIAL;
+
+    s_engine.update_and_notify_outcome(outcome, 0, publish_gather_results);
+}
+
+// The payload of a bulk transfer outcome is the mask of the targets which rebuilt the blob
+static inline void updateAndNotifyBulkOutcome(LoraReplyOutcomes_t outcome)
+{
+    s_bulk_preempt_requested = false;
+
+    s_engine.update_and_notify_outcome(outcome, lora_bulk_sender_get_completed_mask());
+}
+
+uint32_t lora_state_machine_get_gather_window_ms(uint16_t argAddressMask)
+{
+    uint8_t slots=0;
+
+    for(uint8_t address=1; address<=LORA_GATHER_MAX_ADDRESS; address++)
+    {
+        if(argAddressMask & (1 << address)) slots++;
+    }
+
+    return lora_timing_get_gather_window_ms(slots);
+}
+
+// Bulk reports need no host round trip: their first slot opens REQUEST_REPLY_DELAY after the poll
+static uint32_t get_bulk_report_window_ms(uint16_t addressMask)
+{
+    return lora_state_machine_get_gather_window_ms(addressMask) - lora_timing_get_gather_reply_base_delay_ms() + REQUEST_REPLY_DELAY;
+}
+
+uint32_t lora_state_machine_get_bulk_transfer_ms(uint16_t argSize, uint16_t argAddressMask)
+{
+    uint32_t rounds = 1 + LORA_BULK_MAX_ROUNDS;
+
+    // A repair round sends at most the data fragments again, every round ends with a poll and its reports
+    uint32_t frames = lora_bulk_get_first_round_count(argSize) + LORA_BULK_MAX_ROUNDS * lora_bulk_get_data_fragment_count(argSize) + rounds;
+
+    return frames * s_tx_timeout_ms * lora_channels_get_count() + rounds * get_bulk_report_window_ms(argAddressMask);
+}
+
+static uint32_t get_tdma_elapsed_in_superframe_ms()
+{
+    return s_tdma_superframe_timer.read_ms() + s_tdma_superframe_offset_ms;
+}
+
+static bool is_tdma_synchronized()
+{
+    if(!s_tdma_synchronized) return false;
+
+    // Too many beacons missed: the local clock can't be trusted anymore to stay in our slots
+    if(get_tdma_elapsed_in_superframe_ms() > TDMA_MAX_MISSED_BEACONS * lora_tdma_get_superframe_ms(s_tdma_slot_map))
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...tdma beacon lost, schedule unsynchronized\n" );
+
+        s_tdma_synchronized=false;
+    }
+
+    return s_tdma_synchronized;
+}
+
+// A broadcast goes out once per channel of the plan, one copy after the other
+static uint32_t get_broadcast_extra_airtime_ms()
+{
+    return (lora_channels_get_count() - 1) * lora_timing_get_frame_airtime_ms();
+}
+
+// The sender of a broadcast counts the slots of the answers from the end of its last copy, we heard the one on our channel
+static uint32_t get_broadcast_copies_after_home_ms()
+{
+    int copiesAfterOurs = (int)lora_channels_get_count() - 1 - lora_channels_get_home(s_my_address);
+
+    return copiesAfterOurs > 0 ? copiesAfterOurs * lora_timing_get_frame_airtime_ms() : 0;
+}
+
+uint32_t lora_state_machine_get_max_access_delay_ms()
+{
+    uint32_t delayMs = LORA_TDMA_ENABLED ? lora_tdma_get_superframe_ms(s_tdma_slot_map) : get_broadcast_extra_airtime_ms();
+
+    // A request for a sleepy end device may wait for its second downlink window
+    if(s_sleepy_peers_mask && lora_timing_get_downlink_window_delay_ms(2) > delayMs) delayMs = lora_timing_get_downlink_window_delay_ms(2);
+
+    return delayMs;
+}
+
+static void account_radio_mode(LoraRadioModes_t mode)
+{
+    s_energy_mutex.lock();
+    lora_energy_set_mode(mode, s_uptime_timer.read_high_resolution_us());
+    s_energy_mutex.unlock();
+}
+
+static void account_energy_class(LoraEnergyClasses_t energyClass)
+{
+    s_energy_mutex.lock();
+    lora_energy_set_class(energyClass, s_uptime_timer.read_high_resolution_us());
+    s_energy_mutex.unlock();
+}
+
+static LoraEnergyClasses_t get_latest_request_energy_class()
+{
+    if(lora_protocol_is_latest_sent_request_a_gather()) return LORA_ENERGY_CLASS_GATHER;
+
+    return lora_protocol_should_i_wait_for_reply_for_latest_sent_request() ? LORA_ENERGY_CLASS_QUERY : LORA_ENERGY_CLASS_COMMAND;
+}
+
+// The synthesizer is only retuned when the frequency changes (single channel: never after initialization)
+static void tune_to_channel(uint8_t channel)
+{
+    uint32_t frequency = lora_channels_get_frequency(channel);
+
+    s_tuned_channel = channel;
+
+    if(frequency == s_tuned_frequency) return;
+
+    Radio.SetChannel( frequency );
+
+    s_tuned_frequency = frequency;
+}
+
+static void tune_to_home_channel()
+{
+    tune_to_channel(lora_channels_get_home(s_my_address));
+}
+
+// A hopped frame leaves the synthesizer on its last hop: retuned home as soon as the frame is over, and idle rx (which
+// continuous rx would otherwise leave armed on the hop frequency) is armed again from scratch
+static void restore_home_channel_after_hops()
+{
+    if(!s_hopped) return;
+
+    s_hopped=false;
+
+    tune_to_home_channel();
+
+    s_idle_rx_running=false;
+}
+
+static void account_channel_airtime(uint16_t bufferSize)
+{
+    s_channels_mutex.lock();
+    lora_channels_account_airtime(s_tuned_channel, lora_airtime_get_time_on_air_ms(bufferSize));
+    s_channels_mutex.unlock();
+}
+
+static void transmit_on_channel(uint8_t channel, uint8_t* buffer, uint16_t bufferSize)
+{
+    tune_to_channel(channel);
+
+    s_stats.txAirtimeMs += lora_airtime_get_time_on_air_ms(bufferSize);
+
+    account_channel_airtime(bufferSize);
+
+    Radio.Send( buffer, bufferSize );
+}
+
+// Next copy of a broadcast, right from the tx done of the previous one
+static void send_next_broadcast_copy()
+{
+    s_broadcast_copies_left--;
+    s_broadcast_copy_index++;
+
+    transmit_on_channel(s_broadcast_copy_index, s_broadcast_buffer, s_broadcast_buffer_size);
+}
+
+// A frame goes out on the home channel of its destination, a broadcast (destination 0) on every channel of the plan in
+// turn: the ones left out too, where nodes which missed the latest active channels may still be listening
+static void send_frame(uint8_t* buffer, uint16_t bufferSize, LoraEnergyClasses_t energyClass, uint8_t destinationAddress)
+{
+    account_energy_class(energyClass);
+    account_radio_mode(LORA_RADIO_MODE_TX);
+
+    s_idle_rx_running=false;
+
+    lora_capture_record(LORA_CAPTURE_TX, s_uptime_timer.read_ms(), buffer, bufferSize, 0, 0);
+
+    if(energyClass == LORA_ENERGY_CLASS_REPLY) lora_trace_stamp(LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REPLY_TX_START);
+
+    if(energyClass == LORA_ENERGY_CLASS_QUERY || energyClass == LORA_ENERGY_CLASS_COMMAND || (energyClass == LORA_ENERGY_CLASS_REPLY && s_reply_carries_request))
+    {
+        lora_trace_stamp(LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_TX_START);
+    }
+
+    uint8_t copies = destinationAddress == 0 ? lora_channels_get_count() : 1;
+
+    if(copies > 1)
+    {
+        s_broadcast_buffer_size = bufferSize < RADIO_MESSAGES_BUFFER_SIZE ? bufferSize : RADIO_MESSAGES_BUFFER_SIZE;
+        memcpy(s_broadcast_buffer, buffer, s_broadcast_buffer_size);
+
+        s_broadcast_copy_index = 0;
+        s_broadcast_copies_left = copies - 1;
+
+        transmit_on_channel(0, s_broadcast_buffer, s_broadcast_buffer_size);
+
+        return;
+    }
+
+    s_broadcast_copies_left = 0;
+
+    transmit_on_channel(lora_channels_get_home(destinationAddress), buffer, bufferSize);
+}
+
+static void tdma_event_proc_send_pending_request()
+{
+    if(!s_tdma_pending_send) return;
+
+    if(getState() != RX_WAITING_FOR_REQUEST)
+    {
+        // Busy serving someone else's transaction: try again in our next slot
+        int32_t delay = lora_tdma_get_delay_to_own_slot_ms(s_tdma_slot_map, s_my_address, get_tdma_elapsed_in_superframe_ms() + TDMA_SLOT_GUARD_TIME + 1);
+
+        if(delay < 0 || !is_tdma_synchronized())
+        {
+            s_tdma_pending_send=false;
+
+            updateAndNotifyConditionOutcome(LORA_OUTCOME_NO_SLOT, 0);
+
+            return;
+        }
+
+        s_stats.slotWaitMs += delay;
+
+        s_event_queue->call_in(delay + TDMA_SLOT_GUARD_TIME + 1, tdma_event_proc_send_pending_request);
+
+        return;
+    }
+
+    s_tdma_pending_send=false;
+
+    setState(TX_WAITING_FOR_REQUEST_SENT);
+
+    s_stats.requestsSent++;
+
+    send_frame( s_tdma_pending_buffer, RADIO_MESSAGES_BUFFER_SIZE, get_latest_request_energy_class(), lora_protocol_get_latest_sent_request_destination_address() );
+}
+
+static void tdma_event_proc_send_beacon()
+{
+    if(getState() != RX_WAITING_FOR_REQUEST || s_tdma_pending_send || s_downlink_pending_send)
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...radio busy, tdma beacon skipped\n" );
+
+        return;
+    }
+
+    uint8_t buffer[RADIO_MESSAGES_BUFFER_SIZE];
+
+    lora_protocol_fill_create_beacon_buffer(buffer, RADIO_MESSAGES_BUFFER_SIZE, ++s_tdma_beacon_sequence, s_tdma_slot_map);
+
+    // The superframe starts with the beacon transmission
+    s_tdma_superframe_timer.reset();
+    s_tdma_superframe_offset_ms=0;
+
+    setState(TX_WAITING_FOR_BEACON_SENT);
+
+    s_stats.beaconsSent++;
+
+    send_frame( buffer, RADIO_MESSAGES_BUFFER_SIZE, LORA_ENERGY_CLASS_BEACON, 0 );
+}
+
+static uint8_t get_own_capabilities()
+{
+    uint8_t capabilities = 0;
+
+    if(s_my_address == LORA_GATEWAY_ADDRESS) capabilities |= LORA_NEIGHBOR_CAPABILITY_GATEWAY;
+    if(LORA_TDMA_ENABLED) capabilities |= LORA_NEIGHBOR_CAPABILITY_TDMA;
+    if(LORA_CONTINUOUS_RX_ENABLED) capabilities |= LORA_NEIGHBOR_CAPABILITY_CONTINUOUS_RX;
+    if(LORA_PIGGYBACK_ENABLED) capabilities |= LORA_NEIGHBOR_CAPABILITY_PIGGYBACK;
+
+    return capabilities;
+}
+
+// Drawn within +- LORA_DISCOVERY_BEACON_JITTER, so that nodes started together don't keep sending at the same time
+static uint32_t get_hello_interval_ms()
+{
+    return LORA_DISCOVERY_BEACON_INTERVAL - LORA_DISCOVERY_BEACON_JITTER + rand() % (2 * LORA_DISCOVERY_BEACON_JITTER + 1);
+}
+
+static uint32_t get_hello_greeting_delay_ms()
+{
+    return rand() % (LORA_DISCOVERY_BEACON_JITTER + 1);
+}
+
+static void event_proc_send_hello(uint8_t generation);
+
+// The earliest HELLO wins: one already due sooner is left as it is
+static void schedule_hello(uint32_t delayMs)
+{
+    uint32_t dueAtMs = s_uptime_timer.read_ms() + delayMs;
+
+    if(s_hello_scheduled && (int32_t)(s_hello_due_at_ms - dueAtMs) <= 0) return;
+
+    s_hello_generation++;
+    s_hello_scheduled = true;
+    s_hello_due_at_ms = dueAtMs;
+
+    s_event_queue->call_in(delayMs, event_proc_send_hello, s_hello_generation);
+}
+
+static void event_proc_send_hello(uint8_t generation)
+{
+    if(generation != s_hello_generation) return;
+
+    s_hello_scheduled = false;
+
+    if(getState() != RX_WAITING_FOR_REQUEST || s_tdma_pending_send || s_downlink_pending_send)
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...radio busy, hello postponed\n" );
+
+        schedule_hello(get_hello_greeting_delay_ms());
+
+        return;
+    }
+
+    if(LORA_TDMA_ENABLED)
+    {
+        // Within our own slots only, like any other transmission of ours
+        int32_t delay = is_tdma_synchronized() ? lora_tdma_get_delay_to_own_slot_ms(s_tdma_slot_map, s_my_address, get_tdma_elapsed_in_superframe_ms()) : -1;
+
+        if(delay != 0)
+        {
+            schedule_hello(delay > 0 ? delay : get_hello_interval_ms());
+
+            return;
+        }
+    }
+
+    uint8_t buffer[RADIO_MESSAGES_BUFFER_SIZE];
+
+    s_neighbors_mutex.lock();
+    uint16_t neighborMask = lora_neighbors_get_mask(s_uptime_timer.read_ms());
+    s_neighbors_mutex.unlock();
+
+    if(++s_hello_sequence == 0) s_hello_sequence = 1;
+
+    // The gateway tells the channels in use
+    uint16_t channelMask = s_my_address == LORA_GATEWAY_ADDRESS && lora_channels_get_count() > 1 ? lora_channels_get_active_mask() : 0;
+
+    lora_protocol_fill_create_hello_buffer(buffer, RADIO_MESSAGES_BUFFER_SIZE, get_own_capabilities(), s_hello_sequence, neighborMask, channelMask);
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA SEND HELLO : '%s' ***\n", (const char*)buffer );
+
+    setState(TX_WAITING_FOR_BEACON_SENT);
+
+    s_stats.hellosSent++;
+
+    send_frame( buffer, RADIO_MESSAGES_BUFFER_SIZE, LORA_ENERGY_CLASS_BEACON, 0 );
+
+    schedule_hello(get_hello_interval_ms());
+}
+
+static bool is_unknown_peer(uint8_t address)
+{
+    // Until the first round of HELLO frames is over the table can't tell; a sleepy end device hears nobody outside its windows
+    if(!LORA_DISCOVERY_ENABLED || s_sleepy || address == 0 || s_uptime_timer.read_ms() < LORA_DISCOVERY_STARTUP_TIME) return false;
+
+    s_neighbors_mutex.lock();
+    bool known = lora_neighbors_is_known(address, s_uptime_timer.read_ms());
+    s_neighbors_mutex.unlock();
+
+    return !known;
+}
+
+bool lora_state_machine_is_peer_known(uint8_t argAddress)
+{
+    return !is_unknown_peer(argAddress);
+}
+
+static bool is_sleepy_peer(uint8_t address)
+{
+    return address > 0 && address <= LORA_GATHER_MAX_ADDRESS && (s_sleepy_peers_mask & (1 << address)) != 0;
+}
+
+// From now to the start of the earliest downlink window of the peer at least afterMs ahead, -1 if its windows are over
+static int32_t get_downlink_delay_ms(uint8_t address, uint32_t afterMs)
+{
+    if(!is_sleepy_peer(address) || !(s_downlink_windows_mask & (1 << address))) return -1;
+
+    uint32_t elapsedMs = (uint32_t)s_uptime_timer.read_ms() - s_peer_uplink_at_ms[address];
+
+    for(uint8_t window=1; window<=2; window++)
+    {
+        uint32_t delayMs = lora_timing_get_downlink_window_delay_ms(window);
+
+        if(delayMs >= elapsedMs + afterMs) return delayMs - elapsedMs;
+    }
+
+    return -1;
+}
+
+// Time left to hand over a request for the second window of the peer, 0 once its windows are over
+static uint32_t get_downlink_window_left_ms(uint8_t address)
+{
+    if(!is_sleepy_peer(address) || !(s_downlink_windows_mask & (1 << address))) return 0;
+
+    uint32_t elapsedMs = (uint32_t)s_uptime_timer.read_ms() - s_peer_uplink_at_ms[address];
+    uint32_t lastDelayMs = lora_timing_get_downlink_window_delay_ms(2);
+
+    return elapsedMs < lastDelayMs ? lastDelayMs - elapsedMs : 0;
+}
+
+static void event_proc_send_pending_downlink()
+{
+    if(!s_downlink_pending_send) return;
+
+    uint8_t destinationAddress = lora_protocol_get_latest_sent_request_destination_address();
+
+    if(getState() != RX_WAITING_FOR_REQUEST)
+    {
+        // Busy serving someone else's transaction: the second window, if it's still to come
+        int32_t delay = get_downlink_delay_ms(destinationAddress, 1);
+
+        if(delay < 0)
+        {
+            s_downlink_pending_send=false;
+
+            s_stats.downlinksMissed++;
+
+            updateAndNotifyConditionOutcome(LORA_OUTCOME_NO_SLOT, 0);
+
+            return;
+        }
+
+        s_event_queue->call_in(delay, event_proc_send_pending_downlink);
+
+        return;
+    }
+
+    s_downlink_pending_send=false;
+
+    // One downlink per uplink: the node stops listening once it got one
+    s_downlink_windows_mask &= ~(1 << destinationAddress);
+
+    setState(TX_WAITING_FOR_REQUEST_SENT);
+
+    s_stats.requestsSent++;
+    s_stats.downlinksSent++;
+
+    send_frame( s_downlink_pending_buffer, RADIO_MESSAGES_BUFFER_SIZE, get_latest_request_energy_class(), destinationAddress );
+}
+
+// A sleepy end device only listens in the windows after its latest uplink: the request waits for the next one of them
+static LoraReplyOutcomes_t start_downlink_transmission(uint8_t* buffer, uint8_t destinationAddress)
+{
+    if(s_downlink_pending_send) return LORA_OUTCOME_INVALID_STATE;
+
+    int32_t delay = get_downlink_delay_ms(destinationAddress, 0);
+
+    if(delay < 0)
+    {
+        s_stats.downlinksMissed++;
+
+        return LORA_OUTCOME_NO_SLOT;
+    }
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...waiting %d ms for the downlink window of %u...\n", delay, destinationAddress );
+
+    memcpy(s_downlink_pending_buffer, buffer, RADIO_MESSAGES_BUFFER_SIZE);
+    s_downlink_pending_send=true;
+
+    s_event_queue->call_in(delay, event_proc_send_pending_downlink);
+
+    return LORA_OUTCOME_PENDING;
+}
+
+// Sends the request right away in contention mode, or defers it up to our next slot in TDMA mode
+// (up to the next downlink window for a sleepy end device, TDMA or not)
+static LoraReplyOutcomes_t start_request_transmission(uint8_t* buffer, uint16_t bufferSize)
+{
+    uint8_t destinationAddress = lora_protocol_get_latest_sent_request_destination_address();
+
+    if(is_sleepy_peer(destinationAddress)) return start_downlink_transmission(buffer, destinationAddress);
+
+    if(LORA_TDMA_ENABLED)
+    {
+        if(s_tdma_pending_send) return LORA_OUTCOME_INVALID_STATE;
+
+        int32_t delay = is_tdma_synchronized() ? lora_tdma_get_delay_to_own_slot_ms(s_tdma_slot_map, s_my_address, get_tdma_elapsed_in_superframe_ms()) : -1;
+
+        if(delay < 0) return LORA_OUTCOME_NO_SLOT;
+
+        if(delay > 0)
+        {
+            sx127x_debug_if( SX127x_DEBUG_ENABLED, "...waiting %d ms for my tdma slot...\n", delay );
+
+            memcpy(s_tdma_pending_buffer, buffer, RADIO_MESSAGES_BUFFER_SIZE);
+            s_tdma_pending_send=true;
+
+            s_stats.slotWaitMs += delay;
+
+            s_event_queue->call_in(delay, tdma_event_proc_send_pending_request);
+
+            return LORA_OUTCOME_PENDING;
+        }
+    }
+
+    setState(TX_WAITING_FOR_REQUEST_SENT);
+
+    s_stats.requestsSent++;
+
+    send_frame( buffer, bufferSize, get_latest_request_energy_class(), destinationAddress );
+
+    return LORA_OUTCOME_PENDING;
+}
+
+void lora_state_machine_fill_with_stats_dump(char* destBuffer, size_t destBufferSize)
+{
+    snprintf(destBuffer, destBufferSize, "req=%lu,rep=%lu,rx=%lu,to=%lu,rtx=%lu,err=%lu,txto=%lu,air=%lu,bcn=%lu/%lu,wait=%lu,pgb=%lu/%lu,rst=%lu,miss=%lu,gmiss=%lu,crx=%d,tdma=%d",
+        (unsigned long)s_stats.requestsSent, (unsigned long)s_stats.repliesSent, (unsigned long)s_stats.repliesReceived,
+        (unsigned long)s_stats.replyTimeouts, (unsigned long)s_stats.retries, (unsigned long)s_stats.rxErrors, (unsigned long)s_stats.txTimeouts,
+        (unsigned long)s_stats.txAirtimeMs, (unsigned long)s_stats.beaconsSent, (unsigned long)s_stats.beaconsReceived,
+        (unsigned long)s_stats.slotWaitMs, (unsigned long)s_stats.piggybackSent, (unsigned long)s_stats.piggybackReceived,
+        (unsigned long)s_stats.rxRestarts, (unsigned long)s_stats.framesMissed,
+        (unsigned long)s_stats.gatherSlotsMissed, LORA_CONTINUOUS_RX_ENABLED ? 1 : 0,
+        LORA_TDMA_ENABLED ? (is_tdma_synchronized() ? 1 : 0) : -1);
+}
+
+void lora_state_machine_fill_with_sleepy_dump(char* destBuffer, size_t destBufferSize)
+{
+    int32_t nextPollMs = -1;
+
+    if(s_sleepy)
+    {
+        nextPollMs = s_poll_requested ? 0 : LORA_SLEEPY_POLL_INTERVAL - s_uplink_timer.read_ms();
+
+        if(nextPollMs < 0) nextPollMs = 0;
+    }
+
+    snprintf(destBuffer, destBufferSize, "on=%d,poll=%lu/%lu,win=%lu,dl=%lu/%lu/%lu,next=%ld,peers=0x%X,rx1=%lu,rx2=%lu,sym=%u",
+        s_sleepy ? 1 : 0, (unsigned long)s_stats.pollsSent, (unsigned long)s_stats.pollsReceived, (unsigned long)s_stats.downlinkWindows,
+        (unsigned long)s_stats.downlinksReceived, (unsigned long)s_stats.downlinksSent, (unsigned long)s_stats.downlinksMissed,
+        (long)nextPollMs, s_sleepy_peers_mask, (unsigned long)lora_timing_get_downlink_window_delay_ms(1), (unsigned long)lora_timing_get_downlink_window_delay_ms(2),
+        lora_timing_get_downlink_window_symbols());
+}
+
+void lora_state_machine_fill_with_neighbors_dump(char* destBuffer, size_t destBufferSize)
+{
+    uint32_t nowMs = s_uptime_timer.read_ms();
+    int32_t nextHelloMs = -1;
+
+    if(s_hello_scheduled)
+    {
+        nextHelloMs = (int32_t)(s_hello_due_at_ms - nowMs);
+
+        if(nextHelloMs < 0) nextHelloMs = 0;
+    }
+
+    int len = snprintf(destBuffer, destBufferSize, "on=%d,hello=%lu/%lu,unk=%lu,next=%ld,",
+        LORA_DISCOVERY_ENABLED ? 1 : 0, (unsigned long)s_stats.hellosSent, (unsigned long)s_stats.hellosReceived,
+        (unsigned long)s_stats.unknownPeers, (long)nextHelloMs);
+
+    if(len < 0 || (size_t)len >= destBufferSize) return;
+
+    s_neighbors_mutex.lock();
+    lora_neighbors_fill_with_table_dump(destBuffer + len, destBufferSize - len, nowMs);
+    s_neighbors_mutex.unlock();
+}
+
+void lora_state_machine_fill_with_channels_dump(char* destBuffer, size_t destBufferSize)
+{
+    s_channels_mutex.lock();
+
+    int len = snprintf(destBuffer, destBufferSize, "n=%u,mask=0x%X,home=%u,fhss=%d,",
+        lora_channels_get_count(), lora_channels_get_active_mask(), lora_channels_get_home(s_my_address), s_fhss ? 1 : 0);
+
+    if(len >= 0 && (size_t)len < destBufferSize) lora_channels_fill_with_dump(destBuffer + len, destBufferSize - len, s_uptime_timer.read_ms());
+
+    s_channels_mutex.unlock();
+}
+
+void lora_state_machine_fill_with_bulk_dump(char* destBuffer, size_t destBufferSize)
+{
+    int len = snprintf(destBuffer, destBufferSize, "frag=%lu/%lu,rnd=%lu,rep=%lu/%lu,ok=%lu,pre=%lu,",
+        (unsigned long)s_stats.bulkFragmentsSent, (unsigned long)s_stats.bulkFragmentsReceived, (unsigned long)s_stats.bulkRounds,
+        (unsigned long)s_stats.bulkReportsSent, (unsigned long)s_stats.bulkReportsReceived, (unsigned long)s_stats.bulkRebuilt,
+        (unsigned long)s_stats.bulkPreemptions);
+
+    if(len >= 0 && (size_t)len < destBufferSize) lora_bulk_fill_with_dump(destBuffer + len, destBufferSize - len);
+}
+
+void lora_state_machine_fill_with_energy_dump(char* destBuffer, size_t destBufferSize)
+{
+    LoraEnergyTotals_t totals;
+
+    s_energy_mutex.lock();
+    lora_energy_get_totals(&totals, s_uptime_timer.read_high_resolution_us());
+    s_energy_mutex.unlock();
+
+    lora_energy_fill_with_totals_dump(&totals, destBuffer, destBufferSize);
+}
+
+int LoraPolicy::get_stale_state_timeout_ms(AppStates_t state)
+{
+    uint32_t expectedMs;
+
+    switch(state)
+    {
+        case RX_WAITING_FOR_REPLY:
+            // While collecting gather replies the state is kept across the whole window
+            expectedMs = lora_protocol_is_latest_sent_request_a_gather() ? s_gather_window_ms : s_reply_timeout_ms;
+            break;
+
+        case TX_WAITING_FOR_REQUEST_SENT:
+        case TX_WAITING_FOR_BEACON_SENT:
+        case TX_WAITING_FOR_BULK_SENT:
+            // Broadcasts are sent once per channel
+            expectedMs = s_tx_timeout_ms * lora_channels_get_count();
+            break;
+
+        case TX_WAITING_FOR_POLL_SENT:
+            expectedMs = s_tx_timeout_ms;
+            break;
+
+        case RX_WAITING_FOR_BULK_REPORTS:
+            expectedMs = s_gather_window_ms;
+            break;
+
+        case TX_WAITING_FOR_REPLY_SENT:
+            // Gather replies wait for their slot, up to the last one of a full group
+            expectedMs = (lora_protocol_is_latest_received_request_a_gather() ? lora_state_machine_get_gather_window_ms(0xFFFE) + get_broadcast_extra_airtime_ms() : REQUEST_REPLY_DELAY) + s_tx_timeout_ms;
+            break;
+
+        case WAITING_FOR_DEFERRED_REPLY:
+            expectedMs = lora_timing_get_host_transaction_timeout_ms();
+            break;
+
+        case RX_WAITING_FOR_REQUEST:
+            // Continuous rx has no timeout to wait for: nothing can go stale while just listening
+            if(s_idle_rx_running) return INT32_MAX;
+
+            expectedMs = RX_TIMEOUT_VALUE;
+            break;
+
+        default:
+            expectedMs = RX_TIMEOUT_VALUE;
+            break;
+    }
+
+    return lora_timing_get_stale_state_timeout_ms(expectedMs);
+}
+
+void LoraPolicy::on_stale_state(AppStates_t state)
+{
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...(lora state-machine timeout in state %d, resetting to initial state)...\n", state );
+}
+
+uint32_t lora_state_machine_get_busy_remaining_ms()
+{
+    AppStates_t state = getState();
+
+    if(s_tdma_pending_send) return lora_state_machine_get_max_access_delay_ms();
+
+    if(s_downlink_pending_send) return lora_timing_get_downlink_window_delay_ms(2);
+
+    // Only an urgent request may go while a bulk transfer is set aside, the others wait for it to go on
+    if(s_bulk_suspended && !s_bulk_preempt_requested) return LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL;
+
+    switch(state)
+    {
+        case RX_WAITING_FOR_REQUEST:
+            return 0;
+
+        case RX_WAITING_FOR_REPLY:
+        case TX_WAITING_FOR_REQUEST_SENT:
+        case TX_WAITING_FOR_REPLY_SENT:
+        case TX_WAITING_FOR_BEACON_SENT:
+        case TX_WAITING_FOR_POLL_SENT:
+        case WAITING_FOR_DEFERRED_REPLY:
+        case TX_WAITING_FOR_BULK_SENT:
+        case RX_WAITING_FOR_BULK_REPORTS:
+            break;
+
+        default:
+            // Passing through: the next dispatch moves on
+            return LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL;
+    }
+
+    // Upper bound: the current state can't last longer than its watchdog (a retransmission starts a new one)
+    uint32_t limitMs = LoraPolicy::get_stale_state_timeout_ms(state);
+    uint32_t elapsedMs = s_engine.get_state_elapsed_ms();
+
+    return elapsedMs < limitMs ? limitMs - elapsedMs : 1;
+}
+
+static void notify_request(uint8_t requestSourceAddress, uint16_t requestPayload)
+{
+    if(lora_state_machine_notify_request_callback) lora_state_machine_notify_request_callback(requestSourceAddress, requestPayload);
+}
+
+static uint16_t notify_request_and_get_reply(uint8_t requestSourceAddress, uint16_t requestPayload)
+{
+    if(lora_state_machine_notify_request_and_get_reply_callback) return lora_state_machine_notify_request_and_get_reply_callback(requestSourceAddress, requestPayload);
+    
+    return 0;
+}
+
+static bool notify_request_and_defer_reply(uint8_t requestSourceAddress, uint16_t requestPayload)
+{
+    if(lora_state_machine_notify_request_and_defer_reply_callback) return lora_state_machine_notify_request_and_defer_reply_callback(requestSourceAddress, requestPayload);
+
+    return false;
+}
+
+static void store_reply_for_retransmissions(uint8_t requestSourceAddress, uint16_t replyPayload)
+{
+    if(lora_protocol_get_latest_received_request_sequence() != 0)
+    {
+        lora_reply_cache_store(requestSourceAddress, lora_protocol_get_latest_received_request_sequence(), replyPayload, s_uptime_timer.read_ms());
+    }
+}
+
+// A query for the node being answered can ride on the reply instead of waiting for its own turn
+static bool can_piggyback_request_to(uint8_t destinationAddress)
+{
+    if(!LORA_PIGGYBACK_ENABLED || s_piggyback_request_queued || s_tdma_pending_send || s_downlink_pending_send) return false;
+
+    AppStates_t state = getState();
+
+    bool replyNotSentYet = state == RX_DONE_RECEIVED_REQUEST || state == WAITING_FOR_DEFERRED_REPLY ||
+        (state == TX_WAITING_FOR_REPLY_SENT && s_pending_reply_scheduled);
+
+    return replyNotSentYet && lora_protocol_should_i_reply_to_latest_received_request() && !lora_protocol_is_latest_received_request_a_gather() &&
+        lora_protocol_get_latest_received_request_source_address() == destinationAddress;
+}
+
+static bool is_request_waiting_for(uint8_t destinationAddress)
+{
+    if(s_piggyback_request_queued) return true;
+
+    // A query waiting for our tdma slot can leave right now, within the requester's transaction
+    return s_tdma_pending_send && lora_protocol_should_i_wait_for_reply_for_latest_sent_request() && !lora_protocol_is_latest_sent_request_a_gather() &&
+        lora_protocol_get_latest_sent_request_destination_address() == destinationAddress;
+}
+
+static void event_proc_send_pending_reply()
+{
+    if(getState() != TX_WAITING_FOR_REPLY_SENT) return;
+
+    s_pending_reply_scheduled=false;
+
+    // The reply frame is built only now, so that a query queued meanwhile can still ride on it (if it fits)
+    s_reply_carries_request = LORA_PIGGYBACK_ENABLED && !lora_protocol_is_latest_received_request_a_gather() &&
+        is_request_waiting_for(lora_protocol_get_latest_received_request_source_address()) &&
+        lora_protocol_fill_create_reply_with_latest_request_buffer(s_pending_reply_buffer, RADIO_MESSAGES_BUFFER_SIZE, s_pending_reply_payload);
+
+    if(s_reply_carries_request)
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...request rides on the reply: '%s'\n", (const char*)s_pending_reply_buffer);
+
+        s_piggyback_request_queued=false;
+        s_tdma_pending_send=false;
+
+        s_stats.requestsSent++;
+        s_stats.piggybackSent++;
+    }
+    else
+    {
+        lora_protocol_fill_create_reply_buffer(s_pending_reply_buffer, RADIO_MESSAGES_BUFFER_SIZE, s_pending_reply_payload);
+    }
+
+    s_stats.repliesSent++;
+
+    send_frame( s_pending_reply_buffer, RADIO_MESSAGES_BUFFER_SIZE, LORA_ENERGY_CLASS_REPLY, lora_protocol_get_latest_received_request_source_address() );
+}
+
+static void start_reply_transmission(uint16_t replyPayload)
+{
+    int delay;
+
+    if(lora_protocol_is_latest_received_request_a_gather())
+    {
+        // Each member of the group replies in its own slot, counted from request reception
+        uint8_t slot = lora_protocol_get_latest_received_request_gather_slot();
+        int slotOffset = lora_timing_get_gather_slot_offset_ms(slot) + get_broadcast_copies_after_home_ms();
+
+        int elapsedSinceRequest = s_request_rx_timer.read_ms();
+
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...gather reply in slot %u (offset %d ms, elapsed %d ms)\n", slot, slotOffset, elapsedSinceRequest);
+
+        delay = slotOffset - elapsedSinceRequest;
+
+        // A late reply would land in the slot of another member of the group
+        if(delay < 0)
+        {
+            sx127x_debug_if( SX127x_DEBUG_ENABLED, "...GATHER SLOT MISSED, reply dropped\n");
+
+            s_stats.gatherSlotsMissed++;
+
+            setState(INITIAL);
+
+            return;
+        }
+    }
+    else
+    {
+        // Attesa di durata sufficiente per permettere a chi ha inviato la request di mettersi
+        // in ascolto della reply
+        delay = REQUEST_REPLY_DELAY;
+    }
+
+    s_pending_reply_payload = replyPayload;
+    s_pending_reply_scheduled = true;
+
+    setState(TX_WAITING_FOR_REPLY_SENT);
+
+    // Waiting on the event queue instead of blocking it keeps the other events (host link included) running meanwhile
+    if(delay > 0) s_event_queue->call_in(delay, event_proc_send_pending_reply);
+    else event_proc_send_pending_reply();
+}
+
+static void event_proc_send_deferred_reply(uint16_t replyPayload)
+{
+    if(getState() != WAITING_FOR_DEFERRED_REPLY)
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...deferred reply %u came too late, dropped\n", replyPayload);
+
+        return;
+    }
+
+    store_reply_for_retransmissions(lora_protocol_get_latest_received_request_source_address(), replyPayload);
+
+    start_reply_transmission(replyPayload);
+}
+
+void lora_state_machine_send_deferred_reply(uint16_t argReplyPayload)
+{
+    // Radio and state machine are only driven from their own event queue
+    s_event_queue->call(event_proc_send_deferred_reply, argReplyPayload);
+}
+
+// Idle listening and waits for reply keep receiving until their own timeout, a downlink window gives up as soon as
+// no preamble showed up within its symbols
+static void configure_rx(bool downlinkWindow)
+{
+    Radio.SetRxConfig( MODEM_LORA, LORA_BANDWIDTH, LORA_SPREADING_FACTOR,
+                         LORA_CODINGRATE, 0, LORA_PREAMBLE_LENGTH,
+                         downlinkWindow ? lora_timing_get_downlink_window_symbols() : LORA_SYMBOL_TIMEOUT, LORA_FIX_LENGTH_PAYLOAD_ON, 0,
+                         LORA_CRC_ENABLED, s_fhss, LORA_NB_SYMB_HOP,
+                         LORA_IQ_INVERSION_ON, !downlinkWindow );
+
+    s_rx_window_configured = downlinkWindow;
+}
+
+// Listening for requests: with continuous rx the radio is armed once, with no timeout, and left receiving;
+// a sleepy end device sleeps instead (requests for it only come in its downlink windows)
+static void start_idle_rx()
+{
+    if(s_idle_rx_running) return;
+
+    if(s_sleepy)
+    {
+        Radio.Sleep();
+
+        account_energy_class(LORA_ENERGY_CLASS_IDLE);
+        account_radio_mode(LORA_RADIO_MODE_SLEEP);
+
+        s_idle_rx_running = true;
+
+        return;
+    }
+
+    s_stats.rxRestarts++;
+
+    Radio.Sleep();
+
+    if(s_rx_window_configured) configure_rx(false);
+
+    tune_to_home_channel();
+
+    Radio.Rx(LORA_CONTINUOUS_RX_ENABLED ? 0 : RX_TIMEOUT_VALUE);
+
+    account_energy_class(LORA_ENERGY_CLASS_IDLE);
+    account_radio_mode(LORA_RADIO_MODE_RX);
+
+    s_idle_rx_running = LORA_CONTINUOUS_RX_ENABLED;
+}
+
+// Listening for replies within a window (OnRxTimeout closes it)
+static void start_timed_rx(uint32_t timeoutMs)
+{
+    s_idle_rx_running=false;
+
+    Radio.Sleep();
+
+    if(s_rx_window_configured) configure_rx(false);
+
+    tune_to_home_channel();
+
+    Radio.Rx(timeoutMs);
+
+    account_radio_mode(LORA_RADIO_MODE_RX);
+}
+
+static uint32_t get_downlink_windows_end_ms()
+{
+    return lora_timing_get_downlink_window_open_ms(2) + lora_timing_get_downlink_window_ms();
+}
+
+static void event_proc_open_downlink_window(uint8_t generation, uint8_t window)
+{
+    // A newer uplink opens windows of its own, a downlink already received closes them
+    if(generation != s_downlink_windows_generation || !s_downlink_windows_open) return;
+
+    if(getState() != RX_WAITING_FOR_REQUEST || !s_idle_rx_running)
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...radio busy, downlink window %u skipped\n", window );
+
+        return;
+    }
+
+    s_stats.downlinkWindows++;
+
+    // Restarts the watchdog of the state, entered long before the window
+    setState(RX_WAITING_FOR_REQUEST);
+
+    s_idle_rx_running=false;
+
+    Radio.Sleep();
+
+    configure_rx(true);
+
+    tune_to_home_channel();
+
+    // The symbol timeout ends an empty window, a frame started in it is received up to its end
+    Radio.Rx(lora_timing_get_downlink_window_ms() + lora_timing_get_frame_airtime_ms());
+
+    account_energy_class(LORA_ENERGY_CLASS_POLL);
+    account_radio_mode(LORA_RADIO_MODE_RX);
+
+    if(window == 2) s_downlink_windows_open=false;
+}
+
+// Every uplink which isn't followed by a reply window of its own counts as a poll: the gateway answers in its windows
+static void open_downlink_windows()
+{
+    s_uplink_timer.reset();
+
+    s_downlink_windows_generation++;
+    s_downlink_windows_open=true;
+    s_poll_requested=false;
+
+    for(uint8_t window=1; window<=2; window++)
+    {
+        s_event_queue->call_in(lora_timing_get_downlink_window_open_ms(window), event_proc_open_downlink_window, s_downlink_windows_generation, window);
+    }
+}
+
+static void send_poll()
+{
+    uint8_t buffer[RADIO_MESSAGES_BUFFER_SIZE];
+
+    lora_protocol_fill_create_poll_buffer(buffer, RADIO_MESSAGES_BUFFER_SIZE, LORA_GATEWAY_ADDRESS, LORA_SLEEPY_POLL_INTERVAL / 1000);
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA SEND POLL : '%s' ***\n", (const char*)buffer );
+
+    setState(TX_WAITING_FOR_POLL_SENT);
+
+    s_stats.pollsSent++;
+
+    send_frame( buffer, RADIO_MESSAGES_BUFFER_SIZE, LORA_ENERGY_CLASS_POLL, LORA_GATEWAY_ADDRESS );
+}
+
+// Back to listening after a frame we don't care about: a wait for reply (or for bulk reports) keeps its original deadline
+static void restart_rx()
+{
+    if(getState() == RX_WAITING_FOR_BULK_REPORTS)
+    {
+        int remainingMs = (int)s_gather_window_ms - s_gather_window_timer.read_ms();
+
+        start_timed_rx(remainingMs > 0 ? remainingMs : 1);
+
+        return;
+    }
+
+    if(getState() != RX_WAITING_FOR_REPLY)
+    {
+        start_idle_rx();
+
+        return;
+    }
+
+    int remainingMs = lora_protocol_is_latest_sent_request_a_gather() ?
+        (int)s_gather_window_ms - s_gather_window_timer.read_ms() : (int)s_reply_timeout_ms - s_reply_window_timer.read_ms();
+
+    start_timed_rx(remainingMs > 0 ? remainingMs : 1);
+}
+
+// States which keep listening across frames that don't concern them (see restart_rx())
+static bool is_listening()
+{
+    return getState() == RX_WAITING_FOR_REQUEST || getState() == RX_WAITING_FOR_REPLY || getState() == RX_WAITING_FOR_BULK_REPORTS;
+}
+
+// Sequence numbers grow by one for every new request of a sender (skipping 0): a jump means frames we never heard
+static void track_heard_request_sequence()
+{
+    uint8_t sourceAddress, sequence;
+
+    if(!lora_protocol_get_received_data_request_sequence(&sourceAddress, &sequence)) return;
+
+    if(sourceAddress == s_my_address || sourceAddress > LORA_GATHER_MAX_ADDRESS) return;
+
+    uint8_t previous = s_heard_request_sequences[sourceAddress];
+
+    s_heard_request_sequences[sourceAddress] = sequence;
+
+    // First frame heard from this sender, or a retransmission
+    if(previous == 0 || previous == sequence) return;
+
+    uint8_t distance = ((int)sequence - previous + 255) % 255;
+
+    if(distance > 1 && distance <= LORA_MISSED_SEQUENCE_MAX_GAP) s_stats.framesMissed += distance - 1;
+}
+
+// Polls tell which nodes are sleepy end devices, their uplinks when their downlink windows open
+static void track_sleepy_peer()
+{
+    uint8_t sourceAddress;
+
+    if(!lora_protocol_get_received_data_source_address(&sourceAddress) || sourceAddress == s_my_address || sourceAddress > LORA_GATHER_MAX_ADDRESS) return;
+
+    if(lora_protocol_is_received_data_a_poll()) s_sleepy_peers_mask |= 1 << sourceAddress;
+
+    if(!is_sleepy_peer(sourceAddress)) return;
+
+    if(lora_protocol_does_received_data_open_downlink_windows())
+    {
+        // RxDone fires at the end of the uplink, as TxDone on the sleepy node
+        s_peer_uplink_at_ms[sourceAddress] = s_uptime_timer.read_ms();
+        s_downlink_windows_mask |= 1 << sourceAddress;
+    }
+    else
+    {
+        s_downlink_windows_mask &= ~(1 << sourceAddress);
+    }
+}
+
+// Any frame tells the sender is in range, its HELLO frames what it can do and whom it hears
+static void track_neighbor(int16_t rssi, int8_t snr)
+{
+    uint8_t sourceAddress;
+
+    if(!LORA_DISCOVERY_ENABLED || !lora_protocol_get_received_data_source_address(&sourceAddress)) return;
+
+    uint8_t helloSourceAddress, capabilities;
+    uint16_t sequence, neighborMask;
+
+    bool isHello = lora_protocol_get_received_hello(&helloSourceAddress, &capabilities, &sequence, &neighborMask);
+
+    uint32_t nowMs = s_uptime_timer.read_ms();
+
+    s_neighbors_mutex.lock();
+
+    bool isNew = lora_neighbors_update_heard(sourceAddress, rssi, snr, nowMs);
+
+    if(isHello) lora_neighbors_update_beacon(sourceAddress, capabilities, sequence, neighborMask, nowMs);
+
+    if(is_sleepy_peer(sourceAddress)) lora_neighbors_add_capabilities(sourceAddress, LORA_NEIGHBOR_CAPABILITY_SLEEPY);
+
+    s_neighbors_mutex.unlock();
+
+    if(isNew) sx127x_debug_if( SX127x_DEBUG_ENABLED, "...new neighbor %u (RSSI:%d, SNR:%d)\n", sourceAddress, rssi, snr );
+
+    // A node just come in range learns about us (and the nodes we hear) without waiting a whole interval
+    if(isNew && !s_sleepy) schedule_hello(get_hello_greeting_delay_ms());
+}
+
+static void notify_heard()
+{
+    uint8_t sourceAddress;
+
+    if(!lora_state_machine_notify_heard_callback || !lora_protocol_get_received_data_source_address(&sourceAddress)) return;
+
+    if(sourceAddress == s_my_address) return;
+
+    lora_state_machine_notify_heard_callback(sourceAddress, is_sleepy_peer(sourceAddress), get_downlink_window_left_ms(sourceAddress));
+}
+
+// Gathers are left out: their replies come from several nodes, each in its own slot
+static void open_responder_trace()
+{
+    if(!lora_protocol_is_latest_received_request_for_me() || lora_protocol_is_latest_received_request_a_gather()) return;
+
+    uint8_t requestSourceAddress = lora_protocol_get_latest_received_request_source_address();
+
+    lora_trace_open(LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_MAKE_ID(requestSourceAddress, lora_protocol_get_latest_received_request_sequence()),
+        requestSourceAddress, lora_protocol_get_latest_received_request_payload(), lora_protocol_should_i_reply_to_latest_received_request());
+}
+
+static void handle_initial()
+{
+    //sx127x_debug_if( SX127x_DEBUG_ENABLED, "--- INITIAL STATE ---\n");
+
+    if(!s_idle_rx_running)
+    {
+        Radio.Sleep();
+
+        account_radio_mode(LORA_RADIO_MODE_SLEEP);
+    }
+
+    lora_protocol_reset();
+    
+    setState(RX_WAITING_FOR_REQUEST);
+
+    if(s_piggyback_request_queued)
+    {
+        // No reply to ride on (not sent, or no room left in it): the queued request goes out on its own
+        s_piggyback_request_queued=false;
+
+        LoraReplyOutcomes_t outcome = start_request_transmission( s_latest_request_buffer, RADIO_MESSAGES_BUFFER_SIZE );
+
+        if(outcome != LORA_OUTCOME_PENDING) updateAndNotifyConditionOutcome(outcome, 0);
+
+        if(getState() != RX_WAITING_FOR_REQUEST) return;
+    }
+    
+    start_idle_rx();
+}
+
+static void handle_rx_done_received_request()
+{
+    char dumpBuffer[RADIO_MESSAGES_BUFFER_SIZE];
+
+    uint16_t requestPayload;
+    uint16_t replyPayload;
+    uint8_t requestSourceAddress;
+
+    lora_protocol_fill_with_rx_buffer_dump(dumpBuffer, RADIO_MESSAGES_BUFFER_SIZE);
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA REQUEST RECEIVED : '%s' ***\n", dumpBuffer);
+    
+    if(!lora_protocol_is_latest_received_request_for_me())
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...request is not for me\n");
+
+        setState(INITIAL);
+        
+        return;
+    }
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...REQUEST IS FOR ME...\n");
+
+    requestSourceAddress = lora_protocol_get_latest_received_request_source_address();
+    requestPayload = lora_protocol_get_latest_received_request_payload();
+
+    if(!lora_protocol_should_i_reply_to_latest_received_request())
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...but I should not reply\n");
+
+        notify_request(requestSourceAddress, requestPayload);
+
+        setState(INITIAL);
+        
+        return;
+    }
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...AND I SHOULD REPLY...\n");
+
+    if(lora_protocol_get_latest_received_request_sequence() != 0 &&
+        lora_reply_cache_lookup(requestSourceAddress, lora_protocol_get_latest_received_request_sequence(), s_uptime_timer.read_ms(), &replyPayload))
+    {
+        // Retransmission of a query already answered: don't bother the host again
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...duplicate request %u, replying %u from cache\n", lora_protocol_get_latest_received_request_sequence(), replyPayload);
+    }
+    else if(notify_request_and_defer_reply(requestSourceAddress, requestPayload))
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...reply deferred\n");
+
+        setState(WAITING_FOR_DEFERRED_REPLY);
+
+        return;
+    }
+    else
+    {
+        replyPayload = notify_request_and_get_reply(requestSourceAddress, requestPayload);
+
+        store_reply_for_retransmissions(requestSourceAddress, replyPayload);
+    }
+
+    start_reply_transmission(replyPayload);
+}
+
+static void handle_rx_done_received_reply()
+{
+    char dumpBuffer[RADIO_MESSAGES_BUFFER_SIZE];
+
+    lora_protocol_fill_with_rx_buffer_dump(dumpBuffer, RADIO_MESSAGES_BUFFER_SIZE);
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA REPLY RECEIVED ('%s') ***\n", dumpBuffer);
+    
+    if(!lora_protocol_is_latest_received_reply_for_me())
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...reply is not for me, ignoring...\n");
+
+        setState(RX_WAITING_FOR_REPLY);
+
+        restart_rx();
+
+        return;
+    }
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...REPLY IS FOR ME...\n");
+
+    s_stats.repliesReceived++;
+
+    // A query riding on the reply is served as if it came in a frame of its own; the state is set before
+    // notifying the outcome, so that a new query for the same node issued on completion rides on our reply
+    bool carriesRequest = LORA_PIGGYBACK_ENABLED && lora_protocol_does_latest_received_reply_carry_request();
+
+    if(carriesRequest)
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...reply carries a request...\n");
+
+        lora_protocol_process_latest_received_reply_as_request();
+
+        s_request_rx_timer.reset();
+
+        open_responder_trace();
+
+        s_stats.piggybackReceived++;
+
+        setState(RX_DONE_RECEIVED_REQUEST);
+    }
+
+    if(lora_protocol_is_latest_received_reply_right())
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...AND REPLY IS RIGHT\n");
+
+        updateAndNotifyConditionOutcome(LORA_OUTCOME_REPLY_RIGHT, lora_protocol_get_latest_received_reply_payload());
+    }
+    else
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...BUT REPLY IS WRONG\n");
+
+        updateAndNotifyConditionOutcome(LORA_OUTCOME_REPLY_WRONG, 0);
+    }
+
+    if(!carriesRequest) setState(INITIAL);
+}
+
+static void handle_tx_done_sent_request()
+{
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...lora request sent...\n" );
+
+    if(!lora_protocol_should_i_wait_for_reply_for_latest_sent_request())
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...but I should not wait for reply\n" );
+
+        updateAndNotifyConditionOutcome(LORA_OUTCOME_REPLY_NOT_NEEDED, 0);
+
+        setState(INITIAL);
+
+        return;
+    }
+
+    if(lora_protocol_is_latest_sent_request_a_gather())
+    {
+        uint16_t addressMask = lora_protocol_get_latest_sent_gather_mask();
+
+        s_gather_window_ms = lora_state_machine_get_gather_window_ms(addressMask);
+
+        memset(&s_gather_collected_results, 0, sizeof(s_gather_collected_results));
+        s_gather_collected_results.requestedMask = addressMask;
+
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...collecting gather replies for %u ms...\n", s_gather_window_ms );
+
+        setState(RX_WAITING_FOR_REPLY);
+
+        s_gather_window_timer.reset();
+
+        start_timed_rx(s_gather_window_ms);
+
+        return;
+    }
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...waiting %lu ms for reply...\n", (unsigned long)s_reply_timeout_ms );
+    
+    setState(RX_WAITING_FOR_REPLY);
+
+    s_reply_window_timer.reset();
+
+    start_timed_rx(s_reply_timeout_ms);
+}
+
+static void handle_rx_done_received_gather_replies()
+{
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA GATHER DONE: requested 0x%X, responded 0x%X ***\n",
+        s_gather_collected_results.requestedMask, s_gather_collected_results.respondedMask);
+
+    updateAndNotifyGatherOutcome();
+
+    setState(INITIAL);
+}
+
+static void handle_tx_done_sent_reply()
+{
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...LORA REPLY SENT\n" ); 
+
+    if(s_reply_carries_request)
+    {
+        s_reply_carries_request=false;
+
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...waiting %lu ms for reply to the request it carried...\n", (unsigned long)s_reply_timeout_ms );
+
+        setState(RX_WAITING_FOR_REPLY);
+
+        s_reply_window_timer.reset();
+
+        start_timed_rx(s_reply_timeout_ms);
+
+        return;
+    }
+   
+    setState(INITIAL);
+}
+
+// Channel statistics windows are closed while idle; the gateway leaves busy channels out (and brings them back later),
+// telling the other nodes right away
+static void update_channels()
+{
+    if(lora_channels_get_count() == 1) return;
+
+    bool manage = LORA_DISCOVERY_ENABLED && s_my_address == LORA_GATEWAY_ADDRESS;
+
+    s_channels_mutex.lock();
+    bool changed = lora_channels_update(s_uptime_timer.read_ms(), manage);
+    s_channels_mutex.unlock();
+
+    if(!changed) return;
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...active channels now 0x%X\n", lora_channels_get_active_mask() );
+
+    schedule_hello(0);
+}
+
+// Nodes follow the channels the gateway advertises: homes move, ours included
+static void adopt_gateway_channels()
+{
+    uint8_t sourceAddress, capabilities;
+    uint16_t sequence, neighborMask, channelMask;
+
+    if(s_my_address == LORA_GATEWAY_ADDRESS || lora_channels_get_count() == 1) return;
+
+    if(!lora_protocol_get_received_hello(&sourceAddress, &capabilities, &sequence, &neighborMask) || sourceAddress != LORA_GATEWAY_ADDRESS) return;
+
+    if(!lora_protocol_get_received_hello_channel_mask(&channelMask)) return;
+
+    s_channels_mutex.lock();
+    bool changed = lora_channels_set_active_mask(channelMask);
+    s_channels_mutex.unlock();
+
+    if(!changed) return;
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...gateway channels 0x%X, home channel now %u\n", channelMask, lora_channels_get_home(s_my_address) );
+
+    // Idle listening is re-armed on the new home channel
+    s_idle_rx_running = false;
+}
+
+static void resume_bulk();
+
+// A bulk transfer set aside goes on, a sleepy end device polls once its latest windows are over, if it was asked to or
+// nothing went out for a while
+static void handle_rx_waiting_for_request()
+{
+    update_channels();
+
+    if(s_bulk_suspended && !s_downlink_pending_send && (!s_bulk_preempt_requested || s_bulk_suspended_timer.read_ms() > LORA_BULK_PREEMPT_HOLD_TIME))
+    {
+        resume_bulk();
+
+        if(getState() != RX_WAITING_FOR_REQUEST) return;
+    }
+
+    if(!s_sleepy || !s_idle_rx_running || s_downlink_pending_send) return;
+
+    uint32_t sinceUplinkMs = s_uplink_timer.read_ms();
+
+    if(s_downlink_windows_open && sinceUplinkMs < get_downlink_windows_end_ms()) return;
+
+    if(s_poll_requested || sinceUplinkMs >= LORA_SLEEPY_POLL_INTERVAL) send_poll();
+}
+
+static void handle_tx_waiting_for_request_sent()
+{
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...waiting for request being sent...\n" ); 
+}
+
+static void handle_tx_waiting_for_reply_sent()
+{
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...waiting for reply being sent...\n" ); 
+}
+
+// Next fragment of the round, or the poll ending it once they're all out; called again from the tx done of each
+static void send_next_bulk_frame()
+{
+    uint8_t buffer[RADIO_MESSAGES_BUFFER_SIZE];
+    uint8_t index;
+    uint8_t fragment[LORA_BULK_FRAGMENT_SIZE];
+
+    s_bulk_poll_sent = !lora_bulk_sender_next_fragment(&index, fragment);
+
+    if(!s_bulk_poll_sent)
+    {
+        lora_protocol_fill_create_bulk_fragment_buffer(buffer, RADIO_MESSAGES_BUFFER_SIZE, s_bulk_session, index, lora_bulk_sender_get_size(), fragment);
+
+        s_stats.bulkFragmentsSent++;
+    }
+    else
+    {
+        // Only the targets which haven't rebuilt the blob yet report, each in its own slot
+        s_bulk_polled_mask = lora_bulk_sender_get_pending_mask();
+        s_bulk_reported_mask = 0;
+
+        lora_protocol_fill_create_bulk_poll_buffer(buffer, RADIO_MESSAGES_BUFFER_SIZE, s_bulk_session, s_bulk_polled_mask);
+
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA SEND BULK POLL : '%s' ***\n", (const char*)buffer );
+    }
+
+    // Restarts the watchdog of the state, frame after frame
+    setState(TX_WAITING_FOR_BULK_SENT);
+
+    send_frame( buffer, RADIO_MESSAGES_BUFFER_SIZE, LORA_ENERGY_CLASS_GATHER, 0 );
+}
+
+// The urgent request goes out from the idle state, the transfer keeps its completion and the time left to its timeout
+static void suspend_bulk()
+{
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...bulk transfer set aside for an urgent request...\n" );
+
+    s_engine.suspend();
+
+    s_bulk_suspended = true;
+    s_bulk_suspended_timer.reset();
+
+    s_stats.bulkPreemptions++;
+
+    handle_initial();
+}
+
+// From the idle state only, so that the urgent request (and whatever it started) is over
+static void resume_bulk()
+{
+    if(!s_engine.resume()) return;
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...bulk transfer goes on...\n" );
+
+    s_bulk_suspended = false;
+    s_bulk_preempt_requested = false;
+
+    send_next_bulk_frame();
+}
+
+static void start_bulk_report_window()
+{
+    s_gather_window_ms = get_bulk_report_window_ms(s_bulk_polled_mask);
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...collecting bulk reports for %u ms...\n", s_gather_window_ms );
+
+    setState(RX_WAITING_FOR_BULK_REPORTS);
+
+    s_gather_window_timer.reset();
+
+    start_timed_rx(s_gather_window_ms);
+}
+
+// A repair round follows as long as some target lacks fragments and rounds are left, the outcome otherwise
+static void handle_rx_done_received_bulk_reports()
+{
+    uint16_t completedMask = lora_bulk_sender_get_completed_mask();
+    uint16_t pendingMask = lora_bulk_sender_get_pending_mask();
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA BULK ROUND %u DONE: targets 0x%X, rebuilt 0x%X, reported 0x%X ***\n",
+        lora_bulk_sender_get_round(), lora_bulk_sender_get_targets_mask(), completedMask, s_bulk_reported_mask);
+
+    if(pendingMask != 0 && lora_bulk_sender_get_round() <= LORA_BULK_MAX_ROUNDS && lora_bulk_sender_plan_round() > 0)
+    {
+        s_stats.bulkRounds++;
+
+        if(s_bulk_preempt_requested) suspend_bulk();
+        else send_next_bulk_frame();
+
+        return;
+    }
+
+    LoraReplyOutcomes_t outcome;
+
+    if(completedMask == 0) outcome = LORA_OUTCOME_WAITING_FOR_REPLY_TIMEOUT;
+    else if(pendingMask == 0) outcome = LORA_OUTCOME_REPLY_RIGHT;
+    else outcome = LORA_OUTCOME_GATHER_PARTIAL;
+
+    updateAndNotifyBulkOutcome(outcome);
+
+    setState(INITIAL);
+}
+
+// Indexed by AppStates_t; NULL where the state only waits for a radio event
+static constexpr LoraPolicy::StateHandler s_state_handlers[] =
+{
+    handle_initial,                             // INITIAL
+    handle_rx_waiting_for_request,              // RX_WAITING_FOR_REQUEST
+    NULL,                                       // RX_WAITING_FOR_REPLY
+    handle_rx_done_received_request,            // RX_DONE_RECEIVED_REQUEST
+    handle_rx_done_received_reply,              // RX_DONE_RECEIVED_REPLY
+    handle_tx_waiting_for_request_sent,         // TX_WAITING_FOR_REQUEST_SENT
+    handle_tx_waiting_for_reply_sent,           // TX_WAITING_FOR_REPLY_SENT
+    handle_tx_done_sent_request,                // TX_DONE_SENT_REQUEST
+    handle_tx_done_sent_reply,                  // TX_DONE_SENT_REPLY
+    handle_rx_done_received_gather_replies,     // RX_DONE_RECEIVED_GATHER_REPLIES
+    NULL,                                       // TX_WAITING_FOR_BEACON_SENT
+    NULL,                                       // WAITING_FOR_DEFERRED_REPLY
+    NULL,                                       // TX_WAITING_FOR_POLL_SENT
+    NULL,                                       // TX_WAITING_FOR_BULK_SENT
+    NULL,                                       // RX_WAITING_FOR_BULK_REPORTS
+    handle_rx_done_received_bulk_reports        // RX_DONE_RECEIVED_BULK_REPORTS
+};
+
+static_assert(sizeof(s_state_handlers)/sizeof(s_state_handlers[0]) == APP_STATES_COUNT, "one handler per lora state expected");
+
+LoraPolicy::StateHandler LoraPolicy::get_state_handler(AppStates_t state)
+{
+    return s_state_handlers[state];
+}
+
+void lora_event_proc_communication_cycle()
+{
+    s_engine.dispatch();
+}
+
+LoraReplyOutcomes_t lora_state_machine_send_request(uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply)
+{
+    uint16_t bufferSize=RADIO_MESSAGES_BUFFER_SIZE;
+    uint8_t buffer[RADIO_MESSAGES_BUFFER_SIZE];
+
+    if(is_unknown_peer(argDestinationAddress))
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...%u not heard lately, request not sent\n", argDestinationAddress );
+
+        s_stats.unknownPeers++;
+
+        return LORA_OUTCOME_UNKNOWN_PEER;
+    }
+
+    bool piggyback = argRequiresReply && can_piggyback_request_to(argDestinationAddress);
+
+    if((getState() != RX_WAITING_FOR_REQUEST || s_downlink_pending_send) && !piggyback) return LORA_OUTCOME_INVALID_STATE;
+
+    if(s_bulk_suspended && !s_bulk_preempt_requested) return LORA_OUTCOME_INVALID_STATE;
+
+    // Send the REQUEST frame
+    lora_protocol_fill_create_request_buffer(buffer, bufferSize, argCounter, argDestinationAddress, argRequiresReply);
+
+    // A sleepy end device told that more is waiting for it polls again right away, instead of at its own pace
+    if(is_sleepy_peer(argDestinationAddress) && lora_state_machine_get_pending_downlinks_callback &&
+        lora_state_machine_get_pending_downlinks_callback(argDestinationAddress) > 0)
+    {
+        lora_protocol_set_more_data_flag(buffer, bufferSize);
+    }
+
+    char dumpBuffer[RADIO_MESSAGES_BUFFER_SIZE];
+
+    lora_protocol_fill_with_tx_buffer_dump(dumpBuffer, buffer, RADIO_MESSAGES_BUFFER_SIZE);
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA SEND REQUEST : '%s' ***\n", dumpBuffer);
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...timeouts: tx %lu ms, reply %lu ms, %u attempts\n",
+        (unsigned long)s_tx_timeout_ms, argRequiresReply ? (unsigned long)s_reply_timeout_ms : 0UL, argRequiresReply ? 1 + LORA_QUERY_MAX_RETRIES : 1);
+
+    memcpy(s_latest_request_buffer, buffer, RADIO_MESSAGES_BUFFER_SIZE);
+    s_retries_left = argRequiresReply ? LORA_QUERY_MAX_RETRIES : 0;
+
+    // The sequence number the responder gets in the frame makes the trace id on both sides
+    lora_trace_open(LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_MAKE_ID(s_my_address, lora_protocol_get_latest_sent_request_sequence()), argDestinationAddress, argCounter, argRequiresReply);
+
+    if(piggyback)
+    {
+        // Retransmissions (if any) use the stand-alone frame, with the same sequence number
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...queued, it will ride on the reply to %u\n", argDestinationAddress);
+
+        s_piggyback_request_queued=true;
+
+        return LORA_OUTCOME_PENDING;
+    }
+
+    LoraReplyOutcomes_t outcome = start_request_transmission( buffer, bufferSize );
+
+    // The urgent request the bulk transfer was set aside for is on its way
+    if(outcome == LORA_OUTCOME_PENDING && s_bulk_suspended) s_bulk_preempt_requested = false;
+
+    return outcome;
+}
+
+LoraReplyOutcomes_t lora_state_machine_send_gather_request(uint16_t argCounter, uint16_t argAddressMask)
+{
+    uint16_t bufferSize=RADIO_MESSAGES_BUFFER_SIZE;
+    uint8_t buffer[RADIO_MESSAGES_BUFFER_SIZE];
+
+    // Address 0 (broadcast) can't be part of a group
+    argAddressMask &= ~1;
 
-#include "lora_state_machine.h"
+    // Not worth retrying, whatever the state
+    if(argAddressMask == 0) return LORA_OUTCOME_INVALID_ARGUMENT;
 
-#define REQUEST_REPLY_DELAY                             150       // in ms
-#define STATE_MACHINE_STALE_STATE_TIMEOUT               (RX_TIMEOUT_VALUE+500)      // in ms
+    if(getState() != RX_WAITING_FOR_REQUEST || s_bulk_suspended) return LORA_OUTCOME_INVALID_STATE;
 
-#define RADIO_MESSAGES_BUFFER_SIZE                      32
+    // Send the GATHER frame
+    lora_protocol_fill_create_gather_request_buffer(buffer, bufferSize, argCounter, argAddressMask);
 
-/*
- *  Global variables declarations
- */
-typedef enum
-{
-    INITIAL,
+    char dumpBuffer[RADIO_MESSAGES_BUFFER_SIZE];
 
-    RX_WAITING_FOR_REQUEST,
-    RX_WAITING_FOR_REPLY,
+    lora_protocol_fill_with_tx_buffer_dump(dumpBuffer, buffer, RADIO_MESSAGES_BUFFER_SIZE);
 
-    RX_DONE_RECEIVED_REQUEST,
-    RX_DONE_RECEIVED_REPLY,
- 
-    TX_WAITING_FOR_REQUEST_SENT,
-    TX_WAITING_FOR_REPLY_SENT,
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA SEND GATHER REQUEST : '%s' ***\n", dumpBuffer);
 
-    TX_DONE_SENT_REQUEST,
-    TX_DONE_SENT_REPLY
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...timeouts: tx %lu ms, gather window %lu ms\n",
+        (unsigned long)s_tx_timeout_ms, (unsigned long)lora_state_machine_get_gather_window_ms(argAddressMask));
 
-} AppStates_t;
- 
-static AppStates_t State = INITIAL;
- 
-/*!
- * Radio events function pointer
- */
-static RadioEvents_t RadioEvents;
- 
-/*
- *  Global variables declarations
- */
-static Timer s_state_timer;
+    s_retries_left = 0;
 
-Mutex lora_reply_cond_var_mutex;
-ConditionVariable lora_reply_cond_var(lora_reply_cond_var_mutex);
-LoraReplyOutcomes_t lora_reply_outcome;
-uint16_t lora_reply_payload;
+    return start_request_transmission( buffer, bufferSize );
+}
 
-lora_notify_request_callback_t lora_state_machine_notify_request_callback;
-lora_notify_request_and_get_reply_callback_t lora_state_machine_notify_request_and_get_reply_callback;
+LoraReplyOutcomes_t lora_state_machine_send_request_and_wait(uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply, uint32_t argTimeoutMs, uint16_t* outReplyPayload)
+{
+    return s_engine.send_request_and_wait(argCounter, argDestinationAddress, argRequiresReply, argTimeoutMs, outReplyPayload);
+}
 
-inline AppStates_t getState() { return State;}
-AppStates_t setState(AppStates_t newState) { AppStates_t previousState=State; State=newState; s_state_timer.reset(); return previousState;}
+LoraReplyOutcomes_t lora_state_machine_send_gather_request_and_wait(uint16_t argCounter, uint16_t argAddressMask, uint32_t argTimeoutMs, LoraGatherResults_t* outResults)
+{
+    return s_engine.send_and_wait(
+        [=]() { return lora_state_machine_send_gather_request(argCounter, argAddressMask); },
+        argTimeoutMs,
+        [=](LoraReplyOutcomes_t outcome, uint16_t) { if(outcome==LORA_OUTCOME_REPLY_RIGHT || outcome==LORA_OUTCOME_GATHER_PARTIAL) *outResults = s_gather_published_results; });
+}
 
-inline void updateAndNotifyConditionOutcome(LoraReplyOutcomes_t outcome, uint16_t payload)
+LoraReplyOutcomes_t lora_state_machine_send_request_async(uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply, uint32_t argTimeoutMs, lora_completion_callback_t argCompletion)
 {
-    lora_reply_cond_var_mutex.lock();
-    lora_reply_outcome=outcome;
-    lora_reply_payload=payload;
-    lora_reply_cond_var.notify_all();
-    lora_reply_cond_var_mutex.unlock();
+    return s_engine.send_request_async(argCounter, argDestinationAddress, argRequiresReply, argTimeoutMs, argCompletion);
 }
 
-void notify_request(uint8_t requestSourceAddress, uint16_t requestPayload)
+static void on_gather_completion(LoraReplyOutcomes_t outcome, uint16_t)
 {
-    if(lora_state_machine_notify_request_callback) lora_state_machine_notify_request_callback(requestSourceAddress, requestPayload);
+    if(s_gather_completion) s_gather_completion(outcome, &s_gather_published_results);
 }
 
-uint16_t notify_request_and_get_reply(uint8_t requestSourceAddress, uint16_t requestPayload)
+LoraReplyOutcomes_t lora_state_machine_send_gather_request_async(uint16_t argCounter, uint16_t argAddressMask, uint32_t argTimeoutMs, lora_gather_completion_callback_t argCompletion)
 {
-    if(lora_state_machine_notify_request_and_get_reply_callback) return lora_state_machine_notify_request_and_get_reply_callback(requestSourceAddress, requestPayload);
-    
-    return 0;
+    return s_engine.send_async(
+        [=]() { s_gather_completion = argCompletion; return lora_state_machine_send_gather_request(argCounter, argAddressMask); },
+        argTimeoutMs,
+        on_gather_completion);
 }
 
-void lora_event_proc_communication_cycle()
+LoraReplyOutcomes_t lora_state_machine_send_bulk(const uint8_t* argBlob, uint16_t argSize, uint16_t argAddressMask)
 {
-    uint16_t bufferSize=RADIO_MESSAGES_BUFFER_SIZE;
-    uint8_t buffer[RADIO_MESSAGES_BUFFER_SIZE];
+    // Fragments go out back to back, regardless of any slot schedule
+    if(LORA_TDMA_ENABLED) return LORA_OUTCOME_INVALID_STATE;
 
-    char dumpBuffer[RADIO_MESSAGES_BUFFER_SIZE];
+    if(getState() != RX_WAITING_FOR_REQUEST || s_downlink_pending_send || s_bulk_suspended) return LORA_OUTCOME_INVALID_STATE;
 
-    int elapsed_ms=s_state_timer.read_ms();
+    if(s_my_address <= LORA_BULK_MAX_ADDRESS) argAddressMask &= ~(1 << s_my_address);
 
-    if(elapsed_ms > STATE_MACHINE_STALE_STATE_TIMEOUT)
-    {
-        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...(lora state-machine timeout, resetting to initial state)...\n" );
+    s_bulk_preempt_requested = false;
 
-        setState(INITIAL);
-    }
+    if(++s_bulk_session == 0) s_bulk_session = 1;
 
-    uint16_t requestPayload;
-    uint16_t replyPayload;
-    uint8_t requestSourceAddress;
-    uint8_t replyDestinationAddress;
+    if(!lora_bulk_sender_start(s_bulk_session, argBlob, argSize, argAddressMask & ~1)) return LORA_OUTCOME_INVALID_STATE;
 
-    switch( getState() )
-    {
-        case INITIAL:
+    uint8_t count = lora_bulk_sender_plan_round();
 
-            //sx127x_debug_if( SX127x_DEBUG_ENABLED, "--- INITIAL STATE ---\n");
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA SEND BULK %u : %u bytes to 0x%X, %u fragments (%u data) ***\n",
+        s_bulk_session, argSize, lora_bulk_sender_get_targets_mask(), count, lora_bulk_get_data_fragment_count(argSize) );
 
-            Radio.Sleep();
+    s_stats.bulkRounds++;
 
-            lora_protocol_reset();
-            
-            setState(RX_WAITING_FOR_REQUEST);
-            
-            Radio.Rx(RX_TIMEOUT_VALUE);
+    send_next_bulk_frame();
 
-            break;
+    return LORA_OUTCOME_PENDING;
+}
 
-        case RX_WAITING_FOR_REQUEST:
-            //sx127x_debug_if( SX127x_DEBUG_ENABLED, "...(waiting for request)...\n" );
-            break;
+LoraReplyOutcomes_t lora_state_machine_send_bulk_async(const uint8_t* argBlob, uint16_t argSize, uint16_t argAddressMask, uint32_t argTimeoutMs, lora_completion_callback_t argCompletion)
+{
+    return s_engine.send_async([=]() { return lora_state_machine_send_bulk(argBlob, argSize, argAddressMask); }, argTimeoutMs, argCompletion);
+}
 
-        case RX_WAITING_FOR_REPLY:
-            //sx127x_debug_if( SX127x_DEBUG_ENABLED, "...(waiting for reply)...\n" );
-            break;
+bool lora_state_machine_preempt_bulk()
+{
+    AppStates_t state = getState();
+
+    bool bulkOngoing = s_bulk_suspended || state == TX_WAITING_FOR_BULK_SENT || state == RX_WAITING_FOR_BULK_REPORTS || state == RX_DONE_RECEIVED_BULK_REPORTS;
 
-        case RX_DONE_RECEIVED_REQUEST:
+    if(!bulkOngoing) return false;
 
-            lora_protocol_fill_with_rx_buffer_dump(dumpBuffer, RADIO_MESSAGES_BUFFER_SIZE);
+    s_bulk_preempt_requested = true;
 
-            sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA REQUEST RECEIVED : '%s' ***\n", dumpBuffer);
-            
-            if(!lora_protocol_is_latest_received_request_for_me())
-            {
-                sx127x_debug_if( SX127x_DEBUG_ENABLED, "...request is not for me\n");
+    // A hold which ran out is granted again
+    if(s_bulk_suspended) s_bulk_suspended_timer.reset();
 
-                setState(INITIAL);
-                
-                break;
-            }
+    return true;
+}
 
-            sx127x_debug_if( SX127x_DEBUG_ENABLED, "...REQUEST IS FOR ME...\n");
+// Every target of the poll reporting ends the window early
+static void collect_bulk_report()
+{
+    if(getState() != RX_WAITING_FOR_BULK_REPORTS)
+    {
+        if(is_listening()) restart_rx();
 
-            requestSourceAddress = lora_protocol_get_latest_received_request_source_address();
-            requestPayload = lora_protocol_get_latest_received_request_payload();
+        return;
+    }
 
-            if(!lora_protocol_should_i_reply_to_latest_received_request())
-            {
-                sx127x_debug_if( SX127x_DEBUG_ENABLED, "...but I should not reply\n");
+    uint8_t sourceAddress, session, destinationAddress;
+    uint64_t missingMask;
 
-                notify_request(requestSourceAddress, requestPayload);
+    if(lora_protocol_get_received_bulk_report(&sourceAddress, &session, &destinationAddress, &missingMask) && destinationAddress == s_my_address &&
+        session == s_bulk_session && sourceAddress <= LORA_BULK_MAX_ADDRESS && (s_bulk_polled_mask & (1 << sourceAddress)))
+    {
+        lora_bulk_sender_add_report(sourceAddress, missingMask);
 
-                setState(INITIAL);
-                
-                break;
-            }
+        s_bulk_reported_mask |= 1 << sourceAddress;
+        s_stats.bulkReportsReceived++;
 
-            sx127x_debug_if( SX127x_DEBUG_ENABLED, "...AND I SHOULD REPLY...\n");
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...bulk report from %u collected\n", sourceAddress );
+    }
 
-            replyPayload = notify_request_and_get_reply(requestSourceAddress, requestPayload);
+    int remaining_ms = (int)s_gather_window_ms - s_gather_window_timer.read_ms();
 
-            setState(TX_WAITING_FOR_REPLY_SENT);
-            
-            // Attesa di durata sufficiente per permettere a chi ha inviato la request di mettersi
-            // in ascolto della reply
-            wait_ms(REQUEST_REPLY_DELAY);
+    if(s_bulk_reported_mask == s_bulk_polled_mask || remaining_ms <= 0)
+    {
+        setState(RX_DONE_RECEIVED_BULK_REPORTS);
 
-            // Send the REPLY frame
-            lora_protocol_fill_create_reply_buffer(buffer, bufferSize, replyPayload);
+        return;
+    }
 
-            Radio.Send( buffer, bufferSize );
+    start_timed_rx(remaining_ms);
+}
 
-            break;
+static void receive_bulk_fragment()
+{
+    uint8_t sourceAddress, session, index;
+    uint16_t size;
+    uint8_t fragment[LORA_BULK_FRAGMENT_SIZE];
 
-        case RX_DONE_RECEIVED_REPLY:
+    if(!lora_protocol_get_received_bulk_fragment(&sourceAddress, &session, &index, &size, fragment) || sourceAddress == s_my_address) return;
 
-            lora_protocol_fill_with_rx_buffer_dump(dumpBuffer, RADIO_MESSAGES_BUFFER_SIZE);
+    s_stats.bulkFragmentsReceived++;
 
-            sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA REPLY RECEIVED ('%s') ***\n", dumpBuffer);
-            
-            if(!lora_protocol_is_latest_received_reply_for_me())
-            {
-                sx127x_debug_if( SX127x_DEBUG_ENABLED, "...reply is not for me, ignoring...\n");
+    if(!lora_bulk_receiver_add_fragment(sourceAddress, session, size, index, fragment)) return;
 
-                Radio.Sleep();
-                Radio.Rx(RX_TIMEOUT_VALUE);
-            }
-            else
-            {
-                sx127x_debug_if( SX127x_DEBUG_ENABLED, "...REPLY IS FOR ME...\n");
+    const uint8_t* blob = lora_bulk_receiver_get_blob(&size);
 
-                if(lora_protocol_is_latest_received_reply_right())
-                {
-                    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...AND REPLY IS RIGHT\n");
+    s_stats.bulkRebuilt++;
 
-                    replyPayload = lora_protocol_get_latest_received_reply_payload();
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA BULK %u FROM %u REBUILT : %u bytes ***\n", session, sourceAddress, size );
 
-                    updateAndNotifyConditionOutcome(LORA_OUTCOME_REPLY_RIGHT, replyPayload);
+    if(lora_state_machine_notify_bulk_callback) lora_state_machine_notify_bulk_callback(sourceAddress, session, blob, size);
+}
 
-                    setState(INITIAL);
-                }
-                else
-                {
-                    sx127x_debug_if( SX127x_DEBUG_ENABLED, "...BUT REPLY IS WRONG\n");
+static void event_proc_send_bulk_report(uint8_t generation, uint8_t destinationAddress, uint8_t session)
+{
+    if(generation != s_bulk_report_generation) return;
 
-                    updateAndNotifyConditionOutcome(LORA_OUTCOME_REPLY_WRONG, 0);
+    // Whatever we're busy with wins, the sender counts us as silent and plans its repair round accordingly
+    if(getState() != RX_WAITING_FOR_REQUEST || s_tdma_pending_send || s_downlink_pending_send)
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...radio busy, bulk report skipped\n" );
 
-                    setState(INITIAL);
-                }
-            }
+        return;
+    }
 
-            break;
+    uint8_t buffer[RADIO_MESSAGES_BUFFER_SIZE];
 
-        case TX_DONE_SENT_REQUEST:
+    lora_protocol_fill_create_bulk_report_buffer(buffer, RADIO_MESSAGES_BUFFER_SIZE, session, destinationAddress,
+        lora_bulk_receiver_get_missing_mask(destinationAddress, session));
 
-            sx127x_debug_if( SX127x_DEBUG_ENABLED, "...lora request sent...\n" );
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA SEND BULK REPORT : '%s' ***\n", (const char*)buffer );
 
-            Radio.Sleep();
+    setState(TX_WAITING_FOR_BEACON_SENT);
 
-            if(!lora_protocol_should_i_wait_for_reply_for_latest_sent_request())
-            {
-                sx127x_debug_if( SX127x_DEBUG_ENABLED, "...but I should not wait for reply\n" );
+    s_stats.bulkReportsSent++;
 
-                updateAndNotifyConditionOutcome(LORA_OUTCOME_REPLY_NOT_NEEDED, 0);
+    send_frame( buffer, RADIO_MESSAGES_BUFFER_SIZE, LORA_ENERGY_CLASS_GATHER, destinationAddress );
+}
 
-                setState(INITIAL);
+// Polled targets report in their own slot, ranked by address within the mask as gather replies are
+static void schedule_bulk_report()
+{
+    uint8_t sourceAddress, session;
+    uint16_t addressMask;
 
-                break;
-            }
+    if(!lora_protocol_get_received_bulk_poll(&sourceAddress, &session, &addressMask)) return;
 
-            sx127x_debug_if( SX127x_DEBUG_ENABLED, "...waiting for reply...\n" );
-            
-            setState(RX_WAITING_FOR_REPLY);
+    if(s_my_address > LORA_BULK_MAX_ADDRESS || !(addressMask & (1 << s_my_address))) return;
 
-            Radio.Rx(RX_TIMEOUT_VALUE);
+    uint8_t slot=0;
 
-            break;
+    for(uint8_t address=1; address<s_my_address; address++)
+    {
+        if(addressMask & (1 << address)) slot++;
+    }
 
-        case TX_DONE_SENT_REPLY:
+    s_bulk_report_generation++;
 
-            sx127x_debug_if( SX127x_DEBUG_ENABLED, "...LORA REPLY SENT\n" ); 
-           
-            setState(INITIAL);
-            
-            break;
+    s_event_queue->call_in(REQUEST_REPLY_DELAY + slot * lora_timing_get_gather_slot_ms() + get_broadcast_copies_after_home_ms(),
+        event_proc_send_bulk_report, s_bulk_report_generation, sourceAddress, session);
+}
 
-        case TX_WAITING_FOR_REQUEST_SENT:
+static void collect_gather_reply()
+{
+    if(lora_protocol_is_latest_received_reply_for_me())
+    {
+        uint8_t replySourceAddress = lora_protocol_get_latest_received_reply_source_address();
+        uint16_t replySourceBit = replySourceAddress <= LORA_GATHER_MAX_ADDRESS ? (1 << replySourceAddress) : 0;
 
-            sx127x_debug_if( SX127x_DEBUG_ENABLED, "...waiting for request being sent...\n" ); 
+        if(s_gather_collected_results.requestedMask & replySourceBit)
+        {
+            s_gather_collected_results.respondedMask |= replySourceBit;
+            s_stats.repliesReceived++;
+            s_gather_collected_results.replyPayloads[replySourceAddress] = lora_protocol_get_latest_received_reply_payload();
 
-            break;
+            sx127x_debug_if( SX127x_DEBUG_ENABLED, "...gather reply from %u collected\n", replySourceAddress );
+        }
+    }
 
-        case TX_WAITING_FOR_REPLY_SENT:
+    int remaining_ms = (int)s_gather_window_ms - s_gather_window_timer.read_ms();
 
-            sx127x_debug_if( SX127x_DEBUG_ENABLED, "...waiting for reply being sent...\n" ); 
+    if(s_gather_collected_results.respondedMask == s_gather_collected_results.requestedMask || remaining_ms <= 0)
+    {
+        setState(RX_DONE_RECEIVED_GATHER_REPLIES);
 
-            break;
+        return;
     }
+
+    // Keep listening for the remaining slots
+    start_timed_rx(remaining_ms);
 }
 
-LoraReplyOutcomes_t lora_state_machine_send_request(uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply)
+void OnTxDone( void )
 {
-    uint16_t bufferSize=RADIO_MESSAGES_BUFFER_SIZE;
-    uint8_t buffer[RADIO_MESSAGES_BUFFER_SIZE];
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "> OnTxDone\n" );
 
-    if(getState() != RX_WAITING_FOR_REQUEST) return LORA_OUTCOME_INVALID_STATE;
+    restore_home_channel_after_hops();
 
-    // Send the REQUEST frame
-    lora_protocol_fill_create_request_buffer(buffer, bufferSize, argCounter, argDestinationAddress, argRequiresReply);
+    // A broadcast is done with its last copy
+    if(s_broadcast_copies_left > 0)
+    {
+        send_next_broadcast_copy();
 
-    char dumpBuffer[RADIO_MESSAGES_BUFFER_SIZE];
+        return;
+    }
 
-    lora_protocol_fill_with_tx_buffer_dump(dumpBuffer, buffer, RADIO_MESSAGES_BUFFER_SIZE);
+    lora_capture_record(LORA_CAPTURE_TX_DONE, s_uptime_timer.read_ms(), NULL, 0, 0, 0);
 
-    sx127x_debug_if( SX127x_DEBUG_ENABLED, "*** LORA SEND REQUEST : '%s' ***\n", dumpBuffer);
+    // The modem falls back to standby at the end of a transmission
+    account_radio_mode(LORA_RADIO_MODE_STANDBY);
 
-    setState(TX_WAITING_FOR_REQUEST_SENT);
+    // Straight back to listening, without waiting for the state machine to get there: only a wait for reply opens its own
+    // window (and a bulk transfer goes on with its next frame, or with the window of its reports)
+    bool replyWindowFollows = (getState() == TX_WAITING_FOR_REQUEST_SENT && lora_protocol_should_i_wait_for_reply_for_latest_sent_request()) ||
+        (getState() == TX_WAITING_FOR_REPLY_SENT && s_reply_carries_request) || getState() == TX_WAITING_FOR_BULK_SENT;
 
-    Radio.Send( buffer, bufferSize );
+    if((LORA_CONTINUOUS_RX_ENABLED || s_sleepy) && !replyWindowFollows) start_idle_rx();
 
-    return LORA_OUTCOME_PENDING;
-}
+    if(s_sleepy && !replyWindowFollows && getState() != TX_WAITING_FOR_BEACON_SENT) open_downlink_windows();
 
-void OnTxDone( void )
-{
-    sx127x_debug_if( SX127x_DEBUG_ENABLED, "> OnTxDone\n" );
+    if(getState() == TX_WAITING_FOR_BEACON_SENT)
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...beacon tx done...\n" );
 
-    if(getState() == TX_WAITING_FOR_REQUEST_SENT)
+        setState(INITIAL);
+    }
+    else if(getState() == TX_WAITING_FOR_POLL_SENT)
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, "...poll tx done...\n" );
+
+        setState(INITIAL);
+    }
+    else if(getState() == TX_WAITING_FOR_BULK_SENT)
+    {
+        if(s_bulk_poll_sent) start_bulk_report_window();
+        else if(s_bulk_preempt_requested) suspend_bulk();
+        else send_next_bulk_frame();
+    }
+    else if(getState() == TX_WAITING_FOR_REQUEST_SENT)
     {
         sx127x_debug_if( SX127x_DEBUG_ENABLED, "...request tx done...\n" );
 
+        lora_trace_stamp(LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_TX_DONE);
+
         setState(TX_DONE_SENT_REQUEST);
     }
     else if (getState() == TX_WAITING_FOR_REPLY_SENT)
     {
         sx127x_debug_if( SX127x_DEBUG_ENABLED, "...reply tx done...\n" );
 
+        lora_trace_stamp(LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REPLY_TX_DONE);
+
+        if(s_reply_carries_request) lora_trace_stamp(LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_TX_DONE);
+
         setState(TX_DONE_SENT_REPLY);
     }
 }
@@ -327,24 +2200,134 @@ void OnRxDone( uint8_t* payload, uint16_t size, int16_t rssi, int8_t snr )
 {
     sx127x_debug_if( SX127x_DEBUG_ENABLED, "> OnRxDone (RSSI:%d, SNR:%d): %s (len: %d) \n", rssi, snr, (const char*)payload, size);
 
+    restore_home_channel_after_hops();
+
     if( size == 0 ) return;
+
+    lora_capture_record(LORA_CAPTURE_RX_DONE, s_uptime_timer.read_ms(), payload, size, rssi, snr);
+
+    account_channel_airtime(size);
     
     lora_protocol_process_received_data(payload, size);
 
+    track_heard_request_sequence();
+
+    track_sleepy_peer();
+
+    track_neighbor(rssi, snr);
+
+    notify_heard();
+
+    if(lora_protocol_is_received_data_a_hello())
+    {
+        s_stats.hellosReceived++;
+
+        adopt_gateway_channels();
+
+        if(is_listening()) restart_rx();
+
+        return;
+    }
+
+    if(lora_protocol_is_received_data_a_poll())
+    {
+        s_stats.pollsReceived++;
+
+        // Nothing to answer: whatever is waiting for the node goes out in its downlink windows
+        if(is_listening()) restart_rx();
+
+        return;
+    }
+
+    if(LORA_TDMA_ENABLED && lora_protocol_is_received_data_a_beacon())
+    {
+        lora_protocol_process_received_data_as_beacon();
+
+        if(s_my_address != TDMA_GATEWAY_ADDRESS)
+        {
+            // RxDone fires at the end of the beacon, which was sent at the start of the superframe
+            s_tdma_superframe_timer.reset();
+            s_tdma_superframe_offset_ms = lora_airtime_get_time_on_air_ms(size);
+
+            strncpy(s_tdma_slot_map, lora_protocol_get_latest_received_beacon_slot_map(), TDMA_MAX_SLOTS);
+            s_tdma_slot_map[TDMA_MAX_SLOTS]='\0';
+
+            s_tdma_synchronized=true;
+
+            s_stats.beaconsReceived++;
+
+            sx127x_debug_if( SX127x_DEBUG_ENABLED, "...tdma beacon %u from %u, slot map '%s'\n",
+                lora_protocol_get_latest_received_beacon_sequence(), lora_protocol_get_latest_received_beacon_source_address(), s_tdma_slot_map);
+        }
+
+        if(is_listening()) restart_rx();
+
+        return;
+    }
+
+    // Bulk frames are taken in any state: fragments are stored whoever they're for, the reports are only collected by
+    // their sender
+    if(lora_protocol_is_received_data_a_bulk_fragment())
+    {
+        receive_bulk_fragment();
+
+        if(is_listening()) restart_rx();
+
+        return;
+    }
+
+    if(lora_protocol_is_received_data_a_bulk_poll())
+    {
+        schedule_bulk_report();
+
+        if(is_listening()) restart_rx();
+
+        return;
+    }
+
+    if(lora_protocol_is_received_data_a_bulk_report())
+    {
+        collect_bulk_report();
+
+        return;
+    }
+
     if(getState() == RX_WAITING_FOR_REQUEST && lora_protocol_is_received_data_a_request())
     {
         sx127x_debug_if( SX127x_DEBUG_ENABLED, "...request rx done...\n" );
 
         lora_protocol_process_received_data_as_request();
 
+        s_request_rx_timer.reset();
+
+        if(s_sleepy && lora_protocol_is_latest_received_request_for_me())
+        {
+            // Got our downlink: no second window, and another poll as soon as it's served if more are waiting
+            s_downlink_windows_open=false;
+
+            s_stats.downlinksReceived++;
+
+            if(lora_protocol_does_latest_received_request_announce_more_data()) s_poll_requested=true;
+        }
+
+        open_responder_trace();
+
         setState(RX_DONE_RECEIVED_REQUEST);
     }
+    else if(getState() == RX_WAITING_FOR_REPLY && lora_protocol_is_received_data_a_reply() && lora_protocol_is_latest_sent_request_a_gather())
+    {
+        lora_protocol_process_received_data_as_reply();
+
+        collect_gather_reply();
+    }
     else if(getState() == RX_WAITING_FOR_REPLY && lora_protocol_is_received_data_a_reply())
     { 
         sx127x_debug_if( SX127x_DEBUG_ENABLED, "...reply rx done...\n" );
 
         lora_protocol_process_received_data_as_reply();
 
+        if(lora_protocol_is_latest_received_reply_for_me()) lora_trace_stamp(LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_REPLY_RX);
+
         setState(RX_DONE_RECEIVED_REPLY);
     }
     else // ricezione valida, ma arrivata in uno stato non previsto
@@ -355,8 +2338,7 @@ void OnRxDone( uint8_t* payload, uint16_t size, int16_t rssi, int8_t snr )
         
         sx127x_debug_if( SX127x_DEBUG_ENABLED, "...valid but unexpected rx done ('%s'), ignoring...\n", dumpBuffer);
 
-        Radio.Sleep();
-        Radio.Rx(RX_TIMEOUT_VALUE);
+        restart_rx();
     }
 }
  
@@ -364,6 +2346,21 @@ void OnTxTimeout( void )
 {
     sx127x_debug_if( SX127x_DEBUG_ENABLED, "> OnTxTimeout\n" );
 
+    restore_home_channel_after_hops();
+
+    s_stats.txTimeouts++;
+
+    lora_capture_record(LORA_CAPTURE_TX_TIMEOUT, s_uptime_timer.read_ms(), NULL, 0, 0, 0);
+
+    account_radio_mode(LORA_RADIO_MODE_STANDBY);
+
+    // Copies of a broadcast still to go are dropped along with it
+    s_broadcast_copies_left=0;
+
+    // The outcome notified below goes to the waiting requester, a query queued for the reply included
+    s_piggyback_request_queued=false;
+    s_reply_carries_request=false;
+
     if(getState() == TX_WAITING_FOR_REQUEST_SENT)
     {
         updateAndNotifyConditionOutcome(LORA_OUTCOME_TIMEOUT_WAITING_FOR_REQUEST_SENT, 0);
@@ -372,6 +2369,10 @@ void OnTxTimeout( void )
     {
         updateAndNotifyConditionOutcome(LORA_OUTCOME_TIMEOUT_WAITING_FOR_REPLY_SENT, 0);
     }
+    else if(getState() == TX_WAITING_FOR_BULK_SENT)
+    {
+        updateAndNotifyBulkOutcome(LORA_OUTCOME_TIMEOUT_WAITING_FOR_REQUEST_SENT);
+    }
     
     setState(INITIAL);
 }
@@ -380,39 +2381,132 @@ void OnRxTimeout( void )
 {
     // sx127x_debug_if( SX127x_DEBUG_ENABLED, "> OnRxTimeout\n" );
 
+    restore_home_channel_after_hops();
+
+    if(getState() == RX_WAITING_FOR_BULK_REPORTS)
+    {
+        sx127x_debug_if(SX127x_DEBUG_ENABLED , "...bulk report window elapsed...\n" );
+
+        setState(RX_DONE_RECEIVED_BULK_REPORTS);
+
+        return;
+    }
+
     if(getState() != RX_WAITING_FOR_REQUEST && getState() != RX_WAITING_FOR_REPLY) return;
 
+    // Idle listening timeouts would flood the capture: only the ones ending a wait for reply are recorded
+    if(getState() == RX_WAITING_FOR_REPLY) lora_capture_record(LORA_CAPTURE_RX_REPLY_TIMEOUT, s_uptime_timer.read_ms(), NULL, 0, 0, 0);
+
     if(getState() == RX_WAITING_FOR_REQUEST)
     {
         // sx127x_debug_if( getState() == RX_WAITING_FOR_REQUEST, "...rx timeout while waiting for request: restarting for request...\n" );
     }
+    else if(getState() == RX_WAITING_FOR_REPLY && lora_protocol_is_latest_sent_request_a_gather())
+    {
+        sx127x_debug_if(SX127x_DEBUG_ENABLED , "...gather window elapsed...\n" );
+
+        setState(RX_DONE_RECEIVED_GATHER_REPLIES);
+
+        return;
+    }
+    else if(getState() == RX_WAITING_FOR_REPLY && s_retries_left > 0 && !is_latest_request_channel_congested())
+    {
+        s_retries_left--;
+
+        sx127x_debug_if(SX127x_DEBUG_ENABLED , "...rx TIMEOUT while WAITING for REPLY: re-sending request (%u retries left)...\n", s_retries_left );
+
+        s_stats.replyTimeouts++;
+        s_stats.retries++;
+
+        setState(RX_WAITING_FOR_REQUEST);
+
+        start_idle_rx();
+
+        // Same frame, hence same sequence number: the responder answers it from its reply cache
+        LoraReplyOutcomes_t outcome = start_request_transmission( s_latest_request_buffer, RADIO_MESSAGES_BUFFER_SIZE );
+
+        if(outcome != LORA_OUTCOME_PENDING) updateAndNotifyConditionOutcome(outcome, 0);
+
+        return;
+    }
     else if(getState() == RX_WAITING_FOR_REPLY)
     {
         sx127x_debug_if(SX127x_DEBUG_ENABLED , "...rx TIMEOUT while WAITING for REPLY: restarting waiting for request...\n" );
 
+        s_stats.replyTimeouts++;
+
         updateAndNotifyConditionOutcome(LORA_OUTCOME_WAITING_FOR_REPLY_TIMEOUT, 0);
     }
 
-    Radio.Sleep();
-
     setState(RX_WAITING_FOR_REQUEST);
     
-    Radio.Rx(RX_TIMEOUT_VALUE);
+    start_idle_rx();
 }
  
 void OnRxError( void )
 {
     sx127x_debug_if( SX127x_DEBUG_ENABLED, "> OnRxError\n" );
 
+    restore_home_channel_after_hops();
+
+    s_stats.rxErrors++;
+
+    lora_capture_record(LORA_CAPTURE_RX_ERROR, s_uptime_timer.read_ms(), NULL, 0, 0, 0);
+
+    // Rx is re-armed from scratch after an error, continuous or not
+    s_idle_rx_running=false;
+
     setState(INITIAL);
     
     sx127x_debug_if( SX127x_DEBUG_ENABLED, "...rx error: resetting state to idle...\n" );
 }
 
+// Frequency hopping: the modem asks for the channelIndex-th hop of the frame, taken among the active channels starting
+// from the one the frame started on (the home channel of its destination, for both sides)
+void OnFhssChangeChannel( uint8_t channelIndex )
+{
+    int startIndex = lora_channels_get_active_index(s_tuned_channel);
+
+    uint32_t frequency = lora_channels_get_frequency(lora_channels_get_active((startIndex > 0 ? startIndex : 0) + channelIndex));
+
+    Radio.SetChannel( frequency );
+
+    // Next tune_to_channel() retunes, even to the channel the frame started on
+    s_tuned_frequency = frequency;
+    s_hopped = true;
+}
+
+static void event_proc_inject_received_frame(std::string* pframe, int16_t rssi, int8_t snr)
+{
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "> Injected frame (%u bytes)\n", (unsigned)pframe->size() );
+
+    OnRxDone( (uint8_t*)&(*pframe)[0], pframe->size(), rssi, snr );
+
+    delete pframe;
+}
+
+void lora_state_machine_inject_received_frame(const uint8_t* argFrame, uint16_t argSize, int16_t argRssi, int8_t argSnr)
+{
+    // Replayed frames go through the same path as the radio ones, on the radio event queue
+    s_event_queue->call(event_proc_inject_received_frame, new std::string((const char*)argFrame, argSize), argRssi, argSnr);
+}
+
 int lora_state_machine_initialize(uint8_t myAddress, EventQueue* eventQueue)
 {
     lora_protocol_initialize(myAddress);
 
+    s_tx_timeout_ms = lora_timing_get_tx_timeout_ms();
+    s_reply_timeout_ms = lora_timing_get_reply_timeout_ms();
+
+    sx127x_debug_if( SX127x_DEBUG_ENABLED, "Timeouts: frame air %lu ms, tx %lu ms, reply %lu ms (host %lu ms)\n",
+        (unsigned long)lora_timing_get_frame_airtime_ms(), (unsigned long)s_tx_timeout_ms, (unsigned long)s_reply_timeout_ms,
+        (unsigned long)lora_timing_get_host_reply_timeout_ms());
+
+    s_my_address = myAddress;
+    s_event_queue = eventQueue;
+
+    s_sleepy = LORA_SLEEPY_END_DEVICE_ENABLED && myAddress != LORA_GATEWAY_ADDRESS;
+
     // Initialize Radio driver
 
     Radio.assign_events_queue(eventQueue);
@@ -422,6 +2516,7 @@ int lora_state_machine_initialize(uint8_t myAddress, EventQueue* eventQueue)
     RadioEvents.RxError = OnRxError;
     RadioEvents.TxTimeout = OnTxTimeout;
     RadioEvents.RxTimeout = OnRxTimeout;
+    RadioEvents.FhssChangeChannel = OnFhssChangeChannel;
 
     Radio.Init( &RadioEvents );
  
@@ -445,26 +2540,79 @@ int lora_state_machine_initialize(uint8_t myAddress, EventQueue* eventQueue)
     
     #endif
 
-    Radio.SetChannel( RF_FREQUENCY ); 
+    lora_channels_initialize(0);
+
+    // Long frames hop, so as not to dwell too long on a single channel
+    s_fhss = LORA_FHSS_ENABLED || (lora_channels_get_count() > 1 && lora_timing_get_frame_airtime_ms() > LORA_FHSS_MIN_FRAME_AIRTIME);
+
+    tune_to_home_channel();
+
+    // Seeds the HELLO intervals from the wideband noise, so that nodes started together draw different ones
+    srand( Radio.Random() ^ myAddress );
  
-    sx127x_debug_if( LORA_FHSS_ENABLED, " > LORA FHSS Mode <\n" );
-    sx127x_debug_if( !LORA_FHSS_ENABLED, " > LORA Mode <\n" );
+    sx127x_debug_if( s_fhss, " > LORA FHSS Mode <\n" );
+    sx127x_debug_if( !s_fhss, " > LORA Mode <\n" );
+    sx127x_debug_if( lora_channels_get_count() > 1, " > %u channels, home channel %u (%lu Hz) <\n",
+        lora_channels_get_count(), s_tuned_channel, (unsigned long)s_tuned_frequency );
+    sx127x_debug_if( LORA_CONTINUOUS_RX_ENABLED && !s_sleepy, " > Continuous RX <\n" );
+    sx127x_debug_if( s_sleepy, " > Sleepy end device, poll every %lu ms, downlink windows at %lu/%lu ms (%u symbols) <\n",
+        (unsigned long)LORA_SLEEPY_POLL_INTERVAL, (unsigned long)lora_timing_get_downlink_window_delay_ms(1),
+        (unsigned long)lora_timing_get_downlink_window_delay_ms(2), lora_timing_get_downlink_window_symbols() );
  
     Radio.SetTxConfig( MODEM_LORA, TX_OUTPUT_POWER, 0, LORA_BANDWIDTH,
                          LORA_SPREADING_FACTOR, LORA_CODINGRATE,
                          LORA_PREAMBLE_LENGTH, LORA_FIX_LENGTH_PAYLOAD_ON,
-                         LORA_CRC_ENABLED, LORA_FHSS_ENABLED, LORA_NB_SYMB_HOP,
-                         LORA_IQ_INVERSION_ON, TX_TIMEOUT_VALUE );
+                         LORA_CRC_ENABLED, s_fhss, LORA_NB_SYMB_HOP,
+                         LORA_IQ_INVERSION_ON, s_tx_timeout_ms );
  
-    Radio.SetRxConfig( MODEM_LORA, LORA_BANDWIDTH, LORA_SPREADING_FACTOR,
-                         LORA_CODINGRATE, 0, LORA_PREAMBLE_LENGTH,
-                         LORA_SYMBOL_TIMEOUT, LORA_FIX_LENGTH_PAYLOAD_ON, 0,
-                         LORA_CRC_ENABLED, LORA_FHSS_ENABLED, LORA_NB_SYMB_HOP,
-                         LORA_IQ_INVERSION_ON, true );
+    configure_rx(false);
  
     Radio.Sleep();
 
-    s_state_timer.start();
+    s_engine.start();
+    s_request_rx_timer.start();
+    s_gather_window_timer.start();
+    s_bulk_suspended_timer.start();
+    s_uptime_timer.start();
+
+    lora_energy_initialize(s_radio_currents_na, s_uptime_timer.read_high_resolution_us());
+    s_reply_window_timer.start();
+
+    if(s_sleepy)
+    {
+        // First poll right away: the gateway learns that downlinks for this node have to wait for its windows
+        s_uplink_timer.start();
+        s_poll_requested=true;
+    }
+
+    lora_neighbors_initialize(myAddress);
+
+    lora_bulk_initialize();
+
+    if(LORA_DISCOVERY_ENABLED && !s_sleepy)
+    {
+        sx127x_debug_if( SX127x_DEBUG_ENABLED, " > Neighbor discovery, hello every %lu +- %lu ms <\n",
+            (unsigned long)LORA_DISCOVERY_BEACON_INTERVAL, (unsigned long)LORA_DISCOVERY_BEACON_JITTER );
+
+        schedule_hello(get_hello_greeting_delay_ms());
+    }
+
+    if(LORA_TDMA_ENABLED)
+    {
+        s_tdma_superframe_timer.start();
+
+        if(myAddress == TDMA_GATEWAY_ADDRESS)
+        {
+            strncpy(s_tdma_slot_map, TDMA_SLOT_MAP, TDMA_MAX_SLOTS);
+            s_tdma_slot_map[TDMA_MAX_SLOTS]='\0';
+
+            s_tdma_synchronized=true;
+
+            sx127x_debug_if( SX127x_DEBUG_ENABLED, " > TDMA gateway, slot map '%s', superframe %lu ms <\n", s_tdma_slot_map, (unsigned long)lora_tdma_get_superframe_ms(s_tdma_slot_map) );
+
+            eventQueue->call_every(lora_tdma_get_superframe_ms(s_tdma_slot_map), tdma_event_proc_send_beacon);
+        }
+    }
 
     return 0;
 }
\ No newline at end of file
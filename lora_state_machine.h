@@ -6,23 +6,139 @@ typedef enum
     LORA_OUTCOME_TIMEOUT_WAITING_FOR_REQUEST_SENT=-4,
     LORA_OUTCOME_TIMEOUT_WAITING_FOR_REPLY_SENT=-5,
     LORA_OUTCOME_INVALID_STATE=-6,
+    LORA_OUTCOME_NO_SLOT=-7,
+    LORA_OUTCOME_UNKNOWN_PEER=-8,
+    LORA_OUTCOME_INVALID_ARGUMENT=-9,
     LORA_OUTCOME_TIMEOUT_STUCK=-10,
     LORA_OUTCOME_REPLY_RIGHT=1,
     LORA_OUTCOME_REPLY_NOT_NEEDED=0,
+    LORA_OUTCOME_GATHER_PARTIAL=2,
 
 } LoraReplyOutcomes_t;
 
+#define LORA_GATHER_MAX_ADDRESS 15 // group masks are 16 bit wide, address 0 is broadcast
+
+typedef struct
+{
+    uint16_t requestedMask;
+    uint16_t respondedMask;
+    uint16_t replyPayloads[LORA_GATHER_MAX_ADDRESS+1];
+
+} LoraGatherResults_t;
+
+typedef struct
+{
+    uint32_t requestsSent;
+    uint32_t repliesSent;
+    uint32_t repliesReceived;
+    uint32_t replyTimeouts;
+    uint32_t retries;
+    uint32_t rxErrors;
+    uint32_t txTimeouts;
+    uint32_t txAirtimeMs;
+    uint32_t beaconsSent;
+    uint32_t beaconsReceived;
+    uint32_t slotWaitMs;
+    uint32_t piggybackSent;
+    uint32_t piggybackReceived;
+    uint32_t rxRestarts;
+    uint32_t framesMissed;
+    uint32_t gatherSlotsMissed;
+    uint32_t pollsSent;
+    uint32_t pollsReceived;
+    uint32_t downlinkWindows;
+    uint32_t downlinksReceived;
+    uint32_t downlinksSent;
+    uint32_t downlinksMissed;
+    uint32_t hellosSent;
+    uint32_t hellosReceived;
+    uint32_t unknownPeers;
+    uint32_t bulkFragmentsSent;
+    uint32_t bulkFragmentsReceived;
+    uint32_t bulkRounds;
+    uint32_t bulkReportsSent;
+    uint32_t bulkReportsReceived;
+    uint32_t bulkRebuilt;
+    uint32_t bulkPreemptions;
+
+} LoraStats_t;
+
 typedef void (*lora_notify_request_callback_t)(uint8_t, uint16_t);
 typedef uint16_t (*lora_notify_request_and_get_reply_callback_t)(uint8_t, uint16_t);
 
-extern Mutex lora_reply_cond_var_mutex;
-extern ConditionVariable lora_reply_cond_var;
-extern LoraReplyOutcomes_t lora_reply_outcome;
-extern uint16_t lora_reply_payload;
+// (source address, payload) -> true if the reply will be sent later through lora_state_machine_send_deferred_reply()
+typedef bool (*lora_notify_request_and_defer_reply_callback_t)(uint8_t, uint16_t);
+
+// (outcome, reply payload) of a request started without blocking
+typedef void (*lora_completion_callback_t)(LoraReplyOutcomes_t, uint16_t);
+
+// (outcome, collected replies) of a gather request started without blocking
+typedef void (*lora_gather_completion_callback_t)(LoraReplyOutcomes_t, const LoraGatherResults_t*);
+
+// (source address, sleepy, downlink window ms) of any frame received from another node; for a sleepy end device, how long
+// a request for it may still be handed to lora_state_machine_send_request() to go out in one of its downlink windows
+typedef void (*lora_notify_heard_callback_t)(uint8_t, bool, uint32_t);
+
+// (destination address) -> requests still waiting for a sleepy end device, besides the one being sent to it
+typedef uint16_t (*lora_get_pending_downlinks_callback_t)(uint8_t);
+
+// (source address, session, blob, size) of a blob rebuilt from the fragments of a bulk transfer
+typedef void (*lora_notify_bulk_callback_t)(uint8_t, uint8_t, const uint8_t*, uint16_t);
 
 extern lora_notify_request_callback_t lora_state_machine_notify_request_callback;
 extern lora_notify_request_and_get_reply_callback_t lora_state_machine_notify_request_and_get_reply_callback;
+extern lora_notify_request_and_defer_reply_callback_t lora_state_machine_notify_request_and_defer_reply_callback;
+extern lora_notify_heard_callback_t lora_state_machine_notify_heard_callback;
+extern lora_get_pending_downlinks_callback_t lora_state_machine_get_pending_downlinks_callback;
+extern lora_notify_bulk_callback_t lora_state_machine_notify_bulk_callback;
 
 int lora_state_machine_initialize(uint8_t myAddress, EventQueue* eventQueue);
 LoraReplyOutcomes_t lora_state_machine_send_request(uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply);
+LoraReplyOutcomes_t lora_state_machine_send_gather_request(uint16_t argCounter, uint16_t argAddressMask);
+LoraReplyOutcomes_t lora_state_machine_send_request_and_wait(uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply, uint32_t argTimeoutMs, uint16_t* outReplyPayload);
+LoraReplyOutcomes_t lora_state_machine_send_gather_request_and_wait(uint16_t argCounter, uint16_t argAddressMask, uint32_t argTimeoutMs, LoraGatherResults_t* outResults);
+LoraReplyOutcomes_t lora_state_machine_send_request_async(uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply, uint32_t argTimeoutMs, lora_completion_callback_t argCompletion);
+LoraReplyOutcomes_t lora_state_machine_send_gather_request_async(uint16_t argCounter, uint16_t argAddressMask, uint32_t argTimeoutMs, lora_gather_completion_callback_t argCompletion);
+void lora_state_machine_send_deferred_reply(uint16_t argReplyPayload);
+void lora_state_machine_inject_received_frame(const uint8_t* argFrame, uint16_t argSize, int16_t argRssi, int8_t argSnr);
+uint32_t lora_state_machine_get_gather_window_ms(uint16_t argAddressMask);
+uint32_t lora_state_machine_get_max_access_delay_ms();
+
+/*!
+ * @brief Sends a blob (up to LORA_BULK_MAX_SIZE bytes) to the nodes of the mask (addresses 1..15) as erasure-coded
+ *        broadcast fragments, with repair rounds for the nodes still missing some (see lora_bulk.h). The outcome payload
+ *        is the mask of the nodes which rebuilt the blob (LORA_OUTCOME_GATHER_PARTIAL if not all of them); refused
+ *        (LORA_OUTCOME_INVALID_STATE) with TDMA
+ */
+LoraReplyOutcomes_t lora_state_machine_send_bulk(const uint8_t* argBlob, uint16_t argSize, uint16_t argAddressMask);
+LoraReplyOutcomes_t lora_state_machine_send_bulk_async(const uint8_t* argBlob, uint16_t argSize, uint16_t argAddressMask, uint32_t argTimeoutMs, lora_completion_callback_t argCompletion);
+
+/*!
+ * @brief Asks the bulk transfer being sent to step aside for an urgent request: at the end of the frame on air (or of
+ *        the report window) the node goes back to idle and the next lora_state_machine_send_request() goes out, every
+ *        other request is refused (LORA_OUTCOME_INVALID_STATE) until the transfer goes on by itself once that one is
+ *        over. The time set aside doesn't count towards the transfer timeout. False if no bulk transfer is ongoing
+ */
+bool lora_state_machine_preempt_bulk();
+
+/*!
+ * @brief Upper bound (in ms) of a bulk transfer with all of its repair rounds, access delay left out
+ */
+uint32_t lora_state_machine_get_bulk_transfer_ms(uint16_t argSize, uint16_t argAddressMask);
+
+/*!
+ * @brief False if neighbor discovery is on and the node wasn't heard lately: a request for it would fail with LORA_OUTCOME_UNKNOWN_PEER
+ */
+bool lora_state_machine_is_peer_known(uint8_t argAddress);
+
+/*!
+ * @brief 0 if a request can be sent right now, otherwise an estimate (in ms) of when the ongoing transaction step ends
+ */
+uint32_t lora_state_machine_get_busy_remaining_ms();
+void lora_state_machine_fill_with_stats_dump(char* destBuffer, size_t destBufferSize);
+void lora_state_machine_fill_with_energy_dump(char* destBuffer, size_t destBufferSize);
+void lora_state_machine_fill_with_sleepy_dump(char* destBuffer, size_t destBufferSize);
+void lora_state_machine_fill_with_neighbors_dump(char* destBuffer, size_t destBufferSize);
+void lora_state_machine_fill_with_channels_dump(char* destBuffer, size_t destBufferSize);
+void lora_state_machine_fill_with_bulk_dump(char* destBuffer, size_t destBufferSize);
 void lora_event_proc_communication_cycle();
@@ -0,0 +1,66 @@
+#include <cstdint>
+#include <cstring>
+
+#include "lora_config.h"
+
+#include "lora_airtime.h"
+#include "lora_tdma.h"
+
+static int8_t get_slot_owner(char slotMapItem)
+{
+    if(slotMapItem >= '0' && slotMapItem <= '9') return slotMapItem - '0';
+    if(slotMapItem >= 'A' && slotMapItem <= 'F') return slotMapItem - 'A' + 10;
+    if(slotMapItem >= 'a' && slotMapItem <= 'f') return slotMapItem - 'a' + 10;
+
+    return -1;
+}
+
+uint32_t lora_tdma_get_slot_ms()
+{
+    return 2 * lora_airtime_get_time_on_air_ms(RADIO_MESSAGES_BUFFER_SIZE) + REQUEST_REPLY_DELAY + TDMA_SLOT_HOST_ALLOWANCE + TDMA_SLOT_GUARD_TIME;
+}
+
+uint32_t lora_tdma_get_beacon_slot_ms()
+{
+    return lora_airtime_get_time_on_air_ms(RADIO_MESSAGES_BUFFER_SIZE) + TDMA_SLOT_GUARD_TIME;
+}
+
+uint32_t lora_tdma_get_superframe_ms(const char* slotMap)
+{
+    size_t slots = strlen(slotMap);
+
+    if(slots > TDMA_MAX_SLOTS) slots = TDMA_MAX_SLOTS;
+
+    return lora_tdma_get_beacon_slot_ms() + slots * lora_tdma_get_slot_ms();
+}
+
+int32_t lora_tdma_get_delay_to_own_slot_ms(const char* slotMap, uint8_t address, uint32_t elapsedInSuperframeMs)
+{
+    size_t slots = strlen(slotMap);
+
+    if(slots > TDMA_MAX_SLOTS) slots = TDMA_MAX_SLOTS;
+
+    uint32_t superframeMs = lora_tdma_get_superframe_ms(slotMap);
+    uint32_t slotMs = lora_tdma_get_slot_ms();
+    uint32_t elapsedMs = elapsedInSuperframeMs % superframeMs;
+
+    int32_t bestDelay = -1;
+
+    for(size_t slot=0; slot<slots; slot++)
+    {
+        if(get_slot_owner(slotMap[slot]) != address) continue;
+
+        uint32_t slotStartMs = lora_tdma_get_beacon_slot_ms() + slot * slotMs;
+
+        int32_t delay;
+
+        // A transaction may start only within the guard time at the beginning of the slot
+        if(elapsedMs >= slotStartMs && elapsedMs <= slotStartMs + TDMA_SLOT_GUARD_TIME) delay = 0;
+        else if(elapsedMs < slotStartMs) delay = slotStartMs - elapsedMs;
+        else delay = superframeMs - elapsedMs + slotStartMs;
+
+        if(bestDelay < 0 || delay < bestDelay) bestDelay = delay;
+    }
+
+    return bestDelay;
+}
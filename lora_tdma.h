@@ -0,0 +1,29 @@
+#ifndef __LORA_TDMA_H__
+#define __LORA_TDMA_H__
+
+#include <cstdint>
+
+#define TDMA_MAX_SLOTS 16
+
+/*!
+ * @brief Length (in ms) of a transmission slot: a full request/reply transaction plus guard time
+ */
+uint32_t lora_tdma_get_slot_ms();
+
+/*!
+ * @brief Length (in ms) of the beacon slot opening each superframe
+ */
+uint32_t lora_tdma_get_beacon_slot_ms();
+
+/*!
+ * @brief Length (in ms) of a superframe (beacon slot followed by one slot per slot map entry)
+ */
+uint32_t lora_tdma_get_superframe_ms(const char* slotMap);
+
+/*!
+ * @brief Delay (in ms) until a transaction can be started by the given address, 0 if it can
+ *        start right now, -1 if the address owns no slot in the slot map
+ */
+int32_t lora_tdma_get_delay_to_own_slot_ms(const char* slotMap, uint8_t address, uint32_t elapsedInSuperframeMs);
+
+#endif // __LORA_TDMA_H__
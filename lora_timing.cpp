@@ -0,0 +1,117 @@
+#include <cstdint>
+
+#include "lora_config.h"
+
+#include "lora_airtime.h"
+#include "lora_timing.h"
+
+#define HOST_FRAME_MAX_SIZE     32      // in bytes, longest host request/reply frame
+#define UART_BITS_PER_BYTE      10      // 8-N-1
+#define RX_MAX_SYMBOL_TIMEOUT   1023    // RegSymbTimeout is 10 bit wide
+
+// The second window must start after a downlink in the first one (early by the timing error) is over
+static_assert(LORA_SLEEPY_RX2_DELAY > LORA_SLEEPY_RX1_DELAY + 2 * LORA_SLEEPY_TIMING_ERROR, "second downlink window overlaps the first one");
+
+static uint32_t with_margin(uint32_t expectedMs)
+{
+    return expectedMs + (expectedMs * TIMEOUT_SAFETY_MARGIN_PERCENT) / 100 + TIMEOUT_SAFETY_MARGIN_MS;
+}
+
+static uint32_t get_host_frame_time_ms()
+{
+    return (HOST_FRAME_MAX_SIZE * UART_BITS_PER_BYTE * 1000UL + HOST_UART_BAUD_RATE - 1) / HOST_UART_BAUD_RATE;
+}
+
+uint32_t lora_timing_get_frame_airtime_ms()
+{
+    return lora_airtime_get_time_on_air_ms(RADIO_MESSAGES_BUFFER_SIZE);
+}
+
+uint32_t lora_timing_get_tx_timeout_ms()
+{
+    return with_margin(lora_timing_get_frame_airtime_ms());
+}
+
+uint32_t lora_timing_get_host_reply_timeout_ms()
+{
+    return with_margin(2 * get_host_frame_time_ms() + HOST_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL + HOST_REPLY_ALLOWANCE);
+}
+
+uint32_t lora_timing_get_host_transaction_timeout_ms()
+{
+    // The host state machine notices its own timeout on the next dispatch
+    return lora_timing_get_host_reply_timeout_ms() + with_margin(HOST_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL);
+}
+
+uint32_t lora_timing_get_reply_timeout_ms()
+{
+    // Requester and responder see the request end at the same time (TxDone / RxDone)
+    return lora_timing_get_host_reply_timeout_ms() +
+        with_margin(LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL + REQUEST_REPLY_DELAY + lora_timing_get_frame_airtime_ms());
+}
+
+uint32_t lora_timing_get_transaction_timeout_ms(bool requiresReply, uint32_t accessDelayMs)
+{
+    uint32_t attemptMs = with_margin(LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL + lora_timing_get_frame_airtime_ms());
+
+    if(!requiresReply) return accessDelayMs + attemptMs;
+
+    // Each retry may wait for the access again (next TDMA slot)
+    return (1 + LORA_QUERY_MAX_RETRIES) * (accessDelayMs + attemptMs + lora_timing_get_reply_timeout_ms());
+}
+
+uint32_t lora_timing_get_gather_reply_base_delay_ms()
+{
+    return lora_timing_get_host_reply_timeout_ms() + with_margin(LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL);
+}
+
+uint32_t lora_timing_get_gather_slot_ms()
+{
+    return lora_timing_get_frame_airtime_ms() + GATHER_REPLY_SLOT_GUARD_TIME;
+}
+
+uint32_t lora_timing_get_gather_slot_offset_ms(uint8_t slot)
+{
+    return lora_timing_get_gather_reply_base_delay_ms() + slot * lora_timing_get_gather_slot_ms();
+}
+
+uint32_t lora_timing_get_gather_window_ms(uint8_t slotCount)
+{
+    return lora_timing_get_gather_slot_offset_ms(slotCount) + GATHER_REPLY_SLOT_GUARD_TIME;
+}
+
+uint32_t lora_timing_get_gather_transaction_timeout_ms(uint32_t gatherWindowMs, uint32_t accessDelayMs)
+{
+    return accessDelayMs + with_margin(LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL + lora_timing_get_frame_airtime_ms() + gatherWindowMs);
+}
+
+uint32_t lora_timing_get_stale_state_timeout_ms(uint32_t expectedMs)
+{
+    return with_margin(expectedMs) + LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL;
+}
+
+uint32_t lora_timing_get_downlink_window_delay_ms(uint8_t window)
+{
+    return window == 1 ? LORA_SLEEPY_RX1_DELAY : LORA_SLEEPY_RX2_DELAY;
+}
+
+uint32_t lora_timing_get_downlink_window_open_ms(uint8_t window)
+{
+    uint32_t delayMs = lora_timing_get_downlink_window_delay_ms(window);
+
+    return delayMs > LORA_SLEEPY_TIMING_ERROR ? delayMs - LORA_SLEEPY_TIMING_ERROR : 0;
+}
+
+uint16_t lora_timing_get_downlink_window_symbols()
+{
+    uint32_t symbolTimeUs = lora_airtime_get_symbol_time_us();
+
+    uint32_t symbols = (2 * LORA_SLEEPY_TIMING_ERROR * 1000UL + symbolTimeUs - 1) / symbolTimeUs + LORA_SLEEPY_RX_MIN_SYMBOLS;
+
+    return symbols < RX_MAX_SYMBOL_TIMEOUT ? symbols : RX_MAX_SYMBOL_TIMEOUT;
+}
+
+uint32_t lora_timing_get_downlink_window_ms()
+{
+    return (lora_timing_get_downlink_window_symbols() * lora_airtime_get_symbol_time_us() + 999) / 1000;
+}
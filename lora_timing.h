@@ -0,0 +1,99 @@
+#ifndef __LORA_TIMING_H__
+#define __LORA_TIMING_H__
+
+#include <cstdint>
+
+/*
+ * Timeout budgets (in ms) derived from the modem settings, frame sizes, turnaround delays and dispatch
+ * intervals in lora_config.h. Each level covers the timeout of the level below it (host link, then radio
+ * hop, then whole transaction) plus its own expected time with TIMEOUT_SAFETY_MARGIN_PERCENT/_MS on top,
+ * so that a valid reply is never cut off while a lost one is detected as soon as possible.
+ */
+
+/*!
+ * @brief Time on air of a frame (every frame is RADIO_MESSAGES_BUFFER_SIZE bytes long)
+ */
+uint32_t lora_timing_get_frame_airtime_ms();
+
+/*!
+ * @brief Radio TX timeout: time on air of a frame, with margin
+ */
+uint32_t lora_timing_get_tx_timeout_ms();
+
+/*!
+ * @brief How long the node waits for its host to answer a query (uart frames, host dispatch, HOST_REPLY_ALLOWANCE)
+ */
+uint32_t lora_timing_get_host_reply_timeout_ms();
+
+/*!
+ * @brief Overall timeout of a request to the host, as seen by the thread sending it
+ */
+uint32_t lora_timing_get_host_transaction_timeout_ms();
+
+/*!
+ * @brief How long the requester listens for a reply after its request was sent: responder dispatch,
+ *        responder host (lora_timing_get_host_reply_timeout_ms()), REQUEST_REPLY_DELAY and reply time on air
+ */
+uint32_t lora_timing_get_reply_timeout_ms();
+
+/*!
+ * @brief Overall timeout of a LoRa request (all its attempts), as seen by the thread sending it;
+ *        accessDelayMs is the longest wait before the request may go on air (TDMA slot)
+ */
+uint32_t lora_timing_get_transaction_timeout_ms(bool requiresReply, uint32_t accessDelayMs);
+
+/*!
+ * @brief From the reception of a gather request to its first reply slot: the responder dispatch and the whole host reply
+ *        timeout, so that any answer the host gives in time still finds its slot open
+ */
+uint32_t lora_timing_get_gather_reply_base_delay_ms();
+
+/*!
+ * @brief Length of a gather reply slot: time on air of the reply and GATHER_REPLY_SLOT_GUARD_TIME
+ */
+uint32_t lora_timing_get_gather_slot_ms();
+
+/*!
+ * @brief From the reception of a gather request to the start of the given reply slot (0 is the first one)
+ */
+uint32_t lora_timing_get_gather_slot_offset_ms(uint8_t slot);
+
+/*!
+ * @brief How long the requester collects the replies of a gather request to slotCount members: until the end of the
+ *        last slot, with one more guard time
+ */
+uint32_t lora_timing_get_gather_window_ms(uint8_t slotCount);
+
+/*!
+ * @brief Overall timeout of a gather request collecting replies for gatherWindowMs
+ */
+uint32_t lora_timing_get_gather_transaction_timeout_ms(uint32_t gatherWindowMs, uint32_t accessDelayMs);
+
+/*!
+ * @brief Watchdog for a state expected to last expectedMs: a state machine stuck longer goes back to initial
+ */
+uint32_t lora_timing_get_stale_state_timeout_ms(uint32_t expectedMs);
+
+/*!
+ * @brief Sleepy end devices: delay (LORA_SLEEPY_RX1_DELAY or LORA_SLEEPY_RX2_DELAY) from the end of an uplink to the start
+ *        of a downlink in window 1 or 2, as timed by the sender of the downlink
+ */
+uint32_t lora_timing_get_downlink_window_delay_ms(uint8_t window);
+
+/*!
+ * @brief Same delay as seen by the sleepy node, which opens the window LORA_SLEEPY_TIMING_ERROR early
+ */
+uint32_t lora_timing_get_downlink_window_open_ms(uint8_t window);
+
+/*!
+ * @brief Receiver symbol timeout of a window: twice LORA_SLEEPY_TIMING_ERROR (both sides may be off) plus the
+ *        LORA_SLEEPY_RX_MIN_SYMBOLS preamble symbols needed to lock, within the 10 bit SX127x register
+ */
+uint16_t lora_timing_get_downlink_window_symbols();
+
+/*!
+ * @brief Length of a window without a frame in it (lora_timing_get_downlink_window_symbols() symbols)
+ */
+uint32_t lora_timing_get_downlink_window_ms();
+
+#endif // __LORA_TIMING_H__
@@ -0,0 +1,350 @@
+#include "mbed.h"
+
+#include "lora_config.h"
+
+#include "lora_trace.h"
+
+typedef struct
+{
+    uint8_t destinationAddress;
+    uint16_t payload;
+    uint32_t hostRxUs;
+    uint32_t queuedUs;
+
+} LoraTraceHostNote_t;
+
+static const char* const s_stage_names[] = LORA_TRACE_STAGE_NAMES;
+
+static_assert(sizeof(s_stage_names)/sizeof(s_stage_names[0]) == LORA_TRACE_STAGES_COUNT, "one name per trace stage expected");
+
+// Stamps come from the radio, host and gateway event queues
+static Mutex s_trace_mutex;
+
+static Timer s_trace_timer;
+
+static volatile bool s_enabled;
+
+// Current record of each role, 0 requester, 1 responder
+static LoraTraceRecord_t s_current[2];
+static bool s_current_open[2];
+
+static LoraTraceRecord_t s_ring[LORA_TRACE_RING_SIZE];
+static uint32_t s_head, s_tail;
+
+static LoraTraceHostNote_t s_host_notes[LORA_TRACE_HOST_NOTES_SIZE];
+static uint8_t s_host_notes_count;
+
+// Last finished responder record and its ring position (s_head when it was stored, dropped if not in the ring any more)
+static LoraTraceRecord_t s_last_responder;
+static bool s_last_responder_valid;
+static uint32_t s_last_responder_position;
+
+static uint32_t s_opened[2], s_finished, s_dropped, s_streamed, s_retransmissions;
+
+static int get_role_index(char role)
+{
+    return role == LORA_TRACE_ROLE_RESPONDER ? 1 : 0;
+}
+
+static bool is_stamped(const LoraTraceRecord_t* record, LoraTraceStages_t stage)
+{
+    return (record->stampedMask & (1UL << stage)) != 0;
+}
+
+static void finish_locked(int roleIndex)
+{
+    if(!s_current_open[roleIndex]) return;
+
+    s_current_open[roleIndex] = false;
+
+    if(roleIndex == 1)
+    {
+        s_last_responder = s_current[roleIndex];
+        s_last_responder_valid = true;
+        s_last_responder_position = s_head;
+    }
+
+    if(s_head - s_tail >= LORA_TRACE_RING_SIZE)
+    {
+        s_dropped++;
+
+        return;
+    }
+
+    s_ring[s_head % LORA_TRACE_RING_SIZE] = s_current[roleIndex];
+
+    s_head++;
+    s_finished++;
+}
+
+// The requester is done once the host has its reply, or with the outcome when no host is waiting for one
+static bool is_complete(const LoraTraceRecord_t* record)
+{
+    if(record->role == LORA_TRACE_ROLE_REQUESTER)
+    {
+        if(is_stamped(record, LORA_TRACE_HOST_TX)) return true;
+
+        return record->outcome != -1 && (!record->requiresReply || !is_stamped(record, LORA_TRACE_QUEUED));
+    }
+
+    if(is_stamped(record, LORA_TRACE_REPLY_TX_DONE)) return true;
+
+    return !record->requiresReply && is_stamped(record, LORA_TRACE_REMOTE_HOST_RX);
+}
+
+void lora_trace_initialize()
+{
+    s_trace_timer.start();
+}
+
+void lora_trace_set_enabled(bool enabled)
+{
+    s_trace_mutex.lock();
+
+    s_enabled = enabled;
+
+    if(!enabled)
+    {
+        s_current_open[0] = s_current_open[1] = false;
+        s_last_responder_valid = false;
+        s_host_notes_count = 0;
+    }
+
+    s_trace_mutex.unlock();
+}
+
+bool lora_trace_is_enabled()
+{
+    return s_enabled;
+}
+
+uint32_t lora_trace_get_time_us()
+{
+    return (uint32_t)s_trace_timer.read_high_resolution_us();
+}
+
+void lora_trace_note_host_request(uint8_t destinationAddress, uint16_t payload, uint32_t hostRxUs)
+{
+    if(!s_enabled) return;
+
+    s_trace_mutex.lock();
+
+    // Full: the oldest note belongs to a request that never made it to the radio
+    if(s_host_notes_count == LORA_TRACE_HOST_NOTES_SIZE)
+    {
+        memmove(&s_host_notes[0], &s_host_notes[1], (LORA_TRACE_HOST_NOTES_SIZE - 1) * sizeof(LoraTraceHostNote_t));
+
+        s_host_notes_count--;
+    }
+
+    LoraTraceHostNote_t* note = &s_host_notes[s_host_notes_count++];
+
+    note->destinationAddress = destinationAddress;
+    note->payload = payload;
+    note->hostRxUs = hostRxUs;
+    note->queuedUs = lora_trace_get_time_us();
+
+    s_trace_mutex.unlock();
+}
+
+static bool take_host_note_locked(uint8_t destinationAddress, uint16_t payload, LoraTraceHostNote_t* outNote)
+{
+    for(uint8_t i=0; i<s_host_notes_count; i++)
+    {
+        if(s_host_notes[i].destinationAddress != destinationAddress || s_host_notes[i].payload != payload) continue;
+
+        if(outNote) *outNote = s_host_notes[i];
+
+        memmove(&s_host_notes[i], &s_host_notes[i + 1], (s_host_notes_count - i - 1) * sizeof(LoraTraceHostNote_t));
+
+        s_host_notes_count--;
+
+        return true;
+    }
+
+    return false;
+}
+
+void lora_trace_discard_host_request(uint8_t destinationAddress, uint16_t payload)
+{
+    if(!s_enabled) return;
+
+    s_trace_mutex.lock();
+
+    take_host_note_locked(destinationAddress, payload, NULL);
+
+    s_trace_mutex.unlock();
+}
+
+// Same request as the last finished responder record: its attempts are bumped if it is still waiting in the ring
+static bool fold_responder_retransmission_locked(uint16_t traceId, uint8_t peer, uint16_t payload)
+{
+    if(s_current_open[1] || !s_last_responder_valid) return false;
+
+    if(s_last_responder.traceId != traceId || s_last_responder.peer != peer || s_last_responder.payload != payload) return false;
+
+    s_last_responder.attempts++;
+
+    bool inRing = s_last_responder_position - s_tail < s_head - s_tail;
+
+    if(inRing) s_ring[s_last_responder_position % LORA_TRACE_RING_SIZE].attempts++;
+
+    s_retransmissions++;
+
+    return true;
+}
+
+void lora_trace_open(char role, uint16_t traceId, uint8_t peer, uint16_t payload, bool requiresReply)
+{
+    if(!s_enabled) return;
+
+    int roleIndex = get_role_index(role);
+
+    s_trace_mutex.lock();
+
+    if(s_current_open[roleIndex] && s_current[roleIndex].traceId == traceId)
+    {
+        s_trace_mutex.unlock();
+
+        return;
+    }
+
+    if(role == LORA_TRACE_ROLE_RESPONDER && fold_responder_retransmission_locked(traceId, peer, payload))
+    {
+        s_trace_mutex.unlock();
+
+        return;
+    }
+
+    finish_locked(roleIndex);
+
+    LoraTraceRecord_t* record = &s_current[roleIndex];
+
+    memset(record, 0, sizeof(LoraTraceRecord_t));
+
+    record->traceId = traceId;
+    record->role = role;
+    record->peer = peer;
+    record->payload = payload;
+    record->requiresReply = requiresReply;
+    record->outcome = -1;
+
+    LoraTraceHostNote_t note;
+
+    if(role == LORA_TRACE_ROLE_REQUESTER && take_host_note_locked(peer, payload, &note))
+    {
+        record->stageUs[LORA_TRACE_HOST_RX] = note.hostRxUs;
+        record->stageUs[LORA_TRACE_QUEUED] = note.queuedUs;
+        record->stampedMask = (1UL << LORA_TRACE_HOST_RX) | (1UL << LORA_TRACE_QUEUED);
+    }
+
+    if(role == LORA_TRACE_ROLE_RESPONDER)
+    {
+        record->stageUs[LORA_TRACE_REMOTE_RX] = lora_trace_get_time_us();
+        record->stampedMask = 1UL << LORA_TRACE_REMOTE_RX;
+    }
+
+    s_current_open[roleIndex] = true;
+    s_opened[roleIndex]++;
+
+    s_trace_mutex.unlock();
+}
+
+void lora_trace_stamp(char role, LoraTraceStages_t stage)
+{
+    if(!s_enabled) return;
+
+    int roleIndex = get_role_index(role);
+
+    s_trace_mutex.lock();
+
+    LoraTraceRecord_t* record = &s_current[roleIndex];
+
+    if(s_current_open[roleIndex])
+    {
+        if(stage == LORA_TRACE_TX_START || stage == LORA_TRACE_REPLY_TX_START) record->attempts++;
+
+        if(!is_stamped(record, stage))
+        {
+            record->stageUs[stage] = lora_trace_get_time_us();
+            record->stampedMask |= 1UL << stage;
+        }
+
+        if(is_complete(record)) finish_locked(roleIndex);
+    }
+
+    s_trace_mutex.unlock();
+}
+
+void lora_trace_set_outcome(char role, int outcome)
+{
+    if(!s_enabled) return;
+
+    int roleIndex = get_role_index(role);
+
+    s_trace_mutex.lock();
+
+    LoraTraceRecord_t* record = &s_current[roleIndex];
+
+    if(s_current_open[roleIndex] && record->outcome == -1)
+    {
+        record->outcome = outcome;
+
+        if(is_complete(record)) finish_locked(roleIndex);
+    }
+
+    s_trace_mutex.unlock();
+}
+
+bool lora_trace_pop(LoraTraceRecord_t* outRecord)
+{
+    s_trace_mutex.lock();
+
+    bool popped = s_head != s_tail;
+
+    if(popped)
+    {
+        *outRecord = s_ring[s_tail % LORA_TRACE_RING_SIZE];
+
+        s_tail++;
+        s_streamed++;
+    }
+
+    s_trace_mutex.unlock();
+
+    return popped;
+}
+
+void lora_trace_fill_with_record_dump(char* destBuffer, size_t destBufferSize, const LoraTraceRecord_t* record)
+{
+    int len = snprintf(destBuffer, destBufferSize, "^T|%u.%u|%c|%u|%u|%d|%u|",
+        record->traceId >> 8, record->traceId & 0xFF, record->role, record->peer, record->payload, record->outcome, record->attempts);
+
+    bool first = true;
+    uint32_t baseUs = 0;
+
+    // Stages are listed in transaction order, so the first one stamped is the earliest
+    for(int stage=0; stage<LORA_TRACE_STAGES_COUNT && len < (int)destBufferSize; stage++)
+    {
+        if(!is_stamped(record, (LoraTraceStages_t)stage)) continue;
+
+        if(first) baseUs = record->stageUs[stage];
+
+        len += snprintf(destBuffer + len, destBufferSize - len, "%s%s=%ld", first ? "" : ",", s_stage_names[stage], (long)(int32_t)(record->stageUs[stage] - baseUs));
+
+        first = false;
+    }
+
+    if(len < (int)destBufferSize) snprintf(destBuffer + len, destBufferSize - len, "@");
+}
+
+void lora_trace_fill_with_stats_dump(char* destBuffer, size_t destBufferSize)
+{
+    s_trace_mutex.lock();
+
+    snprintf(destBuffer, destBufferSize, "on=%d,q=%lu,r=%lu,rtx=%lu,done=%lu,drop=%lu,out=%lu,used=%lu/%d",
+        s_enabled ? 1 : 0, (unsigned long)s_opened[0], (unsigned long)s_opened[1], (unsigned long)s_retransmissions, (unsigned long)s_finished,
+        (unsigned long)s_dropped, (unsigned long)s_streamed, (unsigned long)(s_head - s_tail), LORA_TRACE_RING_SIZE);
+
+    s_trace_mutex.unlock();
+}
@@ -0,0 +1,96 @@
+#ifndef __LORA_TRACE_H__
+#define __LORA_TRACE_H__
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * End to end transaction tracing: each node timestamps the stages a request goes through on its side, both nodes key
+ * their record with the same trace id, (origin address << 8) | sequence number of the request frame, so the two halves
+ * of a transaction can be joined offline (tools/lora_trace_tool).
+ *
+ * Requester ('Q'): host rx -> queued -> tx start -> tx done -> reply rx -> reply to host
+ * Responder ('R'): request rx -> request to host -> host reply -> reply tx start -> reply tx done
+ */
+
+typedef enum
+{
+    LORA_TRACE_HOST_RX,                 // request frame from the host parsed by the uart worker
+    LORA_TRACE_QUEUED,                  // request handed to the radio side (gateway queue or blocking send)
+    LORA_TRACE_TX_START,                // first transmission of the request (retransmissions count as attempts)
+    LORA_TRACE_TX_DONE,
+    LORA_TRACE_REPLY_RX,
+    LORA_TRACE_HOST_TX,                 // reply handed back to the host link
+
+    LORA_TRACE_REMOTE_RX,               // request received by the responder
+    LORA_TRACE_REMOTE_HOST_TX,          // request sent to the responder host
+    LORA_TRACE_REMOTE_HOST_RX,          // reply (or outcome of a command) from the responder host
+    LORA_TRACE_REPLY_TX_START,
+    LORA_TRACE_REPLY_TX_DONE,
+
+    LORA_TRACE_STAGES_COUNT
+
+} LoraTraceStages_t;
+
+// Stage names in the exported records, in LoraTraceStages_t order
+#define LORA_TRACE_STAGE_NAMES { "hrx", "que", "txs", "txd", "rrx", "htx", "rx", "hqs", "hrp", "rts", "rtd" }
+
+#define LORA_TRACE_ROLE_REQUESTER       'Q'
+#define LORA_TRACE_ROLE_RESPONDER       'R'
+
+// "^T|<origin>.<sequence>|<role>|<peer>|<payload>|<outcome>|<attempts>|<stage>=<us>,...@", times relative to the first stage stamped
+#define LORA_TRACE_RECORD_DUMP_SIZE     192
+
+typedef struct
+{
+    uint16_t traceId;
+    char role;
+    uint8_t peer;
+    uint16_t payload;
+    bool requiresReply;
+    int8_t outcome;                     // lora outcome (requester) or host outcome (responder), -1 until known
+    uint8_t attempts;
+    uint32_t stampedMask;               // bit per LoraTraceStages_t
+    uint32_t stageUs[LORA_TRACE_STAGES_COUNT];
+
+} LoraTraceRecord_t;
+
+#define LORA_TRACE_MAKE_ID(originAddress, sequence) ((uint16_t)(((originAddress) << 8) | (sequence)))
+
+void lora_trace_initialize();
+
+void lora_trace_set_enabled(bool enabled);
+bool lora_trace_is_enabled();
+
+uint32_t lora_trace_get_time_us();
+
+/*!
+ * @brief Notes a request from the host before it reaches the radio side: the record opened for it later on (same
+ *        destination and payload, oldest first) starts from these stamps
+ */
+void lora_trace_note_host_request(uint8_t destinationAddress, uint16_t payload, uint32_t hostRxUs);
+void lora_trace_discard_host_request(uint8_t destinationAddress, uint16_t payload);
+
+/*!
+ * @brief Starts the record of the current transaction of a role; a record of the same role still open is finished as it is,
+ *        unless it has the same trace id (retransmission of the same request). A responder retransmission coming after its
+ *        record was finished (reply lost, answered from the reply cache) counts as one more attempt of that record
+ */
+void lora_trace_open(char role, uint16_t traceId, uint8_t peer, uint16_t payload, bool requiresReply);
+
+/*!
+ * @brief Stamps a stage of the current record of a role (first stamp wins, tx start counts the attempts)
+ */
+void lora_trace_stamp(char role, LoraTraceStages_t stage);
+
+void lora_trace_set_outcome(char role, int outcome);
+
+/*!
+ * @brief Takes the oldest finished record out of the ring
+ */
+bool lora_trace_pop(LoraTraceRecord_t* outRecord);
+
+void lora_trace_fill_with_record_dump(char* destBuffer, size_t destBufferSize, const LoraTraceRecord_t* record);
+void lora_trace_fill_with_stats_dump(char* destBuffer, size_t destBufferSize);
+
+#endif // __LORA_TRACE_H__
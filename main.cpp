@@ -2,14 +2,33 @@
 
 #include "lora_state_machine.h"
 #include "host_state_machine.h"
+#include "host_protocol_impl.h"
+
+#include "lora_config.h"
+#include "lora_timing.h"
+#include "lora_gateway.h"
+#include "lora_reply_cache.h"
+#include "host_query_cache.h"
+#include "lora_capture.h"
+#include "lora_benchmark.h"
+#include "lora_trace.h"
 
 static DigitalIn lora_address_in_bit_0(PH_0, PullUp);
 static DigitalIn lora_address_in_bit_1(PH_1, PullUp);
 
 static InterruptIn btn(BUTTON1);
 
-#define LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL         100       // in ms
-#define HOST_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL         100       // in ms
+// Main
+static EventQueue s_eq_main;
+
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+
+// Single-thread cooperative runtime: radio, host link and gateway all run on s_eq_main, so nothing
+// may wait for a reply: requests complete through callbacks instead of condition variables
+static EventQueue& s_eq_manage_lora_communication = s_eq_main;
+static EventQueue& s_eq_manage_host_communication = s_eq_main;
+
+#else
 
 static Thread s_thread_manage_lora_communication;
 static EventQueue s_eq_manage_lora_communication;
@@ -17,11 +36,7 @@ static EventQueue s_eq_manage_lora_communication;
 static Thread s_thread_manage_host_communication;
 static EventQueue s_eq_manage_host_communication;
 
-#define SEND_LORA_REQUEST_TIMEOUT 3000 // in ms
-#define SEND_HOST_REQUEST_TIMEOUT 3000 // in ms
-
-// Main
-static EventQueue s_eq_main;
+#endif
 
 // Variabili per demo
 static uint8_t s_lora_MyAddress;
@@ -36,84 +51,110 @@ static int s_lora_toggler_wheel=-1, s_host_toggler_wheel=-1;
 
 #define MAX_DESTINATION_ADDRESS 4
 
-//static bool s_toggler;
+#define RUNTIME_STATS_MAX_THREADS 8
 
-LoraReplyOutcomes_t send_lora_request(uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply, uint16_t* outReplyPayload)
-{
-    Timer timer;
+// Gateway role: host traffic is queued per peer and scheduled on s_eq_main instead of blocking the host link
+static bool s_gateway_mode;
 
-    lora_reply_cond_var_mutex.lock();
+// Gather request started without blocking, waiting for its replies
+static uint16_t s_pending_gather_mask;
 
-    timer.start();
+// Time base of the host-side query cache
+static Timer s_query_cache_timer;
 
-    bool timedOut=false;
-    uint32_t timeLeft=SEND_LORA_REQUEST_TIMEOUT;
+//static bool s_toggler;
 
-    lora_reply_outcome=LORA_OUTCOME_PENDING;
+static uint32_t get_lora_request_timeout_ms(bool argRequiresReply)
+{
+    // In TDMA mode the request may have to wait for our slot before being sent, and queries may be re-sent
+    return lora_timing_get_transaction_timeout_ms(argRequiresReply, lora_state_machine_get_max_access_delay_ms());
+}
 
-    LoraReplyOutcomes_t outcome = lora_state_machine_send_request(argCounter, argDestinationAddress, argRequiresReply);
+static uint32_t get_lora_gather_timeout_ms(uint16_t argAddressMask)
+{
+    // The requester stays in RX for the whole gather window, so the overall timeout must cover it
+    return lora_timing_get_gather_transaction_timeout_ms(lora_state_machine_get_gather_window_ms(argAddressMask), lora_state_machine_get_max_access_delay_ms());
+}
 
-    if(outcome != LORA_OUTCOME_PENDING)
+static uint32_t get_lora_bulk_timeout_ms(uint16_t argSize, uint16_t argAddressMask)
+{
+    // The repair rounds are all within the transaction
+    return lora_timing_get_gather_transaction_timeout_ms(lora_state_machine_get_bulk_transfer_ms(argSize, argAddressMask), lora_state_machine_get_max_access_delay_ms());
+}
+
+// The request never went on air, as opposed to a negative or missing reply
+static bool is_not_sent_outcome(int outcome)
+{
+    return outcome==LORA_OUTCOME_INVALID_STATE || outcome==LORA_OUTCOME_NO_SLOT || outcome==LORA_OUTCOME_UNKNOWN_PEER || outcome==LORA_OUTCOME_INVALID_ARGUMENT;
+}
+
+static void reject_host_request(int outcome)
+{
+    if(outcome==LORA_OUTCOME_NO_SLOT)
     {
-        lora_reply_cond_var_mutex.unlock();
-        return outcome;
+        host_state_machine_reject_latest_request(HOST_NOT_SENT_NO_SLOT, lora_state_machine_get_max_access_delay_ms());
+
+        return;
     }
 
-    do
+    if(outcome==LORA_OUTCOME_UNKNOWN_PEER)
     {
-        timedOut = lora_reply_cond_var.wait_for(timeLeft);
+        // By then a node in range has sent its HELLO frame
+        host_state_machine_reject_latest_request(HOST_NOT_SENT_UNKNOWN_PEER, LORA_DISCOVERY_BEACON_INTERVAL + LORA_DISCOVERY_BEACON_JITTER);
 
-        uint32_t elapsed = timer.read_ms();
-        timeLeft = elapsed > SEND_LORA_REQUEST_TIMEOUT ? 0 : SEND_LORA_REQUEST_TIMEOUT - elapsed;
-
-    } while(lora_reply_outcome == LORA_OUTCOME_PENDING && !timedOut);
+        return;
+    }
 
-    outcome=timedOut ? LORA_OUTCOME_TIMEOUT_STUCK : lora_reply_outcome;
+    if(outcome==LORA_OUTCOME_INVALID_ARGUMENT)
+    {
+        host_state_machine_reject_latest_request(HOST_NOT_SENT_BAD_REQUEST, 0);
 
-    if(outcome==LORA_OUTCOME_REPLY_RIGHT) *outReplyPayload = lora_reply_payload;
+        return;
+    }
 
-    lora_reply_cond_var_mutex.unlock();
+    uint32_t busyRemainingMs = lora_state_machine_get_busy_remaining_ms();
 
-    return outcome;
+    host_state_machine_reject_latest_request(HOST_NOT_SENT_BUSY, busyRemainingMs > 0 ? busyRemainingMs : LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL);
 }
 
-HostReplyOutcomes_t send_host_request(uint16_t argCounter, uint8_t argSourceAddress, bool argRequiresReply, uint16_t* outReplyPayload)
+static void reject_host_request_for_full_queue(uint8_t argDestinationAddress)
 {
-    Timer timer;
+    uint32_t retryAfterMs;
 
-    host_reply_cond_var_mutex.lock();
+    lora_gateway_get_peer_credits(argDestinationAddress, get_lora_request_timeout_ms(true), &retryAfterMs);
 
-    timer.start();
-
-    bool timedOut=false;
-    uint32_t timeLeft=SEND_HOST_REQUEST_TIMEOUT;
-
-    host_reply_outcome=HOST_OUTCOME_PENDING;
-
-    HostReplyOutcomes_t outcome = host_state_machine_send_request(argCounter, argSourceAddress, argRequiresReply);
-
-    if(outcome != HOST_OUTCOME_PENDING)
-    {
-        host_reply_cond_var_mutex.unlock();
-        return outcome;
-    }
-
-    do
-    {
-        timedOut = host_reply_cond_var.wait_for(timeLeft);
+    host_state_machine_reject_latest_request(HOST_NOT_SENT_QUEUE_FULL, retryAfterMs);
+}
 
-        uint32_t elapsed = timer.read_ms();
-        timeLeft = elapsed > SEND_HOST_REQUEST_TIMEOUT ? 0 : SEND_HOST_REQUEST_TIMEOUT - elapsed;
+// Called on the host event queue, right after the frame of the request was handled
+static void note_host_request_for_trace(uint8_t argDestinationAddress, uint16_t argPayload)
+{
+    lora_trace_note_host_request(argDestinationAddress, argPayload, host_protocol_get_latest_received_command_rx_us());
+}
 
-    } while(host_reply_outcome == HOST_OUTCOME_PENDING && !timedOut);
+LoraReplyOutcomes_t send_lora_request(uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply, uint16_t* outReplyPayload)
+{
+    return lora_state_machine_send_request_and_wait(argCounter, argDestinationAddress, argRequiresReply, get_lora_request_timeout_ms(argRequiresReply), outReplyPayload);
+}
 
-    outcome=timedOut ? HOST_OUTCOME_TIMEOUT_STUCK : host_reply_outcome;
+LoraReplyOutcomes_t send_lora_gather_request(uint16_t argCounter, uint16_t argAddressMask, LoraGatherResults_t* outResults)
+{
+    return lora_state_machine_send_gather_request_and_wait(argCounter, argAddressMask, get_lora_gather_timeout_ms(argAddressMask), outResults);
+}
 
-    if(outcome==HOST_OUTCOME_REPLY_RIGHT) *outReplyPayload = host_reply_payload;
+HostReplyOutcomes_t send_host_request(uint16_t argCounter, uint8_t argSourceAddress, bool argRequiresReply, uint16_t* outReplyPayload)
+{
+    return host_state_machine_send_request_and_wait(argCounter, argSourceAddress, argRequiresReply, lora_timing_get_host_transaction_timeout_ms(), outReplyPayload);
+}
 
-    host_reply_cond_var_mutex.unlock();
+void on_lora_demo_request_completion(LoraReplyOutcomes_t outcome, uint16_t replyPayload)
+{
+    printf("__________ LORA END %d (0x%X) __________\n", outcome, outcome==LORA_OUTCOME_REPLY_RIGHT ? replyPayload : 0xFFFF);
+}
 
-    return outcome;
+void on_host_demo_request_completion(HostReplyOutcomes_t outcome, uint16_t replyPayload)
+{
+    printf("__________ HOST END %d (0x%X) __________\n", outcome, outcome==HOST_OUTCOME_REPLY_RIGHT ? replyPayload : 0xFFFF);
 }
 
 void event_proc_send_data_through_lora()
@@ -122,17 +163,36 @@ void event_proc_send_data_through_lora()
     s_lora_DestinationAddress++;
     s_lora_toggler_wheel++;
 
-    if(s_lora_DestinationAddress==s_lora_MyAddress) s_lora_DestinationAddress++;
-    if(s_lora_DestinationAddress>MAX_DESTINATION_ADDRESS) s_lora_DestinationAddress=0;
+    // With neighbor discovery, nodes not heard lately are skipped instead of waiting for their timeouts
+    for(int i=0; i<=MAX_DESTINATION_ADDRESS; i++)
+    {
+        if(s_lora_DestinationAddress==s_lora_MyAddress) s_lora_DestinationAddress++;
+        if(s_lora_DestinationAddress>MAX_DESTINATION_ADDRESS) s_lora_DestinationAddress=0;
+
+        if(lora_state_machine_is_peer_known(s_lora_DestinationAddress)) break;
+
+        s_lora_DestinationAddress++;
+    }
+
     if(s_lora_toggler_wheel > 6) s_lora_toggler_wheel=0;
 
     printf("\n\n___________ LORA BEGIN %d -> %d ___________\n", s_lora_Counter, s_lora_DestinationAddress);
 
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+
+    int outcome = lora_state_machine_send_request_async(s_lora_Counter, s_lora_DestinationAddress, s_lora_toggler_wheel!=0, get_lora_request_timeout_ms(s_lora_toggler_wheel!=0), on_lora_demo_request_completion);
+
+    if(outcome != LORA_OUTCOME_PENDING) on_lora_demo_request_completion((LoraReplyOutcomes_t)outcome, 0xFFFF);
+
+#else
+
     uint16_t outReplyPayload=0xFFFF;
 
     int outcome = send_lora_request(s_lora_Counter, s_lora_DestinationAddress, s_lora_toggler_wheel!=0, &outReplyPayload);
 
     printf("__________ LORA END %d (0x%X) __________\n", outcome, outReplyPayload);
+
+#endif
 }
 
 void event_proc_send_data_to_host()
@@ -148,11 +208,21 @@ void event_proc_send_data_to_host()
 
     printf("\n\n___________ HOST BEGIN %d ___________\n", s_host_Counter);
 
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+
+    int outcome = host_state_machine_send_request_async(s_host_Counter, s_host_SourceAddress, s_host_toggler_wheel!=0, lora_timing_get_host_transaction_timeout_ms(), on_host_demo_request_completion);
+
+    if(outcome != HOST_OUTCOME_PENDING) on_host_demo_request_completion((HostReplyOutcomes_t)outcome, 0xFFFF);
+
+#else
+
     uint16_t outReplyPayload=0xFFFF;
 
     int outcome = send_host_request(s_host_Counter, s_host_SourceAddress, s_host_toggler_wheel!=0, &outReplyPayload);
 
     printf("__________ HOST END %d (0x%X) __________\n", outcome, outReplyPayload);
+
+#endif
 }
 
 void btn_interrupt_handler()
@@ -202,14 +272,131 @@ uint16_t on_host_state_machine_notify_request_and_get_reply_callback(uint8_t req
     return replyPayload;
 }*/
 
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+
+void on_gateway_lora_request_completion(LoraReplyOutcomes_t outcome, uint16_t replyPayload)
+{
+    lora_gateway_complete_pending_request(outcome, outcome==LORA_OUTCOME_REPLY_RIGHT ? replyPayload : 0xFFFF);
+}
+
+int gateway_send_lora_request(uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply, uint16_t* outReplyPayload)
+{
+    return lora_state_machine_send_request_async(argCounter, argDestinationAddress, argRequiresReply, get_lora_request_timeout_ms(argRequiresReply), on_gateway_lora_request_completion);
+}
+
+#else
+
+int gateway_send_lora_request(uint16_t argCounter, uint8_t argDestinationAddress, bool argRequiresReply, uint16_t* outReplyPayload)
+{
+    return send_lora_request(argCounter, argDestinationAddress, argRequiresReply, outReplyPayload);
+}
+
+#endif
+
+void on_gateway_lora_bulk_completion(LoraReplyOutcomes_t outcome, uint16_t completedMask)
+{
+    lora_gateway_complete_bulk(outcome, completedMask);
+}
+
+// Never blocks: the gateway scheduler keeps running during the transfer, to have it step aside for urgent requests
+int gateway_send_lora_bulk(const uint8_t* argBlob, uint16_t argSize, uint16_t argAddressMask)
+{
+    return lora_state_machine_send_bulk_async(argBlob, argSize, argAddressMask, get_lora_bulk_timeout_ms(argSize, argAddressMask), on_gateway_lora_bulk_completion);
+}
+
+void event_proc_store_query_reply(uint8_t destinationAddress, uint16_t requestPayload, uint16_t replyPayload)
+{
+    host_query_cache_store(destinationAddress, requestPayload, replyPayload, s_query_cache_timer.read_ms());
+}
+
+// Batch from the host ("!M|..#") in the gateway queues, one at a time; its requests are tagged (batch id << 8) | item index
+static HostBatchItem_t s_pending_batch[HOST_BATCH_MAX_ITEMS];
+static uint8_t s_pending_batch_count;
+static uint8_t s_pending_batch_left;
+static uint8_t s_pending_batch_id;
+
+static uint8_t get_batch_item_status(int outcome)
+{
+    if(outcome==LORA_OUTCOME_NO_SLOT) return HOST_NOT_SENT_NO_SLOT;
+    if(outcome==LORA_OUTCOME_UNKNOWN_PEER) return HOST_NOT_SENT_UNKNOWN_PEER;
+    if(outcome==LORA_OUTCOME_INVALID_STATE) return HOST_NOT_SENT_BUSY;
+
+    // A negative ack is an answer too, its payload tells the host
+    return outcome==LORA_OUTCOME_REPLY_RIGHT || outcome==LORA_OUTCOME_REPLY_WRONG || outcome==LORA_OUTCOME_REPLY_NOT_NEEDED ? HOST_BATCH_ITEM_DONE : HOST_BATCH_ITEM_FAILED;
+}
+
+static uint16_t get_batch_item_reply_payload(int outcome, bool requiresReply, uint16_t replyPayload)
+{
+    return requiresReply && (outcome==LORA_OUTCOME_REPLY_RIGHT || outcome==LORA_OUTCOME_REPLY_WRONG) ? replyPayload : 0xFFFF;
+}
+
+// On the host event queue, which owns the pending batch
+void event_proc_complete_batch_item(uint16_t tag, uint8_t status, uint16_t replyPayload)
+{
+    uint8_t index = tag & 0xFF;
+
+    if((tag >> 8) != s_pending_batch_id || index >= s_pending_batch_count || s_pending_batch_left == 0) return;
+
+    s_pending_batch[index].status = status;
+    s_pending_batch[index].replyPayload = replyPayload;
+
+    if(--s_pending_batch_left == 0) host_state_machine_send_batch_reply(s_pending_batch, s_pending_batch_count);
+}
+
+void on_lora_gateway_notify_completion_callback(uint8_t peerAddress, uint16_t requestPayload, bool requiresReply, uint16_t replyPayload, int outcome, uint16_t tag)
+{
+    printf(">>> GATEWAY %s SENT to LORA node %u: Outcome=%d, ReplyPayload=%u\n", requiresReply ? "QUERY" : "COMMAND", peerAddress, outcome, replyPayload);
+
+    // The query cache belongs to the host side, which runs on its own event queue
+    if(requiresReply && outcome==LORA_OUTCOME_REPLY_RIGHT) s_eq_manage_host_communication.call(event_proc_store_query_reply, peerAddress, requestPayload, replyPayload);
+
+    if(requiresReply) lora_trace_stamp(LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_HOST_TX);
+
+    // Items of a batch are answered all together, once the last one is over
+    if(tag != 0)
+    {
+        s_eq_manage_host_communication.call(event_proc_complete_batch_item, tag, get_batch_item_status(outcome), get_batch_item_reply_payload(outcome, requiresReply, replyPayload));
+
+        return;
+    }
+
+    if(requiresReply) host_state_machine_send_deferred_reply(peerAddress, outcome==LORA_OUTCOME_REPLY_RIGHT || outcome==LORA_OUTCOME_REPLY_WRONG ? replyPayload : 0xFFFF);
+}
+
+void on_lora_gateway_notify_stored_callback(uint8_t peerAddress, uint16_t requestPayload, bool requiresReply, uint16_t replyPayload, GatewayStoreEvents_t event, uint32_t ms)
+{
+    static const char* const eventNames[] = { "STORED", "DELIVERED", "EXPIRED", "DROPPED" };
+
+    printf(">>> GATEWAY %s %s for LORA node %u: Payload=%u, ReplyPayload=%u, %lu ms\n", requiresReply ? "QUERY" : "COMMAND", eventNames[event], peerAddress, requestPayload, replyPayload, (unsigned long)ms);
+
+    if(event == GATEWAY_STORE_DELIVERED && requiresReply && replyPayload != 0xFFFF) s_eq_manage_host_communication.call(event_proc_store_query_reply, peerAddress, requestPayload, replyPayload);
+
+    host_state_machine_send_stored_report(peerAddress, requestPayload, replyPayload, event, ms);
+}
+
+void on_lora_state_machine_notify_heard_callback(uint8_t sourceAddress, bool sleepy, uint32_t downlinkWindowMs)
+{
+    lora_gateway_notify_peer_heard(sourceAddress, sleepy, downlinkWindowMs);
+}
+
+uint16_t on_lora_state_machine_get_pending_downlinks_callback(uint8_t destinationAddress)
+{
+    return lora_gateway_get_peer_pending_count(destinationAddress);
+}
+
 void on_lora_state_machine_notify_request_callback(uint8_t requestSourceAddress, uint16_t requestPayload)
 {
     printf("<<< COMMAND RECEIVED through LORA channel: Source=%u, Payload=%u\n", requestSourceAddress, requestPayload);
 
     uint16_t outReplyPayload=0xFFFF;
 
+    lora_trace_stamp(LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REMOTE_HOST_TX);
+
     int outcome = send_host_request(requestPayload, requestSourceAddress, false, &outReplyPayload);
 
+    lora_trace_set_outcome(LORA_TRACE_ROLE_RESPONDER, outcome);
+    lora_trace_stamp(LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REMOTE_HOST_RX);
+
     printf(">>> COMMAND SENT to HOST: Outcome=%d, ReplyPayload=%u\n", outcome, outReplyPayload);
 }
 
@@ -219,22 +406,115 @@ uint16_t on_lora_state_machine_notify_request_and_get_reply_callback(uint8_t req
 
     uint16_t outReplyPayload=0xFFFF;
 
+    lora_trace_stamp(LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REMOTE_HOST_TX);
+
     int outcome = send_host_request(requestPayload, requestSourceAddress, true, &outReplyPayload);
 
+    lora_trace_set_outcome(LORA_TRACE_ROLE_RESPONDER, outcome);
+    lora_trace_stamp(LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REMOTE_HOST_RX);
+
     printf(">>> QUERY SENT to HOST: Outcome=%d, RETURNING ReplyPayload=%u\n", outcome, outReplyPayload);
 
     return outReplyPayload;
 }
 
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+
+// Single-thread runtime without the gateway queues: host requests go out one at a time through
+// lora_state_machine_send_request_async() and are answered from their completion
+static uint8_t s_pending_query_address;
+static uint16_t s_pending_query_payload;
+
+void on_lora_command_sent_completion(LoraReplyOutcomes_t outcome, uint16_t replyPayload)
+{
+    printf(">>> COMMAND SENT to LORA node: Outcome=%d, ReplyPayload=%u\n", outcome, replyPayload);
+}
+
+void on_lora_query_sent_completion(LoraReplyOutcomes_t outcome, uint16_t replyPayload)
+{
+    uint16_t outReplyPayload = outcome==LORA_OUTCOME_REPLY_RIGHT || outcome==LORA_OUTCOME_REPLY_WRONG ? replyPayload : 0xFFFF;
+
+    lora_trace_stamp(LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_HOST_TX);
+
+    if(outcome==LORA_OUTCOME_REPLY_RIGHT) host_query_cache_store(s_pending_query_address, s_pending_query_payload, outReplyPayload, s_query_cache_timer.read_ms());
+
+    printf(">>> QUERY SENT to LORA node: Outcome=%d, RETURNING ReplyPayload=%u\n", outcome, outReplyPayload);
+
+    host_state_machine_send_deferred_reply(s_pending_query_address, outReplyPayload);
+}
+
+static void send_lora_command_async(uint8_t argDestinationAddress, uint16_t argPayload)
+{
+    int outcome = lora_state_machine_send_request_async(argPayload, argDestinationAddress, false, get_lora_request_timeout_ms(false), on_lora_command_sent_completion);
+
+    if(outcome == LORA_OUTCOME_PENDING) return;
+
+    if(is_not_sent_outcome(outcome)) lora_trace_discard_host_request(argDestinationAddress, argPayload);
+
+    if(is_not_sent_outcome(outcome)) reject_host_request(outcome);
+
+    on_lora_command_sent_completion((LoraReplyOutcomes_t)outcome, 0xFFFF);
+}
+
+static void send_lora_query_async(uint8_t argDestinationAddress, uint16_t argPayload)
+{
+    int outcome = lora_state_machine_send_request_async(argPayload, argDestinationAddress, true, get_lora_request_timeout_ms(true), on_lora_query_sent_completion);
+
+    if(outcome != LORA_OUTCOME_PENDING)
+    {
+        // Not through on_lora_query_sent_completion(): a query still on its way may own s_pending_query_address
+        printf(">>> QUERY NOT SENT to LORA node: Outcome=%d\n", outcome);
+
+        lora_trace_discard_host_request(argDestinationAddress, argPayload);
+
+        if(is_not_sent_outcome(outcome)) reject_host_request(outcome);
+        else host_state_machine_send_deferred_reply(argDestinationAddress, 0xFFFF);
+
+        return;
+    }
+
+    s_pending_query_address = argDestinationAddress;
+    s_pending_query_payload = argPayload;
+}
+
+#endif
+
 void on_host_state_machine_notify_request_callback(uint8_t requestLoraDestinationAddress, uint16_t requestPayload)
 {
     printf("<<< COMMAND RECEIVED from HOST: LoraTargetAddress=%u, Payload=%u\n", requestLoraDestinationAddress, requestPayload);
 
+    // A command may change what the node would answer
+    host_query_cache_invalidate(requestLoraDestinationAddress);
+
+    // Noted before the request is handed over, the radio side may take it right away
+    note_host_request_for_trace(requestLoraDestinationAddress, requestPayload);
+
+    if(s_gateway_mode)
+    {
+        bool queued = lora_gateway_enqueue_request(requestPayload, requestLoraDestinationAddress, false);
+
+        printf(">>> COMMAND %s for LORA node %u\n", queued ? "QUEUED" : "REJECTED (queue full)", requestLoraDestinationAddress);
+
+        if(!queued) lora_trace_discard_host_request(requestLoraDestinationAddress, requestPayload);
+
+        if(!queued && requestLoraDestinationAddress < GATEWAY_MAX_PEERS) reject_host_request_for_full_queue(requestLoraDestinationAddress);
+
+        return;
+    }
+
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+    send_lora_command_async(requestLoraDestinationAddress, requestPayload);
+#else
     uint16_t outReplyPayload=0xFFFF;
 
     int outcome = send_lora_request(requestPayload, requestLoraDestinationAddress, false, &outReplyPayload);
 
+    if(is_not_sent_outcome(outcome)) lora_trace_discard_host_request(requestLoraDestinationAddress, requestPayload);
+
+    if(is_not_sent_outcome(outcome)) reject_host_request(outcome);
+
     printf(">>> COMMAND SENT to LORA node: Outcome=%d, ReplyPayload=%u\n", outcome, outReplyPayload);
+#endif
 }
 
 uint16_t on_host_state_machine_notify_request_and_get_reply_callback(uint8_t requestLoraDestinationAddress, uint16_t requestPayload)
@@ -243,13 +523,670 @@ uint16_t on_host_state_machine_notify_request_and_get_reply_callback(uint8_t req
 
     uint16_t outReplyPayload=0xFFFF;
 
+    if(host_query_cache_lookup(requestLoraDestinationAddress, requestPayload, s_query_cache_timer.read_ms(), &outReplyPayload))
+    {
+        printf(">>> QUERY ANSWERED from CACHE: RETURNING ReplyPayload=%u\n", outReplyPayload);
+
+        return outReplyPayload;
+    }
+
+    note_host_request_for_trace(requestLoraDestinationAddress, requestPayload);
+
     int outcome = send_lora_request(requestPayload, requestLoraDestinationAddress, true, &outReplyPayload);
 
+    if(is_not_sent_outcome(outcome)) lora_trace_discard_host_request(requestLoraDestinationAddress, requestPayload);
+    else lora_trace_stamp(LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_HOST_TX);
+
+    if(is_not_sent_outcome(outcome)) reject_host_request(outcome);
+
+    if(outcome==LORA_OUTCOME_REPLY_RIGHT) host_query_cache_store(requestLoraDestinationAddress, requestPayload, outReplyPayload, s_query_cache_timer.read_ms());
+
     printf(">>> QUERY SENT to LORA node: Outcome=%d, RETURNING ReplyPayload=%u\n", outcome, outReplyPayload);
 
     return outReplyPayload;
 }
  
+bool on_host_state_machine_notify_request_and_defer_reply_callback(uint8_t requestLoraDestinationAddress, uint16_t requestPayload)
+{
+    // Otherwise answered right away through on_host_state_machine_notify_request_and_get_reply_callback()
+    if(!s_gateway_mode && !MBED_CONF_APP_SINGLE_THREAD_RUNTIME) return false;
+
+    printf("<<< QUERY RECEIVED from HOST: LoraTargetAddress=%u, Payload=%u\n", requestLoraDestinationAddress, requestPayload);
+
+    uint16_t cachedReplyPayload;
+
+    if(host_query_cache_lookup(requestLoraDestinationAddress, requestPayload, s_query_cache_timer.read_ms(), &cachedReplyPayload))
+    {
+        printf(">>> QUERY ANSWERED from CACHE: ReplyPayload=%u\n", cachedReplyPayload);
+
+        host_state_machine_send_deferred_reply(requestLoraDestinationAddress, cachedReplyPayload);
+
+        return true;
+    }
+
+    note_host_request_for_trace(requestLoraDestinationAddress, requestPayload);
+
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+    if(!s_gateway_mode)
+    {
+        send_lora_query_async(requestLoraDestinationAddress, requestPayload);
+
+        return true;
+    }
+#endif
+
+    if(!lora_gateway_enqueue_request(requestPayload, requestLoraDestinationAddress, true))
+    {
+        printf(">>> QUERY REJECTED (queue full) for LORA node %u\n", requestLoraDestinationAddress);
+
+        lora_trace_discard_host_request(requestLoraDestinationAddress, requestPayload);
+
+        if(requestLoraDestinationAddress < GATEWAY_MAX_PEERS) reject_host_request_for_full_queue(requestLoraDestinationAddress);
+        else host_state_machine_send_deferred_reply(requestLoraDestinationAddress, 0xFFFF);
+    }
+
+    return true;
+}
+
+// Urgent class: ahead of every queued request, a bulk transfer on air steps aside at the end of its current frame
+static int enqueue_urgent_command(uint8_t argDestinationAddress, int argPayload)
+{
+    if(!s_gateway_mode || argPayload < 0 || argPayload > 0xFFFF) return -1;
+
+    printf("<<< URGENT COMMAND RECEIVED from HOST: LoraTargetAddress=%u, Payload=%d\n", argDestinationAddress, argPayload);
+
+    host_query_cache_invalidate(argDestinationAddress);
+
+    note_host_request_for_trace(argDestinationAddress, argPayload);
+
+    bool queued = lora_gateway_enqueue_urgent_request(argPayload, argDestinationAddress, false);
+
+    printf(">>> URGENT COMMAND %s for LORA node %u\n", queued ? "QUEUED" : "REJECTED (queue full)", argDestinationAddress);
+
+    if(!queued) lora_trace_discard_host_request(argDestinationAddress, argPayload);
+
+    return queued ? argPayload : -1;
+}
+
+int on_host_state_machine_notify_local_command_callback(char command, int arg1, int arg2)
+{
+    switch(command)
+    {
+        case 'P':
+            return lora_gateway_set_peer_weight(arg1, arg2) ? arg2 : -1;
+
+        case 'K':
+            return host_query_cache_set_cacheable_class(arg1, arg2 > 0 ? arg2 : 0) ? arg2 : -1;
+
+        case 'F':
+            lora_capture_set_enabled(arg1 != 0);
+            return lora_capture_is_enabled() ? 1 : 0;
+
+        case 'T':
+            lora_trace_set_enabled(arg1 != 0);
+            return lora_trace_is_enabled() ? 1 : 0;
+
+        case 'D':
+            return arg2 >= 0 && arg2 <= 0xFFFF && lora_gateway_set_peer_store_ttl(arg1, arg2) ? arg2 : -1;
+
+        case 'U':
+            return enqueue_urgent_command(arg1, arg2);
+    }
+
+    return -1;
+}
+
+uint8_t on_host_state_machine_get_credits_callback(uint8_t address, uint8_t* outWindow, uint32_t* outRetryAfterMs)
+{
+    if(s_gateway_mode)
+    {
+        *outWindow = GATEWAY_PEER_QUEUE_SIZE;
+
+        return lora_gateway_get_peer_credits(address, get_lora_request_timeout_ms(true), outRetryAfterMs);
+    }
+
+    // Without the gateway queues the radio takes one request at a time
+    *outWindow = 1;
+    *outRetryAfterMs = lora_state_machine_get_busy_remaining_ms();
+
+    return *outRetryAfterMs == 0 ? 1 : 0;
+}
+
+int on_host_state_machine_notify_injected_frame_callback(const uint8_t* frame, uint16_t frameSize, int16_t rssi, int8_t snr)
+{
+    lora_state_machine_inject_received_frame(frame, frameSize, rssi, snr);
+
+    return rssi;
+}
+
+void event_proc_stream_capture()
+{
+    LoraCaptureRecord_t record;
+    uint8_t buffer[LORA_CAPTURE_RECORD_MAX_SIZE];
+
+    // A few records per pass, so that the host link isn't held for long
+    for(int i=0; i<4 && lora_capture_pop(&record); i++)
+    {
+        uint16_t size = lora_capture_encode_record(&record, buffer, sizeof(buffer));
+
+        host_protocol_send_binary(buffer, size);
+    }
+}
+
+void event_proc_stream_trace()
+{
+    LoraTraceRecord_t record;
+    char buffer[LORA_TRACE_RECORD_DUMP_SIZE];
+
+    for(int i=0; i<4 && lora_trace_pop(&record); i++)
+    {
+        lora_trace_fill_with_record_dump(buffer, sizeof(buffer), &record);
+
+        host_protocol_send_out_of_band_reply((uint8_t*)buffer, sizeof(buffer));
+    }
+}
+
+void on_host_state_machine_notify_gather_and_get_replies_callback(uint16_t requestLoraAddressMask, uint16_t requestPayload, uint16_t* outRespondedMask, uint16_t* outReplyPayloads)
+{
+    printf("<<< GATHER RECEIVED from HOST: LoraAddressMask=0x%X, Payload=%u\n", requestLoraAddressMask, requestPayload);
+
+    LoraGatherResults_t results;
+
+    memset(&results, 0, sizeof(results));
+
+    int outcome = send_lora_gather_request(requestPayload, requestLoraAddressMask, &results);
+
+    if(is_not_sent_outcome(outcome)) reject_host_request(outcome);
+
+    *outRespondedMask = results.respondedMask;
+
+    for(int address=0; address<=LORA_GATHER_MAX_ADDRESS && address<=HOST_GATHER_MAX_ADDRESS; address++) outReplyPayloads[address] = results.replyPayloads[address];
+
+    printf(">>> GATHER SENT to LORA nodes: Outcome=%d, RespondedMask=0x%X\n", outcome, *outRespondedMask);
+}
+ 
+void on_host_command_sent_completion(HostReplyOutcomes_t outcome, uint16_t)
+{
+    printf(">>> COMMAND SENT to HOST: Outcome=%d\n", outcome);
+
+    lora_trace_set_outcome(LORA_TRACE_ROLE_RESPONDER, outcome);
+    lora_trace_stamp(LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REMOTE_HOST_RX);
+}
+
+void on_host_query_sent_completion(HostReplyOutcomes_t outcome, uint16_t replyPayload)
+{
+    uint16_t outReplyPayload = outcome==HOST_OUTCOME_REPLY_RIGHT ? replyPayload : 0xFFFF;
+
+    printf(">>> QUERY SENT to HOST: Outcome=%d, RETURNING ReplyPayload=%u\n", outcome, outReplyPayload);
+
+    lora_trace_set_outcome(LORA_TRACE_ROLE_RESPONDER, outcome);
+    lora_trace_stamp(LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REMOTE_HOST_RX);
+
+    lora_state_machine_send_deferred_reply(outReplyPayload);
+}
+
+void on_lora_state_machine_notify_request_nonblocking_callback(uint8_t requestSourceAddress, uint16_t requestPayload)
+{
+    printf("<<< COMMAND RECEIVED through LORA channel: Source=%u, Payload=%u\n", requestSourceAddress, requestPayload);
+
+    lora_trace_stamp(LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REMOTE_HOST_TX);
+
+    int outcome = host_state_machine_send_request_async(requestPayload, requestSourceAddress, false, lora_timing_get_host_transaction_timeout_ms(), on_host_command_sent_completion);
+
+    if(outcome != HOST_OUTCOME_PENDING) on_host_command_sent_completion((HostReplyOutcomes_t)outcome, 0xFFFF);
+}
+
+bool on_lora_state_machine_notify_request_and_defer_reply_callback(uint8_t requestSourceAddress, uint16_t requestPayload)
+{
+    printf("<<< QUERY RECEIVED through LORA channel: Source=%u, Payload=%u\n", requestSourceAddress, requestPayload);
+
+    lora_trace_stamp(LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REMOTE_HOST_TX);
+
+    int outcome = host_state_machine_send_request_async(requestPayload, requestSourceAddress, true, lora_timing_get_host_transaction_timeout_ms(), on_host_query_sent_completion);
+
+    if(outcome != HOST_OUTCOME_PENDING) on_host_query_sent_completion((HostReplyOutcomes_t)outcome, 0xFFFF);
+
+    return true;
+}
+
+void on_lora_gather_sent_completion(LoraReplyOutcomes_t outcome, const LoraGatherResults_t* results)
+{
+    uint16_t respondedMask = outcome==LORA_OUTCOME_REPLY_RIGHT || outcome==LORA_OUTCOME_GATHER_PARTIAL ? results->respondedMask : 0;
+
+    printf(">>> GATHER SENT to LORA nodes: Outcome=%d, RespondedMask=0x%X\n", outcome, respondedMask);
+
+    host_state_machine_send_deferred_gather_reply(s_pending_gather_mask, respondedMask, results->replyPayloads);
+}
+
+bool on_host_state_machine_notify_gather_and_defer_replies_callback(uint16_t requestLoraAddressMask, uint16_t requestPayload)
+{
+    printf("<<< GATHER RECEIVED from HOST: LoraAddressMask=0x%X, Payload=%u\n", requestLoraAddressMask, requestPayload);
+
+    s_pending_gather_mask = requestLoraAddressMask;
+
+    int outcome = lora_state_machine_send_gather_request_async(requestPayload, requestLoraAddressMask, get_lora_gather_timeout_ms(requestLoraAddressMask), on_lora_gather_sent_completion);
+
+    if(is_not_sent_outcome(outcome))
+    {
+        reject_host_request(outcome);
+    }
+    else if(outcome != LORA_OUTCOME_PENDING)
+    {
+        static const LoraGatherResults_t noResults = {};
+
+        on_lora_gather_sent_completion((LoraReplyOutcomes_t)outcome, &noResults);
+    }
+
+    return true;
+}
+
+static uint16_t s_pending_bulk_mask;
+
+void on_lora_bulk_sent_completion(LoraReplyOutcomes_t outcome, uint16_t completedMask)
+{
+    printf(">>> BULK SENT to LORA nodes: Outcome=%d, CompletedMask=0x%X\n", outcome, completedMask);
+
+    host_state_machine_send_bulk_report(s_pending_bulk_mask, outcome==LORA_OUTCOME_REPLY_RIGHT || outcome==LORA_OUTCOME_GATHER_PARTIAL ? completedMask : 0);
+}
+
+bool on_host_state_machine_notify_bulk_callback(uint16_t addressMask, const uint8_t* blob, uint16_t size)
+{
+    printf("<<< BULK RECEIVED from HOST: LoraAddressMask=0x%X, Size=%u\n", addressMask, size);
+
+    // Lowest traffic class: it waits for the queued requests to go
+    if(s_gateway_mode) return lora_gateway_enqueue_bulk(blob, size, addressMask);
+
+    s_pending_bulk_mask = addressMask;
+
+    return lora_state_machine_send_bulk_async(blob, size, addressMask, get_lora_bulk_timeout_ms(size, addressMask), on_lora_bulk_sent_completion) == LORA_OUTCOME_PENDING;
+}
+
+void on_lora_gateway_notify_bulk_completion_callback(uint16_t addressMask, int outcome, uint16_t completedMask)
+{
+    printf(">>> BULK SENT to LORA nodes 0x%X: Outcome=%d, CompletedMask=0x%X\n", addressMask, outcome, completedMask);
+
+    host_state_machine_send_bulk_report(addressMask, outcome==LORA_OUTCOME_REPLY_RIGHT || outcome==LORA_OUTCOME_GATHER_PARTIAL ? completedMask : 0);
+}
+
+void on_lora_state_machine_notify_bulk_callback(uint8_t sourceAddress, uint8_t session, const uint8_t* blob, uint16_t size)
+{
+    printf(">>> BULK %u RECEIVED from LORA node %u: Size=%u\n", session, sourceAddress, size);
+
+    host_state_machine_send_bulk_received(sourceAddress, session, blob, size);
+}
+
+// Answered from the host query cache (or taken by nothing): false if the item still has to go over LoRa
+static bool handle_batch_item_locally(HostBatchItem_t* item)
+{
+    if(item->status == HOST_BATCH_ITEM_INVALID) return true;
+
+    uint16_t cachedReplyPayload;
+
+    if(item->type == 'Q' && host_query_cache_lookup(item->address, item->payload, s_query_cache_timer.read_ms(), &cachedReplyPayload))
+    {
+        item->status = HOST_BATCH_ITEM_DONE;
+        item->replyPayload = cachedReplyPayload;
+
+        return true;
+    }
+
+    if(item->type == 'C') host_query_cache_invalidate(item->address);
+
+    // Noted when the batch is handled: the time it spent on the host link before isn't traced
+    lora_trace_note_host_request(item->address, item->payload, lora_trace_get_time_us());
+
+    return false;
+}
+
+static bool enqueue_gateway_batch(HostBatchItem_t* items, uint8_t count)
+{
+    // One batch at a time: the items of the next one are turned down as busy until it is over
+    if(s_pending_batch_left > 0) return false;
+
+    if(++s_pending_batch_id == 0) s_pending_batch_id = 1;
+
+    memcpy(s_pending_batch, items, count * sizeof(HostBatchItem_t));
+    s_pending_batch_count = count;
+
+    GatewayRequest_t requests[HOST_BATCH_MAX_ITEMS];
+    uint8_t requestItems[HOST_BATCH_MAX_ITEMS];
+    bool queued[HOST_BATCH_MAX_ITEMS];
+    uint8_t requestCount=0;
+
+    for(uint8_t i=0; i<count; i++)
+    {
+        HostBatchItem_t* item = &s_pending_batch[i];
+
+        if(handle_batch_item_locally(item)) continue;
+
+        GatewayRequest_t request = { item->payload, item->address, item->type == 'Q', (uint16_t)((s_pending_batch_id << 8) | i) };
+
+        requests[requestCount] = request;
+        requestItems[requestCount++] = i;
+    }
+
+    s_pending_batch_left = lora_gateway_enqueue_batch(requests, requestCount, queued);
+
+    for(uint8_t j=0; j<requestCount; j++)
+    {
+        if(queued[j]) continue;
+
+        HostBatchItem_t* item = &s_pending_batch[requestItems[j]];
+
+        item->status = HOST_NOT_SENT_QUEUE_FULL;
+
+        lora_trace_discard_host_request(item->address, item->payload);
+    }
+
+    printf(">>> BATCH %u: %u items QUEUED for LORA nodes\n", s_pending_batch_id, s_pending_batch_left);
+
+    if(s_pending_batch_left > 0) return true;
+
+    // Nothing went to the queues: answered right away
+    memcpy(items, s_pending_batch, count * sizeof(HostBatchItem_t));
+
+    return false;
+}
+
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+
+static uint8_t s_pending_batch_next;
+static bool s_pending_batch_item_retried;
+
+static void event_proc_send_next_batch_item();
+
+void on_lora_batch_item_sent_completion(LoraReplyOutcomes_t outcome, uint16_t replyPayload)
+{
+    uint8_t index = s_pending_batch_next++;
+    HostBatchItem_t* item = &s_pending_batch[index];
+    bool requiresReply = item->type == 'Q';
+
+    printf(">>> BATCH ITEM %u SENT to LORA node %u: Outcome=%d\n", index, item->address, outcome);
+
+    if(requiresReply) lora_trace_stamp(LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_HOST_TX);
+
+    if(requiresReply && outcome==LORA_OUTCOME_REPLY_RIGHT) host_query_cache_store(item->address, item->payload, replyPayload, s_query_cache_timer.read_ms());
+
+    event_proc_complete_batch_item((s_pending_batch_id << 8) | index, get_batch_item_status(outcome), get_batch_item_reply_payload(outcome, requiresReply, replyPayload));
+
+    // The radio gets back to listening on its next cycle
+    s_eq_main.call(event_proc_send_next_batch_item);
+}
+
+// The items still to go over LoRa are those handle_batch_item_locally() left HOST_NOT_SENT_BUSY
+static void event_proc_send_next_batch_item()
+{
+    for(; s_pending_batch_next < s_pending_batch_count; s_pending_batch_next++)
+    {
+        HostBatchItem_t* item = &s_pending_batch[s_pending_batch_next];
+
+        if(item->status != HOST_NOT_SENT_BUSY) continue;
+
+        bool requiresReply = item->type == 'Q';
+
+        int outcome = lora_state_machine_send_request_async(item->payload, item->address, requiresReply, get_lora_request_timeout_ms(requiresReply), on_lora_batch_item_sent_completion);
+
+        if(outcome == LORA_OUTCOME_PENDING)
+        {
+            s_pending_batch_item_retried=false;
+
+            return;
+        }
+
+        // Radio still winding down the previous item (or answering another node): the item waits for it once
+        uint32_t busyRemainingMs = lora_state_machine_get_busy_remaining_ms();
+
+        if(outcome == LORA_OUTCOME_INVALID_STATE && busyRemainingMs > 0 && !s_pending_batch_item_retried)
+        {
+            s_pending_batch_item_retried=true;
+
+            s_eq_main.call_in(busyRemainingMs, event_proc_send_next_batch_item);
+
+            return;
+        }
+
+        s_pending_batch_item_retried=false;
+
+        lora_trace_discard_host_request(item->address, item->payload);
+
+        event_proc_complete_batch_item((s_pending_batch_id << 8) | s_pending_batch_next, get_batch_item_status(outcome), 0xFFFF);
+    }
+}
+
+// Same one-batch-at-a-time rule as the gateway queues; the items go out one after the other
+static bool start_chained_batch(HostBatchItem_t* items, uint8_t count)
+{
+    if(s_pending_batch_left > 0) return false;
+
+    if(++s_pending_batch_id == 0) s_pending_batch_id = 1;
+
+    for(uint8_t i=0; i<count; i++)
+    {
+        if(!handle_batch_item_locally(&items[i])) s_pending_batch_left++;
+    }
+
+    // Nothing to send: answered right away
+    if(s_pending_batch_left == 0) return false;
+
+    memcpy(s_pending_batch, items, count * sizeof(HostBatchItem_t));
+    s_pending_batch_count = count;
+    s_pending_batch_next = 0;
+
+    printf(">>> BATCH %u: %u items to send to LORA nodes\n", s_pending_batch_id, s_pending_batch_left);
+
+    event_proc_send_next_batch_item();
+
+    return true;
+}
+
+#endif
+
+bool on_host_state_machine_notify_batch_callback(HostBatchItem_t* items, uint8_t count)
+{
+    printf("<<< BATCH RECEIVED from HOST: Items=%u\n", count);
+
+    if(s_gateway_mode) return enqueue_gateway_batch(items, count);
+
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+    return start_chained_batch(items, count);
+#endif
+
+    // Without the gateway queues the items go out one after the other, still within a single host message
+    for(uint8_t i=0; i<count; i++)
+    {
+        HostBatchItem_t* item = &items[i];
+
+        if(handle_batch_item_locally(item)) continue;
+
+        bool requiresReply = item->type == 'Q';
+        uint16_t outReplyPayload=0xFFFF;
+
+        int outcome = send_lora_request(item->payload, item->address, requiresReply, &outReplyPayload);
+
+        if(is_not_sent_outcome(outcome)) lora_trace_discard_host_request(item->address, item->payload);
+        else if(requiresReply) lora_trace_stamp(LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_HOST_TX);
+
+        if(requiresReply && outcome==LORA_OUTCOME_REPLY_RIGHT) host_query_cache_store(item->address, item->payload, outReplyPayload, s_query_cache_timer.read_ms());
+
+        item->status = get_batch_item_status(outcome);
+        item->replyPayload = get_batch_item_reply_payload(outcome, requiresReply, outReplyPayload);
+    }
+
+    printf(">>> BATCH SENT to LORA nodes\n");
+
+    return false;
+}
+
+#if MBED_CONF_APP_RUNTIME_STATS && !(defined(MBED_HEAP_STATS_ENABLED) && defined(MBED_STACK_STATS_ENABLED))
+#error "runtime_stats needs MBED_HEAP_STATS_ENABLED=1 and MBED_STACK_STATS_ENABLED=1 in the mbed_app.json macros"
+#endif
+
+// Heap and stack usage only with "runtime_stats" (see mbed_app.json), the mode alone otherwise
+static void fill_with_runtime_dump(char* destBuffer, uint16_t destBufferSize)
+{
+    int len = snprintf(destBuffer, destBufferSize, "mode=%s", MBED_CONF_APP_SINGLE_THREAD_RUNTIME ? "single" : "multi");
+
+#if MBED_CONF_APP_RUNTIME_STATS
+    mbed_stats_heap_t heapStats;
+    mbed_stats_stack_t stackStats[RUNTIME_STATS_MAX_THREADS];
+
+    mbed_stats_heap_get(&heapStats);
+
+    size_t threadCount = mbed_stats_stack_get_each(stackStats, RUNTIME_STATS_MAX_THREADS);
+
+    if(len < destBufferSize)
+    {
+        len += snprintf(destBuffer + len, destBufferSize - len, ",heap=%lu/%lu", (unsigned long)heapStats.current_size, (unsigned long)heapStats.max_size);
+    }
+
+    // Per thread: highest stack usage seen / stack size
+    for(size_t i=0; i<threadCount && len < destBufferSize; i++)
+    {
+        len += snprintf(destBuffer + len, destBufferSize - len, ",%lX=%lu/%lu",
+            (unsigned long)stackStats[i].thread_id, (unsigned long)stackStats[i].max_size, (unsigned long)stackStats[i].reserved_size);
+    }
+#endif
+}
+
+#if MBED_CONF_APP_BENCHMARK_ON_BOOT
+
+#define BENCHMARK_JSON_LINE_SIZE 256
+
+static Timer s_benchmark_timer;
+
+static uint64_t benchmark_read_time_ns()
+{
+    return (uint64_t)s_benchmark_timer.read_us() * 1000;
+}
+
+// DWT cycle counter: Cortex-M3/M4 and above (not on the M0+ of NUCLEO_L073RZ)
+#if defined(DWT_CTRL_CYCCNTENA_Msk)
+static uint32_t benchmark_read_cycles()
+{
+    return DWT->CYCCNT;
+}
+#endif
+
+#if MBED_CONF_APP_RUNTIME_STATS
+static uint32_t benchmark_read_allocation_count()
+{
+    mbed_stats_heap_t heapStats;
+
+    mbed_stats_heap_get(&heapStats);
+
+    return heapStats.alloc_cnt;
+}
+#endif
+
+// Runs before the worker threads start: the state machines are initialized, but nothing else runs meanwhile
+static void run_boot_benchmark()
+{
+    static LoraBenchmarkResult_t results[LORA_BENCHMARK_MAX_CASES];
+
+    s_benchmark_timer.start();
+
+#if defined(DWT_CTRL_CYCCNTENA_Msk)
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    lora_benchmark_read_cycles_callback = benchmark_read_cycles;
+#endif
+
+    lora_benchmark_read_time_ns_callback = benchmark_read_time_ns;
+#if MBED_CONF_APP_RUNTIME_STATS
+    lora_benchmark_read_allocation_count_callback = benchmark_read_allocation_count;
+#endif
+    lora_benchmark_dispatch_callback = lora_event_proc_communication_cycle;
+
+    int count = lora_benchmark_run_all(LORA_BENCHMARK_ITERATIONS, results, LORA_BENCHMARK_MAX_CASES);
+
+    for(int i=0; i<count; i++)
+    {
+        char jsonLine[BENCHMARK_JSON_LINE_SIZE];
+
+        lora_benchmark_fill_with_result_json(jsonLine, BENCHMARK_JSON_LINE_SIZE, "mbed", &results[i]);
+
+        printf("BENCH %s\n", jsonLine);
+    }
+
+    s_benchmark_timer.stop();
+}
+
+#endif
+
+void on_host_state_machine_fill_status_callback(char section, char* destBuffer, uint16_t destBufferSize)
+{
+    switch(section)
+    {
+        case 'L':
+            lora_state_machine_fill_with_stats_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'R':
+            lora_reply_cache_fill_with_stats_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'Q':
+            host_query_cache_fill_with_stats_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'T':
+            fill_with_runtime_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'F':
+            lora_capture_fill_with_stats_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'E':
+            lora_state_machine_fill_with_energy_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'P':
+            lora_state_machine_fill_with_sleepy_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'N':
+            lora_state_machine_fill_with_neighbors_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'C':
+            lora_state_machine_fill_with_channels_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'U':
+            host_protocol_fill_with_link_stats_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'W':
+            host_state_machine_fill_with_flow_stats_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'X':
+            lora_trace_fill_with_stats_dump(destBuffer, destBufferSize);
+            break;
+
+        case 'G':
+            if(s_gateway_mode) lora_gateway_fill_with_status_dump(destBuffer, destBufferSize);
+            else snprintf(destBuffer, destBufferSize, "disabled");
+            break;
+
+        case 'D':
+            if(s_gateway_mode) lora_gateway_fill_with_store_dump(destBuffer, destBufferSize);
+            else snprintf(destBuffer, destBufferSize, "disabled");
+            break;
+
+        case 'Y':
+            lora_state_machine_fill_with_bulk_dump(destBuffer, destBufferSize);
+            break;
+
+        default:
+            snprintf(destBuffer, destBufferSize, "unknown");
+            break;
+    }
+}
+
 int main( void ) 
 {
     printf("LoRa Request/Reply Demo Application (blue button to send a new LoRa request)\n");
@@ -259,6 +1196,14 @@ int main( void )
     printf("\n\n ------------------------\n");
     printf("|   MY LORA ADDRESS: %u   |\n", s_lora_MyAddress);
     printf(" ------------------------\n\n");
+
+    s_query_cache_timer.start();
+
+    lora_trace_initialize();
+
+    s_gateway_mode = LORA_GATEWAY_MODE_ENABLED && s_lora_MyAddress == LORA_GATEWAY_ADDRESS;
+
+    if(s_gateway_mode) printf(" > GATEWAY MODE <\n\n");
     
     s_eq_manage_lora_communication.call_every(LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL, lora_event_proc_communication_cycle);
     s_eq_manage_host_communication.call_every(HOST_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL, host_event_proc_communication_cycle);
@@ -283,14 +1228,65 @@ int main( void )
         return host_init_ret_val;
     }
 
+#if MBED_CONF_APP_SINGLE_THREAD_RUNTIME
+
+    lora_state_machine_notify_request_callback = on_lora_state_machine_notify_request_nonblocking_callback;
+    lora_state_machine_notify_request_and_defer_reply_callback = on_lora_state_machine_notify_request_and_defer_reply_callback;
+
+    host_state_machine_notify_gather_and_defer_replies_callback = on_host_state_machine_notify_gather_and_defer_replies_callback;
+
+#else
+
     lora_state_machine_notify_request_callback = on_lora_state_machine_notify_request_callback;
     lora_state_machine_notify_request_and_get_reply_callback = on_lora_state_machine_notify_request_and_get_reply_callback;
 
-    host_state_machine_notify_request_callback = on_host_state_machine_notify_request_callback;
     host_state_machine_notify_request_and_get_reply_callback = on_host_state_machine_notify_request_and_get_reply_callback;
+    host_state_machine_notify_gather_and_get_replies_callback = on_host_state_machine_notify_gather_and_get_replies_callback;
+
+#endif
+
+    host_state_machine_notify_request_callback = on_host_state_machine_notify_request_callback;
+    host_state_machine_fill_status_callback = on_host_state_machine_fill_status_callback;
+    host_state_machine_notify_request_and_defer_reply_callback = on_host_state_machine_notify_request_and_defer_reply_callback;
+    host_state_machine_notify_local_command_callback = on_host_state_machine_notify_local_command_callback;
+    host_state_machine_notify_injected_frame_callback = on_host_state_machine_notify_injected_frame_callback;
+    host_state_machine_get_credits_callback = on_host_state_machine_get_credits_callback;
+    host_state_machine_notify_bulk_callback = on_host_state_machine_notify_bulk_callback;
+    host_state_machine_notify_batch_callback = on_host_state_machine_notify_batch_callback;
+
+    lora_state_machine_notify_bulk_callback = on_lora_state_machine_notify_bulk_callback;
+
+    // Frame capture records are written to the host link from its own event queue
+    s_eq_manage_host_communication.call_every(LORA_CAPTURE_STREAM_INTERVAL, event_proc_stream_capture);
+
+    // So are the finished transaction traces
+    s_eq_manage_host_communication.call_every(LORA_TRACE_STREAM_INTERVAL, event_proc_stream_trace);
+
+    if(s_gateway_mode)
+    {
+        lora_gateway_initialize(gateway_send_lora_request, gateway_send_lora_bulk);
+
+        lora_gateway_notify_completion_callback = on_lora_gateway_notify_completion_callback;
+        lora_gateway_notify_stored_callback = on_lora_gateway_notify_stored_callback;
+        lora_gateway_notify_bulk_completion_callback = on_lora_gateway_notify_bulk_completion_callback;
+
+        // Any frame from a node tells the gateway it is awake, so that what was stored for it goes out right away
+        lora_state_machine_notify_heard_callback = on_lora_state_machine_notify_heard_callback;
+
+        // Sleepy end devices are told when more requests are waiting for them
+        lora_state_machine_get_pending_downlinks_callback = on_lora_state_machine_get_pending_downlinks_callback;
+
+        s_eq_main.call_every(GATEWAY_SCHEDULER_CYCLE_INTERVAL, lora_gateway_event_proc_scheduler_cycle);
+    }
+
+#if MBED_CONF_APP_BENCHMARK_ON_BOOT
+    run_boot_benchmark();
+#endif
 
+#if !MBED_CONF_APP_SINGLE_THREAD_RUNTIME
     s_thread_manage_lora_communication.start(callback(&s_eq_manage_lora_communication, &EventQueue::dispatch_forever));
     s_thread_manage_host_communication.start(callback(&s_eq_manage_host_communication, &EventQueue::dispatch_forever));
+#endif
 
     s_eq_main.dispatch_forever();
 }
\ No newline at end of file
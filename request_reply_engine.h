@@ -0,0 +1,265 @@
+#ifndef __REQUEST_REPLY_ENGINE_H__
+#define __REQUEST_REPLY_ENGINE_H__
+
+#include "mbed.h"
+
+/*
+ * Request/reply engine shared by the LoRa (radio) and host (UART) state machines: it owns the
+ * current state with its stale-state timer, dispatches the communication cycle through the
+ * state handler table and hands outcomes over to the thread waiting for a request to complete.
+ *
+ * Transport must provide:
+ *
+ *   typedef <outcome enum> Outcome;
+ *   static constexpr Outcome pending_outcome();
+ *   static constexpr Outcome timeout_stuck_outcome();
+ *   static constexpr Outcome reply_right_outcome();
+ *   static constexpr Outcome invalid_state_outcome();
+ *   static Outcome send_request(uint16_t payload, uint8_t address, bool requiresReply);
+ *
+ * Policy must provide:
+ *
+ *   typedef <state enum> State;
+ *   typedef void (*StateHandler)();
+ *   static constexpr State initial_state();
+ *   static StateHandler get_state_handler(State state);      (lookup in a constexpr table, NULL if nothing to do)
+ *   static int get_stale_state_timeout_ms(State state);
+ *   static void on_stale_state(State state);
+ */
+template <typename Transport, typename Policy>
+class RequestReplyEngine
+{
+public:
+
+    typedef typename Transport::Outcome Outcome;
+    typedef typename Policy::State State;
+    typedef typename Policy::StateHandler StateHandler;
+
+    // (outcome, reply payload), called on the thread which notified the outcome
+    typedef void (*CompletionCallback)(Outcome, uint16_t);
+
+    RequestReplyEngine() : _cond_var(_mutex), _outcome(Transport::pending_outcome()), _payload(0), _state(Policy::initial_state()),
+        _completion(NULL), _completion_timeout_ms(0), _suspended_completion(NULL), _suspended_timeout_left_ms(0)
+    {
+    }
+
+    void start()
+    {
+        _state_timer.start();
+        _completion_timer.start();
+    }
+
+    State get_state() const
+    {
+        return _state;
+    }
+
+    uint32_t get_state_elapsed_ms()
+    {
+        return _state_timer.read_ms();
+    }
+
+    State set_state(State newState)
+    {
+        State previousState=_state;
+        _state=newState;
+        _state_timer.reset();
+        return previousState;
+    }
+
+    /*!
+     * @brief One pass of the communication cycle: stale state check, then table lookup of the state handler
+     */
+    void dispatch()
+    {
+        if(_completion && (uint32_t)_completion_timer.read_ms() > _completion_timeout_ms)
+        {
+            update_and_notify_outcome(Transport::timeout_stuck_outcome(), 0);
+        }
+
+        if(_state_timer.read_ms() > Policy::get_stale_state_timeout_ms(_state))
+        {
+            Policy::on_stale_state(_state);
+
+            set_state(Policy::initial_state());
+        }
+
+        StateHandler handler = Policy::get_state_handler(_state);
+
+        if(handler) handler();
+    }
+
+    /*!
+     * @brief Hands the outcome of the ongoing request over to the waiting thread; extraUpdate (if any)
+     *        runs under the same lock, to publish additional results together with the outcome
+     */
+    void update_and_notify_outcome(Outcome outcome, uint16_t payload, void (*extraUpdate)() = NULL)
+    {
+        _mutex.lock();
+        _outcome=outcome;
+        _payload=payload;
+        if(extraUpdate) extraUpdate();
+        _cond_var.notify_all();
+        CompletionCallback completion=_completion;
+        _completion=NULL;
+        _mutex.unlock();
+
+        if(completion) completion(outcome, payload);
+    }
+
+    /*!
+     * @brief Starts a request through send() and blocks until its outcome is notified or timeoutMs elapses;
+     *        collect(outcome, payload) runs under the lock once the outcome is known, to copy results out
+     */
+    template <typename SendFunction, typename CollectFunction>
+    Outcome send_and_wait(SendFunction send, uint32_t timeoutMs, CollectFunction collect)
+    {
+        Timer timer;
+
+        _mutex.lock();
+
+        timer.start();
+
+        bool timedOut=false;
+        uint32_t timeLeft=timeoutMs;
+
+        _outcome=Transport::pending_outcome();
+
+        Outcome outcome = send();
+
+        if(outcome != Transport::pending_outcome())
+        {
+            _mutex.unlock();
+            return outcome;
+        }
+
+        do
+        {
+            timedOut = _cond_var.wait_for(timeLeft);
+
+            uint32_t elapsed = timer.read_ms();
+            timeLeft = elapsed > timeoutMs ? 0 : timeoutMs - elapsed;
+
+        } while(_outcome == Transport::pending_outcome() && !timedOut);
+
+        outcome=timedOut ? Transport::timeout_stuck_outcome() : _outcome;
+
+        if(!timedOut) collect(outcome, _payload);
+
+        _mutex.unlock();
+
+        return outcome;
+    }
+
+    /*!
+     * @brief Starts a request through send() without blocking: completion is called with its outcome,
+     *        or with the timeout stuck outcome by dispatch() once timeoutMs elapses
+     */
+    template <typename SendFunction>
+    Outcome send_async(SendFunction send, uint32_t timeoutMs, CompletionCallback completion)
+    {
+        _mutex.lock();
+
+        if(_completion)
+        {
+            _mutex.unlock();
+            return Transport::invalid_state_outcome();
+        }
+
+        _outcome=Transport::pending_outcome();
+        _completion=completion;
+        _completion_timeout_ms=timeoutMs;
+        _completion_timer.reset();
+
+        Outcome outcome = send();
+
+        if(outcome != Transport::pending_outcome()) _completion=NULL;
+
+        _mutex.unlock();
+
+        return outcome;
+    }
+
+    /*!
+     * @brief Sets the ongoing async request aside (its completion and the time left to its timeout), so that another one
+     *        can go in the meantime; false if there is none, or one is already set aside
+     */
+    bool suspend()
+    {
+        _mutex.lock();
+
+        if(!_completion || _suspended_completion)
+        {
+            _mutex.unlock();
+            return false;
+        }
+
+        uint32_t elapsed = _completion_timer.read_ms();
+
+        _suspended_completion=_completion;
+        _suspended_timeout_left_ms=elapsed < _completion_timeout_ms ? _completion_timeout_ms - elapsed : 0;
+        _completion=NULL;
+
+        _mutex.unlock();
+
+        return true;
+    }
+
+    /*!
+     * @brief Takes back the request set aside by suspend(), with the time it had left; false while another async request
+     *        is ongoing
+     */
+    bool resume()
+    {
+        _mutex.lock();
+
+        if(!_suspended_completion || _completion)
+        {
+            _mutex.unlock();
+            return false;
+        }
+
+        _outcome=Transport::pending_outcome();
+        _completion=_suspended_completion;
+        _completion_timeout_ms=_suspended_timeout_left_ms;
+        _completion_timer.reset();
+        _suspended_completion=NULL;
+
+        _mutex.unlock();
+
+        return true;
+    }
+
+    Outcome send_request_async(uint16_t payload, uint8_t address, bool requiresReply, uint32_t timeoutMs, CompletionCallback completion)
+    {
+        return send_async([=]() { return Transport::send_request(payload, address, requiresReply); }, timeoutMs, completion);
+    }
+
+    Outcome send_request_and_wait(uint16_t payload, uint8_t address, bool requiresReply, uint32_t timeoutMs, uint16_t* outReplyPayload)
+    {
+        return send_and_wait(
+            [=]() { return Transport::send_request(payload, address, requiresReply); },
+            timeoutMs,
+            [=](Outcome outcome, uint16_t replyPayload) { if(outcome==Transport::reply_right_outcome() && outReplyPayload) *outReplyPayload = replyPayload; });
+    }
+
+private:
+
+    Mutex _mutex;
+    ConditionVariable _cond_var;
+
+    Outcome _outcome;
+    uint16_t _payload;
+
+    State _state;
+    Timer _state_timer;
+
+    CompletionCallback _completion;
+    uint32_t _completion_timeout_ms;
+    Timer _completion_timer;
+
+    CompletionCallback _suspended_completion;
+    uint32_t _suspended_timeout_left_ms;
+};
+
+#endif // __REQUEST_REPLY_ENGINE_H__
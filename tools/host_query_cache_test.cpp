@@ -0,0 +1,131 @@
+/*
+ * Query cache of the host side (host_query_cache): only the cacheable classes are kept, a reply is served until the ttl
+ * of its class runs out, invalidation drops the replies of a node (or of all of them), expired entries make room
+ * before live ones are evicted, least recently used first
+ */
+
+#include <cstdint>
+#include <cstdio>
+
+#include "lora_config.h"
+#include "host_query_cache.h"
+
+#include "lora_test.h"
+
+#define SHORT_TTL_PAYLOAD   100
+#define SHORT_TTL_MS        1000
+#define LONG_TTL_PAYLOAD    200
+#define LONG_TTL_MS         60000
+
+static void test_only_cacheable_classes()
+{
+    uint16_t replyPayload = 0;
+
+    TEST_CHECK(!host_query_cache_is_cacheable(SHORT_TTL_PAYLOAD));
+
+    host_query_cache_store(2, SHORT_TTL_PAYLOAD, 1, 0);
+
+    TEST_CHECK(!host_query_cache_lookup(2, SHORT_TTL_PAYLOAD, 0, &replyPayload));
+
+    TEST_CHECK(host_query_cache_set_cacheable_class(SHORT_TTL_PAYLOAD, SHORT_TTL_MS));
+    TEST_CHECK(host_query_cache_set_cacheable_class(LONG_TTL_PAYLOAD, LONG_TTL_MS));
+    TEST_CHECK(host_query_cache_is_cacheable(SHORT_TTL_PAYLOAD));
+
+    // The classes are a fixed table
+    for(uint16_t payload=1; payload<=HOST_QUERY_CACHE_MAX_CLASSES - 2; payload++) TEST_CHECK(host_query_cache_set_cacheable_class(payload, 1));
+
+    TEST_CHECK(!host_query_cache_set_cacheable_class(HOST_QUERY_CACHE_MAX_CLASSES - 1, 1));
+
+    for(uint16_t payload=1; payload<=HOST_QUERY_CACHE_MAX_CLASSES - 2; payload++) TEST_CHECK(host_query_cache_set_cacheable_class(payload, 0));
+
+    TEST_CHECK(!host_query_cache_is_cacheable(1));
+}
+
+static void test_hit_until_expiry()
+{
+    uint16_t replyPayload = 0;
+
+    host_query_cache_store(2, SHORT_TTL_PAYLOAD, 55, 10000);
+
+    TEST_CHECK(host_query_cache_lookup(2, SHORT_TTL_PAYLOAD, 10000 + SHORT_TTL_MS, &replyPayload));
+    TEST_CHECK_EQUAL(replyPayload, 55);
+
+    // Another node, or another query to the same node
+    TEST_CHECK(!host_query_cache_lookup(3, SHORT_TTL_PAYLOAD, 10000, &replyPayload));
+    TEST_CHECK(!host_query_cache_lookup(2, LONG_TTL_PAYLOAD, 10000, &replyPayload));
+
+    TEST_CHECK(!host_query_cache_lookup(2, SHORT_TTL_PAYLOAD, 10000 + SHORT_TTL_MS + 1, &replyPayload));
+
+    // A class made not cacheable drops its replies, which don't come back with it
+    host_query_cache_store(2, SHORT_TTL_PAYLOAD, 56, 20000);
+
+    TEST_CHECK(host_query_cache_set_cacheable_class(SHORT_TTL_PAYLOAD, 0));
+    TEST_CHECK(host_query_cache_set_cacheable_class(SHORT_TTL_PAYLOAD, SHORT_TTL_MS));
+    TEST_CHECK(!host_query_cache_lookup(2, SHORT_TTL_PAYLOAD, 20000, &replyPayload));
+}
+
+static void test_invalidation()
+{
+    uint16_t replyPayload = 0;
+
+    for(uint8_t address=2; address<=4; address++) host_query_cache_store(address, LONG_TTL_PAYLOAD, address, 30000);
+
+    host_query_cache_invalidate(3);
+
+    TEST_CHECK(host_query_cache_lookup(2, LONG_TTL_PAYLOAD, 30000, &replyPayload));
+    TEST_CHECK(!host_query_cache_lookup(3, LONG_TTL_PAYLOAD, 30000, &replyPayload));
+    TEST_CHECK(host_query_cache_lookup(4, LONG_TTL_PAYLOAD, 30000, &replyPayload));
+
+    host_query_cache_invalidate(0);
+
+    TEST_CHECK(!host_query_cache_lookup(2, LONG_TTL_PAYLOAD, 30000, &replyPayload));
+    TEST_CHECK(!host_query_cache_lookup(4, LONG_TTL_PAYLOAD, 30000, &replyPayload));
+}
+
+static void test_expired_entries_make_room_first()
+{
+    uint16_t replyPayload = 0;
+    uint32_t nowMs = 40000;
+
+    // One old live entry, then short lived ones used more recently, which expire
+    host_query_cache_store(1, LONG_TTL_PAYLOAD, 1, nowMs++);
+
+    for(uint8_t address=2; address<=HOST_QUERY_CACHE_SIZE; address++) host_query_cache_store(address, SHORT_TTL_PAYLOAD, address, nowMs++);
+
+    nowMs += SHORT_TTL_MS + 1;
+
+    host_query_cache_store(HOST_QUERY_CACHE_SIZE + 1, LONG_TTL_PAYLOAD, 17, nowMs);
+
+    TEST_CHECK(host_query_cache_lookup(1, LONG_TTL_PAYLOAD, nowMs, &replyPayload));
+    TEST_CHECK(host_query_cache_lookup(HOST_QUERY_CACHE_SIZE + 1, LONG_TTL_PAYLOAD, nowMs, &replyPayload));
+
+    host_query_cache_invalidate(0);
+}
+
+static void test_least_recently_used_is_evicted()
+{
+    uint16_t replyPayload = 0;
+    uint32_t nowMs = 50000;
+
+    for(uint8_t address=1; address<=HOST_QUERY_CACHE_SIZE; address++) host_query_cache_store(address, LONG_TTL_PAYLOAD, address, nowMs++);
+
+    TEST_CHECK(host_query_cache_lookup(1, LONG_TTL_PAYLOAD, nowMs++, &replyPayload));
+
+    host_query_cache_store(HOST_QUERY_CACHE_SIZE + 1, LONG_TTL_PAYLOAD, 17, nowMs++);
+
+    TEST_CHECK(host_query_cache_lookup(1, LONG_TTL_PAYLOAD, nowMs, &replyPayload));
+    TEST_CHECK(!host_query_cache_lookup(2, LONG_TTL_PAYLOAD, nowMs, &replyPayload));
+    TEST_CHECK(host_query_cache_lookup(3, LONG_TTL_PAYLOAD, nowMs, &replyPayload));
+    TEST_CHECK(host_query_cache_lookup(HOST_QUERY_CACHE_SIZE + 1, LONG_TTL_PAYLOAD, nowMs, &replyPayload));
+}
+
+int main()
+{
+    test_only_cacheable_classes();
+    test_hit_until_expiry();
+    test_invalidation();
+    test_expired_entries_make_room_first();
+    test_least_recently_used_is_evicted();
+
+    return test_report("host_query_cache_test");
+}
@@ -0,0 +1,255 @@
+/*
+ * Native (Linux) run of the protocol microbenchmarks (see lora_benchmark.h)
+ *
+ *  lora_benchmark_tool [iterations] [result file]      one JSON object per line in the result file (default lora_benchmark.json),
+ *                                                      a readable table on stdout
+ *
+ * ns/op from CLOCK_MONOTONIC, cycles/op from the TSC (x86 only), allocations/op counting operator new.
+ * dispatch_cycle is one RequestReplyEngine::dispatch() pass in its idle state, as the LoRa state machine while waiting for requests;
+ * dispatch_cycle_switch is the same pass written as the communication cycles were before the engine (stale state check and
+ * switch on the state, same number of states as the LoRa state machine had then).
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "mbed.h"
+
+#include "lora_protocol_impl.h"
+#include "lora_benchmark.h"
+#include "request_reply_engine.h"
+
+#define DEFAULT_ITERATIONS 100000
+#define DEFAULT_RESULT_FILE "lora_benchmark.json"
+#define JSON_LINE_SIZE 256
+#define STALE_STATE_TIMEOUT 60000
+
+static uint32_t s_allocation_count;
+
+void* operator new(size_t size)
+{
+    s_allocation_count++;
+
+    void* p=malloc(size ? size : 1);
+
+    if(!p) throw std::bad_alloc();
+
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+static uint64_t read_time_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint32_t read_cycles()
+{
+    return (uint32_t)__rdtsc();
+}
+#endif
+
+static uint32_t read_allocation_count()
+{
+    return s_allocation_count;
+}
+
+// Engine with the same shape as the LoRa one: an initial state moving to an idle (no handler) one, then states with work
+
+typedef enum
+{
+    BENCH_INITIAL,
+    BENCH_IDLE,
+    BENCH_BUSY_1,
+    BENCH_BUSY_2,
+    BENCH_BUSY_3,
+    BENCH_BUSY_4,
+    BENCH_BUSY_5,
+    BENCH_BUSY_6,
+    BENCH_BUSY_7,
+    BENCH_BUSY_8,
+    BENCH_STATES_COUNT
+
+} BenchStates_t;
+
+typedef enum
+{
+    BENCH_OUTCOME_PENDING=-1,
+    BENCH_OUTCOME_INVALID_STATE=-6,
+    BENCH_OUTCOME_TIMEOUT_STUCK=-10,
+    BENCH_OUTCOME_REPLY_RIGHT=1,
+
+} BenchOutcomes_t;
+
+struct BenchTransport
+{
+    typedef BenchOutcomes_t Outcome;
+
+    static constexpr Outcome pending_outcome() { return BENCH_OUTCOME_PENDING; }
+    static constexpr Outcome timeout_stuck_outcome() { return BENCH_OUTCOME_TIMEOUT_STUCK; }
+    static constexpr Outcome reply_right_outcome() { return BENCH_OUTCOME_REPLY_RIGHT; }
+    static constexpr Outcome invalid_state_outcome() { return BENCH_OUTCOME_INVALID_STATE; }
+
+    static Outcome send_request(uint16_t, uint8_t, bool) { return BENCH_OUTCOME_INVALID_STATE; }
+};
+
+static volatile uint32_t s_busy_count;
+
+static void handle_initial();
+
+static void handle_busy()
+{
+    s_busy_count++;
+}
+
+struct BenchPolicy
+{
+    typedef BenchStates_t State;
+    typedef void (*StateHandler)();
+
+    static constexpr State initial_state() { return BENCH_INITIAL; }
+
+    static StateHandler get_state_handler(State state)
+    {
+        static constexpr StateHandler handlers[BENCH_STATES_COUNT] =
+        {
+            handle_initial, NULL, handle_busy, handle_busy, handle_busy, handle_busy, handle_busy, handle_busy, handle_busy, handle_busy
+        };
+
+        return handlers[state];
+    }
+
+    static int get_stale_state_timeout_ms(State) { return STALE_STATE_TIMEOUT; }
+
+    static void on_stale_state(State) {}
+};
+
+static RequestReplyEngine<BenchTransport, BenchPolicy> s_engine;
+
+static void handle_initial()
+{
+    s_engine.set_state(BENCH_IDLE);
+}
+
+static void dispatch()
+{
+    s_engine.dispatch();
+}
+
+// Baseline: the communication cycle before RequestReplyEngine
+
+static BenchStates_t s_switch_state = BENCH_INITIAL;
+static Timer s_switch_state_timer;
+
+static void set_switch_state(BenchStates_t newState)
+{
+    s_switch_state=newState;
+    s_switch_state_timer.reset();
+}
+
+static void dispatch_switch()
+{
+    if(s_switch_state_timer.read_ms() > STALE_STATE_TIMEOUT) set_switch_state(BENCH_INITIAL);
+
+    switch(s_switch_state)
+    {
+        case BENCH_INITIAL:
+            set_switch_state(BENCH_IDLE);
+            break;
+
+        case BENCH_IDLE:
+            break;
+
+        case BENCH_BUSY_1:
+        case BENCH_BUSY_2:
+        case BENCH_BUSY_3:
+        case BENCH_BUSY_4:
+        case BENCH_BUSY_5:
+        case BENCH_BUSY_6:
+        case BENCH_BUSY_7:
+        case BENCH_BUSY_8:
+            handle_busy();
+            break;
+
+        default:
+            break;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t iterations=argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+    const char* resultFileName=argc > 2 ? argv[2] : DEFAULT_RESULT_FILE;
+
+    if(iterations == 0)
+    {
+        fprintf(stderr, "usage: %s [iterations] [result file]\n", argv[0]);
+        return 1;
+    }
+
+    FILE* resultFile=fopen(resultFileName, "w");
+
+    if(!resultFile)
+    {
+        perror(resultFileName);
+        return 1;
+    }
+
+    lora_protocol_initialize(1);
+
+    s_engine.start();
+    s_switch_state_timer.start();
+
+    lora_benchmark_read_time_ns_callback = read_time_ns;
+#if defined(__x86_64__) || defined(__i386__)
+    lora_benchmark_read_cycles_callback = read_cycles;
+#endif
+    lora_benchmark_read_allocation_count_callback = read_allocation_count;
+    lora_benchmark_dispatch_callback = dispatch;
+    lora_benchmark_switch_dispatch_callback = dispatch_switch;
+
+    LoraBenchmarkResult_t results[LORA_BENCHMARK_MAX_CASES];
+
+    int count=lora_benchmark_run_all(iterations, results, LORA_BENCHMARK_MAX_CASES);
+
+    printf("%-28s %12s %12s %12s\n", "case", "ns/op", "cycles/op", "allocs/op");
+
+    for(int i=0; i<count; i++)
+    {
+        char jsonLine[JSON_LINE_SIZE];
+
+        lora_benchmark_fill_with_result_json(jsonLine, JSON_LINE_SIZE, "native", &results[i]);
+
+        fprintf(resultFile, "%s\n", jsonLine);
+
+        printf("%-28s %12.1f %12.1f %12.2f\n", results[i].name,
+            (double)results[i].elapsedNs / iterations, (double)results[i].cycles / iterations, (double)results[i].allocations / iterations);
+    }
+
+    fclose(resultFile);
+
+    printf("%d results written to %s\n", count, resultFileName);
+
+    return 0;
+}
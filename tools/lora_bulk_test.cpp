@@ -0,0 +1,246 @@
+/*
+ * Erasure coding of the bulk transfers (lora_bulk): any k distinct fragments of the n a blob is coded into rebuild it,
+ * whichever they are and in whatever order they come, k - 1 never do; the repair rounds of the sender go by the
+ * reports of the targets
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "lora_config.h"
+#include "lora_bulk.h"
+
+#include "lora_test.h"
+
+#define ALL_FRAGMENTS_MASK  ((1ULL << LORA_BULK_MAX_FRAGMENTS) - 1)
+#define TARGET_ADDRESS      2
+
+static std::mt19937 s_random(1234);
+
+static uint8_t s_fragments[LORA_BULK_MAX_FRAGMENTS][LORA_BULK_FRAGMENT_SIZE];
+
+static void make_blob(uint8_t* blob, uint16_t size)
+{
+    for(uint16_t i=0; i<size; i++) blob[i] = (uint8_t)s_random();
+}
+
+// Every fragment of the blob, asking for repair rounds (the target reporting it has nothing) until the parity runs out
+static void code_all_fragments(uint8_t session, const uint8_t* blob, uint16_t size)
+{
+    uint64_t codedMask=0;
+
+    TEST_CHECK(lora_bulk_sender_start(session, blob, size, 1 << TARGET_ADDRESS));
+
+    for(int round=0; round<LORA_BULK_MAX_FRAGMENTS && codedMask != ALL_FRAGMENTS_MASK; round++)
+    {
+        if(round > 0) lora_bulk_sender_add_report(TARGET_ADDRESS, ALL_FRAGMENTS_MASK);
+
+        TEST_CHECK(lora_bulk_sender_plan_round() > 0);
+
+        uint8_t index;
+        uint8_t fragment[LORA_BULK_FRAGMENT_SIZE];
+
+        while(lora_bulk_sender_next_fragment(&index, fragment))
+        {
+            // A fragment sent again is the same
+            if(codedMask & (1ULL << index)) TEST_CHECK(memcmp(s_fragments[index], fragment, LORA_BULK_FRAGMENT_SIZE) == 0);
+
+            memcpy(s_fragments[index], fragment, LORA_BULK_FRAGMENT_SIZE);
+
+            codedMask |= 1ULL << index;
+        }
+    }
+
+    TEST_CHECK_EQUAL(codedMask, ALL_FRAGMENTS_MASK);
+}
+
+// Feeds the fragments to the receiver, true if the last one (and only it) rebuilt the same blob
+static bool rebuild(uint8_t session, const uint8_t* blob, uint16_t size, const std::vector<uint8_t>& indices)
+{
+    bool complete=false;
+
+    for(size_t i=0; i<indices.size(); i++)
+    {
+        complete = lora_bulk_receiver_add_fragment(1, session, size, indices[i], s_fragments[indices[i]]);
+
+        if(complete != (i == indices.size() - 1)) return false;
+    }
+
+    uint16_t rebuiltSize;
+    const uint8_t* rebuilt = lora_bulk_receiver_get_blob(&rebuiltSize);
+
+    return complete && rebuiltSize == size && memcmp(rebuilt, blob, size) == 0 && lora_bulk_receiver_get_missing_mask(1, session) == 0;
+}
+
+static void test_code_is_systematic()
+{
+    uint8_t blob[LORA_BULK_MAX_SIZE];
+    uint16_t size = 2 * LORA_BULK_FRAGMENT_SIZE + 1;
+
+    make_blob(blob, size);
+    code_all_fragments(1, blob, size);
+
+    TEST_CHECK(memcmp(s_fragments[0], blob, 2 * LORA_BULK_FRAGMENT_SIZE) == 0);
+
+    // The last data fragment is zero padded
+    TEST_CHECK_EQUAL(s_fragments[2][0], blob[2 * LORA_BULK_FRAGMENT_SIZE]);
+
+    for(int byte=1; byte<LORA_BULK_FRAGMENT_SIZE; byte++) TEST_CHECK_EQUAL(s_fragments[2][byte], 0);
+}
+
+// Small blobs: every pair of the n fragments, in both orders
+static void test_any_two_of_n()
+{
+    uint8_t blob[LORA_BULK_MAX_SIZE];
+    uint16_t size = 2 * LORA_BULK_FRAGMENT_SIZE;
+    uint8_t session = 10;
+
+    make_blob(blob, size);
+    code_all_fragments(session, blob, size);
+
+    int rebuilt=0;
+
+    for(uint8_t a=0; a<LORA_BULK_MAX_FRAGMENTS; a++)
+    {
+        for(uint8_t b=0; b<LORA_BULK_MAX_FRAGMENTS; b++)
+        {
+            if(a == b) continue;
+
+            // A new session each time, so that the receiver starts over
+            rebuilt += rebuild(++session, blob, size, { a, b });
+        }
+    }
+
+    TEST_CHECK_EQUAL(rebuilt, LORA_BULK_MAX_FRAGMENTS * (LORA_BULK_MAX_FRAGMENTS - 1));
+}
+
+// Larger blobs up to LORA_BULK_MAX_SIZE: random k-subsets (all parity first, data and parity mixed) in random order,
+// and the same minus one fragment
+static void test_random_k_of_n()
+{
+    const uint16_t sizes[] = { 1, LORA_BULK_FRAGMENT_SIZE, 23, 64, 101, LORA_BULK_MAX_SIZE };
+    uint8_t blob[LORA_BULK_MAX_SIZE];
+    uint8_t session = 0;
+
+    for(uint16_t size : sizes)
+    {
+        uint8_t k = lora_bulk_get_data_fragment_count(size);
+
+        make_blob(blob, size);
+        code_all_fragments(++session, blob, size);
+
+        std::vector<uint8_t> all;
+
+        for(uint8_t index=0; index<LORA_BULK_MAX_FRAGMENTS; index++) all.push_back(index);
+
+        for(int trial=0; trial<200; trial++)
+        {
+            std::vector<uint8_t> indices;
+
+            if(trial == 0)
+            {
+                // As much parity as there is, then the last data fragments
+                for(uint8_t index=LORA_BULK_MAX_FRAGMENTS; indices.size()<k; ) indices.push_back(--index);
+            }
+            else
+            {
+                std::shuffle(all.begin(), all.end(), s_random);
+
+                indices.assign(all.begin(), all.begin() + k);
+            }
+
+            TEST_CHECK(rebuild(++session, blob, size, indices));
+
+            if(k < 2) continue;
+
+            indices.pop_back();
+
+            ++session;
+
+            for(uint8_t index : indices) TEST_CHECK(!lora_bulk_receiver_add_fragment(1, session, size, index, s_fragments[index]));
+
+            uint64_t missingMask = lora_bulk_receiver_get_missing_mask(1, session);
+            uint16_t rebuiltSize;
+
+            lora_bulk_receiver_get_blob(&rebuiltSize);
+
+            TEST_CHECK_EQUAL(rebuiltSize, 0);
+
+            for(uint8_t index : indices) TEST_CHECK(!(missingMask & (1ULL << index)));
+        }
+    }
+}
+
+// A fragment heard twice counts once
+static void test_duplicates_do_not_count()
+{
+    uint8_t blob[LORA_BULK_MAX_SIZE];
+    uint16_t size = 3 * LORA_BULK_FRAGMENT_SIZE;
+
+    make_blob(blob, size);
+    code_all_fragments(200, blob, size);
+
+    TEST_CHECK(!lora_bulk_receiver_add_fragment(1, 201, size, 40, s_fragments[40]));
+    TEST_CHECK(!lora_bulk_receiver_add_fragment(1, 201, size, 40, s_fragments[40]));
+    TEST_CHECK(!lora_bulk_receiver_add_fragment(1, 201, size, 5, s_fragments[5]));
+    TEST_CHECK(lora_bulk_receiver_add_fragment(1, 201, size, 1, s_fragments[1]));
+
+    uint16_t rebuiltSize;
+    const uint8_t* rebuilt = lora_bulk_receiver_get_blob(&rebuiltSize);
+
+    TEST_CHECK_EQUAL(rebuiltSize, size);
+    TEST_CHECK(memcmp(rebuilt, blob, size) == 0);
+}
+
+// A repair round sends as many fragments as the target still lacks, fresh parity first
+static void test_repair_round_follows_the_report()
+{
+    uint8_t blob[LORA_BULK_MAX_SIZE];
+    uint16_t size = 8 * LORA_BULK_FRAGMENT_SIZE;
+    uint8_t index;
+    uint8_t fragment[LORA_BULK_FRAGMENT_SIZE];
+
+    make_blob(blob, size);
+
+    TEST_CHECK(lora_bulk_sender_start(1, blob, size, 1 << TARGET_ADDRESS));
+
+    uint8_t firstCount = lora_bulk_sender_plan_round();
+
+    TEST_CHECK_EQUAL(firstCount, lora_bulk_get_first_round_count(size));
+    TEST_CHECK_EQUAL(firstCount, 8 + 2);
+
+    while(lora_bulk_sender_next_fragment(&index, fragment));
+
+    // 7 of the 10 got through (3 data fragments lost): 1 more is enough
+    lora_bulk_sender_add_report(TARGET_ADDRESS, (1ULL << 0) | (1ULL << 3) | (1ULL << 6) | (ALL_FRAGMENTS_MASK & ~((1ULL << firstCount) - 1)));
+
+    TEST_CHECK_EQUAL(lora_bulk_sender_plan_round(), 1);
+    TEST_CHECK(lora_bulk_sender_next_fragment(&index, fragment));
+    TEST_CHECK_EQUAL(index, firstCount);
+    TEST_CHECK(!lora_bulk_sender_next_fragment(&index, fragment));
+
+    TEST_CHECK_EQUAL(lora_bulk_sender_get_pending_mask(), 1 << TARGET_ADDRESS);
+
+    lora_bulk_sender_add_report(TARGET_ADDRESS, 0);
+
+    TEST_CHECK_EQUAL(lora_bulk_sender_get_completed_mask(), 1 << TARGET_ADDRESS);
+    TEST_CHECK_EQUAL(lora_bulk_sender_get_pending_mask(), 0);
+    TEST_CHECK_EQUAL(lora_bulk_sender_plan_round(), 0);
+}
+
+int main()
+{
+    lora_bulk_initialize();
+
+    test_code_is_systematic();
+    test_any_two_of_n();
+    test_random_k_of_n();
+    test_duplicates_do_not_count();
+    test_repair_round_follows_the_report();
+
+    return test_report("lora_bulk_test");
+}
@@ -0,0 +1,611 @@
+/*
+ * Linux companion of the firmware frame capture (see lora_capture.h and "!F|1#" in README.md)
+ *
+ *  lora_capture_tool capture <serial device> <capture file>     records the binary stream sent by the node (text lines go to stdout)
+ *  lora_capture_tool csv <capture file>                         one line per record, with the decoded frame fields
+ *  lora_capture_tool pcap <capture file> <pcap file>            LoRaTap pcap, for wireshark
+ *  lora_capture_tool decode <capture file> <my address>         feeds the received frames to the protocol decoder, as node <my address> would
+ *  lora_capture_tool replay <capture file> <serial device|-> [speed]
+ *                                                               injects the received frames into a node ("!J|..#"), at original pace
+ *                                                               multiplied by speed (default 1, 0 = as fast as possible)
+ *  lora_capture_tool energy <capture file> [sx1272|sx1276]     radio time and charge estimate of the captured node, as accounted by the
+ *                                                               firmware ("!S|E#"), assuming it listens whenever it isn't transmitting
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "lora_config.h"
+#include "lora_capture.h"
+#include "lora_protocol_impl.h"
+#include "lora_energy.h"
+
+#define SERIAL_READ_BUFFER_SIZE 256
+
+#define LINKTYPE_LORATAP 270
+#define LORATAP_HEADER_SIZE 15
+#define LORATAP_SYNC_WORD_PRIVATE 0x12
+
+static int open_serial(const char* path, int flags)
+{
+    int fd = open(path, flags | O_NOCTTY);
+
+    if(fd < 0) return fd;
+
+    struct termios tio;
+
+    // Not a tty (e.g. a plain file or a pipe): used as is
+    if(tcgetattr(fd, &tio) != 0) return fd;
+
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B115200);
+
+    tcsetattr(fd, TCSANOW, &tio);
+
+    return fd;
+}
+
+static bool read_capture_file(const char* path, std::vector<LoraCaptureRecord_t>& records)
+{
+    FILE* file = fopen(path, "rb");
+
+    if(!file) return false;
+
+    std::vector<uint8_t> data;
+    uint8_t chunk[SERIAL_READ_BUFFER_SIZE];
+    size_t n;
+
+    while((n = fread(chunk, 1, sizeof(chunk), file)) > 0) data.insert(data.end(), chunk, chunk + n);
+
+    fclose(file);
+
+    size_t offset=0;
+
+    while(offset < data.size())
+    {
+        LoraCaptureRecord_t record;
+
+        int consumed = lora_capture_decode_record(&data[offset], data.size() - offset > 0xFFFF ? 0xFFFF : data.size() - offset, &record);
+
+        if(consumed == 0) break;
+
+        if(consumed < 0)
+        {
+            offset++;
+            continue;
+        }
+
+        records.push_back(record);
+        offset += consumed;
+    }
+
+    return true;
+}
+
+static const char* get_kind_name(uint8_t kind)
+{
+    switch(kind)
+    {
+        case LORA_CAPTURE_RX_DONE: return "RX";
+        case LORA_CAPTURE_RX_ERROR: return "RX_ERROR";
+        case LORA_CAPTURE_RX_REPLY_TIMEOUT: return "RX_REPLY_TIMEOUT";
+        case LORA_CAPTURE_TX: return "TX";
+        case LORA_CAPTURE_TX_DONE: return "TX_DONE";
+        case LORA_CAPTURE_TX_TIMEOUT: return "TX_TIMEOUT";
+    }
+
+    return "?";
+}
+
+// Frames are NUL padded text, printable up to the first NUL
+static std::string get_frame_text(const LoraCaptureRecord_t& record)
+{
+    std::string text;
+
+    for(int i=0; i<record.size && record.frame[i] != '\0'; i++) text.push_back(record.frame[i] >= ' ' && record.frame[i] < 127 && record.frame[i] != ',' ? record.frame[i] : '.');
+
+    return text;
+}
+
+// type, source, payload, sequence as seen by the protocol decoder
+static void fill_with_decoded_fields(const LoraCaptureRecord_t& record, char* destBuffer, size_t destBufferSize)
+{
+    uint8_t frame[LORA_CAPTURE_MAX_FRAME_SIZE];
+
+    memcpy(frame, record.frame, record.size);
+
+    lora_protocol_process_received_data(frame, record.size);
+
+    if(lora_protocol_is_received_data_a_beacon())
+    {
+        lora_protocol_process_received_data_as_beacon();
+
+        snprintf(destBuffer, destBufferSize, "BEACON,%u,,%u", lora_protocol_get_latest_received_beacon_source_address(), lora_protocol_get_latest_received_beacon_sequence());
+    }
+    else if(lora_protocol_is_received_data_a_hello())
+    {
+        uint8_t sourceAddress=0, capabilities=0;
+        uint16_t sequence=0, neighborMask=0;
+
+        lora_protocol_get_received_hello(&sourceAddress, &capabilities, &sequence, &neighborMask);
+
+        snprintf(destBuffer, destBufferSize, "HELLO,%u,,%u", sourceAddress, sequence);
+    }
+    else if(lora_protocol_is_received_data_a_request())
+    {
+        lora_protocol_process_received_data_as_request();
+
+        // COMMAND, QUERY or GATHER: the frame prefix, the decoder only tells whether this node should reply
+        const char* separator = (const char*)memchr(frame, '-', record.size);
+        int typeLength = separator ? separator - (const char*)frame : 0;
+
+        snprintf(destBuffer, destBufferSize, "%.*s,%u,%u,%u", typeLength, (const char*)frame,
+            lora_protocol_get_latest_received_request_source_address(), lora_protocol_get_latest_received_request_payload(), lora_protocol_get_latest_received_request_sequence());
+    }
+    else if(lora_protocol_is_received_data_a_reply())
+    {
+        lora_protocol_process_received_data_as_reply();
+
+        snprintf(destBuffer, destBufferSize, "RESPONSE,%u,%u,", lora_protocol_get_latest_received_reply_source_address(), lora_protocol_get_latest_received_reply_payload());
+    }
+    else
+    {
+        snprintf(destBuffer, destBufferSize, ",,,");
+    }
+}
+
+static int command_capture(const char* serialPath, const char* capturePath)
+{
+    int fd = open_serial(serialPath, O_RDONLY);
+
+    if(fd < 0)
+    {
+        perror(serialPath);
+        return 1;
+    }
+
+    FILE* file = fopen(capturePath, "ab");
+
+    if(!file)
+    {
+        perror(capturePath);
+        return 1;
+    }
+
+    std::vector<uint8_t> pending;
+    uint8_t chunk[SERIAL_READ_BUFFER_SIZE];
+    unsigned long count=0;
+
+    for(;;)
+    {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+
+        if(n <= 0) break;
+
+        pending.insert(pending.end(), chunk, chunk + n);
+
+        size_t offset=0;
+
+        while(offset < pending.size())
+        {
+            LoraCaptureRecord_t record;
+
+            int consumed = lora_capture_decode_record(&pending[offset], pending.size() - offset, &record);
+
+            if(consumed == 0) break;
+
+            if(consumed < 0)
+            {
+                // Not a record: text coming from the node
+                putchar(pending[offset]);
+                offset++;
+                continue;
+            }
+
+            fwrite(&pending[offset], 1, consumed, file);
+            fflush(file);
+
+            count++;
+            offset += consumed;
+        }
+
+        fflush(stdout);
+
+        pending.erase(pending.begin(), pending.begin() + offset);
+    }
+
+    fprintf(stderr, "%lu records captured\n", count);
+
+    fclose(file);
+    close(fd);
+
+    return 0;
+}
+
+static int command_csv(const char* capturePath)
+{
+    std::vector<LoraCaptureRecord_t> records;
+
+    if(!read_capture_file(capturePath, records))
+    {
+        perror(capturePath);
+        return 1;
+    }
+
+    printf("timestamp_ms,event,rssi,snr,size,frame,type,source,payload,sequence\n");
+
+    for(size_t i=0; i<records.size(); i++)
+    {
+        const LoraCaptureRecord_t& record = records[i];
+        char decoded[64] = ",,,";
+
+        if(record.size > 0) fill_with_decoded_fields(record, decoded, sizeof(decoded));
+
+        printf("%lu,%s,%d,%d,%u,%s,%s\n", (unsigned long)record.timestampMs, get_kind_name(record.kind), record.rssi, record.snr, record.size,
+            get_frame_text(record).c_str(), decoded);
+    }
+
+    return 0;
+}
+
+static void write_u16(FILE* file, uint16_t value) { fwrite(&value, 2, 1, file); }
+static void write_u32(FILE* file, uint32_t value) { fwrite(&value, 4, 1, file); }
+
+static int command_pcap(const char* capturePath, const char* pcapPath)
+{
+    std::vector<LoraCaptureRecord_t> records;
+
+    if(!read_capture_file(capturePath, records))
+    {
+        perror(capturePath);
+        return 1;
+    }
+
+    FILE* file = fopen(pcapPath, "wb");
+
+    if(!file)
+    {
+        perror(pcapPath);
+        return 1;
+    }
+
+    // Native endianness global header, the magic number tells readers which one
+    write_u32(file, 0xa1b2c3d4);
+    write_u16(file, 2);
+    write_u16(file, 4);
+    write_u32(file, 0);
+    write_u32(file, 0);
+    write_u32(file, 65535);
+    write_u32(file, LINKTYPE_LORATAP);
+
+    unsigned long count=0;
+
+    for(size_t i=0; i<records.size(); i++)
+    {
+        const LoraCaptureRecord_t& record = records[i];
+
+        if(record.size == 0) continue;
+
+        // LoRaTap v0 header, multi-byte fields big endian
+        uint8_t header[LORATAP_HEADER_SIZE];
+        uint32_t frequency = RF_FREQUENCY;
+        int rssi = record.kind == LORA_CAPTURE_RX_DONE ? record.rssi + 139 : 0;
+
+        if(rssi < 0) rssi = 0;
+        if(rssi > 255) rssi = 255;
+
+        header[0] = 0;
+        header[1] = 0;
+        header[2] = 0;
+        header[3] = LORATAP_HEADER_SIZE;
+        header[4] = frequency >> 24;
+        header[5] = frequency >> 16;
+        header[6] = frequency >> 8;
+        header[7] = frequency;
+        header[8] = 1 << LORA_BANDWIDTH;           // in 125 kHz steps
+        header[9] = LORA_SPREADING_FACTOR;
+        header[10] = rssi;
+        header[11] = rssi;
+        header[12] = rssi;
+        header[13] = (uint8_t)(int8_t)(record.snr * 4);
+        header[14] = LORATAP_SYNC_WORD_PRIVATE;
+
+        write_u32(file, record.timestampMs / 1000);
+        write_u32(file, (record.timestampMs % 1000) * 1000);
+        write_u32(file, LORATAP_HEADER_SIZE + record.size);
+        write_u32(file, LORATAP_HEADER_SIZE + record.size);
+
+        fwrite(header, 1, LORATAP_HEADER_SIZE, file);
+        fwrite(record.frame, 1, record.size, file);
+
+        count++;
+    }
+
+    fclose(file);
+
+    fprintf(stderr, "%lu frames written\n", count);
+
+    return 0;
+}
+
+static double get_elapsed_ns(const struct timespec& start, const struct timespec& end)
+{
+    return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+static int command_decode(const char* capturePath, uint8_t myAddress)
+{
+    std::vector<LoraCaptureRecord_t> records;
+
+    if(!read_capture_file(capturePath, records))
+    {
+        perror(capturePath);
+        return 1;
+    }
+
+    lora_protocol_initialize(myAddress);
+
+    unsigned long frames=0, requests=0, requestsForMe=0, replies=0, repliesForMe=0, beacons=0, unknown=0;
+    double decodeNs=0;
+
+    for(size_t i=0; i<records.size(); i++)
+    {
+        const LoraCaptureRecord_t& record = records[i];
+
+        if(record.kind != LORA_CAPTURE_RX_DONE || record.size == 0) continue;
+
+        uint8_t frame[LORA_CAPTURE_MAX_FRAME_SIZE];
+        memcpy(frame, record.frame, record.size);
+
+        struct timespec start, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        // Same sequence of calls as OnRxDone()
+        lora_protocol_process_received_data(frame, record.size);
+
+        const char* verdict;
+
+        if(lora_protocol_is_received_data_a_beacon())
+        {
+            lora_protocol_process_received_data_as_beacon();
+            beacons++;
+            verdict = "beacon";
+        }
+        else if(lora_protocol_is_received_data_a_request())
+        {
+            lora_protocol_process_received_data_as_request();
+            requests++;
+
+            if(lora_protocol_is_latest_received_request_for_me())
+            {
+                requestsForMe++;
+                verdict = lora_protocol_should_i_reply_to_latest_received_request() ? "request for me, reply" : "request for me, no reply";
+            }
+            else verdict = "request not for me";
+        }
+        else if(lora_protocol_is_received_data_a_reply())
+        {
+            lora_protocol_process_received_data_as_reply();
+            replies++;
+
+            if(lora_protocol_is_latest_received_reply_for_me())
+            {
+                repliesForMe++;
+                verdict = "reply for me";
+            }
+            else verdict = "reply not for me";
+        }
+        else
+        {
+            unknown++;
+            verdict = "unknown frame";
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        decodeNs += get_elapsed_ns(start, end);
+        frames++;
+
+        printf("%10lu ms  %-32s  %s\n", (unsigned long)record.timestampMs, get_frame_text(record).c_str(), verdict);
+    }
+
+    printf("\n%lu frames: %lu requests (%lu for me), %lu replies (%lu for me), %lu beacons, %lu unknown, %.0f ns/frame\n",
+        frames, requests, requestsForMe, replies, repliesForMe, beacons, unknown, frames ? decodeNs / frames : 0.0);
+
+    return 0;
+}
+
+static int command_replay(const char* capturePath, const char* serialPath, double speed)
+{
+    std::vector<LoraCaptureRecord_t> records;
+
+    if(!read_capture_file(capturePath, records))
+    {
+        perror(capturePath);
+        return 1;
+    }
+
+    int fd = strcmp(serialPath, "-") == 0 ? STDOUT_FILENO : open_serial(serialPath, O_WRONLY);
+
+    if(fd < 0)
+    {
+        perror(serialPath);
+        return 1;
+    }
+
+    bool first=true;
+    uint32_t previousTimestampMs=0;
+    unsigned long count=0;
+
+    for(size_t i=0; i<records.size(); i++)
+    {
+        const LoraCaptureRecord_t& record = records[i];
+
+        if(record.kind != LORA_CAPTURE_RX_DONE || record.size == 0) continue;
+
+        if(!first && speed > 0)
+        {
+            uint32_t gapMs = record.timestampMs - previousTimestampMs;
+
+            usleep((useconds_t)(gapMs * 1000.0 / speed));
+        }
+
+        first=false;
+        previousTimestampMs = record.timestampMs;
+
+        std::string command = "!J|" + std::to_string(record.rssi) + "|" + std::to_string(record.snr) + "|";
+        char hex[3];
+
+        for(int b=0; b<record.size; b++)
+        {
+            snprintf(hex, sizeof(hex), "%02X", record.frame[b]);
+            command += hex;
+        }
+
+        command += "#\n";
+
+        if(write(fd, command.c_str(), command.size()) < 0)
+        {
+            perror(serialPath);
+            return 1;
+        }
+
+        count++;
+    }
+
+    if(fd != STDOUT_FILENO) close(fd);
+
+    fprintf(stderr, "%lu frames replayed\n", count);
+
+    return 0;
+}
+
+static bool has_frame_prefix(const LoraCaptureRecord_t& record, const char* prefix)
+{
+    size_t length = strlen(prefix);
+
+    return record.size >= length && memcmp(record.frame, prefix, length) == 0;
+}
+
+static LoraEnergyClasses_t get_sent_frame_energy_class(const LoraCaptureRecord_t& record)
+{
+    if(has_frame_prefix(record, "QUERY-")) return LORA_ENERGY_CLASS_QUERY;
+    if(has_frame_prefix(record, "COMMAND-")) return LORA_ENERGY_CLASS_COMMAND;
+    if(has_frame_prefix(record, "GATHER-")) return LORA_ENERGY_CLASS_GATHER;
+    if(has_frame_prefix(record, "RESPONSE-")) return LORA_ENERGY_CLASS_REPLY;
+    if(has_frame_prefix(record, "BEACON-")) return LORA_ENERGY_CLASS_BEACON;
+    if(has_frame_prefix(record, "POLL-")) return LORA_ENERGY_CLASS_POLL;
+    if(has_frame_prefix(record, "HELLO-")) return LORA_ENERGY_CLASS_BEACON;
+
+    return LORA_ENERGY_CLASS_IDLE;
+}
+
+// Same accounting as the firmware, driven by the captured radio events instead of the radio calls
+static int command_energy(const char* capturePath, const std::string& radio)
+{
+    std::vector<LoraCaptureRecord_t> records;
+
+    if(!read_capture_file(capturePath, records))
+    {
+        perror(capturePath);
+        return 1;
+    }
+
+    if(records.empty())
+    {
+        fprintf(stderr, "no records\n");
+        return 1;
+    }
+
+    const uint32_t sx1272Currents[LORA_RADIO_MODES_COUNT] = { SX1272_SLEEP_CURRENT_NA, SX1272_STANDBY_CURRENT_NA, SX1272_RX_CURRENT_NA, SX1272_TX_CURRENT_NA, SX1272_CAD_CURRENT_NA };
+    const uint32_t sx1276Currents[LORA_RADIO_MODES_COUNT] = { SX1276_SLEEP_CURRENT_NA, SX1276_STANDBY_CURRENT_NA, SX1276_RX_CURRENT_NA, SX1276_TX_CURRENT_NA, SX1276_CAD_CURRENT_NA };
+
+    lora_energy_initialize(radio == "sx1276" ? sx1276Currents : sx1272Currents, (uint64_t)records[0].timestampMs * 1000);
+    lora_energy_set_mode(LORA_RADIO_MODE_RX, (uint64_t)records[0].timestampMs * 1000);
+
+    LoraEnergyClasses_t sentClass = LORA_ENERGY_CLASS_IDLE;
+
+    for(size_t i=0; i<records.size(); i++)
+    {
+        const LoraCaptureRecord_t& record = records[i];
+        uint64_t nowUs = (uint64_t)record.timestampMs * 1000;
+
+        switch(record.kind)
+        {
+            case LORA_CAPTURE_TX:
+                sentClass = get_sent_frame_energy_class(record);
+                lora_energy_set_class(sentClass, nowUs);
+                lora_energy_set_mode(LORA_RADIO_MODE_TX, nowUs);
+                break;
+
+            case LORA_CAPTURE_TX_DONE:
+                // A wait for reply is charged to the request that opened it
+                if(sentClass != LORA_ENERGY_CLASS_QUERY && sentClass != LORA_ENERGY_CLASS_GATHER) lora_energy_set_class(LORA_ENERGY_CLASS_IDLE, nowUs);
+                lora_energy_set_mode(LORA_RADIO_MODE_RX, nowUs);
+                break;
+
+            case LORA_CAPTURE_TX_TIMEOUT:
+            case LORA_CAPTURE_RX_REPLY_TIMEOUT:
+                sentClass = LORA_ENERGY_CLASS_IDLE;
+                lora_energy_set_class(LORA_ENERGY_CLASS_IDLE, nowUs);
+                lora_energy_set_mode(LORA_RADIO_MODE_RX, nowUs);
+                break;
+
+            case LORA_CAPTURE_RX_DONE:
+                // A query ends with its reply, a gather with its window
+                if(sentClass == LORA_ENERGY_CLASS_QUERY && has_frame_prefix(record, "RESPONSE-"))
+                {
+                    sentClass = LORA_ENERGY_CLASS_IDLE;
+                    lora_energy_set_class(LORA_ENERGY_CLASS_IDLE, nowUs);
+                }
+                break;
+        }
+    }
+
+    LoraEnergyTotals_t totals;
+    char dump[160];
+
+    lora_energy_get_totals(&totals, (uint64_t)records.back().timestampMs * 1000);
+    lora_energy_fill_with_totals_dump(&totals, dump, sizeof(dump));
+
+    printf("%s\n", dump);
+
+    return 0;
+}
+
+static int usage()
+{
+    fprintf(stderr, "usage: lora_capture_tool capture <serial device> <capture file>\n"
+                    "       lora_capture_tool csv <capture file>\n"
+                    "       lora_capture_tool pcap <capture file> <pcap file>\n"
+                    "       lora_capture_tool decode <capture file> <my address>\n"
+                    "       lora_capture_tool replay <capture file> <serial device|-> [speed]\n"
+                    "       lora_capture_tool energy <capture file> [sx1272|sx1276]\n");
+    return 2;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3) return usage();
+
+    std::string command = argv[1];
+
+    if(command == "capture" && argc == 4) return command_capture(argv[2], argv[3]);
+    if(command == "csv" && argc == 3) return command_csv(argv[2]);
+    if(command == "pcap" && argc == 4) return command_pcap(argv[2], argv[3]);
+    if(command == "decode" && argc == 4) return command_decode(argv[2], atoi(argv[3]));
+    if(command == "replay" && (argc == 4 || argc == 5)) return command_replay(argv[2], argv[3], argc == 5 ? atof(argv[4]) : 1.0);
+    if(command == "energy" && (argc == 3 || argc == 4)) return command_energy(argv[2], argc == 4 ? argv[3] : "sx1272");
+
+    return usage();
+}
@@ -0,0 +1,368 @@
+/*
+ * Flash log of the gateway store (lora_flash_log) on a flash model in RAM, which like NOR flash only clears bits when
+ * programming and can be cut off after a number of programs (a reset): compaction keeps the live items in order across
+ * many turns of the two sectors, a reset in the middle of one leaves the log as it was, and neither the generation nor
+ * the item ids get confused when they wrap around
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "lora_flash_log.h"
+
+#include "lora_test.h"
+
+#define SECTOR_SIZE     256     // 16 records: room for 14 items
+
+static uint8_t s_flash[2 * SECTOR_SIZE];
+static int s_programs_left = -1;        // -1: no reset planned
+static uint32_t s_program_over_data;
+
+static bool flash_read(uint32_t offset, void* buffer, uint32_t size)
+{
+    memcpy(buffer, s_flash + offset, size);
+
+    return true;
+}
+
+static bool flash_program(uint32_t offset, const void* buffer, uint32_t size)
+{
+    if(s_programs_left == 0) return false;
+
+    if(s_programs_left > 0) s_programs_left--;
+
+    for(uint32_t i=0; i<size; i++)
+    {
+        if(s_flash[offset + i] != 0xFF) s_program_over_data++;
+
+        s_flash[offset + i] &= ((const uint8_t*)buffer)[i];
+    }
+
+    return true;
+}
+
+static bool flash_erase(uint32_t offset, uint32_t size)
+{
+    memset(s_flash + offset, 0xFF, size);
+
+    return true;
+}
+
+static const LoraFlashLogOps_t s_ops = { flash_read, flash_program, flash_erase, SECTOR_SIZE };
+
+static void make_data(uint8_t* data, uint16_t value)
+{
+    for(int i=0; i<LORA_FLASH_LOG_ITEM_SIZE; i++) data[i] = (uint8_t)(value + i);
+}
+
+static bool collect_visitor(const LoraFlashLogItem_t* item, void* context)
+{
+    ((std::vector<LoraFlashLogItem_t>*)context)->push_back(*item);
+
+    return true;
+}
+
+static std::vector<LoraFlashLogItem_t> get_items(LoraFlashLog_t* log)
+{
+    std::vector<LoraFlashLogItem_t> items;
+
+    lora_flash_log_for_each(log, collect_visitor, &items);
+
+    return items;
+}
+
+// The log holds exactly the items of the given ids, in this order, each with the data of its value
+static void check_items(LoraFlashLog_t* log, const std::vector<uint16_t>& ids, const std::vector<uint16_t>& values)
+{
+    std::vector<LoraFlashLogItem_t> items = get_items(log);
+
+    TEST_CHECK_EQUAL(items.size(), ids.size());
+    TEST_CHECK_EQUAL(log->liveCount, ids.size());
+
+    for(size_t i=0; i<items.size() && i<ids.size(); i++)
+    {
+        uint8_t data[LORA_FLASH_LOG_ITEM_SIZE];
+
+        make_data(data, values[i]);
+
+        TEST_CHECK_EQUAL(items[i].id, ids[i]);
+        TEST_CHECK(memcmp(items[i].data, data, LORA_FLASH_LOG_ITEM_SIZE) == 0);
+    }
+}
+
+static void start_blank(LoraFlashLog_t* log)
+{
+    memset(s_flash, 0xFF, sizeof(s_flash));
+
+    s_programs_left = -1;
+
+    TEST_CHECK(lora_flash_log_mount(log, &s_ops));
+}
+
+static void test_append_and_remove()
+{
+    LoraFlashLog_t log;
+    uint8_t data[LORA_FLASH_LOG_ITEM_SIZE];
+    uint16_t ids[3];
+
+    start_blank(&log);
+
+    TEST_CHECK_EQUAL(lora_flash_log_get_capacity(&log), SECTOR_SIZE / LORA_FLASH_LOG_RECORD_SIZE - 2);
+
+    for(int i=0; i<3; i++)
+    {
+        make_data(data, 10 * i);
+
+        TEST_CHECK(lora_flash_log_append(&log, data, &ids[i]));
+    }
+
+    TEST_CHECK(lora_flash_log_remove(&log, ids[1]));
+
+    check_items(&log, { ids[0], ids[2] }, { 0, 20 });
+
+    // Same content after a reset
+    LoraFlashLog_t mounted;
+
+    TEST_CHECK(lora_flash_log_mount(&mounted, &s_ops));
+
+    check_items(&mounted, { ids[0], ids[2] }, { 0, 20 });
+    TEST_CHECK(mounted.nextId > ids[2]);
+}
+
+// Many more records than a sector holds: every compaction moves the live items to the other sector, oldest first
+static void test_compaction_across_many_turns()
+{
+    LoraFlashLog_t log;
+    uint8_t data[LORA_FLASH_LOG_ITEM_SIZE];
+
+    start_blank(&log);
+
+    std::vector<uint16_t> ids, values;
+
+    for(uint16_t value=0; value<500; value++)
+    {
+        uint16_t id;
+
+        make_data(data, value);
+
+        TEST_CHECK(lora_flash_log_append(&log, data, &id));
+
+        ids.push_back(id);
+        values.push_back(value);
+
+        // Keep 5 items live, the oldest goes
+        if(ids.size() > 5)
+        {
+            TEST_CHECK(lora_flash_log_remove(&log, ids.front()));
+
+            ids.erase(ids.begin());
+            values.erase(values.begin());
+        }
+    }
+
+    check_items(&log, ids, values);
+
+    TEST_CHECK(log.compactions > 50);
+    TEST_CHECK_EQUAL(log.generation, 1 + log.compactions);
+    TEST_CHECK_EQUAL(log.programErrors, 0);
+
+    // Each record was programmed over erased flash only
+    TEST_CHECK_EQUAL(s_program_over_data, 0);
+
+    LoraFlashLog_t mounted;
+
+    TEST_CHECK(lora_flash_log_mount(&mounted, &s_ops));
+
+    check_items(&mounted, ids, values);
+    TEST_CHECK_EQUAL(mounted.activeSector, log.activeSector);
+}
+
+// A full log refuses new items, but still takes the remove which makes room
+static void test_full_log()
+{
+    LoraFlashLog_t log;
+    uint8_t data[LORA_FLASH_LOG_ITEM_SIZE];
+    uint16_t firstId=0, id;
+
+    start_blank(&log);
+
+    for(uint16_t i=0; i<lora_flash_log_get_capacity(&log); i++)
+    {
+        make_data(data, i);
+
+        TEST_CHECK(lora_flash_log_append(&log, data, i == 0 ? &firstId : &id));
+    }
+
+    TEST_CHECK(!lora_flash_log_append(&log, data, &id));
+    TEST_CHECK(lora_flash_log_remove(&log, firstId));
+    TEST_CHECK(lora_flash_log_append(&log, data, &id));
+    TEST_CHECK_EQUAL(log.liveCount, lora_flash_log_get_capacity(&log));
+}
+
+// A reset at any program of a compaction: the remount finds either the old sector or the new one, never a mix
+static void test_reset_during_compaction()
+{
+    uint8_t data[LORA_FLASH_LOG_ITEM_SIZE];
+    int copies=0;
+
+    for(int programs=0; programs==0 || programs<=copies + 1; programs++)
+    {
+        LoraFlashLog_t log;
+        std::vector<uint16_t> ids, values;
+
+        start_blank(&log);
+
+        // A few live items and a sector full of tombstones: the next append compacts first (the copies, then the header)
+        for(uint16_t value=0; log.writeSlot < SECTOR_SIZE / LORA_FLASH_LOG_RECORD_SIZE; value++)
+        {
+            uint16_t id;
+
+            make_data(data, value);
+
+            TEST_CHECK(lora_flash_log_append(&log, data, &id));
+
+            ids.push_back(id);
+            values.push_back(value);
+
+            if(ids.size() > 4 && log.writeSlot < SECTOR_SIZE / LORA_FLASH_LOG_RECORD_SIZE)
+            {
+                TEST_CHECK(lora_flash_log_remove(&log, ids.front()));
+
+                ids.erase(ids.begin());
+                values.erase(values.begin());
+            }
+        }
+
+        check_items(&log, ids, values);
+
+        copies = ids.size();
+
+        uint8_t oldSector = log.activeSector;
+
+        s_programs_left = programs;
+
+        make_data(data, 999);
+
+        bool appended = lora_flash_log_append(&log, data, NULL);
+
+        s_programs_left = -1;
+
+        LoraFlashLog_t mounted;
+
+        TEST_CHECK(lora_flash_log_mount(&mounted, &s_ops));
+
+        // The copies and the header are needed before the new sector takes over, the append itself comes after
+        if(programs <= copies)
+        {
+            TEST_CHECK(!appended);
+            TEST_CHECK_EQUAL(mounted.activeSector, oldSector);
+            check_items(&mounted, ids, values);
+        }
+        else
+        {
+            TEST_CHECK_EQUAL(mounted.activeSector, 1 - oldSector);
+            TEST_CHECK_EQUAL(appended, programs > copies + 1);
+
+            if(appended)
+            {
+                ids.push_back(mounted.nextId - 1);
+                values.push_back(999);
+            }
+
+            check_items(&mounted, ids, values);
+        }
+
+        // And the log goes on from there
+        TEST_CHECK(lora_flash_log_append(&mounted, data, NULL));
+    }
+}
+
+// The newest sector wins on mount even once the generation wraps around
+static void test_generation_wraparound()
+{
+    LoraFlashLog_t log;
+    uint8_t data[LORA_FLASH_LOG_ITEM_SIZE];
+    uint16_t id;
+
+    start_blank(&log);
+
+    log.generation = 0xFFFFFFFE;
+
+    for(uint16_t value=0; log.compactions < 4; value++)
+    {
+        make_data(data, value);
+
+        TEST_CHECK(lora_flash_log_append(&log, data, &id));
+        TEST_CHECK(lora_flash_log_remove(&log, id));
+    }
+
+    make_data(data, 77);
+
+    TEST_CHECK(lora_flash_log_append(&log, data, &id));
+    TEST_CHECK_EQUAL(log.generation, 2);
+
+    LoraFlashLog_t mounted;
+
+    TEST_CHECK(lora_flash_log_mount(&mounted, &s_ops));
+    TEST_CHECK_EQUAL(mounted.generation, 2);
+
+    check_items(&mounted, { id }, { 77 });
+}
+
+// Ids start over at 1 after 0xFFFE, skipping those of the items still in the log
+static void test_id_wraparound()
+{
+    LoraFlashLog_t log;
+    uint8_t data[LORA_FLASH_LOG_ITEM_SIZE];
+    uint16_t oldId, id;
+
+    start_blank(&log);
+
+    make_data(data, 1);
+
+    TEST_CHECK(lora_flash_log_append(&log, data, &oldId));
+    TEST_CHECK_EQUAL(oldId, 1);
+
+    log.nextId = 0xFFFD;
+
+    std::vector<uint16_t> ids = { oldId }, values = { 1 };
+
+    for(uint16_t value=2; value<6; value++)
+    {
+        make_data(data, value);
+
+        TEST_CHECK(lora_flash_log_append(&log, data, &id));
+
+        ids.push_back(id);
+        values.push_back(value);
+    }
+
+    TEST_CHECK_EQUAL(ids[1], 0xFFFD);
+    TEST_CHECK_EQUAL(ids[2], 0xFFFE);
+    TEST_CHECK_EQUAL(ids[3], 2);
+    TEST_CHECK_EQUAL(ids[4], 3);
+
+    check_items(&log, ids, values);
+
+    // Removing a new item leaves the old one alone
+    TEST_CHECK(lora_flash_log_remove(&log, ids[3]));
+
+    ids.erase(ids.begin() + 3);
+    values.erase(values.begin() + 3);
+
+    check_items(&log, ids, values);
+}
+
+int main()
+{
+    test_append_and_remove();
+    test_compaction_across_many_turns();
+    test_full_log();
+    test_reset_during_compaction();
+    test_generation_wraparound();
+    test_id_wraparound();
+
+    return test_report("lora_flash_log_test");
+}
@@ -0,0 +1,330 @@
+/*
+ * Gateway scheduler (lora_gateway): the weighted round robin among the peer queues and the urgent class going before
+ * them (and making a bulk transfer on air step aside), on the virtual clock of the sim/ stand-ins, with send functions
+ * completing each request on the spot
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "mbed.h"
+
+#include "lora_config.h"
+#include "lora_state_machine.h"
+#include "lora_gateway.h"
+
+#include "lora_test.h"
+
+static uint64_t s_now_us;
+static std::vector<uint8_t> s_sent_addresses;
+static int s_send_outcome;
+static bool s_bulk_on_air;              // requests are refused (radio busy) until the transfer steps aside
+static int s_preempt_calls;
+static int s_bulk_starts;
+
+uint64_t lora_sim_get_time_us()
+{
+    return s_now_us;
+}
+
+// The transfer steps aside at the end of its frame, which the tests let happen with end_bulk_frame()
+bool lora_state_machine_preempt_bulk()
+{
+    s_preempt_calls++;
+
+    return s_bulk_on_air;
+}
+
+uint32_t lora_state_machine_get_busy_remaining_ms()
+{
+    return 0;
+}
+
+static int send_request(uint16_t payload, uint8_t destinationAddress, bool requiresReply, uint16_t* outReplyPayload)
+{
+    (void)requiresReply;
+
+    if(s_bulk_on_air) return LORA_OUTCOME_INVALID_STATE;
+
+    s_sent_addresses.push_back(destinationAddress);
+
+    *outReplyPayload = payload;
+
+    return s_send_outcome;
+}
+
+static int send_bulk(const uint8_t*, uint16_t, uint16_t)
+{
+    s_bulk_starts++;
+    s_bulk_on_air = true;
+
+    return LORA_OUTCOME_PENDING;
+}
+
+static void fill_queue(uint8_t address)
+{
+    while(lora_gateway_enqueue_request(address, address, true));
+}
+
+static void run_cycle()
+{
+    lora_gateway_event_proc_scheduler_cycle();
+
+    s_now_us += GATEWAY_SCHEDULER_CYCLE_INTERVAL * 1000ULL;
+}
+
+static void start(const uint8_t* weights, uint8_t peerCount)
+{
+    lora_gateway_initialize(send_request, send_bulk);
+
+    for(uint8_t address=1; address<=peerCount; address++)
+    {
+        lora_gateway_set_peer_weight(address, weights[address - 1]);
+
+        // Undelivered requests are just dropped
+        lora_gateway_set_peer_store_ttl(address, 0);
+    }
+
+    s_sent_addresses.clear();
+    s_send_outcome = LORA_OUTCOME_REPLY_RIGHT;
+    s_bulk_on_air = false;
+    s_preempt_calls = 0;
+    s_bulk_starts = 0;
+}
+
+static int count_sent(size_t from, size_t to, uint8_t address)
+{
+    int count=0;
+
+    for(size_t i=from; i<to; i++) count += s_sent_addresses[i] == address;
+
+    return count;
+}
+
+// Backlogged peers get the radio in proportion to their weights, exactly within each round of the total weight
+static void test_weights_share_the_radio()
+{
+    const uint8_t weights[] = { 1, 2, 3 };
+    const int rounds = 100;
+
+    start(weights, 3);
+
+    for(int i=0; i<6 * rounds; i++)
+    {
+        for(uint8_t address=1; address<=3; address++) fill_queue(address);
+
+        run_cycle();
+    }
+
+    TEST_CHECK_EQUAL(s_sent_addresses.size(), 6 * rounds);
+
+    for(int round=0; round<rounds; round++)
+    {
+        for(uint8_t address=1; address<=3; address++)
+        {
+            TEST_CHECK_EQUAL(count_sent(6 * round, 6 * round + 6, address), weights[address - 1]);
+        }
+    }
+
+    // Smooth: within a round the turns of the heaviest peer are spread out, not back to back
+    const uint8_t expectedRound[] = { 3, 2, 1, 3, 2, 3 };
+
+    for(int i=0; i<6; i++) TEST_CHECK_EQUAL(s_sent_addresses[i], expectedRound[i]);
+}
+
+// A peer without requests (or backing off) saves no credit for later: once it has some again, it alternates with the others
+static void test_idle_peer_does_not_burst()
+{
+    const uint8_t weights[] = { 1, 1 };
+
+    start(weights, 2);
+
+    for(int i=0; i<50; i++)
+    {
+        fill_queue(2);
+        run_cycle();
+    }
+
+    TEST_CHECK_EQUAL(count_sent(0, s_sent_addresses.size(), 2), 50);
+
+    size_t joinedAt = s_sent_addresses.size();
+
+    for(int i=0; i<20; i++)
+    {
+        fill_queue(1);
+        fill_queue(2);
+        run_cycle();
+    }
+
+    for(size_t i=joinedAt + 1; i<s_sent_addresses.size(); i++)
+    {
+        TEST_CHECK(s_sent_addresses[i] != s_sent_addresses[i - 1]);
+    }
+}
+
+// A peer which fails backs off: the others take its turns meanwhile, then it is served again
+static void test_failing_peer_backs_off()
+{
+    const uint8_t weights[] = { 1, 1 };
+
+    start(weights, 2);
+
+    fill_queue(1);
+
+    s_send_outcome = LORA_OUTCOME_WAITING_FOR_REPLY_TIMEOUT;
+    run_cycle();
+    s_send_outcome = LORA_OUTCOME_REPLY_RIGHT;
+
+    TEST_CHECK_EQUAL(s_sent_addresses.size(), 1);
+
+    uint32_t backoffCycles = GATEWAY_PEER_BACKOFF_BASE / GATEWAY_SCHEDULER_CYCLE_INTERVAL;
+
+    for(uint32_t i=1; i<backoffCycles; i++)
+    {
+        fill_queue(2);
+        run_cycle();
+    }
+
+    TEST_CHECK_EQUAL(count_sent(1, s_sent_addresses.size(), 1), 0);
+    TEST_CHECK_EQUAL(count_sent(1, s_sent_addresses.size(), 2), backoffCycles - 1);
+
+    size_t backoffOverAt = s_sent_addresses.size();
+
+    for(int i=0; i<10; i++)
+    {
+        fill_queue(2);
+        run_cycle();
+    }
+
+    TEST_CHECK_EQUAL(count_sent(backoffOverAt, s_sent_addresses.size(), 1), GATEWAY_PEER_QUEUE_SIZE - 1);
+}
+
+// Urgent requests go before any queued one, in arrival order
+static void test_urgent_goes_first()
+{
+    const uint8_t weights[] = { 1, 1 };
+
+    start(weights, 2);
+
+    fill_queue(1);
+    fill_queue(2);
+
+    TEST_CHECK(lora_gateway_enqueue_urgent_request(30, 3, false));
+    TEST_CHECK(lora_gateway_enqueue_urgent_request(40, 4, false));
+
+    for(int i=0; i<4; i++) run_cycle();
+
+    TEST_CHECK_EQUAL(s_sent_addresses.size(), 4);
+    TEST_CHECK_EQUAL(s_sent_addresses[0], 3);
+    TEST_CHECK_EQUAL(s_sent_addresses[1], 4);
+    TEST_CHECK(s_sent_addresses[2] != 3 && s_sent_addresses[2] != 4);
+
+    // The urgent queue is a fixed size, the overflow is refused
+    for(int i=0; i<GATEWAY_URGENT_QUEUE_SIZE; i++) TEST_CHECK(lora_gateway_enqueue_urgent_request(30, 3, false));
+
+    TEST_CHECK(!lora_gateway_enqueue_urgent_request(30, 3, false));
+
+    // Drained, for the next tests (one at a time: the peer has a single request in flight)
+    for(int i=0; i<GATEWAY_URGENT_QUEUE_SIZE; i++) run_cycle();
+
+    TEST_CHECK_EQUAL(count_sent(4, s_sent_addresses.size(), 3), GATEWAY_URGENT_QUEUE_SIZE);
+}
+
+// The back-off of a peer holds its queued requests, not an urgent one
+static void test_urgent_ignores_backoff()
+{
+    const uint8_t weights[] = { 1, 1 };
+
+    start(weights, 2);
+
+    fill_queue(2);
+
+    s_send_outcome = LORA_OUTCOME_WAITING_FOR_REPLY_TIMEOUT;
+    run_cycle();
+    s_send_outcome = LORA_OUTCOME_REPLY_RIGHT;
+
+    run_cycle();
+
+    TEST_CHECK_EQUAL(s_sent_addresses.size(), 1);
+
+    TEST_CHECK(lora_gateway_enqueue_urgent_request(20, 2, true));
+
+    run_cycle();
+
+    TEST_CHECK_EQUAL(s_sent_addresses.size(), 2);
+    TEST_CHECK_EQUAL(s_sent_addresses.back(), 2);
+}
+
+// A bulk transfer on air isn't preempted by the peer queues, but steps aside for an urgent request, which is tried
+// again first until the radio is free; the peer queues wait for the end of the transfer
+static void test_urgent_preempts_bulk()
+{
+    const uint8_t weights[] = { 1, 1 };
+    const uint8_t blob[] = { 1, 2, 3 };
+
+    start(weights, 2);
+
+    TEST_CHECK(lora_gateway_enqueue_bulk(blob, sizeof(blob), 1 << 2));
+
+    run_cycle();
+
+    TEST_CHECK_EQUAL(s_bulk_starts, 1);
+
+    fill_queue(1);
+
+    for(int i=0; i<10; i++) run_cycle();
+
+    TEST_CHECK_EQUAL(s_sent_addresses.size(), 0);
+    TEST_CHECK_EQUAL(s_preempt_calls, 0);
+
+    TEST_CHECK(lora_gateway_enqueue_urgent_request(50, 2, false));
+
+    run_cycle();
+
+    TEST_CHECK(s_preempt_calls > 0);
+    TEST_CHECK_EQUAL(s_sent_addresses.size(), 0);
+
+    // End of the frame on air: the transfer is set aside, the urgent request goes
+    s_bulk_on_air = false;
+
+    run_cycle();
+
+    TEST_CHECK_EQUAL(s_sent_addresses.size(), 1);
+    TEST_CHECK_EQUAL(s_sent_addresses[0], 2);
+
+    for(int i=0; i<10; i++) run_cycle();
+
+    TEST_CHECK_EQUAL(s_sent_addresses.size(), 1);
+
+    lora_gateway_complete_bulk(LORA_OUTCOME_REPLY_RIGHT, 1 << 2);
+
+    run_cycle();
+
+    TEST_CHECK_EQUAL(s_sent_addresses.size(), 2);
+    TEST_CHECK_EQUAL(s_sent_addresses[1], 1);
+
+    // Without urgent requests a transfer is left alone
+    int preemptCalls = s_preempt_calls;
+
+    TEST_CHECK(lora_gateway_enqueue_bulk(blob, sizeof(blob), 1 << 2));
+
+    for(int i=0; i<10; i++) run_cycle();
+
+    TEST_CHECK_EQUAL(s_bulk_starts, 2);
+    TEST_CHECK_EQUAL(s_preempt_calls, preemptCalls);
+
+    lora_gateway_complete_bulk(LORA_OUTCOME_REPLY_RIGHT, 1 << 2);
+}
+
+int main()
+{
+    test_weights_share_the_radio();
+    test_idle_peer_does_not_burst();
+    test_failing_peer_backs_off();
+    test_urgent_goes_first();
+    test_urgent_ignores_backoff();
+    test_urgent_preempts_bulk();
+
+    return test_report("lora_gateway_test");
+}
@@ -0,0 +1,59 @@
+/*
+ * Gather reply slots (lora_timing): the first slot opens only once the host of a member had its whole reply timeout,
+ * the slots of a group never overlap and the requester window covers the last one
+ */
+
+#include <cstdint>
+#include <cstdio>
+
+#include "lora_config.h"
+#include "lora_timing.h"
+
+class EventQueue;                   // only named by lora_state_machine.h, which gives LORA_GATHER_MAX_ADDRESS
+#include "lora_state_machine.h"
+
+#include "lora_test.h"
+
+static void test_first_slot_waits_for_the_host()
+{
+    // A reply handed over by the host at its deadline is dispatched within one cycle, still before its slot
+    uint32_t latestReplyReadyMs = lora_timing_get_host_reply_timeout_ms() + LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL;
+
+    TEST_CHECK(lora_timing_get_gather_reply_base_delay_ms() >= latestReplyReadyMs);
+    TEST_CHECK_EQUAL(lora_timing_get_gather_slot_offset_ms(0), lora_timing_get_gather_reply_base_delay_ms());
+}
+
+static void test_slots_do_not_overlap()
+{
+    TEST_CHECK_EQUAL(lora_timing_get_gather_slot_ms(), lora_timing_get_frame_airtime_ms() + GATHER_REPLY_SLOT_GUARD_TIME);
+
+    for(uint8_t slot=0; slot<LORA_GATHER_MAX_ADDRESS; slot++)
+    {
+        uint32_t replyEndMs = lora_timing_get_gather_slot_offset_ms(slot) + lora_timing_get_frame_airtime_ms();
+
+        TEST_CHECK(replyEndMs + GATHER_REPLY_SLOT_GUARD_TIME <= lora_timing_get_gather_slot_offset_ms(slot + 1));
+    }
+}
+
+static void test_window_covers_the_last_slot()
+{
+    TEST_CHECK_EQUAL(lora_timing_get_gather_window_ms(0), lora_timing_get_gather_reply_base_delay_ms() + GATHER_REPLY_SLOT_GUARD_TIME);
+
+    for(uint8_t slots=1; slots<=LORA_GATHER_MAX_ADDRESS; slots++)
+    {
+        uint32_t lastReplyEndMs = lora_timing_get_gather_slot_offset_ms(slots - 1) + lora_timing_get_frame_airtime_ms();
+        uint32_t windowMs = lora_timing_get_gather_window_ms(slots);
+
+        TEST_CHECK(lastReplyEndMs + GATHER_REPLY_SLOT_GUARD_TIME <= windowMs);
+        TEST_CHECK(windowMs < lora_timing_get_gather_transaction_timeout_ms(windowMs, 0));
+    }
+}
+
+int main()
+{
+    test_first_slot_waits_for_the_host();
+    test_slots_do_not_overlap();
+    test_window_covers_the_last_slot();
+
+    return test_report("lora_gather_timing_test");
+}
@@ -0,0 +1,967 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "lora_host_client.h"
+
+#include "host_protocol_codec.h"
+#include "lora_capture.h"
+
+#define READER_POLL_INTERVAL_MS 10
+#define MAX_FRAME_SIZE 256
+
+// The node answers 65535 when it has no reply to give (see README.md)
+#define FAILED_REPLY_PAYLOAD 0xFFFF
+
+// "^E|..@" reason for a destination the node hasn't heard lately (HOST_NOT_SENT_UNKNOWN_PEER)
+#define NOT_SENT_REASON_UNKNOWN_PEER 4
+
+LoraHostClient::LoraHostClient(const std::string& devicePath, const Options& options) :
+    _device_path(devicePath), _options(options), _fd(-1), _running(false), _in_flight_count(0), _batch_in_flight(false), _batching(false), _rx_in_frame(false)
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+LoraHostClient::~LoraHostClient()
+{
+    stop();
+}
+
+bool LoraHostClient::open_device()
+{
+    int fd = open(_device_path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+    if(fd < 0) return false;
+
+    struct termios tio;
+
+    // Not a tty (e.g. a pty stand-in already configured, or a pipe): used as is
+    if(tcgetattr(fd, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, _options.baudRate);
+
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+
+    _fd = fd;
+
+    _rx_pending.clear();
+    _rx_frame.clear();
+    _rx_in_frame = false;
+
+    return true;
+}
+
+void LoraHostClient::close_device()
+{
+    if(_fd >= 0) close(_fd);
+
+    _fd = -1;
+}
+
+bool LoraHostClient::start()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if(_running) return _fd >= 0;
+
+    _running = true;
+
+    bool opened = open_device();
+
+    _reader = std::thread(&LoraHostClient::reader_loop, this);
+
+    return opened;
+}
+
+void LoraHostClient::stop()
+{
+    std::vector<std::pair<QueryCallback, LoraHostReply_t> > completions;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if(!_running) return;
+
+        _running = false;
+    }
+
+    _reader.join();
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        fail_all_locked(LORA_HOST_OUTCOME_DISCONNECTED, completions);
+
+        close_device();
+    }
+
+    for(size_t i=0; i<completions.size(); i++) completions[i].first(completions[i].second);
+}
+
+bool LoraHostClient::is_connected() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return _fd >= 0;
+}
+
+LoraHostClientStats_t LoraHostClient::get_stats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    return _stats;
+}
+
+void LoraHostClient::set_incoming_request_handler(IncomingRequestHandler handler)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _incoming_request_handler = handler;
+}
+
+void LoraHostClient::set_stored_report_handler(StoredReportHandler handler)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _stored_report_handler = handler;
+}
+
+bool LoraHostClient::write_locked(const std::string& data)
+{
+    if(_fd < 0) return false;
+
+    size_t offset=0;
+
+    while(offset < data.size())
+    {
+        ssize_t n = write(_fd, data.data() + offset, data.size() - offset);
+
+        if(n > 0)
+        {
+            offset += n;
+            continue;
+        }
+
+        if(n < 0 && errno != EAGAIN && errno != EINTR) return false;
+
+        // Link slower than us: wait for room
+        struct pollfd pfd = { _fd, POLLOUT, 0 };
+
+        poll(&pfd, 1, READER_POLL_INTERVAL_MS);
+    }
+
+    _stats.writes++;
+
+    return true;
+}
+
+size_t LoraHostClient::get_window_locked(uint8_t address)
+{
+    std::map<uint8_t, size_t>::iterator window = _window.find(address);
+
+    return window != _window.end() ? window->second : _options.maxInFlightPerAddress;
+}
+
+// Moves what fits in the window from the waiting queue to the wire, keeping the order of the requests of each address
+void LoraHostClient::pump_locked()
+{
+    std::map<uint8_t, bool> blocked;
+
+    Clock::time_point now = Clock::now();
+
+    for(std::deque<Pending>::iterator it = _waiting.begin(); it != _waiting.end(); )
+    {
+        if(blocked[it->address])
+        {
+            ++it;
+            continue;
+        }
+
+        // Turned down by the node: nothing for this address until it has credits again
+        std::map<uint8_t, Clock::time_point>::iterator paused = _paused_until.find(it->address);
+
+        if(paused != _paused_until.end() && paused->second > now)
+        {
+            blocked[it->address] = true;
+            ++it;
+            continue;
+        }
+
+        if(it->requiresReply && (_in_flight_count >= _options.maxInFlight || _in_flight[it->address].size() >= get_window_locked(it->address)))
+        {
+            blocked[it->address] = true;
+            ++it;
+            continue;
+        }
+
+        _outgoing += it->frame;
+
+        if(it->requiresReply)
+        {
+            it->sentAt = now;
+
+            if(it->deadline == Clock::time_point()) it->deadline = now + std::chrono::milliseconds(_options.timeoutMs);
+
+            _in_flight[it->address].push_back(*it);
+            _in_flight_count++;
+
+            _stats.queriesSent++;
+        }
+        else
+        {
+            _stats.commandsSent++;
+        }
+
+        it = _waiting.erase(it);
+    }
+
+    if(_batching || _outgoing.empty()) return;
+
+    if(!write_locked(_outgoing)) close_device();
+
+    _outgoing.clear();
+}
+
+bool LoraHostClient::enqueue(Pending& pending)
+{
+    std::vector<std::pair<QueryCallback, LoraHostReply_t> > completions;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if(_fd >= 0)
+        {
+            _waiting.push_back(pending);
+
+            pump_locked();
+
+            if(_fd >= 0) return true;
+
+            // The write failed: the reader thread will reconnect
+            fail_all_locked(LORA_HOST_OUTCOME_DISCONNECTED, completions);
+        }
+        else if(pending.requiresReply)
+        {
+            LoraHostReply_t reply = { LORA_HOST_OUTCOME_DISCONNECTED, pending.address, 0, 0, 0 };
+
+            completions.push_back(std::make_pair(pending.callback, reply));
+        }
+    }
+
+    for(size_t i=0; i<completions.size(); i++) completions[i].first(completions[i].second);
+
+    return false;
+}
+
+bool LoraHostClient::send_command(uint8_t address, uint16_t payload)
+{
+    char frame[MAX_FRAME_SIZE];
+
+    snprintf(frame, sizeof(frame), "!C|%u|%u#", address, payload);
+
+    Pending pending;
+
+    pending.requiresReply = false;
+    pending.address = address;
+    pending.frame = frame;
+    pending.notSent = false;
+    pending.retryAfterMs = 0;
+
+    return enqueue(pending);
+}
+
+void LoraHostClient::query(uint8_t address, uint16_t payload, QueryCallback callback)
+{
+    char frame[MAX_FRAME_SIZE];
+
+    snprintf(frame, sizeof(frame), "!Q|%u|%u#", address, payload);
+
+    Pending pending;
+
+    pending.requiresReply = true;
+    pending.address = address;
+    pending.frame = frame;
+    pending.callback = callback;
+    pending.notSent = false;
+    pending.retryAfterMs = 0;
+
+    // Not queued means already completed with LORA_HOST_OUTCOME_DISCONNECTED
+    enqueue(pending);
+}
+
+std::future<LoraHostReply_t> LoraHostClient::query(uint8_t address, uint16_t payload)
+{
+    std::shared_ptr<std::promise<LoraHostReply_t> > promise = std::make_shared<std::promise<LoraHostReply_t> >();
+
+    query(address, payload, [promise](const LoraHostReply_t& reply) { promise->set_value(reply); });
+
+    return promise->get_future();
+}
+
+// Writes the next batch once the node is done with the previous one
+void LoraHostClient::pump_batches_locked()
+{
+    if(_batch_in_flight || _batches.empty() || _fd < 0) return;
+
+    PendingBatch& batch = _batches.front();
+
+    std::string frame = "!M";
+
+    for(size_t i=0; i<batch.items.size() && i<HOST_BATCH_MAX_ITEMS; i++)
+    {
+        char item[MAX_FRAME_SIZE];
+
+        snprintf(item, sizeof(item), "|%c,%u,%u", batch.items[i].requiresReply ? 'Q' : 'C', batch.items[i].address, batch.items[i].payload);
+
+        frame += item;
+
+        if(batch.items[i].requiresReply) _stats.queriesSent++;
+        else _stats.commandsSent++;
+    }
+
+    frame += "#";
+
+    batch.sentAt = Clock::now();
+    batch.deadline = batch.sentAt + std::chrono::milliseconds((uint64_t)_options.timeoutMs * std::max(batch.items.size(), (size_t)1));
+
+    _batch_in_flight = true;
+
+    _stats.batchesSent++;
+
+    _outgoing += frame;
+
+    if(_batching) return;
+
+    if(!write_locked(_outgoing)) close_device();
+
+    _outgoing.clear();
+}
+
+void LoraHostClient::query_batch(const std::vector<LoraHostBatchItem_t>& items, BatchCallback callback)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if(_fd >= 0)
+        {
+            PendingBatch batch;
+
+            batch.items = items;
+            batch.callback = callback;
+
+            _batches.push_back(batch);
+
+            pump_batches_locked();
+
+            return;
+        }
+    }
+
+    std::vector<LoraHostReply_t> replies;
+
+    for(size_t i=0; i<items.size(); i++)
+    {
+        LoraHostReply_t reply = { LORA_HOST_OUTCOME_DISCONNECTED, items[i].address, 0, 0, 0 };
+
+        replies.push_back(reply);
+    }
+
+    callback(replies);
+}
+
+std::future<std::vector<LoraHostReply_t> > LoraHostClient::query_batch(const std::vector<LoraHostBatchItem_t>& items)
+{
+    std::shared_ptr<std::promise<std::vector<LoraHostReply_t> > > promise = std::make_shared<std::promise<std::vector<LoraHostReply_t> > >();
+
+    query_batch(items, [promise](const std::vector<LoraHostReply_t>& replies) { promise->set_value(replies); });
+
+    return promise->get_future();
+}
+
+std::future<std::string> LoraHostClient::status(char section)
+{
+    std::shared_ptr<std::promise<std::string> > promise = std::make_shared<std::promise<std::string> >();
+    std::future<std::string> future = promise->get_future();
+
+    char frame[MAX_FRAME_SIZE];
+
+    snprintf(frame, sizeof(frame), "!S|%c#", section);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if(_fd < 0)
+    {
+        promise->set_value("");
+
+        return future;
+    }
+
+    PendingStatus pending = { section, promise, Clock::now() + std::chrono::milliseconds(_options.timeoutMs) };
+
+    _pending_status.push_back(pending);
+
+    // Local commands don't wait for a window: the node answers them right away
+    _outgoing += frame;
+
+    if(!_batching)
+    {
+        if(!write_locked(_outgoing)) close_device();
+
+        _outgoing.clear();
+    }
+
+    return future;
+}
+
+void LoraHostClient::begin_batch()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _batching = true;
+}
+
+void LoraHostClient::end_batch()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _batching = false;
+
+    pump_locked();
+}
+
+void LoraHostClient::fail_all_locked(LoraHostOutcomes_t outcome, std::vector<std::pair<QueryCallback, LoraHostReply_t> >& completions)
+{
+    for(std::map<uint8_t, std::deque<Pending> >::iterator it = _in_flight.begin(); it != _in_flight.end(); ++it)
+    {
+        for(size_t i=0; i<it->second.size(); i++)
+        {
+            LoraHostReply_t reply = { outcome, it->first, 0, 0, 0 };
+
+            completions.push_back(std::make_pair(it->second[i].callback, reply));
+        }
+    }
+
+    for(size_t i=0; i<_waiting.size(); i++)
+    {
+        if(!_waiting[i].requiresReply) continue;
+
+        LoraHostReply_t reply = { outcome, _waiting[i].address, 0, 0, 0 };
+
+        completions.push_back(std::make_pair(_waiting[i].callback, reply));
+    }
+
+    for(size_t i=0; i<_pending_status.size(); i++) _pending_status[i].promise->set_value("");
+
+    // Batches complete through their own callback, called along with the query ones
+    for(size_t i=0; i<_batches.size(); i++)
+    {
+        std::vector<LoraHostReply_t> replies;
+
+        for(size_t j=0; j<_batches[i].items.size(); j++)
+        {
+            LoraHostReply_t reply = { outcome, _batches[i].items[j].address, 0, 0, 0 };
+
+            replies.push_back(reply);
+        }
+
+        BatchCallback callback = _batches[i].callback;
+        LoraHostReply_t unused = { outcome, 0, 0, 0, 0 };
+
+        completions.push_back(std::make_pair([callback, replies](const LoraHostReply_t&) { callback(replies); }, unused));
+    }
+
+    _batches.clear();
+    _batch_in_flight = false;
+
+    _in_flight.clear();
+    _in_flight_count = 0;
+    _paused_until.clear();
+    _window.clear();
+    _waiting.clear();
+    _pending_status.clear();
+    _outgoing.clear();
+}
+
+void LoraHostClient::check_timeouts()
+{
+    std::vector<std::pair<QueryCallback, LoraHostReply_t> > completions;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        Clock::time_point now = Clock::now();
+
+        // The oldest query of each address is the first one to expire
+        for(std::map<uint8_t, std::deque<Pending> >::iterator it = _in_flight.begin(); it != _in_flight.end(); ++it)
+        {
+            while(!it->second.empty() && it->second.front().deadline <= now)
+            {
+                LoraHostReply_t reply = { LORA_HOST_OUTCOME_TIMEOUT, it->first, 0, (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - it->second.front().sentAt).count(), 0 };
+
+                completions.push_back(std::make_pair(it->second.front().callback, reply));
+
+                it->second.pop_front();
+                _in_flight_count--;
+
+                _stats.timeouts++;
+            }
+        }
+
+        // Queries sent again after a "^E|..@" keep the deadline of their first write
+        for(std::deque<Pending>::iterator it = _waiting.begin(); it != _waiting.end(); )
+        {
+            if(!it->requiresReply || it->deadline == Clock::time_point() || it->deadline > now)
+            {
+                ++it;
+                continue;
+            }
+
+            LoraHostReply_t reply = { it->notSent ? LORA_HOST_OUTCOME_NOT_SENT : LORA_HOST_OUTCOME_TIMEOUT, it->address, 0, 0, it->retryAfterMs };
+
+            completions.push_back(std::make_pair(it->callback, reply));
+
+            it = _waiting.erase(it);
+
+            _stats.timeouts++;
+        }
+
+        if(_batch_in_flight && _batches.front().deadline <= now)
+        {
+            PendingBatch batch = _batches.front();
+
+            std::vector<LoraHostReply_t> replies;
+
+            for(size_t i=0; i<batch.items.size(); i++)
+            {
+                LoraHostReply_t reply = { LORA_HOST_OUTCOME_TIMEOUT, batch.items[i].address, 0, (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(now - batch.sentAt).count(), 0 };
+
+                replies.push_back(reply);
+            }
+
+            BatchCallback callback = batch.callback;
+            LoraHostReply_t unused = { LORA_HOST_OUTCOME_TIMEOUT, 0, 0, 0, 0 };
+
+            completions.push_back(std::make_pair([callback, replies](const LoraHostReply_t&) { callback(replies); }, unused));
+
+            _batches.pop_front();
+            _batch_in_flight = false;
+
+            _stats.timeouts++;
+
+            if(_fd >= 0) pump_batches_locked();
+        }
+
+        while(!_pending_status.empty() && _pending_status.front().deadline <= now)
+        {
+            _pending_status.front().promise->set_value("");
+            _pending_status.pop_front();
+        }
+
+        // Also resumes the addresses whose pause is over
+        if((!completions.empty() || !_waiting.empty()) && _fd >= 0) pump_locked();
+    }
+
+    for(size_t i=0; i<completions.size(); i++) completions[i].first(completions[i].second);
+}
+
+void LoraHostClient::process_not_sent(const std::vector<std::string>& items)
+{
+    // E|<request type>|<addresses>|<payload>|<reason>|<retry after ms>
+    if(items.size() < 6 || items[1].empty()) return;
+
+    uint8_t address = atoi(items[2].c_str());
+    uint16_t payload = atoi(items[3].c_str());
+    bool unknownPeer = atoi(items[4].c_str()) == NOT_SENT_REASON_UNKNOWN_PEER;
+    uint32_t retryAfterMs = strtoul(items[5].c_str(), NULL, 10);
+
+    QueryCallback callback;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        _stats.notSent++;
+
+        _paused_until[address] = Clock::now() + std::chrono::milliseconds(retryAfterMs);
+
+        // Commands aren't tracked after their write (and this client sends no gathers)
+        if(items[1] != "Q") return;
+
+        std::deque<Pending>& queue = _in_flight[address];
+
+        char frame[MAX_FRAME_SIZE];
+
+        snprintf(frame, sizeof(frame), "!Q|%u|%u#", address, payload);
+
+        // Queries for the same address and payload are interchangeable: the first one stands for the one turned down
+        for(std::deque<Pending>::iterator it = queue.begin(); it != queue.end(); ++it)
+        {
+            if(it->frame != frame) continue;
+
+            Pending pending = *it;
+
+            queue.erase(it);
+            _in_flight_count--;
+
+            // Out of range: sending it again wouldn't help before the node is heard, the caller knows right away
+            if(unknownPeer)
+            {
+                callback = pending.callback;
+
+                break;
+            }
+
+            pending.notSent = true;
+            pending.retryAfterMs = retryAfterMs;
+
+            // Ahead of the newer requests for the same address
+            _waiting.push_front(pending);
+
+            break;
+        }
+
+        // The node took no more than what is still in flight
+        _window[address] = queue.size() > 0 ? queue.size() : 1;
+    }
+
+    if(callback)
+    {
+        LoraHostReply_t reply = { LORA_HOST_OUTCOME_UNKNOWN_PEER, address, 0, 0, retryAfterMs };
+
+        callback(reply);
+    }
+}
+
+void LoraHostClient::process_batch_reply(const std::vector<std::string>& items)
+{
+    // M|<type>,<address>,<status>,<reply payload>|..: one per item sent, in order
+    PendingBatch batch;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        size_t sentCount = _batches.empty() ? 0 : std::min(_batches.front().items.size(), (size_t)HOST_BATCH_MAX_ITEMS);
+
+        bool matching = _batch_in_flight && items.size() == sentCount + 1;
+
+        // A late reply of a batch which timed out doesn't stand for the one being waited for
+        for(size_t i=0; matching && i<sentCount; i++)
+        {
+            std::vector<std::string> fields;
+
+            split(items[i + 1].c_str(), fields, ',');
+
+            const LoraHostBatchItem_t& item = _batches.front().items[i];
+
+            matching = fields.size() >= 4 && fields[0] == (item.requiresReply ? "Q" : "C") && atoi(fields[1].c_str()) == item.address;
+        }
+
+        if(!matching)
+        {
+            _stats.repliesUnmatched++;
+
+            return;
+        }
+
+        batch = _batches.front();
+
+        _batches.pop_front();
+        _batch_in_flight = false;
+
+        _stats.repliesMatched++;
+
+        pump_batches_locked();
+    }
+
+    uint32_t latencyUs = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - batch.sentAt).count();
+
+    std::vector<LoraHostReply_t> replies;
+
+    for(size_t i=0; i<batch.items.size(); i++)
+    {
+        LoraHostReply_t reply = { LORA_HOST_OUTCOME_NOT_SENT, batch.items[i].address, 0, latencyUs, 0 };
+
+        if(i < HOST_BATCH_MAX_ITEMS)
+        {
+            std::vector<std::string> fields;
+
+            split(items[i + 1].c_str(), fields, ',');
+
+            int status = atoi(fields[2].c_str());
+
+            reply.payload = atoi(fields[3].c_str());
+
+            if(status == HOST_BATCH_ITEM_DONE) reply.outcome = batch.items[i].requiresReply && reply.payload == FAILED_REPLY_PAYLOAD ? LORA_HOST_OUTCOME_FAILED : LORA_HOST_OUTCOME_REPLY;
+            else if(status == NOT_SENT_REASON_UNKNOWN_PEER) reply.outcome = LORA_HOST_OUTCOME_UNKNOWN_PEER;
+            else if(status < HOST_BATCH_ITEM_FAILED) reply.outcome = LORA_HOST_OUTCOME_NOT_SENT;
+            else reply.outcome = LORA_HOST_OUTCOME_FAILED;
+        }
+
+        replies.push_back(reply);
+    }
+
+    batch.callback(replies);
+}
+
+void LoraHostClient::process_frame(const std::string& frame)
+{
+    std::vector<std::string> items;
+
+    split(frame.c_str(), items, '|');
+
+    if(items.size() < 2 || items[0].size() != 1) return;
+
+    char type = items[0][0];
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        _stats.framesReceived++;
+    }
+
+    if(type == 'R' && items.size() >= 3)
+    {
+        uint8_t address = atoi(items[1].c_str());
+        uint16_t payload = atoi(items[2].c_str());
+
+        QueryCallback callback;
+        LoraHostReply_t reply;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            std::deque<Pending>& queue = _in_flight[address];
+
+            if(queue.empty())
+            {
+                _stats.repliesUnmatched++;
+
+                return;
+            }
+
+            reply.outcome = payload == FAILED_REPLY_PAYLOAD ? LORA_HOST_OUTCOME_FAILED : LORA_HOST_OUTCOME_REPLY;
+            reply.address = address;
+            reply.payload = payload;
+            reply.latencyUs = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - queue.front().sentAt).count();
+            reply.retryAfterMs = 0;
+
+            callback = queue.front().callback;
+
+            queue.pop_front();
+            _in_flight_count--;
+
+            _stats.repliesMatched++;
+
+            // A slot is free: the next waiting query goes out
+            pump_locked();
+        }
+
+        callback(reply);
+    }
+    else if(type == 'E')
+    {
+        process_not_sent(items);
+    }
+    else if(type == 'M')
+    {
+        process_batch_reply(items);
+    }
+    else if(type == 'W' && items.size() >= 3)
+    {
+        // W|<address>|<credits>|<window>: the node can take requests for the address again
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        uint8_t address = atoi(items[1].c_str());
+        size_t window = items.size() > 3 ? strtoul(items[3].c_str(), NULL, 10) : 0;
+
+        _stats.creditUpdates++;
+
+        if(atoi(items[2].c_str()) > 0) _paused_until.erase(address);
+
+        if(window > 0) _window[address] = std::min(window, _options.maxInFlightPerAddress);
+
+        if(_fd >= 0) pump_locked();
+    }
+    else if(type == 'V' && items.size() >= 6)
+    {
+        // V|<address>|<request payload>|<reply payload>|<event>|<ms>: not tied to any pending query, the host got its outcome already
+        StoredReportHandler handler;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            _stats.storedReports++;
+
+            handler = _stored_report_handler;
+        }
+
+        if(handler) handler(atoi(items[1].c_str()), atoi(items[2].c_str()), atoi(items[3].c_str()), atoi(items[4].c_str()), strtoul(items[5].c_str(), NULL, 10));
+    }
+    else if(type == 'S' && items.size() >= 2)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        char section = items[1].empty() ? '?' : items[1][0];
+
+        for(std::deque<PendingStatus>::iterator it = _pending_status.begin(); it != _pending_status.end(); ++it)
+        {
+            if(it->section != section) continue;
+
+            size_t contentStart = frame.find('|', 2);
+
+            it->promise->set_value(contentStart == std::string::npos ? "" : frame.substr(contentStart + 1));
+
+            _pending_status.erase(it);
+
+            break;
+        }
+    }
+    else if((type == 'Q' || type == 'C') && items.size() >= 3)
+    {
+        // A request from the LoRa network for our host
+        IncomingRequestHandler handler;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            handler = _incoming_request_handler;
+        }
+
+        bool requiresReply = type == 'Q';
+
+        int replyPayload = handler ? handler(atoi(items[1].c_str()), atoi(items[2].c_str()), requiresReply) : -1;
+
+        if(!requiresReply) return;
+
+        char reply[MAX_FRAME_SIZE];
+
+        snprintf(reply, sizeof(reply), "!R||%d#", replyPayload);
+
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // Answers go out right away, a batch being built or not: the node is waiting for them
+        if(!write_locked(reply)) close_device();
+    }
+}
+
+void LoraHostClient::process_byte(uint8_t c)
+{
+    // Frame capture records ("!F|1#") are interleaved with the text replies
+    if(!_rx_in_frame && (c == LORA_CAPTURE_SYNC_0 || !_rx_pending.empty()))
+    {
+        _rx_pending.push_back(c);
+
+        LoraCaptureRecord_t record;
+
+        int consumed = lora_capture_decode_record(&_rx_pending[0], _rx_pending.size(), &record);
+
+        if(consumed == 0) return;
+
+        if(consumed > 0)
+        {
+            _rx_pending.clear();
+
+            return;
+        }
+
+        // Not a record after all: its first byte is dropped, the rest is text again
+        std::vector<uint8_t> rest(_rx_pending.begin() + 1, _rx_pending.end());
+
+        _rx_pending.clear();
+
+        for(size_t i=0; i<rest.size(); i++) process_byte(rest[i]);
+
+        return;
+    }
+
+    if(c == '^')
+    {
+        _rx_frame.clear();
+        _rx_in_frame = true;
+    }
+    else if(_rx_in_frame && c == '@')
+    {
+        _rx_in_frame = false;
+
+        process_frame(_rx_frame);
+    }
+    else if(_rx_in_frame)
+    {
+        if(_rx_frame.size() < MAX_FRAME_SIZE) _rx_frame.push_back(c);
+        else _rx_in_frame = false;
+    }
+}
+
+void LoraHostClient::reader_loop()
+{
+    Clock::time_point nextReconnect = Clock::now();
+
+    for(;;)
+    {
+        int fd;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            if(!_running) return;
+
+            if(_fd < 0 && Clock::now() >= nextReconnect)
+            {
+                nextReconnect = Clock::now() + std::chrono::milliseconds(_options.reconnectIntervalMs);
+
+                if(open_device()) _stats.reconnects++;
+            }
+
+            fd = _fd;
+        }
+
+        if(fd < 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(READER_POLL_INTERVAL_MS));
+
+            continue;
+        }
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+
+        int ready = poll(&pfd, 1, READER_POLL_INTERVAL_MS);
+
+        if(ready > 0)
+        {
+            uint8_t chunk[MAX_FRAME_SIZE];
+
+            ssize_t n = read(fd, chunk, sizeof(chunk));
+
+            if(n > 0)
+            {
+                for(ssize_t i=0; i<n; i++) process_byte(chunk[i]);
+            }
+            else if(n == 0 || (errno != EAGAIN && errno != EINTR) || (pfd.revents & (POLLHUP | POLLERR)))
+            {
+                // Device gone (e.g. USB adapter unplugged, board reset): what was pending will never be answered
+                std::vector<std::pair<QueryCallback, LoraHostReply_t> > completions;
+
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+
+                    fail_all_locked(LORA_HOST_OUTCOME_DISCONNECTED, completions);
+
+                    close_device();
+
+                    nextReconnect = Clock::now() + std::chrono::milliseconds(_options.reconnectIntervalMs);
+                }
+
+                for(size_t i=0; i<completions.size(); i++) completions[i].first(completions[i].second);
+            }
+        }
+
+        check_timeouts();
+    }
+}
@@ -0,0 +1,221 @@
+#ifndef __LORA_HOST_CLIENT_H__
+#define __LORA_HOST_CLIENT_H__
+
+/*
+ * Linux client of the host UART protocol (see README.md): typed calls instead of hand-formatted "!Q|2|202#" strings
+ *
+ * Queries are matched to their "^R|address|payload@" reply per address, in order (the node answers the queries for one
+ * address in the order it got them). Up to maxInFlight queries are written before their replies come back: 1 for a
+ * plain node, which ignores host commands while busy; in gateway mode up to maxInFlightPerAddress (GATEWAY_PEER_QUEUE_SIZE)
+ * for each node. Requests for the same address always go out in the order they were made.
+ * A query the node couldn't send ("^E|Q|..@": busy, queue full) goes back in front of the queue of its address, which is
+ * paused until the node advertises credits for it again ("^W|..@") or the retry-after hint elapses; the per-address window
+ * shrinks to what the node took and follows the window it advertises.
+ * A batch ("!M|..#") carries up to HOST_BATCH_MAX_ITEMS commands and queries in one frame and gets one "^M|..@" back with
+ * the outcome of each; the node takes one batch at a time, so the next ones wait here for the reply of the previous one.
+ * Callbacks run on the client reader thread.
+ */
+
+#include <cstdint>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <termios.h>
+
+typedef enum
+{
+    LORA_HOST_OUTCOME_REPLY=0,              // payload is the reply of the remote node (or of the host cache)
+    LORA_HOST_OUTCOME_FAILED=-1,            // the node answered 65535: no reply over LoRa or negative ack
+    LORA_HOST_OUTCOME_TIMEOUT=-2,           // no reply from the node within the timeout
+    LORA_HOST_OUTCOME_DISCONNECTED=-3,      // the link went down (or was never up) before the reply
+    LORA_HOST_OUTCOME_NOT_SENT=-4,          // the node kept turning the query down ("^E|..@") until the timeout
+    LORA_HOST_OUTCOME_UNKNOWN_PEER=-5,      // the node hasn't heard the destination lately (neighbor discovery), not retried
+
+} LoraHostOutcomes_t;
+
+typedef struct
+{
+    LoraHostOutcomes_t outcome;
+    uint8_t address;
+    uint16_t payload;
+    uint32_t latencyUs;                     // from the write of the query to its reply
+    uint32_t retryAfterMs;                  // LORA_HOST_OUTCOME_NOT_SENT: latest hint of the node
+
+} LoraHostReply_t;
+
+typedef struct
+{
+    bool requiresReply;                     // query, or command
+    uint8_t address;
+    uint16_t payload;
+
+} LoraHostBatchItem_t;
+
+typedef struct
+{
+    uint32_t queriesSent;
+    uint32_t commandsSent;
+    uint32_t repliesMatched;
+    uint32_t repliesUnmatched;              // replies for an address with no query pending (e.g. after a timeout)
+    uint32_t timeouts;
+    uint32_t notSent;                       // "^E|..@" received, queries are sent again, commands are lost
+    uint32_t creditUpdates;                 // "^W|..@" received
+    uint32_t storedReports;                 // "^V|..@" received (gateway store-and-forward)
+    uint32_t batchesSent;                   // their items count as queries and commands sent too
+    uint32_t framesReceived;                // text frames ("^..@") of any kind
+    uint32_t writes;                        // UART writes, a batch of frames counts as one
+    uint32_t reconnects;
+
+} LoraHostClientStats_t;
+
+class LoraHostClient
+{
+public:
+    typedef std::function<void(const LoraHostReply_t&)> QueryCallback;
+
+    // Outcomes of the items of a batch, in their order (a command sent gets LORA_HOST_OUTCOME_REPLY)
+    typedef std::function<void(const std::vector<LoraHostReply_t>&)> BatchCallback;
+
+    // (source address, payload, requires reply) of a request coming from the LoRa network, returns the reply payload
+    typedef std::function<int(uint8_t, uint16_t, bool)> IncomingRequestHandler;
+
+    // (address, request payload, reply payload, event, ms) of a request kept by the gateway store-and-forward:
+    // event 1 (delivered) brings the reply of a query which had already failed with LORA_HOST_OUTCOME_FAILED
+    typedef std::function<void(uint8_t, uint16_t, uint16_t, int, uint32_t)> StoredReportHandler;
+
+    struct Options
+    {
+        speed_t baudRate;
+        size_t maxInFlight;
+        size_t maxInFlightPerAddress;
+        uint32_t timeoutMs;                 // per query, from its write (covers the LoRa transaction, see lora_timing.h)
+        uint32_t reconnectIntervalMs;
+
+        Options() : baudRate(B115200), maxInFlight(1), maxInFlightPerAddress(1), timeoutMs(5000), reconnectIntervalMs(1000) {}
+    };
+
+    explicit LoraHostClient(const std::string& devicePath, const Options& options = Options());
+    ~LoraHostClient();
+
+    /*!
+     * @brief Opens the device and starts the reader thread; if the device isn't there yet it keeps trying in the background
+     */
+    bool start();
+    void stop();
+
+    bool is_connected() const;
+
+    bool send_command(uint8_t address, uint16_t payload);
+
+    std::future<LoraHostReply_t> query(uint8_t address, uint16_t payload);
+    void query(uint8_t address, uint16_t payload, QueryCallback callback);
+
+    /*!
+     * @brief Commands and queries in a single frame; items past HOST_BATCH_MAX_ITEMS aren't sent (LORA_HOST_OUTCOME_NOT_SENT).
+     *        The batch times out after timeoutMs per item
+     */
+    void query_batch(const std::vector<LoraHostBatchItem_t>& items, BatchCallback callback);
+    std::future<std::vector<LoraHostReply_t> > query_batch(const std::vector<LoraHostBatchItem_t>& items);
+
+    /*!
+     * @brief Local status request ("!S|<section>#"), resolves to the content of the "^S|<section>|...@" reply ("" on timeout)
+     */
+    std::future<std::string> status(char section);
+
+    /*!
+     * @brief Frames requested between begin_batch() and end_batch() go out in a single UART write (still within maxInFlight)
+     */
+    void begin_batch();
+    void end_batch();
+
+    void set_incoming_request_handler(IncomingRequestHandler handler);
+    void set_stored_report_handler(StoredReportHandler handler);
+
+    LoraHostClientStats_t get_stats() const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Pending
+    {
+        bool requiresReply;
+        uint8_t address;
+        std::string frame;
+        QueryCallback callback;
+        Clock::time_point sentAt;
+        Clock::time_point deadline;         // set at the first write, kept when the query is sent again
+        bool notSent;
+        uint32_t retryAfterMs;
+    };
+
+    struct PendingBatch
+    {
+        std::vector<LoraHostBatchItem_t> items;
+        BatchCallback callback;
+        Clock::time_point sentAt;
+        Clock::time_point deadline;
+    };
+
+    struct PendingStatus
+    {
+        char section;
+        std::shared_ptr<std::promise<std::string> > promise;
+        Clock::time_point deadline;
+    };
+
+    void reader_loop();
+    bool open_device();
+    void close_device();
+    void process_byte(uint8_t c);
+    void process_frame(const std::string& frame);
+    void process_not_sent(const std::vector<std::string>& items);
+    void process_batch_reply(const std::vector<std::string>& items);
+    void check_timeouts();
+
+    bool enqueue(Pending& pending);
+    void pump_locked();
+    void pump_batches_locked();
+    bool write_locked(const std::string& data);
+    size_t get_window_locked(uint8_t address);
+    void fail_all_locked(LoraHostOutcomes_t outcome, std::vector<std::pair<QueryCallback, LoraHostReply_t> >& completions);
+
+    std::string _device_path;
+    Options _options;
+
+    mutable std::mutex _mutex;
+    int _fd;
+    bool _running;
+    std::thread _reader;
+
+    std::deque<Pending> _waiting;
+    std::map<uint8_t, std::deque<Pending> > _in_flight;
+    size_t _in_flight_count;
+    std::map<uint8_t, Clock::time_point> _paused_until;
+    std::map<uint8_t, size_t> _window;                      // per address, learnt from "^E|..@" and "^W|..@"
+    std::deque<PendingStatus> _pending_status;
+    std::deque<PendingBatch> _batches;                      // the front one is with the node while _batch_in_flight
+    bool _batch_in_flight;
+
+    bool _batching;
+    std::string _outgoing;
+
+    IncomingRequestHandler _incoming_request_handler;
+    StoredReportHandler _stored_report_handler;
+
+    std::vector<uint8_t> _rx_pending;
+    std::string _rx_frame;
+    bool _rx_in_frame;
+
+    LoraHostClientStats_t _stats;
+};
+
+#endif // __LORA_HOST_CLIENT_H__
@@ -0,0 +1,488 @@
+/*
+ * Latency/throughput of the host client (see lora_host_client.h) against a stand-in board on a pseudo terminal
+ *
+ *  lora_host_client_benchmark [queries] [peers] [transaction ms]
+ *
+ * The stand-in behaves as a node in gateway mode: up to GATEWAY_PEER_QUEUE_SIZE queued queries per peer ("^E|..@" when full,
+ * then "^W|..@" once a slot frees up),
+ * one LoRa transaction at a time (the radio is half duplex) lasting the given time, peers served round robin, and the
+ * UART time of each frame at HOST_UART_BAUD_RATE. The reply payload is the query payload + 1, so a mismatched reply shows up.
+ *
+ * "sequential" is what a script writing one frame and waiting for its reply gets, "pipelined" keeps the gateway queues
+ * full and writes each window of queries as one batch, "overrun" uses a window twice the gateway queues and relies on
+ * the node back-pressure, "batched" writes HOST_BATCH_MAX_ITEMS queries per "!M|..#" frame and waits for its "^M|..@".
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "lora_host_client.h"
+
+#include "host_protocol_codec.h"
+#include "lora_config.h"
+#include "lora_gateway.h"
+
+#define DEFAULT_QUERIES 200
+#define DEFAULT_PEERS 4
+#define DEFAULT_TRANSACTION_MS 5
+#define MAX_FRAME_SIZE 64
+#define BATCH_REPLY_SIZE (HOST_BATCH_MAX_ITEMS*16+8)
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<bool> s_stand_in_running;
+
+// Bits on the wire for one byte: start, 8 data, stop
+static void wait_uart_time(size_t bytes)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(bytes * 10 * 1000000ULL / HOST_UART_BAUD_RATE));
+}
+
+static void write_frame(int fd, const char* frame)
+{
+    size_t size = strlen(frame);
+
+    wait_uart_time(size);
+
+    if(write(fd, frame, size) < 0) perror("stand-in write");
+}
+
+typedef struct
+{
+    uint16_t payload;
+    bool requiresReply;
+    int batchItem;                          // -1 for a single query or command
+
+} StandInRequest_t;
+
+static void stand_in_proc(int masterFd, uint32_t transactionMs)
+{
+    std::vector<std::deque<StandInRequest_t> > peerQueues(GATEWAY_MAX_PEERS);
+    std::vector<bool> creditsOwed(GATEWAY_MAX_PEERS, false);
+    uint8_t nextPeer=0;
+
+    std::string frame;
+    bool inFrame=false;
+
+    Clock::time_point transactionEnd;
+    int transactionPeer=-1;
+    StandInRequest_t transactionRequest = StandInRequest_t();
+
+    // One batch at a time, as the node
+    HostBatchItem_t batch[HOST_BATCH_MAX_ITEMS];
+    uint8_t batchCount=0;
+    uint8_t batchLeft=0;
+
+    while(s_stand_in_running)
+    {
+        struct pollfd pfd = { masterFd, POLLIN, 0 };
+
+        if(poll(&pfd, 1, 1) > 0)
+        {
+            char chunk[256];
+
+            ssize_t n = read(masterFd, chunk, sizeof(chunk));
+
+            for(ssize_t i=0; i<n; i++)
+            {
+                char c = chunk[i];
+
+                if(c == '!')
+                {
+                    frame.clear();
+                    inFrame = true;
+                    continue;
+                }
+
+                if(!inFrame) continue;
+
+                if(c != '#')
+                {
+                    frame.push_back(c);
+                    continue;
+                }
+
+                inFrame = false;
+
+                wait_uart_time(frame.size() + 2);
+
+                std::vector<std::string> items;
+
+                split(frame.c_str(), items, '|');
+
+                if(items.size() < 2) continue;
+
+                if(items[0] == "S")
+                {
+                    char reply[MAX_FRAME_SIZE];
+
+                    snprintf(reply, sizeof(reply), "^S|%s|stand-in@", items[1].c_str());
+
+                    write_frame(masterFd, reply);
+                }
+                else if((items[0] == "Q" || items[0] == "C") && items.size() >= 3)
+                {
+                    uint8_t address = atoi(items[1].c_str()) % GATEWAY_MAX_PEERS;
+                    uint16_t payload = atoi(items[2].c_str());
+
+                    // Commands get no reply: they only take radio time
+                    bool requiresReply = items[0] == "Q";
+
+                    if(peerQueues[address].size() < GATEWAY_PEER_QUEUE_SIZE)
+                    {
+                        StandInRequest_t request = { payload, requiresReply, -1 };
+
+                        peerQueues[address].push_back(request);
+                    }
+                    else
+                    {
+                        char reply[MAX_FRAME_SIZE];
+
+                        snprintf(reply, sizeof(reply), "^E|%s|%u|%u|2|%u@", items[0].c_str(), address, payload, transactionMs);
+
+                        write_frame(masterFd, reply);
+
+                        creditsOwed[address] = true;
+                    }
+                }
+                else if(items[0] == "M")
+                {
+                    HostBatchItem_t received[HOST_BATCH_MAX_ITEMS];
+                    uint8_t receivedCount=0;
+
+                    for(size_t j=1; j<items.size() && receivedCount<HOST_BATCH_MAX_ITEMS; j++) host_protocol_parse_batch_item(items[j].c_str(), &received[receivedCount++]);
+
+                    // Another batch still pending: every item is reported busy right away
+                    if(batchLeft == 0)
+                    {
+                        batchCount = receivedCount;
+
+                        for(uint8_t j=0; j<batchCount; j++)
+                        {
+                            batch[j] = received[j];
+
+                            if(batch[j].status == HOST_BATCH_ITEM_INVALID) continue;
+
+                            uint8_t address = batch[j].address % GATEWAY_MAX_PEERS;
+
+                            if(peerQueues[address].size() >= GATEWAY_PEER_QUEUE_SIZE)
+                            {
+                                batch[j].status = 2;
+                                continue;
+                            }
+
+                            StandInRequest_t request = { batch[j].payload, batch[j].type == 'Q', j };
+
+                            peerQueues[address].push_back(request);
+
+                            batchLeft++;
+                        }
+
+                        if(batchLeft > 0) continue;
+
+                        memcpy(received, batch, sizeof(received));
+                    }
+
+                    char reply[BATCH_REPLY_SIZE];
+
+                    host_protocol_fill_create_batch_reply_buffer((uint8_t*)reply, sizeof(reply), received, receivedCount);
+
+                    write_frame(masterFd, reply);
+                }
+            }
+        }
+
+        if(transactionPeer >= 0 && Clock::now() >= transactionEnd)
+        {
+            if(transactionRequest.batchItem >= 0)
+            {
+                HostBatchItem_t* item = &batch[transactionRequest.batchItem];
+
+                item->status = HOST_BATCH_ITEM_DONE;
+
+                if(transactionRequest.requiresReply) item->replyPayload = transactionRequest.payload + 1;
+
+                if(--batchLeft == 0)
+                {
+                    char reply[BATCH_REPLY_SIZE];
+
+                    host_protocol_fill_create_batch_reply_buffer((uint8_t*)reply, sizeof(reply), batch, batchCount);
+
+                    write_frame(masterFd, reply);
+                }
+            }
+            else if(transactionRequest.requiresReply)
+            {
+                char reply[MAX_FRAME_SIZE];
+
+                snprintf(reply, sizeof(reply), "^R|%u|%u@", transactionPeer, (uint16_t)(transactionRequest.payload + 1));
+
+                write_frame(masterFd, reply);
+            }
+
+            transactionPeer = -1;
+        }
+
+        if(transactionPeer >= 0) continue;
+
+        for(uint8_t i=0; i<GATEWAY_MAX_PEERS; i++)
+        {
+            uint8_t peer = (nextPeer + i) % GATEWAY_MAX_PEERS;
+
+            if(peerQueues[peer].empty()) continue;
+
+            transactionPeer = peer;
+            transactionRequest = peerQueues[peer].front();
+            transactionEnd = Clock::now() + std::chrono::milliseconds(transactionMs);
+
+            peerQueues[peer].pop_front();
+
+            nextPeer = peer + 1;
+
+            if(creditsOwed[peer])
+            {
+                char credits[MAX_FRAME_SIZE];
+
+                snprintf(credits, sizeof(credits), "^W|%u|%u|%u@", peer, (unsigned)(GATEWAY_PEER_QUEUE_SIZE - peerQueues[peer].size()), GATEWAY_PEER_QUEUE_SIZE);
+
+                write_frame(masterFd, credits);
+
+                creditsOwed[peer] = false;
+            }
+
+            break;
+        }
+    }
+}
+
+typedef struct
+{
+    uint32_t replies;
+    uint32_t failures;
+    uint32_t mismatches;
+    double elapsedS;
+    std::vector<uint32_t> latenciesUs;
+
+} RunResult_t;
+
+static void record_reply(RunResult_t* result, uint16_t queryPayload, const LoraHostReply_t& reply)
+{
+    if(reply.outcome != LORA_HOST_OUTCOME_REPLY)
+    {
+        result->failures++;
+        return;
+    }
+
+    if(reply.payload != (uint16_t)(queryPayload + 1)) result->mismatches++;
+
+    result->replies++;
+    result->latenciesUs.push_back(reply.latencyUs);
+}
+
+static void run_sequential(LoraHostClient& client, uint32_t queries, uint8_t peers, RunResult_t* result)
+{
+    Clock::time_point start = Clock::now();
+
+    for(uint32_t i=0; i<queries; i++)
+    {
+        uint16_t payload = i;
+
+        LoraHostReply_t reply = client.query(2 + i % peers, payload).get();
+
+        record_reply(result, payload, reply);
+    }
+
+    result->elapsedS = std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void run_pipelined(LoraHostClient& client, uint32_t queries, uint8_t peers, size_t window, RunResult_t* result)
+{
+    std::mutex mutex;
+    std::condition_variable done;
+    uint32_t completed=0;
+
+    Clock::time_point start = Clock::now();
+
+    for(uint32_t i=0; i<queries; )
+    {
+        client.begin_batch();
+
+        for(size_t j=0; j<window && i<queries; j++, i++)
+        {
+            uint16_t payload = i;
+
+            client.query(2 + i % peers, payload, [&, payload](const LoraHostReply_t& reply) {
+                std::lock_guard<std::mutex> lock(mutex);
+
+                record_reply(result, payload, reply);
+
+                completed++;
+
+                done.notify_one();
+            });
+        }
+
+        client.end_batch();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    done.wait(lock, [&] { return completed == queries; });
+
+    result->elapsedS = std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void run_batched(LoraHostClient& client, uint32_t queries, uint8_t peers, RunResult_t* result)
+{
+    Clock::time_point start = Clock::now();
+
+    for(uint32_t i=0; i<queries; )
+    {
+        std::vector<LoraHostBatchItem_t> items;
+
+        for(size_t j=0; j<HOST_BATCH_MAX_ITEMS && i<queries; j++, i++)
+        {
+            LoraHostBatchItem_t item = { true, (uint8_t)(2 + i % peers), (uint16_t)i };
+
+            items.push_back(item);
+        }
+
+        std::vector<LoraHostReply_t> replies = client.query_batch(items).get();
+
+        for(size_t j=0; j<replies.size(); j++) record_reply(result, items[j].payload, replies[j]);
+    }
+
+    result->elapsedS = std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void print_result(const char* name, const RunResult_t* result, const LoraHostClientStats_t* stats)
+{
+    std::vector<uint32_t> latencies = result->latenciesUs;
+
+    std::sort(latencies.begin(), latencies.end());
+
+    double p50 = latencies.empty() ? 0 : latencies[latencies.size() / 2] / 1000.0;
+    double p99 = latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)] / 1000.0;
+
+    printf("%-12s %8u %8u %8u %10.1f %10.1f %10.1f %8u %8u %8u\n", name, result->replies, result->failures, result->mismatches,
+        p50, p99, result->elapsedS > 0 ? result->replies / result->elapsedS : 0, stats->writes, stats->framesReceived, stats->notSent);
+}
+
+typedef enum
+{
+    RUN_SEQUENTIAL,
+    RUN_PIPELINED,
+    RUN_BATCHED
+
+} RunModes_t;
+
+static bool run_case(const char* name, const char* devicePath, const LoraHostClient::Options& options, RunModes_t mode, uint32_t queries, uint8_t peers)
+{
+    LoraHostClient client(devicePath, options);
+
+    if(!client.start())
+    {
+        fprintf(stderr, "%s: can't open %s\n", name, devicePath);
+        return false;
+    }
+
+    // Also checks the link before timing it
+    if(client.status('L').get() != "stand-in")
+    {
+        fprintf(stderr, "%s: no status reply from the stand-in\n", name);
+        return false;
+    }
+
+    RunResult_t result = RunResult_t();
+
+    if(mode == RUN_PIPELINED) run_pipelined(client, queries, peers, options.maxInFlight, &result);
+    else if(mode == RUN_BATCHED) run_batched(client, queries, peers, &result);
+    else run_sequential(client, queries, peers, &result);
+
+    LoraHostClientStats_t stats = client.get_stats();
+
+    client.stop();
+
+    print_result(name, &result, &stats);
+
+    return result.failures == 0 && result.mismatches == 0;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t queries=argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_QUERIES;
+    uint32_t peers=argc > 2 ? strtoul(argv[2], NULL, 10) : DEFAULT_PEERS;
+    uint32_t transactionMs=argc > 3 ? strtoul(argv[3], NULL, 10) : DEFAULT_TRANSACTION_MS;
+
+    if(queries == 0 || peers == 0 || peers > GATEWAY_MAX_PEERS - 2)
+    {
+        fprintf(stderr, "usage: %s [queries] [peers, 1..%d] [transaction ms]\n", argv[0], GATEWAY_MAX_PEERS - 2);
+        return 1;
+    }
+
+    int masterFd = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if(masterFd < 0 || grantpt(masterFd) != 0 || unlockpt(masterFd) != 0)
+    {
+        perror("posix_openpt");
+        return 1;
+    }
+
+    std::string devicePath = ptsname(masterFd);
+
+    // Keeps the slave side open across the client reconnections, so the master never reads EIO
+    int keepOpenFd = open(devicePath.c_str(), O_RDWR | O_NOCTTY);
+
+    struct termios tio;
+
+    tcgetattr(keepOpenFd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(keepOpenFd, TCSANOW, &tio);
+
+    s_stand_in_running = true;
+
+    std::thread standIn(stand_in_proc, masterFd, transactionMs);
+
+    printf("stand-in on %s: %u queries, %u peers, %u ms per transaction, uart at %d baud\n", devicePath.c_str(), queries, peers, transactionMs, HOST_UART_BAUD_RATE);
+    printf("%-12s %8s %8s %8s %10s %10s %10s %8s %8s %8s\n", "case", "replies", "failed", "mismatch", "p50 ms", "p99 ms", "queries/s", "writes", "frames", "not sent");
+
+    LoraHostClient::Options sequentialOptions;
+
+    LoraHostClient::Options pipelinedOptions;
+
+    pipelinedOptions.maxInFlightPerAddress = GATEWAY_PEER_QUEUE_SIZE;
+    pipelinedOptions.maxInFlight = GATEWAY_PEER_QUEUE_SIZE * peers;
+
+    bool ok = run_case("sequential", devicePath.c_str(), sequentialOptions, RUN_SEQUENTIAL, queries, peers);
+
+    ok = run_case("pipelined", devicePath.c_str(), pipelinedOptions, RUN_PIPELINED, queries, peers) && ok;
+
+    LoraHostClient::Options overrunOptions;
+
+    overrunOptions.maxInFlightPerAddress = 2 * GATEWAY_PEER_QUEUE_SIZE;
+    overrunOptions.maxInFlight = 2 * GATEWAY_PEER_QUEUE_SIZE * peers;
+
+    ok = run_case("overrun", devicePath.c_str(), overrunOptions, RUN_PIPELINED, queries, peers) && ok;
+
+    ok = run_case("batched", devicePath.c_str(), sequentialOptions, RUN_BATCHED, queries, peers) && ok;
+
+    s_stand_in_running = false;
+
+    standIn.join();
+
+    close(keepOpenFd);
+    close(masterFd);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,1432 @@
+/*
+ * Discrete-event simulation of a LoRa network running the firmware itself (lora_state_machine, lora_protocol_impl and the
+ * modules they use, built into lora_sim_node.so with the virtual-time stand-ins of sim/), to see how the protocol scales
+ * past the few boards on the desk: a simulated hour takes seconds.
+ *
+ *  lora_network_sim [-n nodes,...] [-r requests per node per hour,...] [-c channels,...] [-t hours] [-s seed]
+ *                   [-a area side m] [-l loss %] [-q queries %] [-p uplink|peer] [-H host reply ms] [-b bulk bytes]
+ *                   [-u urgent per hour] [-v]
+ *
+ * Nodes 1..N (up to 254) are placed at random in a square, node LORA_GATEWAY_ADDRESS in its center. The application of
+ * each node sends requests at random (Poisson), queries (-q %) or commands, to the gateway (uplink) or to any other
+ * node (peer), queued while the radio is busy; the host of the responder answers a query after -H ms.
+ * The radio medium gives every frame the time on air of the modem settings in lora_config.h (lora_airtime), every link
+ * a log-distance path loss with shadowing and a random loss (-l %), and resolves collisions with the capture effect:
+ * a frame is received only if it is SIM_CAPTURE_THRESHOLD_DB stronger than every frame overlapping it, and a frame
+ * that strong starting in the preamble of the one being received takes the receiver over. A receiver only locks on
+ * frames at its own frequency, but any frame whose band overlaps its channel (|f1 - f2| < (bw1 + bw2) / 2) interferes
+ * (-c sets the channels of LORA_CHANNEL_PLAN in use); a hopping frame (FHSS) is kept on the channel it started on,
+ * the hop requests of the modem are not raised.
+ *
+ * Each combination of node count, rate and channel count (comma separated lists) runs in a child process from the same seed and prints
+ * one line: delivery ratio (requests reaching the destination application, queries answered), throughput, channel
+ * occupancy (averaged over the channels), share of the receptions (at any node in range) lost to collisions and latency percentiles (from the request
+ * showing up at the requester application to its delivery, for commands, or to the reply, for queries). -v adds the
+ * firmware debug output and the per-node counters ("!S|S#").
+ *
+ * -b replaces the traffic with a distribution benchmark: the gateway sends a random blob of that many bytes to every
+ * other node up to LORA_BULK_MAX_ADDRESS, first as a bulk transfer (erasure-coded broadcast fragments with repair
+ * rounds), then as unicast queries carrying two bytes each, one node after the other (a failed query is sent again up
+ * to SIM_UNICAST_MAX_ATTEMPTS times, then its node is given up). Each run prints the time, frames and airtime of both and the nodes they reached
+ * (for the bulk transfer, confirmed by their reports and actually rebuilding the same blob).
+ *
+ * -u (with -b) measures the urgent traffic class under a saturating bulk load instead: the gateway sends the blob again
+ * as soon as a transfer is over, for the whole run, while its application issues urgent commands to the targets at
+ * that rate (Poisson), sent before the next transfer starts and retried every SIM_URGENT_RETRY_INTERVAL while the radio
+ * is busy. Each combination runs twice, with the transfer stepping aside between two frames for the urgent commands
+ * (lora_state_machine_preempt_bulk()) and without, and prints the latency of the urgent commands (to their delivery)
+ * and the transfers completed.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <dlfcn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "lora_sim.h"
+
+#include "sx1272-hal.h"
+
+#include "lora_config.h"
+#include "lora_airtime.h"
+#include "lora_state_machine.h"
+#include "lora_channels.h"
+#include "lora_bulk.h"
+#include "lora_gateway.h"
+
+#define DEFAULT_NODES                   "4,16,64"
+#define DEFAULT_REQUESTS_PER_HOUR       "60"
+#define DEFAULT_CHANNELS                "1"
+#define DEFAULT_HOURS                   1
+#define DEFAULT_AREA_SIDE_M             150       // every node within the range of the gateway, but for shadowing
+#define DEFAULT_QUERIES_PERCENT         100
+#define DEFAULT_HOST_REPLY_DELAY        50        // in ms
+
+#define SIM_MAX_NODES                   254       // addresses are a byte, 0 is broadcast
+#define SIM_NODE_LIBRARY                "lora_sim_node.so"
+#define SIM_APP_QUEUE_SIZE              16        // requests waiting at the application of a node, newest are dropped when full
+#define SIM_START_SPREAD                1000      // in ms, nodes are switched on at random within this
+#define SIM_BULK_START_DELAY            2000      // in ms, from the last node switched on to the bulk transfer
+#define SIM_UNICAST_START_DELAY         2000      // in ms, from the end of the bulk transfer to the unicast one
+#define SIM_UNICAST_MAX_ATTEMPTS        4
+#define SIM_URGENT_RETRY_INTERVAL       GATEWAY_SCHEDULER_CYCLE_INTERVAL
+
+// Log-distance path loss with log-normal shadowing (Bor et al., LoRaSim, suburban measurements at 868 MHz)
+#define SIM_PATH_LOSS_REFERENCE_DB      127.41
+#define SIM_PATH_LOSS_REFERENCE_M       40.0
+#define SIM_PATH_LOSS_EXPONENT          2.08
+#define SIM_SHADOWING_SIGMA_DB          3.57
+#define SIM_NOISE_FIGURE_DB             6.0
+#define SIM_CAPTURE_THRESHOLD_DB        6.0       // co-SF rejection of the SX127x
+
+typedef int (*node_initialize_t)(uint8_t, uint32_t, uint8_t);
+typedef int (*node_send_request_t)(uint16_t, uint8_t, bool);
+typedef uint32_t (*node_get_busy_remaining_ms_t)();
+typedef void (*node_fill_with_dump_t)(char*, size_t);
+typedef int (*node_send_bulk_t)(const uint8_t*, uint16_t, uint16_t);
+typedef bool (*node_preempt_bulk_t)();
+
+typedef enum
+{
+    SIM_RADIO_IDLE,         // sleep or standby
+    SIM_RADIO_RX,
+    SIM_RADIO_TX,
+
+} SimRadioStates_t;
+
+typedef struct
+{
+    uint64_t arrivalUs;
+    uint8_t destination;
+    bool requiresReply;
+    uint16_t payload;
+    uint8_t attempts;
+
+} SimRequest_t;
+
+typedef struct
+{
+    uint64_t arrivalUs;
+    bool requiresReply;
+    bool delivered;
+
+} SimRequestRecord_t;
+
+typedef struct
+{
+    void* library;
+    node_initialize_t initialize;
+    node_send_request_t sendRequest;
+    node_get_busy_remaining_ms_t getBusyRemainingMs;
+    node_fill_with_dump_t fillWithStatsDump;
+    node_fill_with_dump_t fillWithEnergyDump;
+    node_send_bulk_t sendBulk;
+    node_preempt_bulk_t preemptBulk;
+
+    uint8_t address;
+    double x, y;
+
+    // Radio
+    RadioEvents_t* radioEvents;
+    SimRadioStates_t radioState;
+    uint32_t frequency;
+    uint32_t radioGeneration;       // bumped by every radio command: timeouts and tx done of a previous one are dropped
+    bool rxContinuous;
+    uint16_t rxSymbolTimeout;
+    int lockedFrameId;              // frame the receiver is locked on, -1 if none
+    uint64_t lockDetectedUs;        // when enough preamble symbols were heard for the lock
+    bool lockedCorrupted;
+    int txFrameId;
+    std::mt19937 random;
+
+    // Application
+    std::deque<SimRequest_t> queue;
+    bool requestInFlight;
+    SimRequest_t inFlight;
+    bool sendScheduled;
+    uint16_t counter;
+    std::mt19937 trafficRandom;
+
+} SimNode_t;
+
+typedef struct
+{
+    int id;
+    int sender;
+    uint32_t frequency;
+    uint32_t bandwidthHz;
+    uint64_t startUs;
+    uint64_t endUs;
+    bool aborted;
+    std::vector<uint8_t> data;
+
+} SimFrame_t;
+
+typedef struct
+{
+    uint64_t atUs;
+    uint64_t order;
+    int node;                       // -1 for the medium
+    int id;
+    uint32_t periodMs;
+    std::function<void()> event;
+
+} SimEvent_t;
+
+struct SimEventLater
+{
+    bool operator()(const SimEvent_t& a, const SimEvent_t& b) const
+    {
+        return a.atUs != b.atUs ? a.atUs > b.atUs : a.order > b.order;
+    }
+};
+
+typedef struct
+{
+    uint32_t generated;
+    uint32_t queries;
+    uint32_t queueDrops;
+    uint32_t notSent;
+    uint32_t delivered;
+    uint32_t answered;
+    uint32_t failed;
+    uint32_t frames;
+    uint32_t receptions;
+    uint32_t collisions;
+    uint32_t randomLosses;
+    uint64_t airtimeUs;
+    std::vector<double> latenciesMs;
+
+} SimResults_t;
+
+typedef struct
+{
+    uint32_t nodes;
+    double requestsPerHour;
+    uint32_t channels;
+    double hours;
+    uint32_t seed;
+    double areaSideM;
+    double lossPercent;
+    double queriesPercent;
+    bool peerTraffic;
+    uint32_t hostReplyDelayMs;
+    uint32_t bulkSize;
+    double urgentPerHour;
+    bool preemptBulk;
+
+} SimParameters_t;
+
+typedef struct
+{
+    uint64_t startUs;
+    uint64_t durationUs;
+    uint32_t frames;
+    uint64_t airtimeUs;
+    uint16_t completedMask;
+
+} SimTransferResults_t;
+
+typedef struct
+{
+    std::vector<uint8_t> blob;
+    uint16_t targetsMask;
+    uint16_t rebuiltMask;           // targets which rebuilt the very blob sent
+    uint16_t unicastFailedMask;
+    bool finished;
+    uint32_t transfers;             // saturating load (-u): transfers over
+    SimTransferResults_t bulk;
+    SimTransferResults_t unicast;
+
+} SimBulkBenchmark_t;
+
+static bool s_verbose;
+static std::string s_library_path;
+
+static const SimParameters_t* s_parameters;
+static std::vector<SimNode_t> s_nodes;
+static std::vector<double> s_rx_power_dbm;      // [sender * nodes + receiver]
+static std::vector<SimFrame_t> s_frames_on_air;
+static std::unordered_map<uint32_t, SimRequestRecord_t> s_requests;
+static SimResults_t s_results;
+static SimBulkBenchmark_t s_bulk;
+static std::mt19937 s_medium_random;
+
+static std::priority_queue<SimEvent_t, std::vector<SimEvent_t>, SimEventLater> s_events;
+static std::unordered_set<int> s_cancelled_events;
+static uint64_t s_now_us;
+static uint64_t s_event_order;
+static int s_next_event_id=1;
+static int s_next_frame_id;
+static int s_current_node=-1;
+
+static double s_noise_floor_dbm;
+static double s_sensitivity_dbm;
+static uint64_t s_symbol_us;
+static uint64_t s_preamble_us;
+
+/*
+ *  Kernel
+ */
+static int post(int node, uint64_t delayUs, uint32_t periodMs, const std::function<void()>& event, int id=0)
+{
+    SimEvent_t entry;
+
+    entry.atUs = s_now_us + delayUs;
+    entry.order = s_event_order++;
+    entry.node = node;
+    entry.id = id ? id : s_next_event_id++;
+    entry.periodMs = periodMs;
+    entry.event = event;
+
+    s_events.push(entry);
+
+    return entry.id;
+}
+
+static void run_until(uint64_t endUs)
+{
+    while(!s_events.empty() && s_events.top().atUs <= endUs && !s_bulk.finished)
+    {
+        SimEvent_t entry = s_events.top();
+
+        s_events.pop();
+
+        if(s_cancelled_events.count(entry.id)) continue;
+
+        s_now_us = entry.atUs;
+        s_current_node = entry.node;
+
+        if(entry.periodMs) post(entry.node, entry.periodMs * 1000ULL, entry.periodMs, entry.event, entry.id);
+
+        entry.event();
+
+        s_current_node = -1;
+    }
+
+    if(!s_bulk.finished) s_now_us = endUs;
+}
+
+uint64_t lora_sim_get_time_us()
+{
+    return s_now_us;
+}
+
+int lora_sim_post(uint32_t delayMs, uint32_t periodMs, const std::function<void()>& event)
+{
+    return post(s_current_node, delayMs * 1000ULL, periodMs, event);
+}
+
+void lora_sim_cancel(int id)
+{
+    s_cancelled_events.insert(id);
+}
+
+bool lora_sim_is_verbose()
+{
+    return s_verbose;
+}
+
+void lora_sim_print_prefix()
+{
+    printf("[%10.3f] %3u ", s_now_us / 1e6, s_current_node >= 0 ? s_nodes[s_current_node].address : 0);
+}
+
+/*
+ *  Radio medium
+ */
+static double get_path_loss_db(double distanceM)
+{
+    return SIM_PATH_LOSS_REFERENCE_DB + 10 * SIM_PATH_LOSS_EXPONENT * log10(std::max(distanceM, 1.0) / SIM_PATH_LOSS_REFERENCE_M);
+}
+
+// Demodulator floor of the spreading factor (SX127x datasheet), below the noise
+static double get_required_snr_db()
+{
+    return -7.5 - 2.5 * (LORA_SPREADING_FACTOR - 7);
+}
+
+static double get_rx_power_dbm(int sender, int receiver)
+{
+    return s_rx_power_dbm[sender * s_nodes.size() + receiver];
+}
+
+static SimFrame_t* find_frame(int frameId)
+{
+    for(size_t i=0; i<s_frames_on_air.size(); i++)
+    {
+        if(s_frames_on_air[i].id == frameId) return &s_frames_on_air[i];
+    }
+
+    return NULL;
+}
+
+// Bandwidth of the channel a node listens on: every node runs the modem settings of lora_config.h
+#define SIM_RX_BANDWIDTH_HZ (125000UL << LORA_BANDWIDTH)
+
+static bool are_bands_overlapping(uint32_t frequency, uint32_t bandwidthHz, uint32_t otherFrequency, uint32_t otherBandwidthHz)
+{
+    uint32_t distanceHz = frequency > otherFrequency ? frequency - otherFrequency : otherFrequency - frequency;
+
+    return 2 * (uint64_t)distanceHz < (uint64_t)bandwidthHz + otherBandwidthHz;
+}
+
+// Any other frame on air at the receiver, on an overlapping band, too close in power to the one it would lock on
+static bool is_frame_overlapped(int receiver, const SimFrame_t* frame)
+{
+    double powerDbm = get_rx_power_dbm(frame->sender, receiver);
+
+    for(size_t i=0; i<s_frames_on_air.size(); i++)
+    {
+        const SimFrame_t* other = &s_frames_on_air[i];
+
+        if(other->id == frame->id || other->sender == receiver) continue;
+
+        if(!are_bands_overlapping(other->frequency, other->bandwidthHz, frame->frequency, frame->bandwidthHz)) continue;
+
+        if(get_rx_power_dbm(other->sender, receiver) > powerDbm - SIM_CAPTURE_THRESHOLD_DB) return true;
+    }
+
+    return false;
+}
+
+static bool is_frame_detectable(int receiver, const SimFrame_t* frame)
+{
+    if(frame->aborted || get_rx_power_dbm(frame->sender, receiver) < s_sensitivity_dbm) return false;
+
+    // Fading of this link for this frame
+    if(std::uniform_real_distribution<double>(0, 100)(s_medium_random) < s_parameters->lossPercent)
+    {
+        s_results.randomLosses++;
+
+        return false;
+    }
+
+    return true;
+}
+
+static void lock_on_frame(int receiver, const SimFrame_t* frame)
+{
+    SimNode_t* node = &s_nodes[receiver];
+
+    node->lockedFrameId = frame->id;
+    node->lockedCorrupted = is_frame_overlapped(receiver, frame);
+    node->lockDetectedUs = std::max(s_now_us, frame->startUs + LORA_SLEEPY_RX_MIN_SYMBOLS * s_symbol_us);
+}
+
+// A frame started: every listening node locks on it, or takes it as interference for the frame it's locked on
+static void on_frame_start(const SimFrame_t* frame)
+{
+    for(size_t receiver=0; receiver<s_nodes.size(); receiver++)
+    {
+        SimNode_t* node = &s_nodes[receiver];
+
+        if((int)receiver == frame->sender || node->radioState != SIM_RADIO_RX) continue;
+
+        if(!are_bands_overlapping(node->frequency, SIM_RX_BANDWIDTH_HZ, frame->frequency, frame->bandwidthHz)) continue;
+
+        // A frame on a neighbouring channel can only spoil the reception
+        bool onChannel = frame->frequency == node->frequency;
+
+        SimFrame_t* locked = node->lockedFrameId >= 0 ? find_frame(node->lockedFrameId) : NULL;
+
+        if(!locked)
+        {
+            if(onChannel && is_frame_detectable(receiver, frame)) lock_on_frame(receiver, frame);
+
+            continue;
+        }
+
+        double powerDbm = get_rx_power_dbm(frame->sender, receiver);
+        double lockedPowerDbm = get_rx_power_dbm(locked->sender, receiver);
+
+        if(onChannel && s_now_us < locked->startUs + s_preamble_us && powerDbm >= lockedPowerDbm + SIM_CAPTURE_THRESHOLD_DB && is_frame_detectable(receiver, frame))
+        {
+            s_results.collisions++;
+
+            lock_on_frame(receiver, frame);
+        }
+        else if(powerDbm > lockedPowerDbm - SIM_CAPTURE_THRESHOLD_DB)
+        {
+            node->lockedCorrupted = true;
+        }
+    }
+}
+
+static void on_frame_end(int frameId)
+{
+    SimFrame_t* frame = find_frame(frameId);
+
+    int16_t size = frame->data.size();
+
+    for(size_t receiver=0; receiver<s_nodes.size(); receiver++)
+    {
+        SimNode_t* node = &s_nodes[receiver];
+
+        if(node->lockedFrameId != frameId) continue;
+
+        node->lockedFrameId = -1;
+
+        // The driver stops its rx timeout at the end of a frame, single reception goes back to standby
+        node->radioGeneration++;
+        if(!node->rxContinuous) node->radioState = SIM_RADIO_IDLE;
+
+        if(node->lockedCorrupted || frame->aborted)
+        {
+            if(node->lockedCorrupted) s_results.collisions++;
+
+            RadioEvents_t* events = node->radioEvents;
+
+            post(receiver, 0, 0, [events]() { events->RxError(); });
+
+            continue;
+        }
+
+        s_results.receptions++;
+
+        double powerDbm = get_rx_power_dbm(frame->sender, receiver);
+        int16_t rssi = (int16_t)lround(powerDbm);
+        int8_t snr = (int8_t)std::max(-20L, std::min(20L, lround(powerDbm - s_noise_floor_dbm)));
+
+        RadioEvents_t* events = node->radioEvents;
+        std::vector<uint8_t> data = frame->data;
+
+        post(receiver, 0, 0, [events, data, size, rssi, snr]() mutable { events->RxDone(&data[0], size, rssi, snr); });
+    }
+
+    SimNode_t* sender = &s_nodes[frame->sender];
+
+    if(!frame->aborted && sender->txFrameId == frameId)
+    {
+        sender->txFrameId = -1;
+        sender->radioState = SIM_RADIO_IDLE;
+        sender->radioGeneration++;
+
+        RadioEvents_t* events = sender->radioEvents;
+
+        post(frame->sender, 0, 0, [events]() { events->TxDone(); });
+    }
+
+    s_frames_on_air.erase(s_frames_on_air.begin() + (frame - &s_frames_on_air[0]));
+}
+
+// Whatever the radio of the node was doing is over: an ongoing transmission is cut (receivers get a broken frame)
+static void stop_radio(SimNode_t* node)
+{
+    if(node->radioState == SIM_RADIO_TX)
+    {
+        SimFrame_t* frame = find_frame(node->txFrameId);
+
+        if(frame) frame->aborted = true;
+
+        node->txFrameId = -1;
+    }
+
+    node->radioState = SIM_RADIO_IDLE;
+    node->radioGeneration++;
+    node->lockedFrameId = -1;
+}
+
+void lora_sim_radio_init(RadioEvents_t* events)
+{
+    s_nodes[s_current_node].radioEvents = events;
+}
+
+void lora_sim_radio_set_rx_config(uint16_t symbolTimeout, bool rxContinuous)
+{
+    s_nodes[s_current_node].rxSymbolTimeout = symbolTimeout;
+    s_nodes[s_current_node].rxContinuous = rxContinuous;
+}
+
+// Retuning while receiving loses the frame the receiver was locked on
+void lora_sim_radio_set_channel(uint32_t frequency)
+{
+    SimNode_t* node = &s_nodes[s_current_node];
+
+    if(node->frequency == frequency) return;
+
+    node->frequency = frequency;
+    node->lockedFrameId = -1;
+}
+
+void lora_sim_radio_sleep()
+{
+    stop_radio(&s_nodes[s_current_node]);
+}
+
+static void on_rx_timeout(int nodeIndex, uint32_t generation, bool symbolTimeout)
+{
+    SimNode_t* node = &s_nodes[nodeIndex];
+
+    if(node->radioGeneration != generation || node->radioState != SIM_RADIO_RX) return;
+
+    // The symbol timeout only ends a reception with no preamble detected in time
+    if(symbolTimeout && node->lockedFrameId >= 0 && node->lockDetectedUs <= s_now_us) return;
+
+    stop_radio(node);
+
+    node->radioEvents->RxTimeout();
+}
+
+void lora_sim_radio_rx(uint32_t timeoutMs)
+{
+    int nodeIndex = s_current_node;
+    SimNode_t* node = &s_nodes[nodeIndex];
+
+    stop_radio(node);
+
+    node->radioState = SIM_RADIO_RX;
+
+    uint32_t generation = node->radioGeneration;
+
+    if(timeoutMs > 0) post(nodeIndex, timeoutMs * 1000ULL, 0, [=]() { on_rx_timeout(nodeIndex, generation, false); });
+
+    if(!node->rxContinuous) post(nodeIndex, node->rxSymbolTimeout * s_symbol_us, 0, [=]() { on_rx_timeout(nodeIndex, generation, true); });
+
+    // A frame already on air can still be caught while enough of its preamble is left
+    const SimFrame_t* best = NULL;
+
+    for(size_t i=0; i<s_frames_on_air.size(); i++)
+    {
+        const SimFrame_t* frame = &s_frames_on_air[i];
+
+        if(frame->frequency != node->frequency || s_now_us + LORA_SLEEPY_RX_MIN_SYMBOLS * s_symbol_us > frame->startUs + s_preamble_us) continue;
+
+        if(!best || get_rx_power_dbm(frame->sender, nodeIndex) > get_rx_power_dbm(best->sender, nodeIndex)) best = frame;
+    }
+
+    if(best && is_frame_detectable(nodeIndex, best))
+    {
+        lock_on_frame(nodeIndex, best);
+
+        node->lockDetectedUs = s_now_us + LORA_SLEEPY_RX_MIN_SYMBOLS * s_symbol_us;
+    }
+}
+
+void lora_sim_radio_send(const uint8_t* buffer, uint8_t size)
+{
+    int nodeIndex = s_current_node;
+    SimNode_t* node = &s_nodes[nodeIndex];
+
+    stop_radio(node);
+
+    SimFrame_t frame;
+
+    frame.id = s_next_frame_id++;
+    frame.sender = nodeIndex;
+    frame.frequency = node->frequency;
+    frame.bandwidthHz = SIM_RX_BANDWIDTH_HZ;
+    frame.startUs = s_now_us;
+    frame.endUs = s_now_us + lora_airtime_get_time_on_air_us(size);
+    frame.aborted = false;
+    frame.data.assign(buffer, buffer + size);
+
+    node->radioState = SIM_RADIO_TX;
+    node->txFrameId = frame.id;
+
+    s_results.frames++;
+    s_results.airtimeUs += frame.endUs - frame.startUs;
+
+    s_frames_on_air.push_back(frame);
+
+    on_frame_start(&s_frames_on_air.back());
+
+    int frameId = frame.id;
+
+    post(-1, frame.endUs - frame.startUs, 0, [frameId]() { on_frame_end(frameId); });
+}
+
+uint32_t lora_sim_radio_random()
+{
+    return s_nodes[s_current_node].random();
+}
+
+/*
+ *  Node applications
+ */
+static uint32_t get_request_key(uint8_t source, uint16_t payload)
+{
+    return ((uint32_t)source << 16) | payload;
+}
+
+static void schedule_send(int nodeIndex, uint32_t delayMs);
+
+static void event_proc_send_next_request(int nodeIndex)
+{
+    SimNode_t* node = &s_nodes[nodeIndex];
+
+    node->sendScheduled = false;
+
+    while(!node->requestInFlight && !node->queue.empty())
+    {
+        SimRequest_t request = node->queue.front();
+
+        bool urgent = s_parameters->urgentPerHour > 0;
+
+        if(urgent && s_parameters->preemptBulk) node->preemptBulk();
+
+        int outcome = node->sendRequest(request.payload, request.destination, request.requiresReply);
+
+        if(outcome == LORA_OUTCOME_INVALID_STATE && urgent)
+        {
+            // As the gateway scheduler does with its urgent queue
+            schedule_send(nodeIndex, SIM_URGENT_RETRY_INTERVAL);
+
+            return;
+        }
+
+        if(outcome == LORA_OUTCOME_INVALID_STATE)
+        {
+            // Serving another transaction: as the host does on a not-sent report, try again when it's over
+            uint32_t retryMs = node->getBusyRemainingMs();
+
+            schedule_send(nodeIndex, std::max(retryMs, (uint32_t)LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL));
+
+            return;
+        }
+
+        node->queue.pop_front();
+
+        if(outcome == LORA_OUTCOME_PENDING)
+        {
+            node->requestInFlight = true;
+            node->inFlight = request;
+
+            return;
+        }
+
+        s_results.notSent++;
+    }
+}
+
+static void schedule_send(int nodeIndex, uint32_t delayMs)
+{
+    if(s_nodes[nodeIndex].sendScheduled) return;
+
+    s_nodes[nodeIndex].sendScheduled = true;
+
+    post(nodeIndex, delayMs * 1000ULL, 0, [nodeIndex]() { event_proc_send_next_request(nodeIndex); });
+}
+
+static uint8_t pick_destination(SimNode_t* node)
+{
+    if(!s_parameters->peerTraffic) return LORA_GATEWAY_ADDRESS;
+
+    uint8_t destination;
+
+    do
+    {
+        destination = std::uniform_int_distribution<int>(1, s_nodes.size())(node->trafficRandom);
+
+    } while(destination == node->address);
+
+    return destination;
+}
+
+static void event_proc_generate_request(int nodeIndex)
+{
+    SimNode_t* node = &s_nodes[nodeIndex];
+
+    double meanIntervalMs = 3600000.0 / s_parameters->requestsPerHour;
+
+    post(nodeIndex, (uint64_t)(std::exponential_distribution<double>(1.0 / meanIntervalMs)(node->trafficRandom) * 1000), 0,
+        [nodeIndex]() { event_proc_generate_request(nodeIndex); });
+
+    SimRequest_t request;
+
+    request.arrivalUs = s_now_us;
+    request.destination = pick_destination(node);
+    request.requiresReply = std::uniform_real_distribution<double>(0, 100)(node->trafficRandom) < s_parameters->queriesPercent;
+    request.payload = ++node->counter;
+    request.attempts = 0;
+
+    s_results.generated++;
+
+    if(request.requiresReply) s_results.queries++;
+
+    if(node->queue.size() >= SIM_APP_QUEUE_SIZE)
+    {
+        s_results.queueDrops++;
+
+        return;
+    }
+
+    SimRequestRecord_t record = { request.arrivalUs, request.requiresReply, false };
+
+    s_requests[get_request_key(node->address, request.payload)] = record;
+
+    node->queue.push_back(request);
+
+    schedule_send(nodeIndex, 0);
+}
+
+// Urgent commands of the gateway application to the bulk targets (-u)
+static void event_proc_generate_urgent_request(int nodeIndex)
+{
+    SimNode_t* node = &s_nodes[nodeIndex];
+
+    double meanIntervalMs = 3600000.0 / s_parameters->urgentPerHour;
+
+    post(nodeIndex, (uint64_t)(std::exponential_distribution<double>(1.0 / meanIntervalMs)(node->trafficRandom) * 1000), 0,
+        [nodeIndex]() { event_proc_generate_urgent_request(nodeIndex); });
+
+    SimRequest_t request;
+
+    request.arrivalUs = s_now_us;
+    request.requiresReply = false;
+    request.payload = ++node->counter;
+    request.attempts = 0;
+
+    do
+    {
+        request.destination = std::uniform_int_distribution<int>(1, LORA_BULK_MAX_ADDRESS)(node->trafficRandom);
+
+    } while(!(s_bulk.targetsMask & (1 << request.destination)));
+
+    s_results.generated++;
+
+    if(node->queue.size() >= SIM_APP_QUEUE_SIZE)
+    {
+        s_results.queueDrops++;
+
+        return;
+    }
+
+    SimRequestRecord_t record = { request.arrivalUs, false, false };
+
+    s_requests[get_request_key(node->address, request.payload)] = record;
+
+    node->queue.push_back(request);
+
+    schedule_send(nodeIndex, 0);
+}
+
+static void finish_transfer(SimTransferResults_t* transfer, uint16_t completedMask)
+{
+    transfer->durationUs = s_now_us - transfer->startUs;
+    transfer->frames = s_results.frames - transfer->frames;
+    transfer->airtimeUs = s_results.airtimeUs - transfer->airtimeUs;
+    transfer->completedMask = completedMask;
+}
+
+static void start_transfer(SimTransferResults_t* transfer)
+{
+    transfer->startUs = s_now_us;
+    transfer->frames = s_results.frames;
+    transfer->airtimeUs = s_results.airtimeUs;
+}
+
+// Unicast benchmark: a query per two bytes of the blob and target, queued at the gateway all at once (sent one at a time)
+static void event_proc_start_unicast_transfer(int nodeIndex)
+{
+    SimNode_t* node = &s_nodes[nodeIndex];
+
+    start_transfer(&s_bulk.unicast);
+
+    for(uint8_t address=1; address<=LORA_BULK_MAX_ADDRESS; address++)
+    {
+        if(!(s_bulk.targetsMask & (1 << address))) continue;
+
+        for(size_t i=0; i<s_bulk.blob.size(); i+=2)
+        {
+            SimRequest_t request;
+
+            request.arrivalUs = s_now_us;
+            request.destination = address;
+            request.requiresReply = true;
+            request.payload = (uint16_t)(((s_bulk.blob[i] << 8) | (i + 1 < s_bulk.blob.size() ? s_bulk.blob[i + 1] : 0)) & 0x7FFF);
+            request.attempts = 0;
+
+            node->queue.push_back(request);
+        }
+    }
+
+    schedule_send(nodeIndex, 0);
+}
+
+static void on_unicast_completion(SimNode_t* node, int outcome)
+{
+    if(outcome != LORA_OUTCOME_REPLY_RIGHT)
+    {
+        uint8_t destination = node->inFlight.destination;
+
+        if(++node->inFlight.attempts < SIM_UNICAST_MAX_ATTEMPTS)
+        {
+            node->queue.push_front(node->inFlight);
+        }
+        else
+        {
+            // Out of reach: the rest of its queries are given up too
+            s_bulk.unicastFailedMask |= 1 << destination;
+
+            node->queue.erase(std::remove_if(node->queue.begin(), node->queue.end(),
+                [destination](const SimRequest_t& request) { return request.destination == destination; }), node->queue.end());
+        }
+    }
+
+    if(!node->queue.empty()) return;
+
+    finish_transfer(&s_bulk.unicast, s_bulk.targetsMask & ~s_bulk.unicastFailedMask);
+
+    s_bulk.finished = true;
+}
+
+static void event_proc_start_bulk_transfer(int nodeIndex)
+{
+    SimNode_t* node = &s_nodes[nodeIndex];
+
+    // Lowest class: the transfer waits for the urgent commands queued
+    if(s_parameters->urgentPerHour > 0 && (!node->queue.empty() || node->requestInFlight))
+    {
+        post(nodeIndex, SIM_URGENT_RETRY_INTERVAL * 1000ULL, 0, [nodeIndex]() { event_proc_start_bulk_transfer(nodeIndex); });
+
+        return;
+    }
+
+    start_transfer(&s_bulk.bulk);
+
+    int outcome = node->sendBulk(&s_bulk.blob[0], s_bulk.blob.size(), s_bulk.targetsMask);
+
+    if(outcome == LORA_OUTCOME_PENDING) return;
+
+    // Radio still busy (e.g. the previous transfer just over): tried again at the next scheduler cycle
+    if(outcome == LORA_OUTCOME_INVALID_STATE && s_parameters->urgentPerHour > 0)
+    {
+        post(nodeIndex, SIM_URGENT_RETRY_INTERVAL * 1000ULL, 0, [nodeIndex]() { event_proc_start_bulk_transfer(nodeIndex); });
+
+        return;
+    }
+
+    fprintf(stderr, "bulk transfer didn't start\n");
+
+    finish_transfer(&s_bulk.bulk, 0);
+
+    post(nodeIndex, SIM_UNICAST_START_DELAY * 1000ULL, 0, [nodeIndex]() { event_proc_start_unicast_transfer(nodeIndex); });
+}
+
+void lora_sim_report_bulk_completion(int outcome, uint16_t completedMask)
+{
+    int nodeIndex = s_current_node;
+
+    finish_transfer(&s_bulk.bulk, outcome == LORA_OUTCOME_REPLY_RIGHT || outcome == LORA_OUTCOME_GATHER_PARTIAL ? completedMask : 0);
+
+    if(s_parameters->urgentPerHour > 0)
+    {
+        s_bulk.transfers++;
+
+        post(nodeIndex, 0, 0, [nodeIndex]() { event_proc_start_bulk_transfer(nodeIndex); });
+
+        return;
+    }
+
+    post(nodeIndex, SIM_UNICAST_START_DELAY * 1000ULL, 0, [nodeIndex]() { event_proc_start_unicast_transfer(nodeIndex); });
+}
+
+void lora_sim_report_bulk(uint8_t, uint8_t, const uint8_t* blob, uint16_t size)
+{
+    uint8_t address = s_nodes[s_current_node].address;
+
+    if(size == s_bulk.blob.size() && memcmp(blob, &s_bulk.blob[0], size) == 0) s_bulk.rebuiltMask |= (s_bulk.targetsMask & (1 << address));
+}
+
+void lora_sim_report_completion(int outcome, uint16_t)
+{
+    SimNode_t* node = &s_nodes[s_current_node];
+
+    if(!node->requestInFlight) return;
+
+    node->requestInFlight = false;
+
+    if(s_parameters->bulkSize > 0 && s_parameters->urgentPerHour == 0)
+    {
+        on_unicast_completion(node, outcome);
+
+        schedule_send(s_current_node, 0);
+
+        return;
+    }
+
+    if(outcome == LORA_OUTCOME_REPLY_RIGHT && node->inFlight.requiresReply)
+    {
+        s_results.answered++;
+        s_results.latenciesMs.push_back((s_now_us - node->inFlight.arrivalUs) / 1000.0);
+    }
+    else if(outcome != LORA_OUTCOME_REPLY_NOT_NEEDED)
+    {
+        s_results.failed++;
+    }
+
+    schedule_send(s_current_node, 0);
+}
+
+void lora_sim_report_request(uint8_t sourceAddress, uint16_t payload, bool)
+{
+    std::unordered_map<uint32_t, SimRequestRecord_t>::iterator it = s_requests.find(get_request_key(sourceAddress, payload));
+
+    if(it == s_requests.end() || it->second.delivered) return;
+
+    it->second.delivered = true;
+
+    s_results.delivered++;
+
+    if(!it->second.requiresReply) s_results.latenciesMs.push_back((s_now_us - it->second.arrivalUs) / 1000.0);
+}
+
+/*
+ *  Simulation run
+ */
+static bool load_node(SimNode_t* node, const std::string& directory, uint32_t index)
+{
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/node_%u.so", directory.c_str(), index);
+
+    // Each node needs its own copy of the firmware globals: the dynamic loader maps a file only once
+    FILE* in = fopen(s_library_path.c_str(), "rb");
+    FILE* out = fopen(path, "wb");
+
+    if(!in || !out)
+    {
+        if(in) fclose(in);
+        if(out) fclose(out);
+
+        fprintf(stderr, "can't copy %s to %s\n", s_library_path.c_str(), path);
+        return false;
+    }
+
+    char buffer[65536];
+    size_t length;
+
+    while((length = fread(buffer, 1, sizeof(buffer), in)) > 0) fwrite(buffer, 1, length, out);
+
+    fclose(in);
+    fclose(out);
+
+    node->library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+
+    unlink(path);
+
+    if(!node->library)
+    {
+        fprintf(stderr, "%s\n", dlerror());
+        return false;
+    }
+
+    node->initialize = (node_initialize_t)dlsym(node->library, "lora_sim_node_initialize");
+    node->sendRequest = (node_send_request_t)dlsym(node->library, "lora_sim_node_send_request");
+    node->getBusyRemainingMs = (node_get_busy_remaining_ms_t)dlsym(node->library, "lora_sim_node_get_busy_remaining_ms");
+    node->fillWithStatsDump = (node_fill_with_dump_t)dlsym(node->library, "lora_sim_node_fill_with_stats_dump");
+    node->fillWithEnergyDump = (node_fill_with_dump_t)dlsym(node->library, "lora_sim_node_fill_with_energy_dump");
+    node->sendBulk = (node_send_bulk_t)dlsym(node->library, "lora_sim_node_send_bulk");
+    node->preemptBulk = (node_preempt_bulk_t)dlsym(node->library, "lora_sim_node_preempt_bulk");
+
+    return node->initialize && node->sendRequest && node->getBusyRemainingMs && node->fillWithStatsDump && node->fillWithEnergyDump && node->sendBulk &&
+        node->preemptBulk;
+}
+
+static void place_nodes(std::mt19937& generator)
+{
+    std::uniform_real_distribution<double> coordinate(-s_parameters->areaSideM / 2, s_parameters->areaSideM / 2);
+    std::normal_distribution<double> shadowing(0, SIM_SHADOWING_SIGMA_DB);
+
+    size_t count = s_nodes.size();
+
+    for(size_t i=0; i<count; i++)
+    {
+        s_nodes[i].x = s_nodes[i].address == LORA_GATEWAY_ADDRESS ? 0 : coordinate(generator);
+        s_nodes[i].y = s_nodes[i].address == LORA_GATEWAY_ADDRESS ? 0 : coordinate(generator);
+    }
+
+    s_rx_power_dbm.assign(count * count, 0);
+
+    // Same shadowing both ways: links are symmetric
+    for(size_t a=0; a<count; a++)
+    {
+        for(size_t b=a+1; b<count; b++)
+        {
+            double distanceM = hypot(s_nodes[a].x - s_nodes[b].x, s_nodes[a].y - s_nodes[b].y);
+            double powerDbm = TX_OUTPUT_POWER - get_path_loss_db(distanceM) + shadowing(generator);
+
+            s_rx_power_dbm[a * count + b] = powerDbm;
+            s_rx_power_dbm[b * count + a] = powerDbm;
+        }
+    }
+}
+
+static uint32_t count_nodes_reaching_gateway()
+{
+    uint32_t count=0;
+
+    for(size_t i=0; i<s_nodes.size(); i++)
+    {
+        if(s_nodes[i].address != LORA_GATEWAY_ADDRESS && get_rx_power_dbm(i, LORA_GATEWAY_ADDRESS - 1) >= s_sensitivity_dbm) count++;
+    }
+
+    return count;
+}
+
+static double get_percentile(std::vector<double> values, double percentile)
+{
+    if(values.empty()) return 0;
+
+    std::sort(values.begin(), values.end());
+
+    size_t index = (size_t)std::ceil(percentile / 100.0 * values.size());
+
+    return values[index > 0 ? index - 1 : 0];
+}
+
+static double get_ratio_percent(uint32_t part, uint32_t total)
+{
+    return total > 0 ? 100.0 * part / total : 0;
+}
+
+static uint32_t count_bits(uint16_t mask)
+{
+    uint32_t count=0;
+
+    for(; mask; mask &= mask - 1) count++;
+
+    return count;
+}
+
+static void print_transfer_results(const SimTransferResults_t* transfer)
+{
+    printf(" %9.1f %6u %7.2f %4u", transfer->durationUs / 1000.0, transfer->frames, transfer->airtimeUs / 1e6, count_bits(transfer->completedMask));
+}
+
+static void print_bulk_benchmark_results()
+{
+    printf("%5u %3u %5u %4u |", s_parameters->nodes, s_parameters->channels, s_parameters->bulkSize, count_bits(s_bulk.targetsMask));
+
+    print_transfer_results(&s_bulk.bulk);
+
+    printf(" %4u |", count_bits(s_bulk.rebuiltMask));
+
+    if(s_bulk.finished) print_transfer_results(&s_bulk.unicast);
+    else printf(" %9s %6s %7s %4s", "-", "-", "-", "-");
+
+    printf("\n");
+}
+
+static void print_urgent_benchmark_results()
+{
+    printf("%5u %3u %5u %6.0f %4s | %6u %7.1f %8.0f %8.0f %8.0f | %5u %8.1f\n", s_parameters->nodes, s_parameters->channels,
+        s_parameters->bulkSize, s_parameters->urgentPerHour, s_parameters->preemptBulk ? "yes" : "no", s_results.generated,
+        get_ratio_percent(s_results.delivered, s_results.generated), get_percentile(s_results.latenciesMs, 50),
+        get_percentile(s_results.latenciesMs, 99), get_percentile(s_results.latenciesMs, 100), s_bulk.transfers,
+        s_bulk.transfers * s_parameters->bulkSize / s_parameters->hours / 3600);
+}
+
+static int simulate(const SimParameters_t* parameters)
+{
+    s_parameters = parameters;
+
+    char directory[] = "/tmp/lora_network_sim.XXXXXX";
+
+    if(!mkdtemp(directory))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    s_nodes.resize(parameters->nodes);
+
+    bool loaded = true;
+
+    for(uint32_t i=0; i<parameters->nodes && loaded; i++)
+    {
+        SimNode_t* node = &s_nodes[i];
+
+        node->address = i + 1;
+        node->lockedFrameId = -1;
+        node->txFrameId = -1;
+        node->rxContinuous = true;
+        node->random.seed(parameters->seed * 1000003UL + node->address);
+        node->trafficRandom.seed(parameters->seed * 7919UL + node->address);
+
+        loaded = load_node(node, directory, i);
+    }
+
+    rmdir(directory);
+
+    if(!loaded) return 1;
+
+    std::mt19937 generator(parameters->seed);
+
+    s_medium_random.seed(parameters->seed + 1);
+
+    place_nodes(generator);
+
+    if(parameters->bulkSize > 0)
+    {
+        for(uint32_t i=0; i<parameters->bulkSize; i++) s_bulk.blob.push_back((uint8_t)generator());
+
+        for(uint32_t address=1; address<=std::min(parameters->nodes, (uint32_t)LORA_BULK_MAX_ADDRESS); address++)
+        {
+            if(address != LORA_GATEWAY_ADDRESS) s_bulk.targetsMask |= 1 << address;
+        }
+
+        int gatewayIndex = LORA_GATEWAY_ADDRESS - 1;
+
+        post(gatewayIndex, (SIM_START_SPREAD + SIM_BULK_START_DELAY) * 1000ULL, 0, [gatewayIndex]() { event_proc_start_bulk_transfer(gatewayIndex); });
+
+        if(parameters->urgentPerHour > 0)
+        {
+            post(gatewayIndex, (SIM_START_SPREAD + SIM_BULK_START_DELAY) * 1000ULL, 0, [gatewayIndex]() { event_proc_generate_urgent_request(gatewayIndex); });
+        }
+    }
+
+    std::uniform_int_distribution<int> startDelayMs(0, SIM_START_SPREAD);
+
+    for(uint32_t i=0; i<parameters->nodes; i++)
+    {
+        int nodeIndex = i;
+
+        post(nodeIndex, startDelayMs(generator) * 1000ULL, 0, [nodeIndex]()
+        {
+            SimNode_t* node = &s_nodes[nodeIndex];
+
+            if(node->initialize(node->address, s_parameters->hostReplyDelayMs, s_parameters->channels) != 0) fprintf(stderr, "node %u didn't start\n", node->address);
+
+            bool sendsRequests = s_parameters->peerTraffic || node->address != LORA_GATEWAY_ADDRESS;
+
+            if(sendsRequests && s_parameters->requestsPerHour > 0) event_proc_generate_request(nodeIndex);
+        });
+    }
+
+    uint64_t durationUs = (uint64_t)(parameters->hours * 3600e6);
+
+    run_until(durationUs);
+
+    if(parameters->urgentPerHour > 0)
+    {
+        print_urgent_benchmark_results();
+
+        return 0;
+    }
+
+    if(parameters->bulkSize > 0)
+    {
+        print_bulk_benchmark_results();
+
+        return 0;
+    }
+
+    // Requests still in flight or queued at the end are left out
+    uint32_t pending=0;
+
+    for(size_t i=0; i<s_nodes.size(); i++) pending += s_nodes[i].queue.size() + (s_nodes[i].requestInFlight ? 1 : 0);
+
+    uint32_t settled = s_results.generated - pending;
+
+    printf("%5u %7.1f %3u %8u %7.1f %7.1f %9.1f %6.2f %6.2f %8.0f %8.0f %8.0f %5u %5u\n", parameters->nodes, parameters->requestsPerHour,
+        parameters->channels, s_results.generated, get_ratio_percent(s_results.delivered, settled), get_ratio_percent(s_results.answered, s_results.queries),
+        s_results.delivered / parameters->hours, 100.0 * s_results.airtimeUs / durationUs / parameters->channels,
+        get_ratio_percent(s_results.collisions, s_results.collisions + s_results.receptions),
+        get_percentile(s_results.latenciesMs, 50), get_percentile(s_results.latenciesMs, 90), get_percentile(s_results.latenciesMs, 99),
+        s_results.queueDrops, s_results.notSent);
+
+    if(s_verbose)
+    {
+        printf("reaching the gateway: %u, frames %u, received %u, random losses %u, failed %u\n", count_nodes_reaching_gateway(),
+            s_results.frames, s_results.receptions, s_results.randomLosses, s_results.failed);
+
+        for(size_t i=0; i<s_nodes.size(); i++)
+        {
+            char dump[256];
+
+            s_current_node = i;
+
+            s_nodes[i].fillWithStatsDump(dump, sizeof(dump));
+
+            printf("%3u (%5.0f,%5.0f): %s\n", s_nodes[i].address, s_nodes[i].x, s_nodes[i].y, dump);
+        }
+    }
+
+    return 0;
+}
+
+static std::vector<double> parse_list(const char* text)
+{
+    std::vector<double> values;
+
+    for(const char* p=text; *p; )
+    {
+        char* end;
+
+        values.push_back(strtod(p, &end));
+
+        if(end == p) return std::vector<double>();
+
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    return values;
+}
+
+static std::string get_library_path()
+{
+    char path[512];
+
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+
+    if(length <= 0) return SIM_NODE_LIBRARY;
+
+    path[length] = '\0';
+
+    std::string executable(path);
+
+    return executable.substr(0, executable.rfind('/') + 1) + SIM_NODE_LIBRARY;
+}
+
+static int usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-n nodes,...] [-r requests per node per hour,...] [-c channels,...] [-t hours] [-s seed] [-a area side m]\n"
+        "       [-l loss %%] [-q queries %%] [-p uplink|peer] [-H host reply ms] [-b bulk bytes] [-u urgent per hour] [-v]\n", name);
+
+    return 1;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* nodesList = DEFAULT_NODES;
+    const char* ratesList = DEFAULT_REQUESTS_PER_HOUR;
+    const char* channelsList = DEFAULT_CHANNELS;
+
+    SimParameters_t parameters = SimParameters_t();
+
+    parameters.hours = DEFAULT_HOURS;
+    parameters.seed = 1;
+    parameters.areaSideM = DEFAULT_AREA_SIDE_M;
+    parameters.queriesPercent = DEFAULT_QUERIES_PERCENT;
+    parameters.hostReplyDelayMs = DEFAULT_HOST_REPLY_DELAY;
+
+    int option;
+
+    while((option = getopt(argc, argv, "n:r:c:t:s:a:l:q:p:H:b:u:v")) != -1)
+    {
+        switch(option)
+        {
+            case 'n': nodesList = optarg; break;
+            case 'r': ratesList = optarg; break;
+            case 'c': channelsList = optarg; break;
+            case 't': parameters.hours = atof(optarg); break;
+            case 's': parameters.seed = strtoul(optarg, NULL, 10); break;
+            case 'a': parameters.areaSideM = atof(optarg); break;
+            case 'l': parameters.lossPercent = atof(optarg); break;
+            case 'q': parameters.queriesPercent = atof(optarg); break;
+            case 'p': parameters.peerTraffic = strcmp(optarg, "peer") == 0; if(!parameters.peerTraffic && strcmp(optarg, "uplink") != 0) return usage(argv[0]); break;
+            case 'H': parameters.hostReplyDelayMs = strtoul(optarg, NULL, 10); break;
+            case 'b': parameters.bulkSize = strtoul(optarg, NULL, 10); if(parameters.bulkSize < 1 || parameters.bulkSize > LORA_BULK_MAX_SIZE) return usage(argv[0]); break;
+            case 'u': parameters.urgentPerHour = atof(optarg); break;
+            case 'v': s_verbose = true; break;
+            default: return usage(argv[0]);
+        }
+    }
+
+    std::vector<double> nodeCounts = parse_list(nodesList);
+    std::vector<double> rates = parse_list(ratesList);
+    std::vector<double> channelCounts = parse_list(channelsList);
+
+    if(nodeCounts.empty() || rates.empty() || channelCounts.empty() || parameters.hours <= 0 || parameters.urgentPerHour < 0 ||
+        (parameters.urgentPerHour > 0 && parameters.bulkSize == 0) || parameters.areaSideM < 0 || parameters.lossPercent < 0 || parameters.lossPercent > 100) return usage(argv[0]);
+
+    for(size_t i=0; i<nodeCounts.size(); i++)
+    {
+        if(nodeCounts[i] < 2 || nodeCounts[i] > SIM_MAX_NODES || nodeCounts[i] < LORA_GATEWAY_ADDRESS) return usage(argv[0]);
+    }
+
+    for(size_t i=0; i<channelCounts.size(); i++)
+    {
+        if(channelCounts[i] < 1 || channelCounts[i] > LORA_CHANNEL_MAX_COUNT) return usage(argv[0]);
+    }
+
+    s_library_path = get_library_path();
+
+    uint32_t bandwidthHz = 125000UL << LORA_BANDWIDTH;
+
+    s_noise_floor_dbm = -174 + 10 * log10((double)bandwidthHz) + SIM_NOISE_FIGURE_DB;
+    s_sensitivity_dbm = s_noise_floor_dbm + get_required_snr_db();
+    s_symbol_us = lora_airtime_get_symbol_time_us();
+    s_preamble_us = (uint64_t)((LORA_PREAMBLE_LENGTH + 4.25) * s_symbol_us);
+
+    printf("profile: SF%d, %lu kHz, frame %lu us on air, sensitivity %.1f dBm, range %.0f m (no shadowing)\n", LORA_SPREADING_FACTOR,
+        (unsigned long)(bandwidthHz / 1000), (unsigned long)lora_airtime_get_time_on_air_us(RADIO_MESSAGES_BUFFER_SIZE), s_sensitivity_dbm,
+        SIM_PATH_LOSS_REFERENCE_M * pow(10, (TX_OUTPUT_POWER - s_sensitivity_dbm - SIM_PATH_LOSS_REFERENCE_DB) / (10 * SIM_PATH_LOSS_EXPONENT)));
+    printf("run: %.2f h, %s traffic, %.0f%% queries, area %.0f m, loss %.1f%%, host reply %lu ms, seed %lu\n\n", parameters.hours,
+        parameters.peerTraffic ? "peer" : "uplink", parameters.queriesPercent, parameters.areaSideM, parameters.lossPercent,
+        (unsigned long)parameters.hostReplyDelayMs, (unsigned long)parameters.seed);
+
+    // No traffic but the transfers in the benchmark
+    if(parameters.bulkSize > 0) rates.assign(1, 0);
+
+    if(parameters.urgentPerHour > 0)
+    {
+        printf("%5s %3s %5s %6s %4s | %6s %7s %8s %8s %8s | %5s %8s\n", "nodes", "ch", "bytes", "urg/h", "pre", "urgent", "deliv%",
+            "p50 ms", "p99 ms", "max ms", "bulks", "bytes/s");
+    }
+    else if(parameters.bulkSize > 0)
+    {
+        printf("%5s %3s %5s %4s | %9s %6s %7s %4s %4s | %9s %6s %7s %4s\n", "nodes", "ch", "bytes", "tgts", "bulk ms", "frames", "air s",
+            "ok", "rebl", "unic ms", "frames", "air s", "ok");
+    }
+    else
+    {
+        printf("%5s %7s %3s %8s %7s %7s %9s %6s %6s %8s %8s %8s %5s %5s\n", "nodes", "req/h", "ch", "offered", "deliv%", "answ%", "deliv/h", "air%",
+            "coll%", "p50 ms", "p90 ms", "p99 ms", "drop", "nsent");
+    }
+
+    int status=0;
+
+    // A run per child process: the node libraries (and the firmware globals in them) start from scratch every time
+    for(size_t n=0; n<nodeCounts.size(); n++)
+    {
+        for(size_t r=0; r<rates.size(); r++)
+        {
+            for(size_t c=0; c<channelCounts.size(); c++)
+            {
+                // The urgent benchmark runs without, then with the preemption of the bulk transfers
+                for(int preempt=parameters.urgentPerHour > 0 ? 0 : 1; preempt<=1; preempt++)
+                {
+                    parameters.nodes = (uint32_t)nodeCounts[n];
+                    parameters.requestsPerHour = rates[r];
+                    parameters.channels = (uint32_t)channelCounts[c];
+                    parameters.preemptBulk = preempt != 0;
+
+                    fflush(stdout);
+
+                    pid_t child = fork();
+
+                    if(child == 0)
+                    {
+                        int result = simulate(&parameters);
+
+                        fflush(stdout);
+                        _exit(result);
+                    }
+
+                    int childStatus;
+
+                    if(child < 0 || waitpid(child, &childStatus, 0) < 0 || !WIFEXITED(childStatus) || WEXITSTATUS(childStatus) != 0) status=1;
+                }
+            }
+        }
+    }
+
+    return status;
+}
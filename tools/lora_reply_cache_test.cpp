@@ -0,0 +1,123 @@
+/*
+ * Reply cache of the responder (lora_reply_cache): a retransmitted query gets the reply already given while it is
+ * fresh, expired entries make room before live ones are evicted, least recently used first
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "lora_config.h"
+#include "lora_reply_cache.h"
+
+#include "lora_test.h"
+
+// Each test uses its own sources, so that the entries of the previous ones don't match
+static uint8_t s_next_source = 1;
+
+static uint32_t get_stat(const char* name)
+{
+    char dump[128];
+
+    lora_reply_cache_fill_with_stats_dump(dump, sizeof(dump));
+
+    const char* value = strstr(dump, name);
+
+    return value ? strtoul(value + strlen(name), NULL, 10) : 0xFFFFFFFF;
+}
+
+static void test_hit_and_miss()
+{
+    uint8_t source = s_next_source++;
+    uint16_t replyPayload = 0;
+
+    TEST_CHECK(!lora_reply_cache_lookup(source, 7, 1000, &replyPayload));
+
+    lora_reply_cache_store(source, 7, 1234, 1000);
+
+    TEST_CHECK(lora_reply_cache_lookup(source, 7, 1500, &replyPayload));
+    TEST_CHECK_EQUAL(replyPayload, 1234);
+
+    // Another query of the same source, or the same sequence from another source
+    TEST_CHECK(!lora_reply_cache_lookup(source, 8, 1500, &replyPayload));
+    TEST_CHECK(!lora_reply_cache_lookup(s_next_source, 7, 1500, &replyPayload));
+
+    // The same query answered again replaces the entry
+    lora_reply_cache_store(source, 7, 4321, 2000);
+
+    TEST_CHECK(lora_reply_cache_lookup(source, 7, 2000, &replyPayload));
+    TEST_CHECK_EQUAL(replyPayload, 4321);
+}
+
+static void test_expiry()
+{
+    uint8_t source = s_next_source++;
+    uint16_t replyPayload = 0;
+
+    lora_reply_cache_store(source, 1, 10, 5000);
+
+    TEST_CHECK(lora_reply_cache_lookup(source, 1, 5000 + LORA_REPLY_CACHE_TTL, &replyPayload));
+    TEST_CHECK(!lora_reply_cache_lookup(source, 1, 5000 + LORA_REPLY_CACHE_TTL + 1, &replyPayload));
+
+    // Ages are differences, so they hold across the wraparound of the ms clock
+    lora_reply_cache_store(source, 2, 20, 0xFFFFFF00);
+
+    TEST_CHECK(lora_reply_cache_lookup(source, 2, 0x00000100, &replyPayload));
+    TEST_CHECK_EQUAL(replyPayload, 20);
+    TEST_CHECK(!lora_reply_cache_lookup(source, 2, 0xFFFFFF00 + LORA_REPLY_CACHE_TTL + 1, &replyPayload));
+}
+
+static void test_expired_entries_make_room_first()
+{
+    uint8_t source = s_next_source++;
+    uint16_t replyPayload = 0;
+    uint32_t startMs = 100000;
+
+    // Every entry in use, then all of them expired
+    for(uint8_t sequence=0; sequence<LORA_REPLY_CACHE_SIZE; sequence++) lora_reply_cache_store(source, sequence, sequence, startMs);
+
+    uint32_t nowMs = startMs + LORA_REPLY_CACHE_TTL + 1;
+    uint32_t evictions = get_stat("evict=");
+
+    for(uint8_t sequence=100; sequence<100 + LORA_REPLY_CACHE_SIZE; sequence++) lora_reply_cache_store(source, sequence, sequence, nowMs);
+
+    TEST_CHECK_EQUAL(get_stat("evict="), evictions);
+
+    for(uint8_t sequence=100; sequence<100 + LORA_REPLY_CACHE_SIZE; sequence++)
+    {
+        TEST_CHECK(lora_reply_cache_lookup(source, sequence, nowMs, &replyPayload));
+    }
+}
+
+static void test_least_recently_used_is_evicted()
+{
+    uint8_t source = s_next_source++;
+    uint16_t replyPayload = 0;
+    uint32_t nowMs = 200000;
+
+    for(uint8_t sequence=0; sequence<LORA_REPLY_CACHE_SIZE; sequence++) lora_reply_cache_store(source, sequence, sequence, nowMs++);
+
+    // The oldest entry is used again, so the second oldest goes
+    TEST_CHECK(lora_reply_cache_lookup(source, 0, nowMs++, &replyPayload));
+
+    uint32_t evictions = get_stat("evict=");
+
+    lora_reply_cache_store(source, 100, 100, nowMs++);
+
+    TEST_CHECK_EQUAL(get_stat("evict="), evictions + 1);
+    TEST_CHECK(lora_reply_cache_lookup(source, 0, nowMs, &replyPayload));
+    TEST_CHECK(!lora_reply_cache_lookup(source, 1, nowMs, &replyPayload));
+    TEST_CHECK(lora_reply_cache_lookup(source, 2, nowMs, &replyPayload));
+    TEST_CHECK(lora_reply_cache_lookup(source, 100, nowMs, &replyPayload));
+}
+
+int main()
+{
+    test_hit_and_miss();
+    test_expiry();
+    test_expired_entries_make_room_first();
+    test_least_recently_used_is_evicted();
+
+    return test_report("lora_reply_cache_test");
+}
@@ -0,0 +1,242 @@
+/*
+ * Linux simulation of a sleepy end device (LORA_SLEEPY_... in lora_config.h, "!S|P#" in README.md) and of the gateway
+ * sending it downlinks, to check the window timing of the radio profile and to trade latency against battery
+ *
+ *  lora_sleepy_tool [hours] [downlinks per hour] [poll interval ms] [jitter ms] [seed]
+ *
+ * Downlinks (commands) reach the gateway at random (Poisson), the node polls every poll interval (default
+ * LORA_SLEEPY_POLL_INTERVAL) and right away when a downlink announces more. Gateway transmissions start off the nominal
+ * window delay by up to +-jitter ms (default LORA_SLEEPY_TIMING_ERROR): a downlink whose preamble doesn't overlap the
+ * node window by LORA_SLEEPY_RX_MIN_SYMBOLS symbols is lost. Windows, frame times and energy come from the same code as
+ * the firmware (lora_timing, lora_airtime, lora_energy), the node being compared with one listening all the time.
+ * Exit status 2 if any downlink was lost.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "lora_config.h"
+#include "lora_airtime.h"
+#include "lora_timing.h"
+#include "lora_energy.h"
+#include "lora_gateway.h"
+
+#define DEFAULT_HOURS 24
+#define DEFAULT_DOWNLINKS_PER_HOUR 4
+
+typedef struct
+{
+    uint32_t uplinks;
+    uint32_t downlinks;
+    uint32_t inRx1;
+    uint32_t inRx2;
+    uint32_t lost;
+    uint32_t windows;
+    std::vector<double> latenciesMs;
+
+} SleepyResults_t;
+
+static const uint32_t s_currents_na[LORA_RADIO_MODES_COUNT] = { SX1272_SLEEP_CURRENT_NA, SX1272_STANDBY_CURRENT_NA, SX1272_RX_CURRENT_NA, SX1272_TX_CURRENT_NA, SX1272_CAD_CURRENT_NA };
+
+static uint64_t to_us(double ms)
+{
+    return (uint64_t)(ms * 1000.0);
+}
+
+static void account_interval(uint8_t mode, uint8_t energyClass, double startMs, double endMs)
+{
+    lora_energy_set_class(energyClass, to_us(startMs));
+    lora_energy_set_mode(mode, to_us(startMs));
+
+    lora_energy_set_class(LORA_ENERGY_CLASS_IDLE, to_us(endMs));
+    lora_energy_set_mode(LORA_RADIO_MODE_SLEEP, to_us(endMs));
+}
+
+// The receiver locks on a preamble if at least LORA_SLEEPY_RX_MIN_SYMBOLS of its symbols fall within the window
+static bool is_preamble_detected(double preambleStartMs, double windowOpenMs)
+{
+    double symbolMs = lora_airtime_get_symbol_time_us() / 1000.0;
+    double preambleEndMs = preambleStartMs + (LORA_PREAMBLE_LENGTH + 4.25) * symbolMs;
+    double windowEndMs = windowOpenMs + lora_timing_get_downlink_window_ms();
+
+    return std::min(preambleEndMs, windowEndMs) - std::max(preambleStartMs, windowOpenMs) >= LORA_SLEEPY_RX_MIN_SYMBOLS * symbolMs;
+}
+
+static double get_percentile(std::vector<double> values, double percentile)
+{
+    if(values.empty()) return 0;
+
+    std::sort(values.begin(), values.end());
+
+    size_t index = (size_t)std::ceil(percentile / 100.0 * values.size());
+
+    return values[index > 0 ? index - 1 : 0];
+}
+
+static double get_mean(const std::vector<double>& values)
+{
+    double total=0;
+
+    for(size_t i=0; i<values.size(); i++) total += values[i];
+
+    return values.empty() ? 0 : total / values.size();
+}
+
+static void simulate(double durationMs, double downlinksPerHour, uint32_t pollIntervalMs, double jitterMs, uint32_t seed, SleepyResults_t* results)
+{
+    std::mt19937 generator(seed);
+    std::exponential_distribution<double> interarrival(downlinksPerHour / 3600000.0);
+    std::uniform_real_distribution<double> jitter(-jitterMs, jitterMs);
+
+    std::deque<double> arrivals;
+
+    for(double t=interarrival(generator); t<durationMs; t+=interarrival(generator)) arrivals.push_back(t);
+
+    const double airtimeMs = lora_airtime_get_time_on_air_us(RADIO_MESSAGES_BUFFER_SIZE) / 1000.0;
+    const double windowMs = lora_timing_get_downlink_window_ms();
+
+    lora_energy_initialize(s_currents_na, 0);
+
+    double uplinkStartMs = 0;
+
+    while(uplinkStartMs < durationMs)
+    {
+        double txEndMs = uplinkStartMs + airtimeMs;
+
+        account_interval(LORA_RADIO_MODE_TX, LORA_ENERGY_CLASS_POLL, uplinkStartMs, txEndMs);
+
+        results->uplinks++;
+
+        bool sent = false;
+        bool received = false;
+        bool moreData = false;
+        double rxEndMs = txEndMs;
+
+        for(uint8_t window=1; window<=2 && !received; window++)
+        {
+            double windowOpenMs = txEndMs + lora_timing_get_downlink_window_open_ms(window);
+            double gatewayTxMs = txEndMs + lora_timing_get_downlink_window_delay_ms(window);
+
+            results->windows++;
+
+            // One downlink per uplink, handed to the radio by the gateway scheduler before the window
+            if(!sent && !arrivals.empty() && arrivals.front() <= gatewayTxMs - GATEWAY_SCHEDULER_CYCLE_INTERVAL)
+            {
+                double arrivalMs = arrivals.front();
+                double preambleStartMs = gatewayTxMs + jitter(generator);
+
+                arrivals.pop_front();
+
+                sent = true;
+                moreData = !arrivals.empty() && arrivals.front() <= gatewayTxMs - GATEWAY_SCHEDULER_CYCLE_INTERVAL;
+
+                results->downlinks++;
+
+                if(is_preamble_detected(preambleStartMs, windowOpenMs))
+                {
+                    received = true;
+                    rxEndMs = preambleStartMs + airtimeMs;
+
+                    account_interval(LORA_RADIO_MODE_RX, LORA_ENERGY_CLASS_POLL, windowOpenMs, rxEndMs);
+
+                    if(window == 1) results->inRx1++;
+                    else results->inRx2++;
+
+                    results->latenciesMs.push_back(rxEndMs - arrivalMs);
+
+                    continue;
+                }
+
+                results->lost++;
+            }
+
+            rxEndMs = windowOpenMs + windowMs;
+
+            account_interval(LORA_RADIO_MODE_RX, LORA_ENERGY_CLASS_POLL, windowOpenMs, rxEndMs);
+        }
+
+        // More downlinks waiting: a new poll on the next dispatch of the state machine, otherwise at the poll pace
+        if(received && moreData) uplinkStartMs = rxEndMs + LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL;
+        else uplinkStartMs = txEndMs + pollIntervalMs;
+    }
+}
+
+static double get_charge_per_day_uah(const LoraEnergyTotals_t* totals, double durationMs)
+{
+    double charge=0;
+
+    for(uint8_t mode=0; mode<LORA_RADIO_MODES_COUNT; mode++) charge += lora_energy_get_mode_charge_uah(totals, mode);
+
+    return charge * 86400000.0 / durationMs;
+}
+
+int main(int argc, char* argv[])
+{
+    double hours = argc > 1 ? atof(argv[1]) : DEFAULT_HOURS;
+    double downlinksPerHour = argc > 2 ? atof(argv[2]) : DEFAULT_DOWNLINKS_PER_HOUR;
+    uint32_t pollIntervalMs = argc > 3 ? strtoul(argv[3], NULL, 10) : LORA_SLEEPY_POLL_INTERVAL;
+    double jitterMs = argc > 4 ? atof(argv[4]) : LORA_SLEEPY_TIMING_ERROR;
+    uint32_t seed = argc > 5 ? strtoul(argv[5], NULL, 10) : 1;
+
+    if(hours <= 0 || downlinksPerHour <= 0 || pollIntervalMs == 0 || jitterMs < 0)
+    {
+        fprintf(stderr, "usage: %s [hours] [downlinks per hour] [poll interval ms] [jitter ms] [seed]\n", argv[0]);
+        return 1;
+    }
+
+    double durationMs = hours * 3600000.0;
+
+    printf("profile: SF%d, %lu kHz, symbol %lu us, frame %lu us on air\n", LORA_SPREADING_FACTOR, (unsigned long)(125UL << LORA_BANDWIDTH),
+        (unsigned long)lora_airtime_get_symbol_time_us(), (unsigned long)lora_airtime_get_time_on_air_us(RADIO_MESSAGES_BUFFER_SIZE));
+    printf("windows: rx1 %lu ms, rx2 %lu ms after the uplink, opened %d ms early, %u symbols (%lu ms)\n",
+        (unsigned long)lora_timing_get_downlink_window_delay_ms(1), (unsigned long)lora_timing_get_downlink_window_delay_ms(2),
+        LORA_SLEEPY_TIMING_ERROR, lora_timing_get_downlink_window_symbols(), (unsigned long)lora_timing_get_downlink_window_ms());
+    printf("run: %.1f h, %.2f downlinks/h, poll every %lu ms, jitter +-%.1f ms, seed %lu\n\n", hours, downlinksPerHour,
+        (unsigned long)pollIntervalMs, jitterMs, (unsigned long)seed);
+
+    SleepyResults_t results = SleepyResults_t();
+
+    simulate(durationMs, downlinksPerHour, pollIntervalMs, jitterMs, seed, &results);
+
+    LoraEnergyTotals_t sleepyTotals;
+
+    lora_energy_get_totals(&sleepyTotals, to_us(durationMs));
+
+    // Same node listening all the time: no polls, a downlink is received as soon as the gateway sends it
+    lora_energy_initialize(s_currents_na, 0);
+    lora_energy_set_mode(LORA_RADIO_MODE_RX, 0);
+
+    LoraEnergyTotals_t continuousTotals;
+
+    lora_energy_get_totals(&continuousTotals, to_us(durationMs));
+
+    double continuousLatencyMs = GATEWAY_SCHEDULER_CYCLE_INTERVAL + lora_airtime_get_time_on_air_us(RADIO_MESSAGES_BUFFER_SIZE) / 1000.0;
+
+    printf("uplinks %lu, windows %lu, downlinks %lu: rx1 %lu, rx2 %lu, lost %lu\n",
+        (unsigned long)results.uplinks, (unsigned long)results.windows, (unsigned long)results.downlinks,
+        (unsigned long)results.inRx1, (unsigned long)results.inRx2, (unsigned long)results.lost);
+
+    printf("%-12s %12s %12s %12s %14s %12s\n", "node", "mean ms", "p95 ms", "max ms", "uAh/day", "avg uA");
+
+    double sleepyCharge = get_charge_per_day_uah(&sleepyTotals, durationMs);
+    double continuousCharge = get_charge_per_day_uah(&continuousTotals, durationMs);
+
+    printf("%-12s %12.0f %12.0f %12.0f %14.1f %12.2f\n", "sleepy", get_mean(results.latenciesMs), get_percentile(results.latenciesMs, 95),
+        get_percentile(results.latenciesMs, 100), sleepyCharge, sleepyCharge / 24);
+    printf("%-12s %12.0f %12.0f %12.0f %14.1f %12.2f\n", "continuous", continuousLatencyMs, continuousLatencyMs, continuousLatencyMs,
+        continuousCharge, continuousCharge / 24);
+
+    char dump[256];
+
+    lora_energy_fill_with_totals_dump(&sleepyTotals, dump, sizeof(dump));
+
+    printf("\nsleepy radio totals (as \"!S|E#\"): %s\n", dump);
+
+    return results.lost > 0 ? 2 : 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Minimal checks for the native unit tests of the portable firmware modules (make test): a failed check prints where
+ * and what, the test goes on and exits with status 1 at the end
+ */
+
+#ifndef __TOOLS_LORA_TEST_H__
+#define __TOOLS_LORA_TEST_H__
+
+#include <cstdio>
+
+static int s_test_checks;
+static int s_test_failures;
+
+#define TEST_CHECK(condition) \
+    do \
+    { \
+        s_test_checks++; \
+        if(!(condition)) \
+        { \
+            s_test_failures++; \
+            printf("%s:%d: FAILED %s\n", __FILE__, __LINE__, #condition); \
+        } \
+    } while(0)
+
+#define TEST_CHECK_EQUAL(actual, expected) \
+    do \
+    { \
+        s_test_checks++; \
+        long long actualValue = (long long)(actual); \
+        long long expectedValue = (long long)(expected); \
+        if(actualValue != expectedValue) \
+        { \
+            s_test_failures++; \
+            printf("%s:%d: FAILED %s == %s (%lld, expected %lld)\n", __FILE__, __LINE__, #actual, #expected, actualValue, expectedValue); \
+        } \
+    } while(0)
+
+static int test_report(const char* name)
+{
+    printf("%s: %d checks, %d failed\n", name, s_test_checks, s_test_failures);
+
+    return s_test_failures ? 1 : 0;
+}
+
+#endif // __TOOLS_LORA_TEST_H__
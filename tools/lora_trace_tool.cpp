@@ -0,0 +1,454 @@
+/*
+ * Linux companion of the firmware transaction tracing (see lora_trace.h and "!T|1#" in README.md)
+ *
+ *  lora_trace_tool summary <log> [remote log]      p50/p99/max of each stage of the traced transactions, and the stage that
+ *                                                  dominates the slowest ones (p99 and above)
+ *  lora_trace_tool csv <log> [remote log]          one line per transaction with the duration of each stage, in us
+ *
+ * A log is whatever the host read from the node uart (text, or the stdout of "lora_capture_tool capture"): the "^T|..@"
+ * records are picked out of it. With the log of the responding node too, the requester records are joined to the
+ * responder ones by trace id, peer and payload, and the wait for the reply is split into time spent on the remote node and
+ * radio time.
+ */
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "host_protocol_codec.h"
+#include "lora_trace.h"
+
+#define TRACE_FIELDS_COUNT 8
+
+typedef struct
+{
+    std::string traceId;
+    char role;
+    unsigned peer;
+    unsigned payload;
+    int outcome;
+    unsigned attempts;
+    int64_t stageUs[LORA_TRACE_STAGES_COUNT];   // -1 if not stamped
+
+} TraceRecord_t;
+
+typedef enum
+{
+    SEGMENT_HOST_TO_QUEUE,
+    SEGMENT_QUEUE_WAIT,
+    SEGMENT_REQUEST_TX,
+    SEGMENT_WAIT_REPLY,
+    SEGMENT_REMOTE,
+    SEGMENT_RADIO,
+    SEGMENT_REPLY_TO_HOST,
+    SEGMENT_TOTAL,
+
+    SEGMENT_REMOTE_TO_HOST,
+    SEGMENT_REMOTE_HOST,
+    SEGMENT_REMOTE_REPLY_PREP,
+    SEGMENT_REMOTE_REPLY_TX,
+    SEGMENT_REMOTE_TOTAL,
+
+    SEGMENTS_COUNT
+
+} Segments_t;
+
+typedef struct
+{
+    const char* name;
+    char role;
+    int fromStage;                      // -1: computed from the joined records
+    int toStage;
+
+} SegmentDefinition_t;
+
+static const SegmentDefinition_t s_segments[SEGMENTS_COUNT] =
+{
+    { "uart->queue", LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_HOST_RX, LORA_TRACE_QUEUED },
+    { "queue wait", LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_QUEUED, LORA_TRACE_TX_START },
+    { "request tx", LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_TX_START, LORA_TRACE_TX_DONE },
+    { "wait reply", LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_TX_DONE, LORA_TRACE_REPLY_RX },
+    { "on remote", LORA_TRACE_ROLE_REQUESTER, -1, -1 },
+    { "radio", LORA_TRACE_ROLE_REQUESTER, -1, -1 },
+    { "reply->host", LORA_TRACE_ROLE_REQUESTER, LORA_TRACE_REPLY_RX, LORA_TRACE_HOST_TX },
+    { "total", LORA_TRACE_ROLE_REQUESTER, -1, -1 },
+
+    { "rx->host", LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REMOTE_RX, LORA_TRACE_REMOTE_HOST_TX },
+    { "host", LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REMOTE_HOST_TX, LORA_TRACE_REMOTE_HOST_RX },
+    { "reply prep", LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REMOTE_HOST_RX, LORA_TRACE_REPLY_TX_START },
+    { "reply tx", LORA_TRACE_ROLE_RESPONDER, LORA_TRACE_REPLY_TX_START, LORA_TRACE_REPLY_TX_DONE },
+    { "total", LORA_TRACE_ROLE_RESPONDER, -1, -1 },
+};
+
+// Stages a requester total may end with, latest first
+static const int s_requester_end_stages[] = { LORA_TRACE_HOST_TX, LORA_TRACE_REPLY_RX, LORA_TRACE_TX_DONE };
+
+typedef struct
+{
+    const TraceRecord_t* record;
+    int64_t segmentUs[SEGMENTS_COUNT];          // -1 if not available
+
+} Transaction_t;
+
+static int get_stage_index(const std::string& name)
+{
+    static const char* const names[] = LORA_TRACE_STAGE_NAMES;
+
+    for(int stage=0; stage<LORA_TRACE_STAGES_COUNT; stage++)
+    {
+        if(name == names[stage]) return stage;
+    }
+
+    return -1;
+}
+
+static bool parse_record(const std::string& frame, TraceRecord_t* outRecord)
+{
+    std::vector<std::string> items;
+
+    split(frame.c_str(), items, '|');
+
+    // The acknowledge of "!T|..#" is "^T|<arg>|<result>@"
+    if(items.size() != TRACE_FIELDS_COUNT || items[1].find('.') == std::string::npos || items[2].size() != 1) return false;
+
+    outRecord->traceId = items[1];
+    outRecord->role = items[2][0];
+    outRecord->peer = strtoul(items[3].c_str(), NULL, 10);
+    outRecord->payload = strtoul(items[4].c_str(), NULL, 10);
+    outRecord->outcome = atoi(items[5].c_str());
+    outRecord->attempts = strtoul(items[6].c_str(), NULL, 10);
+
+    for(int stage=0; stage<LORA_TRACE_STAGES_COUNT; stage++) outRecord->stageUs[stage] = -1;
+
+    std::vector<std::string> stages;
+
+    split(items[7].c_str(), stages, ',');
+
+    for(size_t i=0; i<stages.size(); i++)
+    {
+        size_t equal = stages[i].find('=');
+
+        if(equal == std::string::npos) continue;
+
+        int stage = get_stage_index(stages[i].substr(0, equal));
+
+        if(stage >= 0) outRecord->stageUs[stage] = strtoll(stages[i].c_str() + equal + 1, NULL, 10);
+    }
+
+    return true;
+}
+
+static bool read_log(const char* path, std::vector<TraceRecord_t>& records)
+{
+    FILE* file = fopen(path, "rb");
+
+    if(!file)
+    {
+        perror(path);
+        return false;
+    }
+
+    std::string frame;
+    bool inFrame=false;
+    int c;
+
+    // Binary capture records may be interleaved: only "^T|...@" frames are taken
+    while((c = fgetc(file)) != EOF)
+    {
+        if(c == '^')
+        {
+            frame.clear();
+            inFrame = true;
+            continue;
+        }
+
+        if(!inFrame) continue;
+
+        if(c == '@')
+        {
+            TraceRecord_t record;
+
+            if(frame.compare(0, 2, "T|") == 0 && parse_record(frame, &record)) records.push_back(record);
+
+            inFrame = false;
+            continue;
+        }
+
+        if(c < ' ' || c > '~' || frame.size() >= LORA_TRACE_RECORD_DUMP_SIZE)
+        {
+            inFrame = false;
+            continue;
+        }
+
+        frame.push_back((char)c);
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+static int64_t get_span_us(const TraceRecord_t* record, int fromStage, int toStage)
+{
+    if(record->stageUs[fromStage] < 0 || record->stageUs[toStage] < 0) return -1;
+
+    return record->stageUs[toStage] - record->stageUs[fromStage];
+}
+
+static int64_t get_requester_total_us(const TraceRecord_t* record)
+{
+    int firstStage = record->stageUs[LORA_TRACE_HOST_RX] >= 0 ? LORA_TRACE_HOST_RX : LORA_TRACE_TX_START;
+
+    for(size_t i=0; i<sizeof(s_requester_end_stages)/sizeof(s_requester_end_stages[0]); i++)
+    {
+        int64_t span = get_span_us(record, firstStage, s_requester_end_stages[i]);
+
+        if(span >= 0) return span;
+    }
+
+    return -1;
+}
+
+static unsigned get_origin_address(const TraceRecord_t* record)
+{
+    return strtoul(record->traceId.c_str(), NULL, 10);
+}
+
+// The responder half of a requester record: same request (the responder peer is the origin of the id) and no more time on
+// the remote node than the requester waited for the reply
+static bool is_responder_of(const TraceRecord_t* responder, const TraceRecord_t* requester, int64_t waitReplyUs)
+{
+    if(responder->peer != get_origin_address(requester) || responder->payload != requester->payload) return false;
+
+    int64_t remoteUs = get_span_us(responder, LORA_TRACE_REMOTE_RX, LORA_TRACE_REPLY_TX_DONE);
+
+    return remoteUs < 0 || waitReplyUs < 0 || remoteUs <= waitReplyUs;
+}
+
+static void build_transactions(const std::vector<TraceRecord_t>& records, std::vector<Transaction_t>& transactions)
+{
+    // Sequence numbers wrap around: records with the same id are candidates in the order they were logged, and the ones
+    // logged before the match are stale (their requester record is missing: request lost, record dropped, log cut)
+    std::map<std::string, std::deque<const TraceRecord_t*> > responders;
+
+    for(size_t i=0; i<records.size(); i++)
+    {
+        if(records[i].role == LORA_TRACE_ROLE_RESPONDER) responders[records[i].traceId].push_back(&records[i]);
+    }
+
+    for(size_t i=0; i<records.size(); i++)
+    {
+        const TraceRecord_t* record = &records[i];
+
+        Transaction_t transaction;
+
+        transaction.record = record;
+
+        for(int segment=0; segment<SEGMENTS_COUNT; segment++)
+        {
+            const SegmentDefinition_t* definition = &s_segments[segment];
+
+            transaction.segmentUs[segment] = definition->role == record->role && definition->fromStage >= 0 ?
+                get_span_us(record, definition->fromStage, definition->toStage) : -1;
+        }
+
+        if(record->role == LORA_TRACE_ROLE_RESPONDER)
+        {
+            transaction.segmentUs[SEGMENT_REMOTE_TOTAL] = get_span_us(record, LORA_TRACE_REMOTE_RX, LORA_TRACE_REPLY_TX_DONE);
+
+            // Commands end with the answer of the host
+            if(transaction.segmentUs[SEGMENT_REMOTE_TOTAL] < 0) transaction.segmentUs[SEGMENT_REMOTE_TOTAL] = get_span_us(record, LORA_TRACE_REMOTE_RX, LORA_TRACE_REMOTE_HOST_RX);
+
+            transactions.push_back(transaction);
+
+            continue;
+        }
+
+        transaction.segmentUs[SEGMENT_TOTAL] = get_requester_total_us(record);
+
+        std::deque<const TraceRecord_t*>& candidates = responders[record->traceId];
+
+        std::deque<const TraceRecord_t*>::iterator match = candidates.begin();
+
+        while(match != candidates.end() && !is_responder_of(*match, record, transaction.segmentUs[SEGMENT_WAIT_REPLY])) ++match;
+
+        if(match != candidates.end())
+        {
+            const TraceRecord_t* responder = *match;
+
+            candidates.erase(candidates.begin(), match + 1);
+
+            int64_t remoteUs = get_span_us(responder, LORA_TRACE_REMOTE_RX, LORA_TRACE_REPLY_TX_DONE);
+
+            if(remoteUs >= 0 && transaction.segmentUs[SEGMENT_WAIT_REPLY] >= 0)
+            {
+                transaction.segmentUs[SEGMENT_REMOTE] = remoteUs;
+                transaction.segmentUs[SEGMENT_RADIO] = transaction.segmentUs[SEGMENT_WAIT_REPLY] - remoteUs;
+            }
+        }
+
+        transactions.push_back(transaction);
+    }
+}
+
+static bool read_transactions(int argc, char* argv[], std::vector<TraceRecord_t>& records, std::vector<Transaction_t>& transactions)
+{
+    for(int i=2; i<argc; i++)
+    {
+        if(!read_log(argv[i], records)) return false;
+    }
+
+    build_transactions(records, transactions);
+
+    return true;
+}
+
+// values sorted
+static int64_t get_percentile(const std::vector<int64_t>& values, int percentile)
+{
+    return values[std::min(values.size() - 1, values.size() * percentile / 100)];
+}
+
+static int run_summary(int argc, char* argv[])
+{
+    std::vector<TraceRecord_t> records;
+    std::vector<Transaction_t> transactions;
+
+    if(!read_transactions(argc, argv, records, transactions)) return 1;
+
+    int counts[2] = { 0, 0 }, abandoned = 0, joined = 0;
+
+    for(size_t i=0; i<transactions.size(); i++)
+    {
+        counts[transactions[i].record->role == LORA_TRACE_ROLE_RESPONDER ? 1 : 0]++;
+
+        if(transactions[i].record->outcome == -1) abandoned++;
+        if(transactions[i].segmentUs[SEGMENT_REMOTE] >= 0) joined++;
+    }
+
+    printf("%d requester, %d responder records (%d without outcome), %d joined\n\n", counts[0], counts[1], abandoned, joined);
+
+    printf("%-4s %-14s %8s %10s %10s %10s\n", "role", "stage", "count", "p50 ms", "p99 ms", "max ms");
+
+    for(int segment=0; segment<SEGMENTS_COUNT; segment++)
+    {
+        std::vector<int64_t> values;
+
+        for(size_t i=0; i<transactions.size(); i++)
+        {
+            if(transactions[i].segmentUs[segment] >= 0) values.push_back(transactions[i].segmentUs[segment]);
+        }
+
+        if(values.empty()) continue;
+
+        std::sort(values.begin(), values.end());
+
+        printf("%-4c %-14s %8zu %10.1f %10.1f %10.1f\n", s_segments[segment].role, s_segments[segment].name, values.size(),
+            get_percentile(values, 50) / 1000.0, get_percentile(values, 99) / 1000.0, values.back() / 1000.0);
+    }
+
+    // Slowest requester transactions: which stage took most of their time
+    std::vector<int64_t> totals;
+
+    for(size_t i=0; i<transactions.size(); i++)
+    {
+        if(transactions[i].record->role == LORA_TRACE_ROLE_REQUESTER && transactions[i].segmentUs[SEGMENT_TOTAL] >= 0) totals.push_back(transactions[i].segmentUs[SEGMENT_TOTAL]);
+    }
+
+    if(totals.empty()) return 0;
+
+    std::sort(totals.begin(), totals.end());
+
+    int64_t p99Us = get_percentile(totals, 99);
+
+    int64_t sumUs[SEGMENTS_COUNT] = {};
+    int64_t totalUs = 0;
+    int slowest = 0;
+
+    for(size_t i=0; i<transactions.size(); i++)
+    {
+        const Transaction_t* transaction = &transactions[i];
+
+        if(transaction->record->role != LORA_TRACE_ROLE_REQUESTER || transaction->segmentUs[SEGMENT_TOTAL] < p99Us) continue;
+
+        // The wait for the reply counts as its two halves when they are known
+        bool split = transaction->segmentUs[SEGMENT_REMOTE] >= 0;
+
+        for(int segment=0; segment<SEGMENT_TOTAL; segment++)
+        {
+            if(transaction->segmentUs[segment] < 0) continue;
+            if(segment == SEGMENT_WAIT_REPLY && split) continue;
+
+            sumUs[segment] += transaction->segmentUs[segment];
+        }
+
+        totalUs += transaction->segmentUs[SEGMENT_TOTAL];
+        slowest++;
+    }
+
+    int dominant = 0;
+
+    for(int segment=1; segment<SEGMENT_TOTAL; segment++)
+    {
+        if(sumUs[segment] > sumUs[dominant]) dominant = segment;
+    }
+
+    printf("\n%d transactions at or above p99 (%.1f ms): '%s' takes %.0f%% of their time\n", slowest, p99Us / 1000.0,
+        s_segments[dominant].name, totalUs > 0 ? 100.0 * sumUs[dominant] / totalUs : 0);
+
+    return 0;
+}
+
+static int run_csv(int argc, char* argv[])
+{
+    std::vector<TraceRecord_t> records;
+    std::vector<Transaction_t> transactions;
+
+    if(!read_transactions(argc, argv, records, transactions)) return 1;
+
+    printf("id,role,peer,payload,outcome,attempts");
+
+    for(int segment=0; segment<SEGMENTS_COUNT; segment++)
+    {
+        std::string name = s_segments[segment].name;
+
+        std::replace(name.begin(), name.end(), ' ', '_');
+
+        printf(",%c_%s", s_segments[segment].role, name.c_str());
+    }
+
+    printf("\n");
+
+    for(size_t i=0; i<transactions.size(); i++)
+    {
+        const TraceRecord_t* record = transactions[i].record;
+
+        printf("%s,%c,%u,%u,%d,%u", record->traceId.c_str(), record->role, record->peer, record->payload, record->outcome, record->attempts);
+
+        for(int segment=0; segment<SEGMENTS_COUNT; segment++)
+        {
+            if(transactions[i].segmentUs[segment] >= 0) printf(",%lld", (long long)transactions[i].segmentUs[segment]);
+            else printf(",");
+        }
+
+        printf("\n");
+    }
+
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc >= 3 && argc <= 4 && strcmp(argv[1], "summary") == 0) return run_summary(argc, argv);
+    if(argc >= 3 && argc <= 4 && strcmp(argv[1], "csv") == 0) return run_csv(argc, argv);
+
+    fprintf(stderr, "usage: %s summary|csv <log> [remote log]\n", argv[0]);
+
+    return 1;
+}
@@ -0,0 +1,74 @@
+/*
+ * Native (Linux) stand-ins for the few mbed OS classes used by the portable firmware headers
+ * (request_reply_engine.h): only what the tools need, on top of the C++11 standard library
+ */
+
+#ifndef __TOOLS_NATIVE_MBED_H__
+#define __TOOLS_NATIVE_MBED_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+
+class Mutex
+{
+public:
+
+    void lock() { _mutex.lock(); }
+    void unlock() { _mutex.unlock(); }
+
+private:
+
+    std::recursive_mutex _mutex;
+
+    friend class ConditionVariable;
+};
+
+class ConditionVariable
+{
+public:
+
+    ConditionVariable(Mutex& mutex) : _mutex(mutex) {}
+
+    // true if timed out, as in mbed OS
+    bool wait_for(uint32_t millisec)
+    {
+        return _cond_var.wait_for(_mutex._mutex, std::chrono::milliseconds(millisec)) == std::cv_status::timeout;
+    }
+
+    void notify_all() { _cond_var.notify_all(); }
+
+private:
+
+    Mutex& _mutex;
+    std::condition_variable_any _cond_var;
+};
+
+class Timer
+{
+public:
+
+    Timer() : _running(false), _accumulated(0) {}
+
+    void start() { if(!_running) { _start=std::chrono::steady_clock::now(); _running=true; } }
+    void stop() { _accumulated=elapsed_us(); _running=false; }
+    void reset() { _accumulated=0; _start=std::chrono::steady_clock::now(); }
+    int read_ms() { return (int)(elapsed_us() / 1000); }
+    int read_us() { return (int)elapsed_us(); }
+
+private:
+
+    int64_t elapsed_us()
+    {
+        if(!_running) return _accumulated;
+        return _accumulated + std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _start).count();
+    }
+
+    bool _running;
+    int64_t _accumulated;
+    std::chrono::steady_clock::time_point _start;
+};
+
+#endif // __TOOLS_NATIVE_MBED_H__
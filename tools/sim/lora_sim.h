@@ -0,0 +1,44 @@
+/*
+ * Services of the network simulator kernel (lora_network_sim.cpp) to the node libraries built from the firmware sources:
+ * virtual time, the event queue and the radio medium. Everything runs on the kernel thread, in the context of the node
+ * whose event is being dispatched (the "current" node).
+ */
+
+#ifndef __TOOLS_SIM_LORA_SIM_H__
+#define __TOOLS_SIM_LORA_SIM_H__
+
+#include <cstdint>
+#include <functional>
+
+// Virtual time since the start of the simulation
+uint64_t lora_sim_get_time_us();
+
+/*!
+ * @brief Runs event delayMs from now on the current node, again every periodMs if not 0; returns an id for
+ *        lora_sim_cancel(), never 0
+ */
+int lora_sim_post(uint32_t delayMs, uint32_t periodMs, const std::function<void()>& event);
+void lora_sim_cancel(int id);
+
+// Firmware debug output (sx127x_debug_if), prefixed with time and node address
+bool lora_sim_is_verbose();
+void lora_sim_print_prefix();
+
+// Radio of the current node (see sx1272-hal.h)
+struct RadioEvents_t;
+
+void lora_sim_radio_init(RadioEvents_t* events);
+void lora_sim_radio_set_rx_config(uint16_t symbolTimeout, bool rxContinuous);
+void lora_sim_radio_set_channel(uint32_t frequency);
+void lora_sim_radio_sleep();
+void lora_sim_radio_rx(uint32_t timeoutMs);
+void lora_sim_radio_send(const uint8_t* buffer, uint8_t size);
+uint32_t lora_sim_radio_random();
+
+// Application of the current node (see lora_sim_node.cpp)
+void lora_sim_report_completion(int outcome, uint16_t replyPayload);
+void lora_sim_report_request(uint8_t sourceAddress, uint16_t payload, bool requiresReply);
+void lora_sim_report_bulk_completion(int outcome, uint16_t completedMask);
+void lora_sim_report_bulk(uint8_t sourceAddress, uint8_t session, const uint8_t* blob, uint16_t size);
+
+#endif // __TOOLS_SIM_LORA_SIM_H__
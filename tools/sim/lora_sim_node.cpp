@@ -0,0 +1,112 @@
+/*
+ * Node application of the network simulator, linked with the firmware sources into the node library (one copy loaded
+ * per node, so that each node gets its own globals): plays the role of main.cpp and of the host wired to the node.
+ * Entry points are looked up by name (dlsym) by the kernel and called in the context of their node.
+ */
+
+#include <cstdint>
+
+#include "mbed.h"
+
+#include "lora_config.h"
+#include "lora_state_machine.h"
+#include "lora_timing.h"
+#include "lora_channels.h"
+
+#include "lora_sim.h"
+
+static EventQueue s_event_queue;
+
+static uint32_t s_host_reply_delay_ms;
+
+static void on_request_completion(LoraReplyOutcomes_t outcome, uint16_t replyPayload)
+{
+    lora_sim_report_completion(outcome, replyPayload);
+}
+
+static void on_notify_request(uint8_t requestSourceAddress, uint16_t requestPayload)
+{
+    lora_sim_report_request(requestSourceAddress, requestPayload, false);
+}
+
+static void on_bulk_completion(LoraReplyOutcomes_t outcome, uint16_t completedMask)
+{
+    lora_sim_report_bulk_completion(outcome, completedMask);
+}
+
+static void on_notify_bulk(uint8_t sourceAddress, uint8_t session, const uint8_t* blob, uint16_t size)
+{
+    lora_sim_report_bulk(sourceAddress, session, blob, size);
+}
+
+static void event_proc_send_host_reply(uint16_t replyPayload)
+{
+    lora_state_machine_send_deferred_reply(replyPayload);
+}
+
+// The host answers every query after the same delay (uart round trip and application), echoing its payload (the top
+// bit of a reply payload tells the host failed)
+static bool on_notify_request_and_defer_reply(uint8_t requestSourceAddress, uint16_t requestPayload)
+{
+    lora_sim_report_request(requestSourceAddress, requestPayload, true);
+
+    s_event_queue.call_in(s_host_reply_delay_ms, event_proc_send_host_reply, (uint16_t)(requestPayload & 0x7FFF));
+
+    return true;
+}
+
+extern "C" int lora_sim_node_initialize(uint8_t myAddress, uint32_t hostReplyDelayMs, uint8_t channelCount)
+{
+    s_host_reply_delay_ms = hostReplyDelayMs;
+
+    lora_channels_set_count(channelCount);
+
+    lora_state_machine_notify_request_callback = on_notify_request;
+    lora_state_machine_notify_request_and_defer_reply_callback = on_notify_request_and_defer_reply;
+    lora_state_machine_notify_bulk_callback = on_notify_bulk;
+
+    int result = lora_state_machine_initialize(myAddress, &s_event_queue);
+
+    if(result != 0) return result;
+
+    s_event_queue.call_every(LORA_EVENT_PROC_COMMUNICATION_CYCLE_INTERVAL, lora_event_proc_communication_cycle);
+
+    return 0;
+}
+
+// LORA_OUTCOME_PENDING if the request went out, its outcome comes through lora_sim_report_completion()
+extern "C" int lora_sim_node_send_request(uint16_t counter, uint8_t destinationAddress, bool requiresReply)
+{
+    uint32_t timeoutMs = lora_timing_get_transaction_timeout_ms(requiresReply, lora_state_machine_get_max_access_delay_ms());
+
+    return lora_state_machine_send_request_async(counter, destinationAddress, requiresReply, timeoutMs, on_request_completion);
+}
+
+// LORA_OUTCOME_PENDING if the transfer started, its outcome comes through lora_sim_report_bulk_completion()
+extern "C" int lora_sim_node_send_bulk(const uint8_t* blob, uint16_t size, uint16_t addressMask)
+{
+    uint32_t timeoutMs = lora_timing_get_gather_transaction_timeout_ms(lora_state_machine_get_bulk_transfer_ms(size, addressMask), lora_state_machine_get_max_access_delay_ms());
+
+    return lora_state_machine_send_bulk_async(blob, size, addressMask, timeoutMs, on_bulk_completion);
+}
+
+// False if no bulk transfer is ongoing, see lora_state_machine_preempt_bulk()
+extern "C" bool lora_sim_node_preempt_bulk()
+{
+    return lora_state_machine_preempt_bulk();
+}
+
+extern "C" uint32_t lora_sim_node_get_busy_remaining_ms()
+{
+    return lora_state_machine_get_busy_remaining_ms();
+}
+
+extern "C" void lora_sim_node_fill_with_stats_dump(char* destBuffer, size_t destBufferSize)
+{
+    lora_state_machine_fill_with_stats_dump(destBuffer, destBufferSize);
+}
+
+extern "C" void lora_sim_node_fill_with_energy_dump(char* destBuffer, size_t destBufferSize)
+{
+    lora_state_machine_fill_with_energy_dump(destBuffer, destBufferSize);
+}
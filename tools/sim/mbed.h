@@ -0,0 +1,85 @@
+/*
+ * Virtual-time stand-ins for the mbed OS classes used by the firmware sources linked into the network simulator
+ * (lora_network_sim.cpp): timers read the simulation clock, event queues post to the kernel. The kernel runs one event at
+ * a time, so mutexes have nothing to protect and nobody may block on a condition variable (only the non-blocking
+ * lora_state_machine_send_..._async() calls are usable).
+ */
+
+#ifndef __TOOLS_SIM_MBED_H__
+#define __TOOLS_SIM_MBED_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
+#include "lora_sim.h"
+
+typedef uint64_t us_timestamp_t;
+
+class Mutex
+{
+public:
+
+    void lock() {}
+    void unlock() {}
+};
+
+class ConditionVariable
+{
+public:
+
+    ConditionVariable(Mutex&) {}
+
+    // true if timed out, as in mbed OS: nothing can ever notify a wait in the kernel thread
+    bool wait_for(uint32_t) { return true; }
+
+    void notify_all() {}
+};
+
+class Timer
+{
+public:
+
+    Timer() : _running(false), _accumulated(0), _start(0) {}
+
+    void start() { if(!_running) { _start=lora_sim_get_time_us(); _running=true; } }
+    void stop() { _accumulated=elapsed_us(); _running=false; }
+    void reset() { _accumulated=0; _start=lora_sim_get_time_us(); }
+    int read_ms() { return (int)(elapsed_us() / 1000); }
+    int read_us() { return (int)elapsed_us(); }
+    us_timestamp_t read_high_resolution_us() { return elapsed_us(); }
+
+private:
+
+    us_timestamp_t elapsed_us()
+    {
+        if(!_running) return _accumulated;
+        return _accumulated + lora_sim_get_time_us() - _start;
+    }
+
+    bool _running;
+    us_timestamp_t _accumulated;
+    us_timestamp_t _start;
+};
+
+class EventQueue
+{
+public:
+
+    EventQueue(unsigned =0, unsigned char* =NULL) {}
+
+    template <typename F, typename... Args>
+    int call(F f, Args... args) { return lora_sim_post(0, 0, std::bind(f, args...)); }
+
+    template <typename F, typename... Args>
+    int call_in(int ms, F f, Args... args) { return lora_sim_post(ms > 0 ? ms : 0, 0, std::bind(f, args...)); }
+
+    template <typename F, typename... Args>
+    int call_every(int ms, F f, Args... args) { return lora_sim_post(ms, ms, std::bind(f, args...)); }
+
+    void cancel(int id) { lora_sim_cancel(id); }
+};
+
+#endif // __TOOLS_SIM_MBED_H__
@@ -0,0 +1,14 @@
+/*
+ * Firmware debug output in the network simulator: off unless asked for (-v), each line tagged with time and node
+ */
+
+#ifndef __TOOLS_SIM_SX1272_DEBUG_H__
+#define __TOOLS_SIM_SX1272_DEBUG_H__
+
+#include <cstdio>
+
+#include "lora_sim.h"
+
+#define sx1272_debug_if(condition, ...) do { if((condition) && lora_sim_is_verbose()) { lora_sim_print_prefix(); printf(__VA_ARGS__); } } while(0)
+
+#endif // __TOOLS_SIM_SX1272_DEBUG_H__
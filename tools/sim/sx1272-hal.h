@@ -0,0 +1,64 @@
+/*
+ * Virtual SX1272MB2xAS for the network simulator: same calls as the SX1272Lib driver, served by the radio medium of the
+ * kernel (lora_network_sim.cpp), which raises the radio events on the node event queue as the driver does. Modem
+ * settings other than the rx mode and the channel are taken from lora_config.h by the kernel, every node uses the same
+ * ones.
+ */
+
+#ifndef __TOOLS_SIM_SX1272_HAL_H__
+#define __TOOLS_SIM_SX1272_HAL_H__
+
+#include <cstdint>
+
+#include "mbed.h"
+
+typedef enum
+{
+    MODEM_FSK = 0,
+    MODEM_LORA,
+
+} RadioModems_t;
+
+struct RadioEvents_t
+{
+    void (*TxDone)(void);
+    void (*TxTimeout)(void);
+    void (*RxDone)(uint8_t* payload, uint16_t size, int16_t rssi, int8_t snr);
+    void (*RxTimeout)(void);
+    void (*RxError)(void);
+    void (*FhssChangeChannel)(uint8_t currentChannel);
+    void (*CadDone)(bool channelActivityDetected);
+};
+
+#define REG_VERSION     0x42
+
+enum { SX1272MB2XAS = 1, SX1272UNDEFINED };
+
+class SX1272MB2xAS
+{
+public:
+
+    SX1272MB2xAS(RadioEvents_t*) {}
+
+    void assign_events_queue(EventQueue*) {}
+    void Init(RadioEvents_t* events) { lora_sim_radio_init(events); }
+    uint8_t Read(uint8_t) { return 0x22; }
+    int DetectBoardType() { return SX1272MB2XAS; }
+    void SetChannel(uint32_t frequency) { lora_sim_radio_set_channel(frequency); }
+
+    void SetTxConfig(RadioModems_t, int8_t, uint32_t, uint32_t, uint32_t, uint8_t, uint16_t, bool, bool, bool, uint8_t, bool, uint32_t) {}
+
+    void SetRxConfig(RadioModems_t, uint32_t, uint32_t, uint8_t, uint32_t, uint16_t, uint16_t symbTimeout, bool, uint8_t, bool, bool, uint8_t, bool,
+        bool rxContinuous)
+    {
+        lora_sim_radio_set_rx_config(symbTimeout, rxContinuous);
+    }
+
+    void Sleep() { lora_sim_radio_sleep(); }
+    void Standby() { lora_sim_radio_sleep(); }
+    void Rx(uint32_t timeout) { lora_sim_radio_rx(timeout); }
+    void Send(uint8_t* buffer, uint8_t size) { lora_sim_radio_send(buffer, size); }
+    uint32_t Random() { return lora_sim_radio_random(); }
+};
+
+#endif // __TOOLS_SIM_SX1272_HAL_H__